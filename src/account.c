@@ -31,8 +31,27 @@
  *                                        a subscription.
  *   meta TEXT       -- Copy of the meta data as put into the journal.
  *                   -- This is also encrypted using the database key.
+ *   dek_id TEXT     -- NULL if the encrypted fields are OpenPGP
+ *                      encrypted or the key id of the data encryption
+ *                      key used to seal them.
  * )
  *
+ * CREATE TABLE dek (
+ *   dek_id TEXT NOT NULL PRIMARY KEY,
+ *   created TEXT NOT NULL,
+ *   wrapped TEXT NOT NULL  -- The data encryption key encrypted to the
+ *                          -- database and the backoffice key.
+ * );
+ *
+ * With --envelope-encryption the fields are not individually
+ * encrypted using OpenPGP but sealed using AES-256-GCM with a data
+ * encryption key (DEK) which is replaced once a day.  To decrypt such
+ * a field, the backoffice decrypts the "wrapped" column of the DEK
+ * with its OpenPGP key, base64 decodes it to get the 32 byte AES key,
+ * and base64 decodes the field to get the 12 byte nonce, the
+ * ciphertext, and the 16 byte tag.  The dek_id is used as additional
+ * authenticated data.
+ *
  * CREATE TABLE pending (
  *   token TEXT NOT NULL PRIMARY KEY,
  *   email TEXT NOT NULL,
@@ -52,6 +71,7 @@
 #include <npth.h>
 #include <gcrypt.h>
 #include <sqlite3.h>
+#include <gpgme.h>
 
 #include "util.h"
 #include "logging.h"
@@ -86,6 +106,62 @@ static sqlite3_stmt *account_update_stmt;
    is protected by account_db_lock.  */
 static sqlite3_stmt *account_select_stmt;
 
+/* This is a prepared statement to insert a DEK.  It is protected by
+   account_db_lock.  */
+static sqlite3_stmt *dek_insert_stmt;
+
+/* This is a prepared statement to select a DEK.  It is protected by
+   account_db_lock.  */
+static sqlite3_stmt *dek_select_stmt;
+
+
+/* The maximum number of decrypted account records we cache, the
+ * maximum number of bytes of secure memory used for them, the time
+ * in seconds a cached record is valid, and the number of hash
+ * buckets.  The byte limit makes sure that the cache does not use up
+ * the secure memory pool which is also needed for the DEKs and the
+ * cipher handles (see the GCRYCTL_INIT_SECMEM in payprocd.c).  */
+#define ACCOUNT_CACHE_SIZE     128
+#define ACCOUNT_CACHE_MAXBYTES (32*1024)
+#define ACCOUNT_CACHE_TTL      (15*60)
+#define ACCOUNT_CACHE_BUCKETS  32
+
+/* An object to cache a decrypted account record.  The object is
+ * allocated in secure memory and wiped when released.  The string
+ * pointers point into DATA.  */
+struct account_cache_s
+{
+  struct account_cache_s *next;      /* Next in the same bucket.  */
+  struct account_cache_s *lru_prev;  /* Next more recently used.  */
+  struct account_cache_s *lru_next;  /* Next less recently used.  */
+  size_t size;                       /* Allocated size of the object.  */
+  time_t expires;
+  int verified;
+  const char *email;
+  const char *stripe_cus;
+  const char *paypal_payer_id;
+  char account_id[16];
+  char data[1];
+};
+typedef struct account_cache_s *account_cache_t;
+
+/* The hash table with the cached records, the LRU list, the number
+ * of cached records and their total size.  All are protected by
+ * account_cache_lock
+ * which may be taken while holding account_db_lock but not the other
+ * way around.  */
+static account_cache_t account_cache[ACCOUNT_CACHE_BUCKETS];
+static account_cache_t account_cache_lru_head;
+static account_cache_t account_cache_lru_tail;
+static int account_cache_count;
+static size_t account_cache_bytes;
+
+/* This counter is incremented with each invalidation so that a
+ * record read before an update is not put into the cache.  */
+static unsigned int account_cache_generation;
+
+static npth_mutex_t account_cache_lock = NPTH_MUTEX_INITIALIZER;
+
 
 
 
@@ -115,6 +191,210 @@ make_account_id (char *buffer, size_t bufsize)
 
 
 
+static void
+lock_account_cache (void)
+{
+  int res;
+
+  res = npth_mutex_lock (&account_cache_lock);
+  if (res)
+    log_fatal ("failed to acquire account cache lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+static void
+unlock_account_cache (void)
+{
+  int res;
+
+  res = npth_mutex_unlock (&account_cache_lock);
+  if (res)
+    log_fatal ("failed to release account cache lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+/* Return the hash bucket for ACCOUNT_ID.  */
+static unsigned int
+account_cache_hash (const char *account_id)
+{
+  unsigned int hash = 0;
+
+  for (; *account_id; account_id++)
+    hash = hash * 31 + *(const unsigned char *)account_id;
+  return hash % ACCOUNT_CACHE_BUCKETS;
+}
+
+
+/* Remove ITEM from the cache and release it.  Must be called with
+ * the cache lock held.  */
+static void
+account_cache_remove (account_cache_t item)
+{
+  account_cache_t *pp;
+
+  for (pp = &account_cache[account_cache_hash (item->account_id)];
+       *pp; pp = &(*pp)->next)
+    if (*pp == item)
+      {
+        *pp = item->next;
+        break;
+      }
+
+  if (item->lru_prev)
+    item->lru_prev->lru_next = item->lru_next;
+  else
+    account_cache_lru_head = item->lru_next;
+  if (item->lru_next)
+    item->lru_next->lru_prev = item->lru_prev;
+  else
+    account_cache_lru_tail = item->lru_prev;
+  account_cache_count--;
+  account_cache_bytes -= item->size;
+
+  wipememory (item, item->size);
+  gcry_free (item);
+}
+
+
+/* Find the cached record for ACCOUNT_ID and mark it as most recently
+ * used.  Expired records are removed.  Must be called with the cache
+ * lock held.  Returns NULL if not found.  */
+static account_cache_t
+account_cache_find (const char *account_id)
+{
+  account_cache_t item;
+
+  for (item = account_cache[account_cache_hash (account_id)];
+       item; item = item->next)
+    if (!strcmp (item->account_id, account_id))
+      break;
+  if (!item)
+    return NULL;
+
+  if (item->expires < time (NULL))
+    {
+      account_cache_remove (item);
+      return NULL;
+    }
+
+  if (item->lru_prev)
+    {
+      /* Move to the head of the LRU list.  */
+      item->lru_prev->lru_next = item->lru_next;
+      if (item->lru_next)
+        item->lru_next->lru_prev = item->lru_prev;
+      else
+        account_cache_lru_tail = item->lru_prev;
+      item->lru_prev = NULL;
+      item->lru_next = account_cache_lru_head;
+      account_cache_lru_head->lru_prev = item;
+      account_cache_lru_head = item;
+    }
+  return item;
+}
+
+
+/* Put a record for ACCOUNT_ID into the cache unless the cache was
+ * invalidated since GENERATION was taken.  Errors are ignored
+ * because the cache is only an optimization.  */
+static void
+account_cache_put (unsigned int generation, const char *account_id,
+                   int verified, const char *email, const char *stripe_cus,
+                   const char *paypal_payer_id)
+{
+  account_cache_t item;
+  size_t n, n1, n2, n3;
+
+  if (strlen (account_id) >= sizeof item->account_id)
+    return;
+
+  n1 = strlen (email) + 1;
+  n2 = strlen (stripe_cus) + 1;
+  n3 = strlen (paypal_payer_id) + 1;
+  n = sizeof *item + n1 + n2 + n3;
+  if (n > ACCOUNT_CACHE_MAXBYTES / 8)
+    return;  /* Unreasonably large record - do not cache.  */
+  item = gcry_calloc_secure (1, n);
+  if (!item)
+    return;
+  item->size = n;
+  item->verified = verified;
+  strcpy (item->account_id, account_id);
+  item->email = memcpy (item->data, email, n1);
+  item->stripe_cus = memcpy (item->data + n1, stripe_cus, n2);
+  item->paypal_payer_id = memcpy (item->data + n1 + n2, paypal_payer_id, n3);
+
+  lock_account_cache ();
+  if (generation != account_cache_generation
+      || account_cache_find (account_id))
+    {
+      unlock_account_cache ();
+      wipememory (item, item->size);
+      gcry_free (item);
+      return;
+    }
+
+  while (account_cache_lru_tail
+         && (account_cache_count >= ACCOUNT_CACHE_SIZE
+             || account_cache_bytes + item->size > ACCOUNT_CACHE_MAXBYTES))
+    account_cache_remove (account_cache_lru_tail);
+
+  item->expires = time (NULL) + ACCOUNT_CACHE_TTL;
+  n = account_cache_hash (account_id);
+  item->next = account_cache[n];
+  account_cache[n] = item;
+  item->lru_next = account_cache_lru_head;
+  if (account_cache_lru_head)
+    account_cache_lru_head->lru_prev = item;
+  else
+    account_cache_lru_tail = item;
+  account_cache_lru_head = item;
+  account_cache_count++;
+  account_cache_bytes += item->size;
+  unlock_account_cache ();
+}
+
+
+/* Remove the record for ACCOUNT_ID from the cache.  */
+static void
+account_cache_invalidate (const char *account_id)
+{
+  account_cache_t item;
+
+  lock_account_cache ();
+  account_cache_generation++;
+  for (item = account_cache[account_cache_hash (account_id)];
+       item; item = item->next)
+    if (!strcmp (item->account_id, account_id))
+      {
+        account_cache_remove (item);
+        break;
+      }
+  unlock_account_cache ();
+}
+
+
+/* Remove all expired records from the cache.  */
+static void
+account_cache_expire (void)
+{
+  account_cache_t item, prev;
+  time_t now = time (NULL);
+
+  lock_account_cache ();
+  for (item = account_cache_lru_tail; item; item = prev)
+    {
+      prev = item->lru_prev;
+      if (item->expires < now)
+        account_cache_remove (item);
+    }
+  unlock_account_cache ();
+}
+
+
+
 /* Relinquishes the lock on the account handle and if DO_CLOSE is
  * true also close the database handle.  Note that we usually keep the
  * database open for the lifetime of the process.  */
@@ -134,6 +414,10 @@ close_account_db (int do_close)
           account_update_stmt = NULL;
           sqlite3_finalize (account_select_stmt);
           account_select_stmt = NULL;
+          sqlite3_finalize (dek_insert_stmt);
+          dek_insert_stmt = NULL;
+          sqlite3_finalize (dek_select_stmt);
+          dek_select_stmt = NULL;
           res = sqlite3_close (account_db);
         }
       if (res)
@@ -236,6 +520,49 @@ open_account_db (void)
     }
 
 
+  /* Same for the dek_id column added for the envelope encryption.  */
+  res = sqlite3_prepare_v2 (account_db,
+                            "ALTER TABLE account ADD COLUMN \n"
+                            "dek_id TEXT",
+                            -1, &stmt, NULL);
+  if (!res)
+    {
+      res = sqlite3_step (stmt);
+      sqlite3_finalize (stmt);
+      if (res != SQLITE_DONE)
+        {
+          log_error ("error adding column to account table: %s\n",
+                     sqlite3_errstr (res));
+          close_account_db (1);
+          return gpg_error (GPG_ERR_GENERAL);
+        }
+    }
+
+  res = sqlite3_prepare_v2 (account_db,
+                            "CREATE TABLE IF NOT EXISTS dek (\n"
+                            "dek_id     TEXT NOT NULL PRIMARY KEY,\n"
+                            "created    TEXT NOT NULL,\n"
+                            "wrapped    TEXT NOT NULL"
+                            ")",
+                            -1, &stmt, NULL);
+  if (res)
+    {
+      log_error ("error creating dek table (prepare): %s\n",
+                 sqlite3_errstr (res));
+      close_account_db (1);
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+
+  res = sqlite3_step (stmt);
+  sqlite3_finalize (stmt);
+  if (res != SQLITE_DONE)
+    {
+      log_error ("error creating dek table: %s\n", sqlite3_errstr (res));
+      close_account_db (1);
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+
+
   /* Prepare an insert statement.  */
   res = sqlite3_prepare_v2
     (account_db,
@@ -257,7 +584,8 @@ open_account_db (void)
                             " updated = ?2,"
                             " stripe_cus = ?3,"
                             " email = ?4,"
-                            " paypal_payer_id = ?5"
+                            " paypal_payer_id = ?5,"
+                            " dek_id = ?6"
                             " WHERE account_id=?1",
                             -1, &stmt, NULL);
   if (res)
@@ -271,7 +599,9 @@ open_account_db (void)
 
   /* Prepare a select statement.  */
   res = sqlite3_prepare_v2 (account_db,
-                            "SELECT * FROM account WHERE account_id=?1",
+                            "SELECT email, verified, stripe_cus,"
+                            " paypal_payer_id, dek_id"
+                            " FROM account WHERE account_id=?1",
                             -1, &stmt, NULL);
   if (res)
     {
@@ -282,10 +612,94 @@ open_account_db (void)
     }
   account_select_stmt = stmt;
 
+  /* Prepare an insert statement for the dek table.  */
+  res = sqlite3_prepare_v2 (account_db,
+                            "INSERT INTO dek (dek_id, created, wrapped)\n"
+                            "         VALUES (?1,?2,?3)",
+                            -1, &stmt, NULL);
+  if (res)
+    {
+      log_error ("error preparing dek insert statement: %s\n",
+                 sqlite3_errstr (res));
+      close_account_db (1);
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+  dek_insert_stmt = stmt;
+
+  /* Prepare a select statement for the dek table.  */
+  res = sqlite3_prepare_v2 (account_db,
+                            "SELECT wrapped FROM dek WHERE dek_id=?1",
+                            -1, &stmt, NULL);
+  if (res)
+    {
+      log_error ("error preparing dek select statement: %s\n",
+                 sqlite3_errstr (res));
+      close_account_db (1);
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+  dek_select_stmt = stmt;
+
   return 0;
 }
 
 
+/* Create a new data encryption key and store it in the dek table.
+ * The new key will then be used by encrypt_seal_strings.  */
+static gpg_error_t
+new_dek_record (void)
+{
+  gpg_error_t err;
+  int res;
+  char datetime_buf [DB_DATETIME_SIZE];
+  char *dek_id = NULL;
+  char *wrapped = NULL;
+
+  err = encrypt_new_dek (&dek_id, &wrapped);
+  if (err)
+    {
+      log_error ("error creating a new data encryption key: %s\n",
+                 gpg_strerror (err));
+      goto leave;
+    }
+
+  sqlite3_reset (dek_insert_stmt);
+
+  res = sqlite3_bind_text (dek_insert_stmt,
+                           1, dek_id, -1, SQLITE_TRANSIENT);
+  if (!res)
+    res = sqlite3_bind_text (dek_insert_stmt,
+                             2, db_datetime_now (datetime_buf), -1,
+                             SQLITE_TRANSIENT);
+  if (!res)
+    res = sqlite3_bind_text (dek_insert_stmt,
+                             3, wrapped, -1, SQLITE_TRANSIENT);
+  if (res)
+    {
+      log_error ("error binding a value for the dek table: %s\n",
+                 sqlite3_errstr (res));
+      err = gpg_error (GPG_ERR_GENERAL);
+      goto leave;
+    }
+
+  res = sqlite3_step (dek_insert_stmt);
+  if (res != SQLITE_DONE)
+    {
+      log_error ("error inserting into the dek table: %s (%d)\n",
+                 sqlite3_errstr (res), res);
+      err = gpg_error (GPG_ERR_GENERAL);
+      goto leave;
+    }
+
+  /* Only now that the wrapped key is stored the DEK may be used.  */
+  err = encrypt_activate_dek (dek_id);
+
+ leave:
+  xfree (dek_id);
+  xfree (wrapped);
+  return err;
+}
+
+
 /* Insert a new record into the account table.  No values are
  * required.  On success the account id is stored at R_ACCOUNT_ID. */
 static gpg_error_t
@@ -353,11 +767,10 @@ update_account_record (keyvalue_t dict)
   int res;
   char datetime_buf [DB_DATETIME_SIZE];
   const char *account_id;
-  const char *stripe_cus;
-  char *enc_stripe_cus = NULL;
   const char *email;
-  const char *paypal_payer_id;
-  char *enc_paypal_payer_id = NULL;
+  const char *plain[2];
+  char *enc[2] = { NULL, NULL };
+  char dek_id[DEK_KEYID_SIZE];
 
   account_id = keyvalue_get_string (dict, "account-id");
   if (!*account_id)
@@ -369,30 +782,31 @@ update_account_record (keyvalue_t dict)
 
   email = keyvalue_get (dict, "Email");
 
-  stripe_cus = keyvalue_get_string (dict, "_stripe_cus");
-  if (*stripe_cus)
+  /* Encrypt all sensitive fields in one go.  Empty fields are not
+   * encrypted but returned as empty strings.  */
+  plain[0] = keyvalue_get_string (dict, "_stripe_cus");
+  plain[1] = keyvalue_get_string (dict, "_paypal_payer_id");
+  if (opt.envelope_encryption)
     {
-      err = encrypt_string (&enc_stripe_cus, stripe_cus,
-                            (ENCRYPT_TO_DATABASE | ENCRYPT_TO_BACKOFFICE));
-      if (err)
+      err = encrypt_seal_strings (enc, plain, DIM (plain), dek_id);
+      if (gpg_err_code (err) == GPG_ERR_NO_KEY)
         {
-          log_error ("encrypting the Stripe customer_id failed: %s <%s>\n",
-                     gpg_strerror (err), gpg_strsource (err));
-          goto leave;
+          err = new_dek_record ();
+          if (!err)
+            err = encrypt_seal_strings (enc, plain, DIM (plain), dek_id);
         }
     }
-
-  paypal_payer_id = keyvalue_get_string (dict, "_paypal_payer_id");
-  if (*paypal_payer_id)
+  else
     {
-      err = encrypt_string (&enc_paypal_payer_id, paypal_payer_id,
-                            (ENCRYPT_TO_DATABASE | ENCRYPT_TO_BACKOFFICE));
-      if (err)
-        {
-          log_error ("encrypting the Paypal paper_id failed: %s <%s>\n",
-                     gpg_strerror (err), gpg_strsource (err));
-          goto leave;
-        }
+      *dek_id = 0;
+      err = encrypt_strings (enc, plain, DIM (plain),
+                             (ENCRYPT_TO_DATABASE | ENCRYPT_TO_BACKOFFICE));
+    }
+  if (err)
+    {
+      log_error ("encrypting the account data failed: %s <%s>\n",
+                 gpg_strerror (err), gpg_strsource (err));
+      goto leave;
     }
 
   sqlite3_reset (account_update_stmt);
@@ -406,7 +820,7 @@ update_account_record (keyvalue_t dict)
                              SQLITE_TRANSIENT);
   if (!res)
     res = sqlite3_bind_text (account_update_stmt,
-                             3, enc_stripe_cus, -1,
+                             3, *plain[0]? enc[0] : NULL, -1,
                              SQLITE_TRANSIENT);
   if (!res)
     res = sqlite3_bind_text (account_update_stmt,
@@ -414,7 +828,11 @@ update_account_record (keyvalue_t dict)
                              SQLITE_TRANSIENT);
   if (!res)
     res = sqlite3_bind_text (account_update_stmt,
-                             5, enc_paypal_payer_id, -1,
+                             5, *plain[1]? enc[1] : NULL, -1,
+                             SQLITE_TRANSIENT);
+  if (!res)
+    res = sqlite3_bind_text (account_update_stmt,
+                             6, *dek_id? dek_id : NULL, -1,
                              SQLITE_TRANSIENT);
   if (res)
     {
@@ -440,12 +858,199 @@ update_account_record (keyvalue_t dict)
                gpg_strerror (err), sqlite3_errstr (res), res);
 
  leave:
+  xfree (enc[0]);
+  xfree (enc[1]);
+  return err;
+}
+
+
+
+/* Decrypt the value ENCVALUE of an account field.  If DEK_ID is not
+ * NULL the value is sealed with that data encryption key; the
+ * OpenPGP encrypted WRAPPED value is then used to load the DEK if it
+ * is not yet known.  Returns an allocated string at R_VALUE.  */
+static gpg_error_t
+decrypt_account_field (char **r_value, const char *encvalue,
+                       const char *dek_id, const char *wrapped)
+{
+  gpg_error_t err;
+  char *tmp;
+
+  *r_value = NULL;
+  if (!encvalue)
+    encvalue = "";
+
+  if (!dek_id)
+    {
+      err = decrypt_string (&tmp, encvalue);
+      if (!err)
+        {
+          /* Copy to our heap because decrypt_string may return
+           * GPGME's memory.  */
+          *r_value = xtrystrdup (tmp);
+          if (!*r_value)
+            err = gpg_error_from_syserror ();
+          wipememory (tmp, strlen (tmp));
+          gpgme_free (tmp);
+        }
+      return err;
+    }
+
+  err = decrypt_sealed_string (r_value, dek_id, encvalue);
+  if (gpg_err_code (err) == GPG_ERR_NO_KEY && wrapped)
+    {
+      err = encrypt_load_dek (dek_id, wrapped);
+      if (!err)
+        err = decrypt_sealed_string (r_value, dek_id, encvalue);
+    }
+  return err;
+}
+
+
+/* Read the record for ACCOUNT_ID from the database, decrypt it, and
+ * put it into the cache.  On success a new dictionary with the
+ * values is stored at R_DICT.  */
+static gpg_error_t
+get_account_record (const char *account_id, keyvalue_t *r_dict)
+{
+  gpg_error_t err;
+  int res;
+  unsigned int generation;
+  char *email = NULL;
+  int verified = 0;
+  char *enc_stripe_cus = NULL;
+  char *enc_paypal_payer_id = NULL;
+  char *dek_id = NULL;
+  char *wrapped = NULL;
+  char *stripe_cus = NULL;
+  char *paypal_payer_id = NULL;
+  const char *s;
+
+  *r_dict = NULL;
+
+  err = open_account_db ();
+  if (err)
+    return err;
+
+  lock_account_cache ();
+  generation = account_cache_generation;
+  unlock_account_cache ();
+
+  sqlite3_reset (account_select_stmt);
+  res = sqlite3_bind_text (account_select_stmt,
+                           1, account_id, -1, SQLITE_TRANSIENT);
+  if (res)
+    {
+      log_error ("error binding a value for the account table: %s\n",
+                 sqlite3_errstr (res));
+      err = gpg_error (GPG_ERR_GENERAL);
+      close_account_db (0);
+      goto leave;
+    }
+
+  res = sqlite3_step (account_select_stmt);
+  if (res == SQLITE_ROW)
+    {
+      verified = sqlite3_column_int (account_select_stmt, 1);
+#define COPY_COLUMN(var, col)                                           \
+      do {                                                              \
+        s = (const char *)sqlite3_column_text (account_select_stmt, col); \
+        if (s && !(var = xtrystrdup (s)))                               \
+          err = gpg_error_from_syserror ();                             \
+      } while (0)
+      COPY_COLUMN (email, 0);
+      if (!err)
+        COPY_COLUMN (enc_stripe_cus, 2);
+      if (!err)
+        COPY_COLUMN (enc_paypal_payer_id, 3);
+      if (!err)
+        COPY_COLUMN (dek_id, 4);
+#undef COPY_COLUMN
+    }
+  else if (res == SQLITE_DONE)
+    err = gpg_error (GPG_ERR_NOT_FOUND);
+  else
+    {
+      log_error ("error selecting from the account table: %s (%d)\n",
+                 sqlite3_errstr (res), res);
+      err = gpg_error (GPG_ERR_GENERAL);
+    }
+  sqlite3_reset (account_select_stmt);
+
+  if (!err && dek_id)
+    {
+      sqlite3_reset (dek_select_stmt);
+      res = sqlite3_bind_text (dek_select_stmt,
+                               1, dek_id, -1, SQLITE_TRANSIENT);
+      if (!res)
+        res = sqlite3_step (dek_select_stmt);
+      if (res == SQLITE_ROW)
+        {
+          s = (const char *)sqlite3_column_text (dek_select_stmt, 0);
+          if (s && !(wrapped = xtrystrdup (s)))
+            err = gpg_error_from_syserror ();
+        }
+      else if (res != SQLITE_DONE)
+        {
+          log_error ("error selecting from the dek table: %s (%d)\n",
+                     sqlite3_errstr (res), res);
+          err = gpg_error (GPG_ERR_GENERAL);
+        }
+      sqlite3_reset (dek_select_stmt);
+    }
+  close_account_db (0);
+  if (err)
+    goto leave;
+
+  /* Decrypt without holding the database lock.  */
+  err = decrypt_account_field (&stripe_cus, enc_stripe_cus, dek_id, wrapped);
+  if (!err)
+    err = decrypt_account_field (&paypal_payer_id, enc_paypal_payer_id,
+                                 dek_id, wrapped);
+  if (err)
+    {
+      log_error ("error decrypting account '%s': %s\n",
+                 account_id, gpg_strerror (err));
+      goto leave;
+    }
+
+  account_cache_put (generation, account_id, verified, email? email : "",
+                     stripe_cus, paypal_payer_id);
+
+  err = keyvalue_put (r_dict, "account-id", account_id);
+  if (!err)
+    err = keyvalue_put (r_dict, "Email", email);
+  if (!err)
+    err = keyvalue_put (r_dict, "Verified", verified? "1" : "0");
+  if (!err)
+    err = keyvalue_put (r_dict, "_stripe_cus", stripe_cus);
+  if (!err)
+    err = keyvalue_put (r_dict, "_paypal_payer_id", paypal_payer_id);
+
+ leave:
+  if (err)
+    {
+      keyvalue_release (*r_dict);
+      *r_dict = NULL;
+    }
+  if (stripe_cus)
+    {
+      wipememory (stripe_cus, strlen (stripe_cus));
+      xfree (stripe_cus);
+    }
+  if (paypal_payer_id)
+    {
+      wipememory (paypal_payer_id, strlen (paypal_payer_id));
+      xfree (paypal_payer_id);
+    }
+  xfree (email);
   xfree (enc_stripe_cus);
   xfree (enc_paypal_payer_id);
+  xfree (dek_id);
+  xfree (wrapped);
   return err;
 }
 
-
 
 /*
  *   Public API
@@ -483,7 +1088,62 @@ account_update_record (keyvalue_t dict)
     return err;
 
   err = update_account_record (dict);
+  account_cache_invalidate (keyvalue_get_string (dict, "account-id"));
   close_account_db (0);
 
   return err;
 }
+
+
+/* Get the account record for ACCOUNT_ID and store a new dictionary
+ * with the values at R_DICT.  The dictionary has the same items as
+ * used by account_update_record and the item "Verified".  Decrypted
+ * records are cached for some time so that repeated requests do not
+ * need to decrypt again.  The caller should wipe the values before
+ * releasing the dictionary.  */
+gpg_error_t
+account_get_record (const char *account_id, keyvalue_t *r_dict)
+{
+  gpg_error_t err;
+  account_cache_t item;
+
+  *r_dict = NULL;
+
+  if (!account_id || !*account_id)
+    return gpg_error (GPG_ERR_MISSING_VALUE);
+
+  lock_account_cache ();
+  item = account_cache_find (account_id);
+  if (item)
+    {
+      err = keyvalue_put (r_dict, "account-id", item->account_id);
+      if (!err)
+        err = keyvalue_put (r_dict, "Email",
+                            *item->email? item->email : NULL);
+      if (!err)
+        err = keyvalue_put (r_dict, "Verified", item->verified? "1" : "0");
+      if (!err)
+        err = keyvalue_put (r_dict, "_stripe_cus", item->stripe_cus);
+      if (!err)
+        err = keyvalue_put (r_dict, "_paypal_payer_id",
+                            item->paypal_payer_id);
+      unlock_account_cache ();
+      if (err)
+        {
+          keyvalue_release (*r_dict);
+          *r_dict = NULL;
+        }
+      return err;
+    }
+  unlock_account_cache ();
+
+  return get_account_record (account_id, r_dict);
+}
+
+
+/* Run regular cleanup tasks.  */
+void
+account_housekeeping (void)
+{
+  account_cache_expire ();
+}
@@ -22,6 +22,8 @@
 
 gpg_error_t account_new_record (char **r_account_id);
 gpg_error_t account_update_record (keyvalue_t dict);
+gpg_error_t account_get_record (const char *account_id, keyvalue_t *r_dict);
+void account_housekeeping (void);
 
 
 #endif /*ACCOUNT_H*/
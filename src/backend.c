@@ -0,0 +1,317 @@
+/* backend.c - Track the state of the payment service backends
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Each call to Stripe or PayPal is bracketed by backend_acquire and
+ * backend_release.  This allows us to keep per backend statistics and
+ * to implement a circuit breaker: After MAX_FAILURES consecutive
+ * failures (transport errors or 5xx status codes) the circuit is
+ * opened and all further requests fail immediately, so that the
+ * connection threads do not pile up waiting for a dead service.
+ * After a cooldown period a single probe request is allowed
+ * (half-open state); if it succeeds the circuit is closed again,
+ * otherwise it is re-opened with a doubled cooldown.
+ *
+ * The I/O timeout for an idempotent call is derived from the recent
+ * latencies of successful calls: it is three times the 95th
+ * percentile, clamped to [MIN_TIMEOUT, MAX_TIMEOUT].  Calls which
+ * change state at the backend (e.g. a charge) always use MAX_TIMEOUT:
+ * if we give up on such a call while the backend is still working on
+ * it, the client would retry an operation which actually succeeded.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <npth.h>
+
+#include "util.h"
+#include "logging.h"
+#include "backend.h"
+
+
+/* Number of consecutive failures to open the circuit.  */
+#define MAX_FAILURES 5
+
+/* Initial and maximum cooldown in seconds.  */
+#define MIN_COOLDOWN 30
+#define MAX_COOLDOWN 300
+
+/* The range for the timeout in milliseconds.  */
+#define MIN_TIMEOUT  2000
+#define MAX_TIMEOUT 30000
+
+/* Number of latency samples kept and the number of samples required
+   before the timeout is adapted.  */
+#define MAX_SAMPLES 64
+#define MIN_SAMPLES 10
+
+
+static struct
+{
+  const char *name;
+  int state;
+  unsigned int failures;
+  time_t opened_at;
+  unsigned int cooldown;
+  int probe_active;
+  unsigned int samples[MAX_SAMPLES];  /* Latencies in milliseconds.  */
+  unsigned int nsamples;
+  unsigned int nextsample;
+  unsigned long calls;
+  unsigned long fastfails;
+} backends[] =
+  {
+    { "stripe" },
+    { "paypal" }
+  };
+#define NBACKENDS ((int)DIM (backends))
+
+/* Lock to protect BACKENDS.  */
+static npth_mutex_t backends_lock = NPTH_MUTEX_INITIALIZER;
+
+
+
+static void
+lock_backends (void)
+{
+  int res = npth_mutex_lock (&backends_lock);
+  if (res)
+    log_fatal ("failed to acquire backends lock: %s\n", strerror (res));
+}
+
+static void
+unlock_backends (void)
+{
+  int res = npth_mutex_unlock (&backends_lock);
+  if (res)
+    log_fatal ("failed to release backends lock: %s\n", strerror (res));
+}
+
+
+static int
+compare_uint (const void *a, const void *b)
+{
+  unsigned int x = *(const unsigned int *)a;
+  unsigned int y = *(const unsigned int *)b;
+
+  return x < y? -1 : x > y;
+}
+
+
+/* Store the median and the 95th percentile of the latency samples of
+   backend IDX at R_P50 and R_P95.  Caller must hold the lock.  */
+static void
+get_percentiles (int idx, unsigned int *r_p50, unsigned int *r_p95)
+{
+  unsigned int sorted[MAX_SAMPLES];
+  unsigned int n = backends[idx].nsamples;
+
+  if (!n)
+    {
+      *r_p50 = *r_p95 = 0;
+      return;
+    }
+  memcpy (sorted, backends[idx].samples, n * sizeof *sorted);
+  qsort (sorted, n, sizeof *sorted, compare_uint);
+  *r_p50 = sorted[(n - 1) * 50 / 100];
+  *r_p95 = sorted[(n - 1) * 95 / 100];
+}
+
+
+/* Return the timeout in milliseconds for backend IDX.  Caller must
+   hold the lock.  */
+static unsigned int
+get_timeout (int idx)
+{
+  unsigned int p50, p95, timeout;
+
+  if (backends[idx].nsamples < MIN_SAMPLES)
+    return MAX_TIMEOUT;
+
+  get_percentiles (idx, &p50, &p95);
+  timeout = 3 * p95;
+  if (timeout < MIN_TIMEOUT)
+    timeout = MIN_TIMEOUT;
+  else if (timeout > MAX_TIMEOUT)
+    timeout = MAX_TIMEOUT;
+  return timeout;
+}
+
+
+/* Prepare a call to BACKEND and initialize CALL.  Returns an error if
+   the circuit for the backend is open; the caller must then not
+   contact the backend and must not call backend_release.  On success
+   the I/O timeout in milliseconds to use for the call is stored at
+   R_TIMEOUT.  IDEMPOTENT must only be set if the call may safely be
+   repeated.  */
+gpg_error_t
+backend_acquire (backend_call_t call, int backend, int idempotent,
+                 unsigned int *r_timeout)
+{
+  gpg_error_t err = 0;
+
+  if (backend < 0 || backend >= NBACKENDS)
+    log_bug ("invalid backend %d\n", backend);
+
+  memset (call, 0, sizeof *call);
+  call->backend = backend;
+
+  lock_backends ();
+  backends[backend].calls++;
+  if (backends[backend].state == BACKEND_OPEN
+      && time (NULL) >= (backends[backend].opened_at
+                         + backends[backend].cooldown))
+    {
+      backends[backend].state = BACKEND_HALF_OPEN;
+      backends[backend].probe_active = 0;
+    }
+
+  if (backends[backend].state == BACKEND_OPEN
+      || (backends[backend].state == BACKEND_HALF_OPEN
+          && backends[backend].probe_active))
+    {
+      backends[backend].fastfails++;
+      err = gpg_error (GPG_ERR_EHOSTDOWN);
+    }
+  else
+    {
+      if (backends[backend].state == BACKEND_HALF_OPEN)
+        {
+          backends[backend].probe_active = 1;
+          call->probe = 1;
+          log_info ("%s: probing backend\n", backends[backend].name);
+        }
+      *r_timeout = idempotent? get_timeout (backend) : MAX_TIMEOUT;
+    }
+  unlock_backends ();
+
+  if (!err)
+    clock_gettime (CLOCK_MONOTONIC, &call->start);
+  return err;
+}
+
+
+/* Finish the call CALL.  ERR is the error returned by the HTTP layer
+   and STATUS the HTTP status code or 0 if no response was received.
+   Errors which happened before the backend was contacted are not
+   counted as failures of the backend.  */
+void
+backend_release (backend_call_t call, gpg_error_t err, unsigned int status)
+{
+  int idx = call->backend;
+  struct timespec now;
+  unsigned int elapsed;
+  int failed;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  elapsed = ((now.tv_sec - call->start.tv_sec) * 1000
+             + (now.tv_nsec - call->start.tv_nsec) / 1000000);
+
+  failed = (err && !status) || status >= 500;
+
+  lock_backends ();
+  if (!call->contacted)
+    {
+      /* A local error - let the next call do the probing.  */
+      if (call->probe)
+        backends[idx].probe_active = 0;
+    }
+  else if (!failed)
+    {
+      backends[idx].samples[backends[idx].nextsample] = elapsed;
+      backends[idx].nextsample = (backends[idx].nextsample + 1) % MAX_SAMPLES;
+      if (backends[idx].nsamples < MAX_SAMPLES)
+        backends[idx].nsamples++;
+      backends[idx].failures = 0;
+      if (call->probe)
+        {
+          backends[idx].state = BACKEND_CLOSED;
+          backends[idx].probe_active = 0;
+          backends[idx].cooldown = 0;
+          log_info ("%s: backend is available again\n", backends[idx].name);
+        }
+    }
+  else
+    {
+      backends[idx].failures++;
+      if (call->probe)
+        {
+          backends[idx].state = BACKEND_OPEN;
+          backends[idx].probe_active = 0;
+          backends[idx].opened_at = time (NULL);
+          backends[idx].cooldown *= 2;
+          if (backends[idx].cooldown > MAX_COOLDOWN)
+            backends[idx].cooldown = MAX_COOLDOWN;
+          log_error ("%s: backend still failing - retrying in %u seconds\n",
+                     backends[idx].name, backends[idx].cooldown);
+        }
+      else if (backends[idx].state == BACKEND_CLOSED
+               && backends[idx].failures >= MAX_FAILURES)
+        {
+          backends[idx].state = BACKEND_OPEN;
+          backends[idx].opened_at = time (NULL);
+          backends[idx].cooldown = MIN_COOLDOWN;
+          log_error ("%s: backend failed %u times - disabled for %u seconds\n",
+                     backends[idx].name, backends[idx].failures,
+                     backends[idx].cooldown);
+        }
+    }
+  unlock_backends ();
+}
+
+
+/* Return a string describing the circuit breaker STATE.  */
+const char *
+backend_state_str (int state)
+{
+  switch (state)
+    {
+    case BACKEND_CLOSED:    return "closed";
+    case BACKEND_OPEN:      return "open";
+    case BACKEND_HALF_OPEN: return "half-open";
+    }
+  return "?";
+}
+
+
+/* Return the name of the backend with sequence number SEQ and store
+   information about it at INFO.  Returns NULL if SEQ is out of
+   range.  */
+const char *
+get_backend_info (int seq, struct backend_info_s *info)
+{
+  if (seq < 0 || seq >= NBACKENDS)
+    return NULL;
+
+  lock_backends ();
+  info->state     = backends[seq].state;
+  info->failures  = backends[seq].failures;
+  info->timeout   = get_timeout (seq);
+  info->cooldown  = (backends[seq].state == BACKEND_CLOSED
+                     ? 0 : backends[seq].cooldown);
+  info->nsamples  = backends[seq].nsamples;
+  get_percentiles (seq, &info->p50, &info->p95);
+  info->calls     = backends[seq].calls;
+  info->fastfails = backends[seq].fastfails;
+  unlock_backends ();
+
+  return backends[seq].name;
+}
@@ -0,0 +1,74 @@
+/* backend.h - Definitions for the payment service backend state
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <time.h>
+
+/* The known backends.  */
+enum
+  {
+    BACKEND_STRIPE = 0,
+    BACKEND_PAYPAL = 1
+  };
+
+/* The state of a backend's circuit breaker.  */
+enum
+  {
+    BACKEND_CLOSED = 0,    /* Normal operation.  */
+    BACKEND_OPEN,          /* Requests fail immediately.  */
+    BACKEND_HALF_OPEN      /* A single probe request is allowed.  */
+  };
+
+/* An object to track a single call to a backend.  */
+struct backend_call_s
+{
+  int backend;
+  int probe;                /* This call is the half-open probe.  */
+  int contacted;            /* Set by the caller right before the
+                               backend is contacted.  */
+  struct timespec start;
+};
+typedef struct backend_call_s *backend_call_t;
+
+/* Information about a backend as returned by get_backend_info.  */
+struct backend_info_s
+{
+  int state;
+  unsigned int failures;    /* Consecutive failures.  */
+  unsigned int timeout;     /* Current timeout in milliseconds.  */
+  unsigned int cooldown;    /* Seconds the circuit stays open.  */
+  unsigned int nsamples;    /* Number of latency samples.  */
+  unsigned int p50;         /* Median latency in milliseconds.  */
+  unsigned int p95;         /* 95th percentile in milliseconds.  */
+  unsigned long calls;      /* Total number of calls.  */
+  unsigned long fastfails;  /* Calls rejected while open.  */
+};
+
+gpg_error_t backend_acquire (backend_call_t call, int backend,
+                             int idempotent, unsigned int *r_timeout);
+void backend_release (backend_call_t call, gpg_error_t err,
+                      unsigned int status);
+
+const char *backend_state_str (int state);
+const char *get_backend_info (int seq, struct backend_info_s *info);
+
+
+#endif /*BACKEND_H*/
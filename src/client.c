@@ -0,0 +1,521 @@
+/* client.c - Client functions to talk to payprocd.
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* These functions are used by the payproc tools and other programs
+   to send requests to payprocd.  They do not print diagnostics; it is
+   up to the caller to report errors.
+
+   Besides the one-shot client_request there is a thread-safe pool of
+   persistent connections.  Pooled connections use the binary framing
+   because payprocd keeps only those connections open for further
+   requests.  A batch takes one connection from the pool, sends the
+   requests added to it without waiting and then reads the responses
+   in the same order, calling a callback for each.  */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "util.h"
+#include "protocol-io.h"
+#include "client.h"
+
+
+/* The maximum number of requests of a batch sent without reading
+   their responses.  The daemon serves one request after the other
+   and blocks when it can't write a response; thus without a limit
+   both sides would block as soon as the socket buffers are full.  */
+#define BATCH_MAX_PENDING 32
+
+
+/* Connect to the daemon at SOCKETNAME and return an estream for the
+   connected socket.  On error returns NULL and sets ERRNO.  */
+estream_t
+client_connect (const char *socketname)
+{
+  int sock;
+  struct sockaddr_un addr_un;
+  struct sockaddr    *addrp;
+  size_t addrlen;
+  estream_t fp;
+
+  if (strlen (socketname)+1 >= sizeof addr_un.sun_path)
+    {
+      gpg_err_set_errno (EINVAL);
+      return NULL;
+    }
+
+  memset (&addr_un, 0, sizeof addr_un);
+  addr_un.sun_family = AF_LOCAL;
+  strncpy (addr_un.sun_path, socketname, sizeof (addr_un.sun_path) - 1);
+  addr_un.sun_path[sizeof (addr_un.sun_path) - 1] = 0;
+  addrlen = SUN_LEN (&addr_un);
+  addrp = (struct sockaddr *)&addr_un;
+
+  sock = socket (AF_LOCAL, SOCK_STREAM, 0);
+  if (sock == -1)
+    return NULL;
+
+  if (connect (sock, addrp, addrlen))
+    {
+      int saveerr = errno;
+      close (sock);
+      errno = saveerr;
+      return NULL;
+    }
+
+  fp = es_fdopen (sock, "r+b");
+  if (!fp)
+    {
+      int saveerr = errno;
+      close (sock);
+      gpg_err_set_errno (saveerr);
+      return NULL;
+    }
+
+  return fp;
+}
+
+
+/* Write the request with COMMAND and the items from INDATA to FP
+   using the line based protocol.  */
+static void
+write_text_request (estream_t fp, const char *command, keyvalue_t indata)
+{
+  keyvalue_t kv;
+  const char *s, *value;
+
+  es_fprintf (fp, "%s\n", command);
+  for (kv = indata; kv; kv = kv->next)
+    {
+      if (!kv->value)
+        continue;
+      es_fputs (kv->name, fp);
+      es_fputs (": ", fp);
+      for (value = kv->value; (s = strchr (value, '\n')); value = s + 1)
+        {
+          es_write (fp, value, s - value, NULL);
+          if (s[1])
+            es_fputs ("\n ", fp);
+        }
+      es_fputs (value, fp);
+      es_putc ('\n', fp);
+    }
+  es_putc ('\n', fp);
+}
+
+
+/* Write the request with COMMAND and the items from INDATA to FP
+   using the binary framing.  */
+static void
+write_binary_request (estream_t fp, const char *command, keyvalue_t indata)
+{
+  keyvalue_t kv;
+
+  protocol_write_binary_start (fp, command);
+  for (kv = indata; kv; kv = kv->next)
+    if (kv->value)
+      protocol_write_binary_item (fp, kv->name, kv->value);
+  protocol_write_binary_end (fp);
+}
+
+
+/* Send COMMAND and INDATA to the daemon listening on SOCKETNAME.  On
+   return OUTDATA is updated with the response values.  If the daemon
+   returned an error its description is stored in OUTDATA under the
+   key "_errdesc".  FLAGS is a bit vector with CLIENT_FLAG_ values.  */
+gpg_error_t
+client_request (const char *socketname, unsigned int flags,
+                const char *command, keyvalue_t indata, keyvalue_t *outdata)
+{
+  gpg_error_t err;
+  estream_t fp;
+
+  fp = client_connect (socketname);
+  if (!fp)
+    return gpg_error_from_syserror ();
+
+  if ((flags & CLIENT_FLAG_BINARY))
+    write_binary_request (fp, command, indata);
+  else
+    write_text_request (fp, command, indata);
+
+  if (es_ferror (fp) || es_fflush (fp))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  if ((flags & CLIENT_FLAG_BINARY))
+    err = protocol_read_binary_response (fp, outdata);
+  else
+    err = protocol_read_response (fp, outdata);
+
+  /* Eat the response for a clean connection shutdown.  */
+  while (es_getc (fp) != EOF)
+    ;
+
+ leave:
+  es_fclose (fp);
+  return err;
+}
+
+
+
+/*
+ * Connection pool
+ */
+
+/* A pooled connection.  We use separate streams for reading and
+   writing because an estream can't switch from reading to writing on
+   a socket.  */
+struct pool_conn_s
+{
+  struct pool_conn_s *next;
+  estream_t in;   /* Owns the socket.  */
+  estream_t out;
+};
+
+/* Object describing a pool of connections.  */
+struct client_pool_s
+{
+  gpgrt_lock_t lock;             /* Protects IDLE and NIDLE.  */
+  struct pool_conn_s *idle;      /* List of idle connections.  */
+  unsigned int nidle;            /* Number of items in IDLE.  */
+  unsigned int maxidle;          /* Max number of idle connections.  */
+  char socketname[1];            /* The name of the daemon's socket.  */
+};
+
+
+/* A pending request in a batch.  */
+struct batch_item_s
+{
+  struct batch_item_s *next;
+  client_cb_t cb;
+  void *opaque;
+};
+
+/* Object describing a batch of pipelined requests.  */
+struct client_batch_s
+{
+  client_pool_t pool;
+  struct pool_conn_s *conn;      /* The connection used.  */
+  gpg_error_t err;               /* The first local error.  */
+  struct batch_item_s *items;    /* The pending requests ...  */
+  struct batch_item_s **tail;    /* ... and the end of that list.  */
+  unsigned int npending;         /* The length of that list.  */
+};
+
+
+/* Create a new pool for connections to the daemon at SOCKETNAME and
+   store it at R_POOL.  At most MAXIDLE idle connections are kept
+   open; the number of connections in use is not limited.  */
+gpg_error_t
+client_pool_new (client_pool_t *r_pool, const char *socketname,
+                 unsigned int maxidle)
+{
+  client_pool_t pool;
+
+  *r_pool = NULL;
+  pool = xtrycalloc (1, sizeof *pool + strlen (socketname));
+  if (!pool)
+    return gpg_error_from_syserror ();
+  gpgrt_lock_init (&pool->lock);
+  pool->maxidle = maxidle;
+  strcpy (pool->socketname, socketname);
+  *r_pool = pool;
+  return 0;
+}
+
+
+/* Close the connection CONN and release it.  */
+static void
+close_pool_conn (struct pool_conn_s *conn)
+{
+  if (!conn)
+    return;
+  es_fclose (conn->out);
+  es_fclose (conn->in);
+  xfree (conn);
+}
+
+
+/* Close all connections of POOL and release it.  The caller must
+   make sure that no connection of the pool is in use.  */
+void
+client_pool_release (client_pool_t pool)
+{
+  struct pool_conn_s *conn;
+
+  if (!pool)
+    return;
+  while ((conn = pool->idle))
+    {
+      pool->idle = conn->next;
+      close_pool_conn (conn);
+    }
+  gpgrt_lock_destroy (&pool->lock);
+  xfree (pool);
+}
+
+
+/* Return true if the idle connection CONN has been closed by the
+   daemon.  An idle connection must not have any data to read, thus
+   readability indicates EOF or an error.  */
+static int
+stale_connection_p (struct pool_conn_s *conn)
+{
+  struct pollfd pfd;
+
+  pfd.fd = es_fileno (conn->in);
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  return poll (&pfd, 1, 0) != 0;
+}
+
+
+/* Take a connection from POOL or open a new one.  Returns NULL and
+   sets ERRNO on error.  */
+static struct pool_conn_s *
+get_pool_conn (client_pool_t pool)
+{
+  struct pool_conn_s *conn;
+  int saveerr;
+
+  for (;;)
+    {
+      gpgrt_lock_lock (&pool->lock);
+      conn = pool->idle;
+      if (conn)
+        {
+          pool->idle = conn->next;
+          pool->nidle--;
+        }
+      gpgrt_lock_unlock (&pool->lock);
+      if (!conn)
+        break;
+      if (!stale_connection_p (conn))
+        return conn;
+      close_pool_conn (conn);
+    }
+
+  conn = xtrycalloc (1, sizeof *conn);
+  if (!conn)
+    return NULL;
+  conn->in = client_connect (pool->socketname);
+  if (!conn->in)
+    goto fail;
+  conn->out = es_fdopen_nc (es_fileno (conn->in), "w");
+  if (!conn->out)
+    goto fail;
+  return conn;
+
+ fail:
+  saveerr = errno;
+  if (conn->in)
+    es_fclose (conn->in);
+  xfree (conn);
+  gpg_err_set_errno (saveerr);
+  return NULL;
+}
+
+
+/* Return the connection CONN to POOL.  If BROKEN is set or the pool
+   is full the connection is closed.  */
+static void
+put_pool_conn (client_pool_t pool, struct pool_conn_s *conn, int broken)
+{
+  if (!conn)
+    return;
+  if (!broken)
+    {
+      gpgrt_lock_lock (&pool->lock);
+      if (pool->nidle < pool->maxidle)
+        {
+          conn->next = pool->idle;
+          pool->idle = conn;
+          pool->nidle++;
+          conn = NULL;
+        }
+      gpgrt_lock_unlock (&pool->lock);
+    }
+  close_pool_conn (conn);
+}
+
+
+/* Return true if ERR as returned by protocol_read_binary_response
+   with OUTDATA is a local error and thus the connection can't be
+   used anymore.  */
+static int
+local_error_p (gpg_error_t err, keyvalue_t outdata)
+{
+  return err && !keyvalue_get (outdata, "_errdesc");
+}
+
+
+/* Same as client_request but use a connection from POOL.  */
+gpg_error_t
+client_pool_request (client_pool_t pool, const char *command,
+                     keyvalue_t indata, keyvalue_t *outdata)
+{
+  gpg_error_t err;
+  struct pool_conn_s *conn;
+
+  conn = get_pool_conn (pool);
+  if (!conn)
+    return gpg_error_from_syserror ();
+
+  write_binary_request (conn->out, command, indata);
+  if (es_ferror (conn->out) || es_fflush (conn->out))
+    {
+      err = gpg_error_from_syserror ();
+      put_pool_conn (pool, conn, 1);
+      return err;
+    }
+
+  err = protocol_read_binary_response (conn->in, outdata);
+  put_pool_conn (pool, conn, local_error_p (err, *outdata));
+  return err;
+}
+
+
+/* Create a new batch for requests sent via a connection from POOL
+   and store it at R_BATCH.  */
+gpg_error_t
+client_batch_new (client_batch_t *r_batch, client_pool_t pool)
+{
+  gpg_error_t err;
+  client_batch_t batch;
+
+  *r_batch = NULL;
+  batch = xtrycalloc (1, sizeof *batch);
+  if (!batch)
+    return gpg_error_from_syserror ();
+  batch->pool = pool;
+  batch->tail = &batch->items;
+  batch->conn = get_pool_conn (pool);
+  if (!batch->conn)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (batch);
+      return err;
+    }
+  *r_batch = batch;
+  return 0;
+}
+
+
+/* Read the responses for all pending requests of BATCH and call
+   their callbacks.  On a local error the remaining callbacks are
+   called with that error.  */
+static void
+drain_batch (client_batch_t batch)
+{
+  struct batch_item_s *item;
+  keyvalue_t outdata;
+  gpg_error_t err;
+
+  if (!batch->err && es_fflush (batch->conn->out))
+    batch->err = gpg_error_from_syserror ();
+
+  while ((item = batch->items))
+    {
+      batch->items = item->next;
+      outdata = NULL;
+      if (batch->err)
+        err = batch->err;
+      else
+        {
+          err = protocol_read_binary_response (batch->conn->in, &outdata);
+          if (local_error_p (err, outdata))
+            batch->err = err;
+        }
+      if (item->cb)
+        item->cb (item->opaque, err, outdata);
+      keyvalue_release (outdata);
+      xfree (item);
+    }
+  batch->tail = &batch->items;
+  batch->npending = 0;
+}
+
+
+/* Add a request with COMMAND and INDATA to BATCH.  The request may be
+   sent right away.  CB is called with OPAQUE, the error code, and the
+   response data once the response has been read; the response data is
+   released after the callback returns.  The responses are read by
+   client_batch_run or, if BATCH_MAX_PENDING requests are pending, by
+   this function; thus CB may be called before this function returns.
+   Returns an error if the request could not be queued; errors while
+   sending or reading are reported to the callbacks.  */
+gpg_error_t
+client_batch_add (client_batch_t batch, const char *command,
+                  keyvalue_t indata, client_cb_t cb, void *opaque)
+{
+  struct batch_item_s *item;
+
+  if (batch->err)
+    return batch->err;
+
+  if (batch->npending >= BATCH_MAX_PENDING)
+    {
+      drain_batch (batch);
+      if (batch->err)
+        return batch->err;
+    }
+
+  item = xtrycalloc (1, sizeof *item);
+  if (!item)
+    return gpg_error_from_syserror ();
+  item->cb = cb;
+  item->opaque = opaque;
+  *batch->tail = item;
+  batch->tail = &item->next;
+  batch->npending++;
+
+  write_binary_request (batch->conn->out, command, indata);
+  if (es_ferror (batch->conn->out))
+    batch->err = gpg_error_from_syserror ();
+  return 0;
+}
+
+
+/* Send all requests of BATCH, read the responses and call the
+   callbacks.  On a local error the remaining callbacks are called
+   with that error.  BATCH is released by this function.  Returns the
+   first local error or 0.  */
+gpg_error_t
+client_batch_run (client_batch_t batch)
+{
+  gpg_error_t err;
+
+  drain_batch (batch);
+
+  err = batch->err;
+  put_pool_conn (batch->pool, batch->conn, !!err);
+  xfree (batch);
+  return err;
+}
@@ -0,0 +1,53 @@
+/* client.h - Definitions for the payprocd client functions.
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CLIENT_H
+#define CLIENT_H
+
+/* Flags for client_request.  */
+#define CLIENT_FLAG_BINARY 1  /* Use the binary framing.  */
+
+estream_t client_connect (const char *socketname);
+gpg_error_t client_request (const char *socketname, unsigned int flags,
+                            const char *command,
+                            keyvalue_t indata, keyvalue_t *outdata);
+
+/* A pool of persistent connections to the daemon.  */
+typedef struct client_pool_s *client_pool_t;
+
+/* A batch of pipelined requests.  */
+typedef struct client_batch_s *client_batch_t;
+
+/* The callback for a request in a batch.  */
+typedef void (*client_cb_t) (void *opaque, gpg_error_t err,
+                             keyvalue_t outdata);
+
+gpg_error_t client_pool_new (client_pool_t *r_pool, const char *socketname,
+                             unsigned int maxidle);
+void client_pool_release (client_pool_t pool);
+gpg_error_t client_pool_request (client_pool_t pool, const char *command,
+                                 keyvalue_t indata, keyvalue_t *outdata);
+
+gpg_error_t client_batch_new (client_batch_t *r_batch, client_pool_t pool);
+gpg_error_t client_batch_add (client_batch_t batch, const char *command,
+                              keyvalue_t indata,
+                              client_cb_t cb, void *opaque);
+gpg_error_t client_batch_run (client_batch_t batch);
+
+#endif /*CLIENT_H*/
@@ -22,6 +22,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 
 
 #include "util.h"
@@ -32,11 +35,19 @@
 #include "journal.h"
 #include "session.h"
 #include "currency.h"
+#include "backend.h"
 #include "preorder.h"
 #include "protocol-io.h"
 #include "mbox-util.h"
 #include "commands.h"
 
+/* The size of the stream buffer used for the responses.  */
+#define RESPONSE_BUFFER_SIZE (64*1024)
+
+/* The time in seconds a read from a client may block.  This is also
+   the time after which an idle persistent connection is closed.  */
+#define CONN_IDLE_TIMEOUT 30
+
 /* Helper macro for the cmd_ handlers.  */
 #define set_error(a,b)                          \
   do {                                          \
@@ -50,9 +61,12 @@ struct conn_s
 {
   unsigned int idno;     /* Connection id for logging.  */
   int fd;                /* File descriptor for this connection.  */
-  estream_t stream;      /* The corresponding stream object.  */
-                         /* N.B. The stream object may only be used
+  estream_t stream;      /* The stream object to write responses.  */
+  estream_t instream;    /* The stream object to read requests.  */
+                         /* N.B. The stream objects may only be used
                             by the connection thread.  */
+  unsigned int perms;    /* The CONN_PERM_ flags of the client.  */
+  int binary;            /* The client uses the binary framing.  */
   char *command;         /* The command line (malloced). */
   keyvalue_t dataitems;  /* The data items.  */
   const char *errdesc;   /* Optional description of an error.  */
@@ -87,6 +101,15 @@ init_connection_obj (conn_t conn, int fd)
 }
 
 
+/* Store the permissions PERMS of the client in CONN.  This is done
+   once after the connection has been accepted.  */
+void
+set_permissions_connection_obj (conn_t conn, unsigned int perms)
+{
+  conn->perms = perms;
+}
+
+
 /* Shutdown a connection.  This is used by asynchronous calls to tell
    the client that the request has been received and processing will
    continue.  */
@@ -98,6 +121,11 @@ shutdown_connection_obj (conn_t conn)
       es_fclose (conn->stream);
       conn->stream = NULL;
     }
+  if (conn->instream)
+    {
+      es_fclose (conn->instream);
+      conn->instream = NULL;
+    }
   if (conn->fd != -1)
     {
       close (conn->fd);
@@ -129,6 +157,7 @@ fd_from_connection_obj (conn_t conn)
 }
 
 
+
 unsigned int
 id_from_connection_obj (conn_t conn)
 {
@@ -136,27 +165,70 @@ id_from_connection_obj (conn_t conn)
 }
 
 
+/* Write VALUE to FP using continuation lines for embedded linefeeds.
+   A trailing linefeed is not written as continuation line.  Runs
+   without a linefeed are written in one go.  */
 static void
 write_data_value (const char *value, estream_t fp)
 {
+  const char *s;
+
   if (!value)
     value = "";
-  for ( ; *value; value++)
+  while ((s = strchr (value, '\n')))
     {
-      if (*value == '\n')
-        {
-          if (value[1])
-            es_fputs ("\n ", fp);
-        }
-      else
-        es_putc (*value, fp);
+      es_write (fp, value, s - value, NULL);
+      if (s[1])
+        es_fputs ("\n ", fp);
+      value = s + 1;
     }
+  es_fputs (value, fp);
   es_putc ('\n', fp);
 }
 
 
+/* Write a data line with NAME and VALUE using the framing of CONN.  */
+static void
+write_data_item (conn_t conn, const char *name, const char *value)
+{
+  if (conn->binary)
+    protocol_write_binary_item (conn->stream, name, value);
+  else
+    {
+      es_fputs (name, conn->stream);
+      es_fputs (": ", conn->stream);
+      write_data_value (value, conn->stream);
+    }
+}
+
+
+/* Write the status line consisting of PREFIX and TEXT using the
+   framing of CONN.  If PREFIX is "# " a comment line is written.  */
+static void
+write_status_line (conn_t conn, const char *prefix, const char *text)
+{
+  char *line;
+
+  if (!conn->binary)
+    {
+      es_fputs (prefix, conn->stream);
+      es_fputs (text, conn->stream);
+      es_putc ('\n', conn->stream);
+    }
+  else if (*prefix == '#')
+    protocol_write_binary_item (conn->stream, "#", text);
+  else
+    {
+      line = strconcat (prefix, text, NULL);
+      protocol_write_binary_start (conn->stream,
+                                   line? line : "ERR 1 (out of core)");
+      xfree (line);
+    }
+}
+
+
 static void
-write_data_line (keyvalue_t kv, estream_t fp)
+write_data_line (keyvalue_t kv, conn_t conn)
 {
   const char *value;
 
@@ -166,9 +238,7 @@ write_data_line (keyvalue_t kv, estream_t fp)
   value = kv->value;
   if (!value)
     return;
-  es_fputs (kv->name, fp);
-  es_fputs (": ", fp);
-  write_data_value (value, fp);
+  write_data_item (conn, kv->name, value);
 
   if (opt.debug_client)
     log_debug ("client-rsp: %s: %s\n", kv->name, kv->value? kv->value:"");
@@ -176,13 +246,11 @@ write_data_line (keyvalue_t kv, estream_t fp)
 
 
 static void
-write_data_line_direct (const char *name, const char *value, estream_t fp)
+write_data_line_direct (const char *name, const char *value, conn_t conn)
 {
   if (!value)
     return;
-  es_fputs (name, fp);
-  es_fputs (": ", fp);
-  write_data_value (value, fp);
+  write_data_item (conn, name, value);
 
   if (opt.debug_client)
     log_debug ("client-rsp: %s: %s\n", name, value);
@@ -190,16 +258,16 @@ write_data_line_direct (const char *name, const char *value, estream_t fp)
 
 
 static void
-write_ok_line (estream_t fp)
+write_ok_line (conn_t conn)
 {
-  es_fputs ("OK\n", fp);
+  write_status_line (conn, "OK", "");
   if (opt.debug_client)
     log_debug ("client-rsp: OK\n");
 }
 
 
 static void
-write_ok_linef (estream_t fp, const char *format, ...)
+write_ok_linef (conn_t conn, const char *format, ...)
 {
   va_list arg_ptr;
   char *buffer;
@@ -208,7 +276,7 @@ write_ok_linef (estream_t fp, const char *format, ...)
   buffer = gpgrt_vbsprintf (format, arg_ptr);
   va_end (arg_ptr);
 
-  es_fprintf (fp, "OK %s\n", buffer? buffer : "[out of core]");
+  write_status_line (conn, "OK ", buffer? buffer : "[out of core]");
   if (opt.debug_client)
     log_debug ("client-rsp: OK %s\n", buffer? buffer : "[out of core]");
   es_free (buffer);
@@ -216,10 +284,19 @@ write_ok_linef (estream_t fp, const char *format, ...)
 
 
 static void
-write_err_line (gpg_error_t err, const char *desc, estream_t fp)
+write_err_line (gpg_error_t err, const char *desc, conn_t conn)
 {
-  es_fprintf (fp, "ERR %d (%s)\n",
-              err, desc? desc : gpg_strerror (err));
+  char *buffer;
+
+  if (!conn->binary)
+    es_fprintf (conn->stream, "ERR %d (%s)\n",
+                err, desc? desc : gpg_strerror (err));
+  else
+    {
+      buffer = es_bsprintf ("%d (%s)", err, desc? desc : gpg_strerror (err));
+      write_status_line (conn, "ERR ", buffer? buffer : "1 ([out of core])");
+      es_free (buffer);
+    }
   if (opt.debug_client)
     log_debug ("client-rsp: ERR %d (%s)\n",
                err, desc? desc : gpg_strerror (err));
@@ -227,16 +304,16 @@ write_err_line (gpg_error_t err, const char *desc, estream_t fp)
 
 
 static void
-write_rem_line (const char *comment, estream_t fp)
+write_rem_line (const char *comment, conn_t conn)
 {
-  es_fprintf (fp, "# %s\n", comment);
+  write_status_line (conn, "# ", comment);
   if (opt.debug_client)
     log_debug ("client-rsp: # %s\n", comment);
 }
 
 
 static void
-write_rem_linef (estream_t fp, const char *format, ...)
+write_rem_linef (conn_t conn, const char *format, ...)
 {
   va_list arg_ptr;
   char *buffer;
@@ -245,7 +322,7 @@ write_rem_linef (estream_t fp, const char *format, ...)
   buffer = gpgrt_vbsprintf (format, arg_ptr);
   va_end (arg_ptr);
 
-  es_fprintf (fp, "# %s\n", buffer? buffer : "[out of core]");
+  write_status_line (conn, "# ", buffer? buffer : "[out of core]");
   if (opt.debug_client)
     log_debug ("client-rsp: # %s\n", buffer? buffer : "[out of core]");
   es_free (buffer);
@@ -371,15 +448,15 @@ cmd_session (conn_t conn, char *args)
     }
   else
     {
-      write_err_line (1, "Unknown sub-command", conn->stream);
-      write_rem_line ("Supported sub-commands are:", conn->stream);
-      write_rem_line ("  create [TTL]",    conn->stream);
-      write_rem_line ("  get SESSID",      conn->stream);
-      write_rem_line ("  put SESSID",      conn->stream);
-      write_rem_line ("  destroy SESSID",  conn->stream);
-      write_rem_line ("  alias SESSID",    conn->stream);
-      write_rem_line ("  dealias ALIASID", conn->stream);
-      write_rem_line ("  sessid ALIASID",  conn->stream);
+      write_err_line (1, "Unknown sub-command", conn);
+      write_rem_line ("Supported sub-commands are:", conn);
+      write_rem_line ("  create [TTL]",    conn);
+      write_rem_line ("  get SESSID",      conn);
+      write_rem_line ("  put SESSID",      conn);
+      write_rem_line ("  destroy SESSID",  conn);
+      write_rem_line ("  alias SESSID",    conn);
+      write_rem_line ("  dealias ALIASID", conn);
+      write_rem_line ("  sessid ALIASID",  conn);
       return 0;
     }
 
@@ -398,15 +475,15 @@ cmd_session (conn_t conn, char *args)
     }
 
   if (err)
-    write_err_line (err, errdesc, conn->stream);
+    write_err_line (err, errdesc, conn);
   else
     {
-      write_ok_line (conn->stream);
-      write_data_line_direct ("_SESSID", sessid, conn->stream);
-      write_data_line_direct ("_ALIASID", aliasid, conn->stream);
+      write_ok_line (conn);
+      write_data_line_direct ("_SESSID", sessid, conn);
+      write_data_line_direct ("_ALIASID", aliasid, conn);
       for (kv = conn->dataitems; kv; kv = kv->next)
         if (kv->name[0] >= 'A' && kv->name[0] < 'Z')
-          write_data_line (kv, conn->stream);
+          write_data_line (kv, conn);
     }
   xfree (sessid);
   xfree (aliasid);
@@ -474,17 +551,15 @@ cmd_cardtoken (conn_t conn, char *args)
  leave:
   if (err)
     {
-      write_err_line (err, conn->errdesc, conn->stream);
-      write_data_line (keyvalue_find (conn->dataitems, "failure"),
-                       conn->stream);
-      write_data_line (keyvalue_find (conn->dataitems, "failure-mesg"),
-                       conn->stream);
+      write_err_line (err, conn->errdesc, conn);
+      write_data_line (keyvalue_find (conn->dataitems, "failure"), conn);
+      write_data_line (keyvalue_find (conn->dataitems, "failure-mesg"), conn);
     }
   else
-    write_ok_line (conn->stream);
+    write_ok_line (conn);
   for (kv = conn->dataitems; kv; kv = kv->next)
     if (kv->name[0] >= 'A' && kv->name[0] < 'Z')
-      write_data_line (kv, conn->stream);
+      write_data_line (kv, conn);
 
   return err;
 }
@@ -589,22 +664,17 @@ cmd_chargecard (conn_t conn, char *args)
           goto leave;
         }
 
-      /* Find or create a plan.  */
-      err = stripe_find_create_plan (&conn->dataitems);
-      dict = conn->dataitems;
-      if (err)
-        {
-          conn->errdesc = "error creating a Plan";
-          goto leave;
-        }
-
-      /* Create a Subscription using the just plan from above and the
-       * Card-Token supplied to this command.  */
+      /* Create a Subscription using the Card-Token supplied to this
+       * command.  The plan is looked up or created while the
+       * customer is created.  */
       err = stripe_create_subscription (&conn->dataitems);
       dict = conn->dataitems;
       if (err)
         {
-          conn->errdesc = "error creating a Subscription";
+          if (!*keyvalue_get_string (dict, "_plan-id"))
+            conn->errdesc = "error creating a Plan";
+          else
+            conn->errdesc = "error creating a Subscription";
           goto leave;
         }
     }
@@ -633,21 +703,18 @@ cmd_chargecard (conn_t conn, char *args)
  leave:
   if (err)
     {
-      write_err_line (err, conn->errdesc, conn->stream);
-      write_data_line (keyvalue_find (conn->dataitems, "failure"),
-                       conn->stream);
-      write_data_line (keyvalue_find (conn->dataitems, "failure-mesg"),
-                       conn->stream);
+      write_err_line (err, conn->errdesc, conn);
+      write_data_line (keyvalue_find (conn->dataitems, "failure"), conn);
+      write_data_line (keyvalue_find (conn->dataitems, "failure-mesg"), conn);
     }
   else
-    write_ok_line (conn->stream);
+    write_ok_line (conn);
   for (kv = conn->dataitems; kv; kv = kv->next)
     if (kv->name[0] >= 'A' && kv->name[0] < 'Z')
-      write_data_line (kv, conn->stream);
-  write_data_line (keyvalue_find (conn->dataitems, "account-id"), conn->stream);
+      write_data_line (kv, conn);
+  write_data_line (keyvalue_find (conn->dataitems, "account-id"), conn);
   if (!err)
-    write_data_line (keyvalue_find (conn->dataitems, "_timestamp"),
-                     conn->stream);
+    write_data_line (keyvalue_find (conn->dataitems, "_timestamp"), conn);
   es_free (buf);
   return err;
 }
@@ -817,25 +884,23 @@ cmd_ppcheckout (conn_t conn, char *args)
     }
   else
     {
-      write_err_line (1, "Unknown sub-command", conn->stream);
-      write_rem_line ("Supported sub-commands are:", conn->stream);
-      write_rem_line ("  prepare", conn->stream);
-      write_rem_line ("  execute", conn->stream);
+      write_err_line (1, "Unknown sub-command", conn);
+      write_rem_line ("Supported sub-commands are:", conn);
+      write_rem_line ("  prepare", conn);
+      write_rem_line ("  execute", conn);
       return 0;
     }
 
  leave:
   if (err)
     {
-      write_err_line (err, conn->errdesc, conn->stream);
-      write_data_line (keyvalue_find (conn->dataitems, "failure"),
-                       conn->stream);
-      write_data_line (keyvalue_find (conn->dataitems, "failure-mesg"),
-                       conn->stream);
+      write_err_line (err, conn->errdesc, conn);
+      write_data_line (keyvalue_find (conn->dataitems, "failure"), conn);
+      write_data_line (keyvalue_find (conn->dataitems, "failure-mesg"), conn);
     }
   else
     {
-      write_ok_line (conn->stream);
+      write_ok_line (conn);
     }
 
   for (kv = conn->dataitems; kv; kv = kv->next)
@@ -845,17 +910,15 @@ cmd_ppcheckout (conn_t conn, char *args)
                           || !strcmp (kv->name, "Email")
                           || !strcmp (kv->name, "Currency")
                           || !strcmp (kv->name, "Amount"))))
-      write_data_line (kv, conn->stream);
+      write_data_line (kv, conn);
 
   if (execmode)
-    write_data_line (keyvalue_find (conn->dataitems, "account-id"),
-                     conn->stream);
+    write_data_line (keyvalue_find (conn->dataitems, "account-id"), conn);
 
   if (!err)
     {
-      write_data_line_direct ("_SESSID", newsessid, conn->stream);
-      write_data_line (keyvalue_find (conn->dataitems, "_timestamp"),
-                       conn->stream);
+      write_data_line_direct ("_SESSID", newsessid, conn);
+      write_data_line (keyvalue_find (conn->dataitems, "_timestamp"), conn);
     }
   xfree (newsessid);
   return err;
@@ -938,17 +1001,15 @@ cmd_sepapreorder (conn_t conn, char *args)
  leave:
   if (err)
     {
-      write_err_line (err, conn->errdesc, conn->stream);
-      write_data_line (keyvalue_find (conn->dataitems, "failure"),
-                       conn->stream);
-      write_data_line (keyvalue_find (conn->dataitems, "failure-mesg"),
-                       conn->stream);
+      write_err_line (err, conn->errdesc, conn);
+      write_data_line (keyvalue_find (conn->dataitems, "failure"), conn);
+      write_data_line (keyvalue_find (conn->dataitems, "failure-mesg"), conn);
     }
   else
-    write_ok_line (conn->stream);
+    write_ok_line (conn);
   for (kv = conn->dataitems; kv; kv = kv->next)
     if (kv->name[0] >= 'A' && kv->name[0] < 'Z')
-      write_data_line (kv, conn->stream);
+      write_data_line (kv, conn);
 
   es_free (buf);
   return err;
@@ -1041,18 +1102,16 @@ cmd_commitpreorder (conn_t conn, char *args)
  leave:
   if (err)
     {
-      write_err_line (err, conn->errdesc, conn->stream);
-      write_data_line (keyvalue_find (conn->dataitems, "failure"),
-                       conn->stream);
-      write_data_line (keyvalue_find (conn->dataitems, "failure-mesg"),
-                       conn->stream);
+      write_err_line (err, conn->errdesc, conn);
+      write_data_line (keyvalue_find (conn->dataitems, "failure"), conn);
+      write_data_line (keyvalue_find (conn->dataitems, "failure-mesg"), conn);
     }
   else
     {
-      write_ok_line (conn->stream);
+      write_ok_line (conn);
       for (kv = conn->dataitems; kv; kv = kv->next)
         if (kv->name[0] >= 'A' && kv->name[0] < 'Z')
-          write_data_line (kv, conn->stream);
+          write_data_line (kv, conn);
     }
 
   es_free (buf);
@@ -1093,18 +1152,16 @@ cmd_getpreorder (conn_t conn, char *args)
  leave:
   if (err)
     {
-      write_err_line (err, conn->errdesc, conn->stream);
-      write_data_line (keyvalue_find (conn->dataitems, "failure"),
-                       conn->stream);
-      write_data_line (keyvalue_find (conn->dataitems, "failure-mesg"),
-                       conn->stream);
+      write_err_line (err, conn->errdesc, conn);
+      write_data_line (keyvalue_find (conn->dataitems, "failure"), conn);
+      write_data_line (keyvalue_find (conn->dataitems, "failure-mesg"), conn);
     }
   else
     {
-      write_ok_line (conn->stream);
+      write_ok_line (conn);
       for (kv = conn->dataitems; kv; kv = kv->next)
         if (kv->name[0] >= 'A' && kv->name[0] < 'Z')
-          write_data_line (kv, conn->stream);
+          write_data_line (kv, conn);
     }
 
   es_free (buf);
@@ -1137,23 +1194,21 @@ cmd_listpreorder (conn_t conn, char *args)
 
   if (err)
     {
-      write_err_line (err, conn->errdesc, conn->stream);
-      write_data_line (keyvalue_find (conn->dataitems, "failure"),
-                       conn->stream);
-      write_data_line (keyvalue_find (conn->dataitems, "failure-mesg"),
-                       conn->stream);
+      write_err_line (err, conn->errdesc, conn);
+      write_data_line (keyvalue_find (conn->dataitems, "failure"), conn);
+      write_data_line (keyvalue_find (conn->dataitems, "failure-mesg"), conn);
     }
   else
     {
-      write_ok_line (conn->stream);
+      write_ok_line (conn);
       snprintf (key, sizeof key, "%u", count);
-      write_data_line_direct ("Count", key, conn->stream);
+      write_data_line_direct ("Count", key, conn);
       for (n=0; n < count; n++)
         {
           snprintf (key, sizeof key, "D[%u]", n);
           write_data_line_direct (key,
                                   keyvalue_get_string (conn->dataitems, key),
-                                  conn->stream);
+                                  conn);
         }
     }
 
@@ -1163,6 +1218,85 @@ cmd_listpreorder (conn_t conn, char *args)
 
 
 
+/* Return the value of the item KEY with index IDX from DICT; see
+ * keyvalue_put_idx for the syntax.  If IDX is -1 the plain KEY is
+ * used.  With FALLBACK set the plain KEY is used if no item with that
+ * index exists.  Returns NULL if not found.  */
+static const char *
+get_idx_value (keyvalue_t dict, const char *key, int idx, int fallback)
+{
+  char name[65];
+  const char *s;
+  size_t n;
+
+  if (idx < 0)
+    return keyvalue_get (dict, key);
+
+  n = strlen (key);
+  if (n > 2 && key[n-1] == ']')
+    snprintf (name, sizeof name, "%.*s.%d]", (int)n-1, key, idx);
+  else
+    snprintf (name, sizeof name, "%s[%d]", key, idx);
+  s = keyvalue_get (dict, name);
+  if (!s && fallback)
+    s = keyvalue_get (dict, key);
+  return s;
+}
+
+
+/* Check the amount with index IDX (-1 for none) from the data items
+ * of CONN and store the results with the same index in the data
+ * items.  On error a description is stored at CONN->ERRDESC.  */
+static gpg_error_t
+check_one_amount (conn_t conn, int idx)
+{
+  gpg_error_t err;
+  const char *curr;
+  const char *s;
+  unsigned int cents;
+  int decdigs;
+  char amountbuf[AMOUNTBUF_SIZE];
+  int recur;
+
+  /* Get Recurrence value or replace by default.  */
+  s = get_idx_value (conn->dataitems, "Recur", idx, 1);
+  if (!valid_recur_p (s? s : "", &recur))
+    {
+      set_error (MISSING_VALUE, "Invalid value for 'Recur'");
+      return err;
+    }
+  snprintf (amountbuf, sizeof amountbuf, "%d", recur);
+  err = keyvalue_put_idx (&conn->dataitems, "Recur", idx, amountbuf);
+  if (err)
+    return err;
+
+  /* Get currency and amount.  */
+  curr = get_idx_value (conn->dataitems, "Currency", idx, 1);
+  if (!curr || !valid_currency_p (curr, &decdigs))
+    {
+      set_error (MISSING_VALUE, "Currency missing or not supported");
+      return err;
+    }
+
+  s = get_idx_value (conn->dataitems, "Amount", idx, 0);
+  if (!s || !*s || !(cents = convert_amount (s, decdigs)))
+    {
+      set_error (MISSING_VALUE, "Amount missing or invalid");
+      return err;
+    }
+
+  if (*convert_currency (amountbuf, sizeof amountbuf, curr, s))
+    {
+      err = keyvalue_put_idx (&conn->dataitems, "Euro", idx, amountbuf);
+      if (err)
+        return err;
+    }
+
+  snprintf (amountbuf, sizeof amountbuf, "%u", cents);
+  return keyvalue_put_idx (&conn->dataitems, "_amount", idx, amountbuf);
+}
+
+
 /* The CHECKAMOUNT command checks whether a given amount is within the
  * configured limits for payment.  It may eventually provide
  * additional options.  The following values are expected in the
@@ -1181,96 +1315,99 @@ cmd_listpreorder (conn_t conn, char *args)
  *             this and then also Amount may be changed from the request.
  * Limit:      If given, the maximum amount acceptable
  * Euro:       If returned, Amount converted to Euro.
+ *
+ * To check several amounts in one request the items may be indexed
+ * starting at 0 (e.g. "Amount[0]", "Amount[1]").  A Currency or Recur
+ * item without an index is used for all amounts without such an
+ * indexed item.  The response is then OK and the above items are
+ * returned with the same index; if the check of an amount failed
+ * "_err[N]" gives the error code and description instead.
  */
 static gpg_error_t
 cmd_checkamount (conn_t conn, char *args)
 {
   gpg_error_t err;
-  keyvalue_t dict = conn->dataitems;
   keyvalue_t kv;
-  const char *curr;
-  const char *s;
-  unsigned int cents;
-  int decdigs;
-  char amountbuf[AMOUNTBUF_SIZE];
-  int recur;
+  char *buf;
+  int idx;
 
   (void)args;
 
   /* Delete items, we want to set.  */
   keyvalue_del (conn->dataitems, "Limit");
 
-  /* Get Recurrence value or replace by default.  */
-  s = keyvalue_get_string (dict, "Recur");
-  if (!valid_recur_p (s, &recur))
-    {
-      set_error (MISSING_VALUE, "Invalid value for 'Recur'");
-      goto leave;
-    }
-  err = keyvalue_putf (&conn->dataitems, "Recur", "%d", recur);
-  dict = conn->dataitems;
-  if (err)
-    goto leave;
-
-  /* Get currency and amount.  */
-  curr = keyvalue_get_string (dict, "Currency");
-  if (!valid_currency_p (curr, &decdigs))
-    {
-      set_error (MISSING_VALUE, "Currency missing or not supported");
-      goto leave;
-    }
-
-  s = keyvalue_get_string (dict, "Amount");
-  if (!*s || !(cents = convert_amount (s, decdigs)))
+  if (!get_idx_value (conn->dataitems, "Amount", 0, 0))
     {
-      set_error (MISSING_VALUE, "Amount missing or invalid");
-      goto leave;
-    }
-
-  if (*convert_currency (amountbuf, sizeof amountbuf, curr, s))
-    err = keyvalue_put (&conn->dataitems, "Euro", amountbuf);
-  else
-    err = 0;
-  if (err)
-    goto leave;
-
-  err = keyvalue_putf (&conn->dataitems, "_amount", "%u", cents);
-  dict = conn->dataitems;
-  if (err)
-    goto leave;
-
- leave:
-  if (err)
-    {
-      write_err_line (err, conn->errdesc, conn->stream);
+      err = check_one_amount (conn, -1);
+      if (err)
+        {
+          write_err_line (err, conn->errdesc, conn);
+        }
+      else
+        {
+          write_ok_line (conn);
+          write_data_line (keyvalue_find (conn->dataitems, "_amount"), conn);
+        }
     }
   else
     {
-      write_ok_line (conn->stream);
-      write_data_line (keyvalue_find (conn->dataitems, "_amount"),
-                       conn->stream);
+      /* Indexed variant.  */
+      err = 0;
+      for (idx=0; !err && get_idx_value (conn->dataitems, "Amount", idx, 0);
+           idx++)
+        {
+          conn->errdesc = NULL;
+          err = check_one_amount (conn, idx);
+          if (gpg_err_code (err) == GPG_ERR_MISSING_VALUE)
+            {
+              buf = es_bsprintf ("%u (%s)", err, conn->errdesc);
+              if (!buf)
+                err = gpg_error_from_syserror ();
+              else
+                {
+                  err = keyvalue_put_idx (&conn->dataitems, "_err", idx, buf);
+                  es_free (buf);
+                }
+            }
+        }
+      if (err)
+        write_err_line (err, NULL, conn);
+      else
+        {
+          write_ok_line (conn);
+          for (kv = conn->dataitems; kv; kv = kv->next)
+            if (kv->name[0] == '_')
+              write_data_line (kv, conn);
+        }
     }
+
   for (kv = conn->dataitems; kv; kv = kv->next)
     if (kv->name[0] >= 'A' && kv->name[0] < 'Z')
-      write_data_line (kv, conn->stream);
+      write_data_line (kv, conn);
   return err;
 }
 
 
-
+
 /* PPIPNHD is a handler for PayPal notifications.
 
-   Note: This is an asynchronous call: We send okay, *close* the
-   socket, and only then process the IPN.  */
+   Note: This is an asynchronous call: The IPN is stored in a queue
+   and we send okay only after that has been done.  It is then
+   verified and processed by a worker thread.  On error ppipnhd tells
+   PayPal to send the IPN again.  */
 static gpg_error_t
 cmd_ppipnhd (conn_t conn, char *args)
 {
+  gpg_error_t err;
+
   (void)args;
 
-  es_fputs ("OK\n\n", conn->stream);
-  shutdown_connection_obj (conn);
-  paypal_proc_ipn (&conn->dataitems);
-  return 0;
+  err = paypal_queue_ipn (&conn->dataitems);
+  if (err)
+    write_err_line (err, NULL, conn);
+  else
+    write_ok_line (conn);
+  return err;
 }
 
 
@@ -1286,41 +1423,65 @@ cmd_getinfo (conn_t conn, char *args)
 
   if (has_leading_keyword (args, "list-currencies"))
     {
-      const char *name, *desc;
-      double rate;
+      struct currency_info_s *info;
+      int n;
+      gpg_error_t err;
 
-      write_ok_line (conn->stream);
-      for (i=0; (name = get_currency_info (i, &desc, &rate)); i++)
-        write_rem_linef (conn->stream, "%s %11.4f - %s",
-                         name, rate, desc);
+      /* Take a copy so that a reload while we write does not mix two
+       * tables.  */
+      err = get_currency_info (&info, &n);
+      if (err)
+        {
+          write_err_line (err, NULL, conn);
+          return err;
+        }
+      write_ok_line (conn);
+      for (i=0; i < n; i++)
+        write_rem_linef (conn, "%s %11.4f - %s",
+                         info[i].name, info[i].rate, info[i].desc);
+      xfree (info);
+    }
+  else if (has_leading_keyword (args, "backends"))
+    {
+      const char *name;
+      struct backend_info_s info;
+
+      write_ok_line (conn);
+      for (i=0; (name = get_backend_info (i, &info)); i++)
+        write_rem_linef (conn, "%s %s failures=%u timeout=%u cooldown=%u"
+                         " p50=%u p95=%u samples=%u calls=%lu fastfails=%lu",
+                         name, backend_state_str (info.state),
+                         info.failures, info.timeout, info.cooldown,
+                         info.p50, info.p95, info.nsamples,
+                         info.calls, info.fastfails);
     }
   else if (has_leading_keyword (args, "version"))
     {
-      write_ok_linef (conn->stream, "%s", PACKAGE_VERSION);
+      write_ok_linef (conn, "%s", PACKAGE_VERSION);
     }
   else if (has_leading_keyword (args, "pid"))
     {
-      write_ok_linef (conn->stream, "%u", (unsigned int)getpid());
+      write_ok_linef (conn, "%u", (unsigned int)getpid());
     }
   else if (has_leading_keyword (args, "live"))
     {
       if (opt.livemode)
-        write_ok_line (conn->stream);
+        write_ok_line (conn);
       else
-        write_err_line (179, "running in test mode", conn->stream);
+        write_err_line (179, "running in test mode", conn);
     }
   else
     {
-      write_err_line (1, "Unknown sub-command", conn->stream);
-      write_rem_line ("Supported sub-commands are:", conn->stream);
-      write_rem_line ("  list-currencies    List supported currencies",
-                      conn->stream);
+      write_err_line (1, "Unknown sub-command", conn);
+      write_rem_line ("Supported sub-commands are:", conn);
+      write_rem_line ("  list-currencies    List supported currencies", conn);
+      write_rem_line ("  backends           Show the state of the backends",
+                      conn);
       write_rem_line ("  version            Show the version of this daemon",
-                      conn->stream);
+                      conn);
       write_rem_line ("  pid                Show the pid of this process",
-                      conn->stream);
-      write_rem_line ("  live               Returns OK if in live mode",
-                      conn->stream);
+                      conn);
+      write_rem_line ("  live               Returns OK if in live mode", conn);
     }
 
   return 0;
@@ -1331,7 +1492,7 @@ cmd_getinfo (conn_t conn, char *args)
 static gpg_error_t
 cmd_ping (conn_t conn, char *args)
 {
-  write_ok_linef (conn->stream, "%s", *args? args : "pong");
+  write_ok_linef (conn, "%s", *args? args : "pong");
   return 0;
 }
 
@@ -1342,7 +1503,7 @@ cmd_shutdown (conn_t conn, char *args)
 {
   (void)args;
 
-  write_ok_linef (conn->stream, "terminating daemon");
+  write_ok_linef (conn, "terminating daemon");
   shutdown_server ();
 
   return 0;
@@ -1386,100 +1547,220 @@ cmd_help (conn_t conn, char *args)
 
   (void)args;
 
-  write_ok_line (conn->stream);
+  write_ok_line (conn);
   for (cmdidx=0; cmdtbl[cmdidx].name; cmdidx++)
-    write_rem_line (cmdtbl[cmdidx].name, conn->stream);
+    write_rem_line (cmdtbl[cmdidx].name, conn);
 
   return 0;
 }
 
 
-/* The handler serving a connection.  UID is the UID of the client. */
-void
-connection_handler (conn_t conn, uid_t uid)
+/* A hash table to map a command name to its index in CMDTBL.  Each
+   slot holds the index plus one or 0 for an empty slot.  */
+#define CMDTBL_HASH_SIZE 64  /* Must be a power of 2.  */
+static unsigned char cmdtbl_hash[CMDTBL_HASH_SIZE];
+static int cmdtbl_hash_ready;
+
+
+/* Return a hash value for the command NAME of length LEN.  */
+static unsigned int
+hash_command_name (const char *name, size_t len)
+{
+  unsigned int hash = 2166136261u;
+
+  for (; len; len--, name++)
+    hash = (hash ^ *(const unsigned char *)name) * 16777619u;
+  return hash & (CMDTBL_HASH_SIZE - 1);
+}
+
+
+/* Build the hash table for CMDTBL.  Due to the npth scheduling this
+   can't be interrupted by another thread.  */
+static void
+init_cmdtbl_hash (void)
+{
+  unsigned int h;
+  int cmdidx;
+
+  for (cmdidx=0; cmdtbl[cmdidx].name; cmdidx++)
+    {
+      h = hash_command_name (cmdtbl[cmdidx].name,
+                             strlen (cmdtbl[cmdidx].name));
+      while (cmdtbl_hash[h])
+        h = (h + 1) & (CMDTBL_HASH_SIZE - 1);
+      cmdtbl_hash[h] = cmdidx + 1;
+    }
+  cmdtbl_hash_ready = 1;
+}
+
+
+/* Return the index into CMDTBL for the command LINE and store a
+   pointer to its arguments at R_ARGS.  Returns -1 if not found.  */
+static int
+find_command (const char *line, char **r_args)
+{
+  unsigned int h;
+  size_t n;
+  int cmdidx;
+
+  if (!cmdtbl_hash_ready)
+    init_cmdtbl_hash ();
+
+  n = strcspn (line, " \t");
+  for (h = hash_command_name (line, n); cmdtbl_hash[h];
+       h = (h + 1) & (CMDTBL_HASH_SIZE - 1))
+    {
+      cmdidx = cmdtbl_hash[h] - 1;
+      if (!strncmp (cmdtbl[cmdidx].name, line, n)
+          && !cmdtbl[cmdidx].name[n])
+        {
+          *r_args = has_leading_keyword (line, cmdtbl[cmdidx].name);
+          return cmdidx;
+        }
+    }
+  return -1;
+}
+
+
+/* Check the permissions of the client and run the handler for the
+   command in CONN.  */
+static void
+dispatch_command (conn_t conn)
 {
-  gpg_error_t err;
   keyvalue_t kv;
   int cmdidx;
   char *cmdargs;
-  int i;
 
-  conn->stream = es_fdopen_nc (conn->fd, "r+,samethread");
-  if (!conn->stream)
+  if (!(conn->perms & CONN_PERM_USER))
     {
-      err = gpg_error_from_syserror ();
-      log_error ("failed to open fd %d as stream: %s\n",
-                 conn->fd, gpg_strerror (err));
+      write_err_line (gpg_error (GPG_ERR_EPERM), "User not allowed", conn);
       return;
     }
 
-  err = protocol_read_request (conn->stream, &conn->command, &conn->dataitems);
-  if (err)
+  cmdidx = find_command (conn->command, &cmdargs);
+  if (cmdidx == -1)
     {
-      log_error ("reading request failed: %s\n", gpg_strerror (err));
-      write_err_line (err, NULL, conn->stream);
+      write_err_line (1, "Unknown command", conn);
+      write_data_line_direct ("_cmd", conn->command? conn->command :"",
+                              conn);
+      for (kv = conn->dataitems; kv; kv = kv->next)
+        write_data_line_direct (kv->name, kv->value? kv->value:"", conn);
       return;
     }
-  es_fflush (conn->stream);
 
-  err = 0;
-  if (opt.n_allowed_uids)
+  if (cmdtbl[cmdidx].admin_required && !(conn->perms & CONN_PERM_ADMIN))
     {
-      for (i=0; i < opt.n_allowed_uids; i++)
-        if (opt.allowed_uids[i] == uid)
-          break;
-      if (!(i < opt.n_allowed_uids))
-        {
-          err = gpg_error (GPG_ERR_EPERM);
-          write_err_line (err, "User not allowed", conn->stream);
-        }
+      write_err_line (gpg_error (GPG_ERR_FORBIDDEN),
+                      "User is not an admin", conn);
+      return;
     }
 
-  if (!err)
+  if (opt.debug_client)
     {
-      cmdargs = NULL;
-      for (cmdidx=0; cmdtbl[cmdidx].name; cmdidx++)
-        if ((cmdargs=has_leading_keyword (conn->command, cmdtbl[cmdidx].name)))
-          break;
-      if (cmdargs)
-        {
-          err = 0;
-          if (cmdtbl[cmdidx].admin_required)
-            {
-              for (i=0; i < opt.n_allowed_admin_uids; i++)
-                if (opt.allowed_admin_uids[i] == uid)
-                  break;
-              if (!(i < opt.n_allowed_admin_uids))
-                {
-                  err = gpg_error (GPG_ERR_FORBIDDEN);
-                  write_err_line (err, "User is not an admin", conn->stream);
-                }
-            }
+      log_debug ("client-req: %s\n", conn->command);
+      for (kv = conn->dataitems; kv; kv = kv->next)
+        log_debug ("client-req: %s: %s\n", kv->name, kv->value);
+      log_debug ("client-req: \n");
+    }
+  cmdtbl[cmdidx].handler (conn, cmdargs);
+}
 
-          if (!err)
-            {
-              if (opt.debug_client)
-                {
-                  log_debug ("client-req: %s\n", conn->command);
-                  for (kv = conn->dataitems; kv; kv = kv->next)
-                    log_debug ("client-req: %s: %s\n", kv->name, kv->value);
-                  log_debug ("client-req: \n");
-                }
-              err = cmdtbl[cmdidx].handler (conn, cmdargs);
 
-            }
+/* The handler serving a connection.  A client using the binary
+   framing may send further binary framed requests over the same
+   connection; the connection is then kept open until the client
+   closes it.  */
+void
+connection_handler (conn_t conn)
+{
+  gpg_error_t err;
+  int first, c;
+  struct timeval tv;
+
+  /* Do not let an idle client block this thread, and with it a
+     graceful shutdown, forever.  */
+  tv.tv_sec = CONN_IDLE_TIMEOUT;
+  tv.tv_usec = 0;
+  if (setsockopt (conn->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv))
+    log_error ("failed to set timeout of fd %d: %s\n",
+               conn->fd, gpg_strerror (gpg_error_from_syserror ()));
+
+  /* We use separate streams for reading and writing so that
+     pipelined requests already buffered in INSTREAM are not discarded
+     when switching to writing the response.  */
+  conn->instream = es_fdopen_nc (conn->fd, "r,samethread");
+  if (conn->instream)
+    conn->stream = es_fdopen_nc (conn->fd, "w,samethread");
+  if (!conn->stream)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("failed to open fd %d as stream: %s\n",
+                 conn->fd, gpg_strerror (err));
+      return;
+    }
+  /* Use a buffer large enough so that most responses are sent with
+     one write at the end of the command.  */
+  if (es_setvbuf (conn->stream, NULL, _IOFBF, RESPONSE_BUFFER_SIZE))
+    log_error ("failed to set buffer of fd %d: %s\n",
+               conn->fd, gpg_strerror (gpg_error_from_syserror ()));
+
+  for (first = 1; ; first = 0)
+    {
+      /* Do not take further requests on a persistent connection
+         while shutting down.  */
+      if (!first && shutdown_pending_p ())
+        return;
+
+      /* A request starting with the magic byte uses the binary
+         framing and the response will use it as well.  */
+      c = es_getc (conn->instream);
+      if (c == PROTOCOL_BINARY_MAGIC)
+        {
+          conn->binary = 1;
+          err = protocol_read_binary_request (conn->instream, &conn->command,
+                                              &conn->dataitems);
+        }
+      else if (!first)
+        {
+          if (c != EOF)
+            log_error ("reading request failed: %s\n",
+                       "binary framing expected");
+          return;
         }
       else
         {
-          write_err_line (1, "Unknown command", conn->stream);
-          write_data_line_direct ("_cmd", conn->command? conn->command :"",
-                                  conn->stream);
-          for (kv = conn->dataitems; kv; kv = kv->next)
-            write_data_line_direct (kv->name, kv->value? kv->value:"",
-                                    conn->stream);
+          if (c != EOF)
+            es_ungetc (c, conn->instream);
+          err = protocol_read_request (conn->instream,
+                                       &conn->command, &conn->dataitems);
+        }
+      if (err)
+        {
+          log_error ("reading request failed: %s\n", gpg_strerror (err));
+          write_err_line (err, NULL, conn);
+          if (conn->binary)
+            protocol_write_binary_end (conn->stream);
+          return;
         }
-    }
 
-  if (conn->stream)
-    es_fprintf (conn->stream, "\n");
+      dispatch_command (conn);
+
+      if (!conn->stream)
+        return;
+      if (!conn->binary)
+        {
+          es_fprintf (conn->stream, "\n");
+          return;
+        }
+      protocol_write_binary_end (conn->stream);
+      if (es_fflush (conn->stream))
+        return;
+
+      /* Prepare for the next request.  */
+      xfree (conn->command);
+      conn->command = NULL;
+      keyvalue_release (conn->dataitems);
+      conn->dataitems = NULL;
+      conn->errdesc = NULL;
+    }
 }
@@ -29,11 +29,16 @@ typedef struct conn_s *conn_t;
 /*-- commands.c --*/
 conn_t new_connection_obj (void);
 void init_connection_obj (conn_t conn, int fd);
+void set_permissions_connection_obj (conn_t conn, unsigned int perms);
 void release_connection_obj (conn_t conn);
 unsigned int id_from_connection_obj (conn_t conn);
 int fd_from_connection_obj (conn_t conn);
 
-void connection_handler (conn_t conn, uid_t uid);
+/* Permission flags for a connection.  */
+#define CONN_PERM_USER   1  /* The client may use the service.  */
+#define CONN_PERM_ADMIN  2  /* The client may use admin commands.  */
+
+void connection_handler (conn_t conn);
 
 
 #endif /*COMMANDS_H*/
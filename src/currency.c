@@ -23,6 +23,11 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+#include <npth.h>
 
 #include "payprocd.h"
 #include "util.h"
@@ -32,68 +37,378 @@
 
 /* The file with the exchange rates.  This is expected to be created
    by a cron job and the geteuroxref script.  */
+static const char euroxref_dir[] = "/var/lib/payproc";
+static const char euroxref_name[] = "euroxref.dat";
 static const char euroxref_fname[] = "/var/lib/payproc/euroxref.dat";
 
+/* If set this file is used instead of the above.  This is only used
+   by the regression tests.  */
+static const char *euroxref_fname_override;
 
-/* The list of supported currencies  */
+/* An optional file with the supported currencies.  If not set the
+   builtin list is used.  */
+static char *currency_table_fname;
+
+/* Exchange rates are stored as integers scaled by this value.  */
+#define RATE_SCALE 1000000
+
+/* The largest supported exchange rate.  Some currencies, for example
+   the Rupiah, have rates above 10000.  */
+#define MAX_RATE 1000000
+
+/* The maximum number of supported currencies.  */
+#define MAX_CURRENCIES 64
+
+/* Number of slots in the index; one for each 3 letter code.  */
+#define INDEX_SLOTS (26*26*26)
+
+
+/* The builtin list of supported currencies.  These are the
+   currencies for which the ECB publishes reference rates.  */
 static struct
 {
   const char *name;
   unsigned char decdigits;
   const char *desc;
-  double rate;     /* Exchange rate to Euro.  */
-} currency_table[] = {
-  { "EUR", 2, "Euro", 1.0 },  /* Must be the first entry! */
+} builtin_currencies[] = {
+  { "EUR", 2, "Euro" },  /* Must be the first entry! */
   { "USD", 2, "US Dollar" },
   { "GBP", 2, "British Pound" },
-  { "JPY", 0, "Yen" }
+  { "JPY", 0, "Yen" },
+  { "CHF", 2, "Swiss Franc" },
+  { "DKK", 2, "Danish Krone" },
+  { "NOK", 2, "Norwegian Krone" },
+  { "SEK", 2, "Swedish Krona" },
+  { "ISK", 0, "Iceland Krona" },
+  { "CZK", 2, "Czech Koruna" },
+  { "HUF", 2, "Forint" },
+  { "PLN", 2, "Zloty" },
+  { "RON", 2, "Romanian Leu" },
+  { "BGN", 2, "Bulgarian Lev" },
+  { "TRY", 2, "Turkish Lira" },
+  { "CAD", 2, "Canadian Dollar" },
+  { "AUD", 2, "Australian Dollar" },
+  { "NZD", 2, "New Zealand Dollar" },
+  { "BRL", 2, "Brazilian Real" },
+  { "MXN", 2, "Mexican Peso" },
+  { "CNY", 2, "Yuan Renminbi" },
+  { "HKD", 2, "Hong Kong Dollar" },
+  { "SGD", 2, "Singapore Dollar" },
+  { "KRW", 0, "Won" },
+  { "INR", 2, "Indian Rupee" },
+  { "IDR", 2, "Rupiah" },
+  { "MYR", 2, "Malaysian Ringgit" },
+  { "PHP", 2, "Philippine Peso" },
+  { "THB", 2, "Baht" },
+  { "ILS", 2, "New Israeli Sheqel" },
+  { "ZAR", 2, "Rand" }
 };
 
 
+/* A snapshot of the currency table.  A snapshot is never changed
+   after it has been published; instead a new one is created and
+   swapped in.  */
+struct currency_table_s
+{
+  int ncurrencies;
+  struct
+  {
+    char name[4];
+    unsigned char decdigits;
+    char desc[40];
+    unsigned long long rate; /* Exchange rate to Euro * RATE_SCALE.  */
+  } currency[MAX_CURRENCIES];
+  /* Maps a currency code to 1 + index into CURRENCY or 0.  */
+  unsigned char index[INDEX_SLOTS];
+};
+typedef struct currency_table_s *currency_table_t;
+
+/* The current snapshot.  Readers only pick up this pointer and thus
+   need no lock.  */
+static currency_table_t current_table;
+
+/* The previous snapshot.  It is kept until the next swap so that a
+   reader which got a pointer just before a swap can still use it.  */
+static currency_table_t retired_table;
+
+/* Lock to serialize the building of new snapshots.  */
+static npth_mutex_t reload_lock = NPTH_MUTEX_INITIALIZER;
+
+/* Set while the rates watcher thread is running.  */
+static int rates_watched;
+
+
+
+/* Return the index slot for the currency code STRING or -1 if
+   STRING is not a 3 letter code.  */
+static int
+code_to_slot (const char *string)
+{
+  int i, c, slot;
+
+  for (slot=i=0; i < 3; i++)
+    {
+      c = string[i];
+      if (c >= 'a' && c <= 'z')
+        c -= 'a';
+      else if (c >= 'A' && c <= 'Z')
+        c -= 'A';
+      else
+        return -1;
+      slot = slot * 26 + c;
+    }
+  return string[3]? -1 : slot;
+}
+
+
+/* Lookup CURRENCY in TBL and return its index or -1.  */
+static int
+lookup_currency (currency_table_t tbl, const char *currency)
+{
+  int slot;
+
+  if (!tbl || (slot = code_to_slot (currency)) < 0 || !tbl->index[slot])
+    return -1;
+  return tbl->index[slot] - 1;
+}
+
+
+/* Add currency NAME to TBL.  Returns 0 on success.  */
+static gpg_error_t
+add_currency (currency_table_t tbl, const char *name, int decdigits,
+              const char *desc)
+{
+  int slot, idx;
+
+  slot = code_to_slot (name);
+  if (slot < 0 || decdigits < 0 || decdigits > 3)
+    return gpg_error (GPG_ERR_INV_VALUE);
+  if (tbl->index[slot])
+    return gpg_error (GPG_ERR_DUP_VALUE);
+  if (tbl->ncurrencies >= MAX_CURRENCIES)
+    return gpg_error (GPG_ERR_TOO_MANY);
+
+  idx = tbl->ncurrencies++;
+  snprintf (tbl->currency[idx].name, sizeof tbl->currency[idx].name,
+            "%s", name);
+  ascii_strupr (tbl->currency[idx].name);
+  tbl->currency[idx].decdigits = decdigits;
+  snprintf (tbl->currency[idx].desc, sizeof tbl->currency[idx].desc,
+            "%s", desc);
+  tbl->currency[idx].rate = idx? 0 : RATE_SCALE;
+  tbl->index[slot] = idx + 1;
+  return 0;
+}
+
+
+/* Set the file with the currency definitions to FNAME.  The file is
+   read by the next call to read_exchange_rates.  */
 void
-read_exchange_rates (void)
+currency_set_table_file (const char *fname)
 {
-  gpg_error_t err = 0;
+  xfree (currency_table_fname);
+  currency_table_fname = fname? xstrdup (fname) : NULL;
+}
+
+
+/* Read a line from FP into LINE of LINESIZE and strip leading spaces
+   and the line ending.  Returns a pointer to the first non-space
+   character, an empty string for lines to be skipped, or NULL at EOF.
+   *LNR is updated.  */
+static char *
+read_conf_line (estream_t fp, const char *fname, int *lnr,
+                char *line, size_t linesize)
+{
+  size_t n;
+  int c;
+  char *p;
+
+  if (!es_fgets (line, linesize-1, fp))
+    return NULL;
+  ++*lnr;
+
+  n = strlen (line);
+  if (!n || line[n-1] != '\n')
+    {
+      /* Eat until end of line. */
+      while ((c=es_getc (fp)) != EOF && c != '\n')
+        ;
+      log_error ("error reading '%s', line %d: %s\n", fname, *lnr,
+                 gpg_strerror (gpg_error (*line? GPG_ERR_LINE_TOO_LONG
+                                          : GPG_ERR_INCOMPLETE_LINE)));
+      *line = 0;
+      return line;
+    }
+  line[--n] = 0; /* Chop the LF. */
+  if (n && line[n-1] == '\r')
+    line[--n] = 0; /* Chop an optional CR. */
+
+  /* Allow leading spaces and skip empty and comment lines. */
+  for (p=line; spacep (p); p++)
+    ;
+  if (*p == '#')
+    *p = 0;
+  return p;
+}
+
+
+/* Fill TBL with the supported currencies.  The format of the
+   currency table file is
+     CODE DECDIGITS DESCRIPTION
+   with one currency per line.  EUR is always supported.  */
+static gpg_error_t
+load_currencies (currency_table_t tbl)
+{
+  gpg_error_t err;
   estream_t fp;
   int lnr = 0;
-  int n, c, idx;
+  int i;
   char line[256];
-  char *p, *pend;
-  double rate;
+  char *p, *name, *pend;
+  long decdigits;
+
+  err = add_currency (tbl, "EUR", 2, "Euro");
+  if (err)
+    return err;
+
+  if (!currency_table_fname)
+    {
+      for (i=1; i < DIM(builtin_currencies); i++)
+        if ((err = add_currency (tbl, builtin_currencies[i].name,
+                                 builtin_currencies[i].decdigits,
+                                 builtin_currencies[i].desc)))
+          return err;
+      return 0;
+    }
 
-  fp = es_fopen (euroxref_fname, "r");
+  fp = es_fopen (currency_table_fname, "r");
   if (!fp)
     {
       err = gpg_error_from_syserror ();
       log_error ("error opening '%s': %s\n",
-                 euroxref_fname, gpg_strerror (err));
-      return;
+                 currency_table_fname, gpg_strerror (err));
+      return err;
     }
 
-  while (es_fgets (line, DIM(line)-1, fp))
+  while ((p = read_conf_line (fp, currency_table_fname, &lnr,
+                              line, sizeof line)))
     {
-      lnr++;
+      if (!*p)
+        continue;
 
-      n = strlen (line);
-      if (!n || line[n-1] != '\n')
+      name = p;
+      while (*p && !spacep (p))
+        p++;
+      if (*p)
+        *p++ = 0;
+      errno = 0;
+      decdigits = strtol (p, &pend, 10);
+      if (p == pend || errno)
         {
-          /* Eat until end of line. */
-          while ((c=es_getc (fp)) != EOF && c != '\n')
-            ;
-          err = gpg_error (*line? GPG_ERR_LINE_TOO_LONG
-                           : GPG_ERR_INCOMPLETE_LINE);
-          log_error ("error reading '%s', line %d: %s\n",
-                     euroxref_fname, lnr, gpg_strerror (err));
+          log_error ("error parsing '%s', line %d: %s\n",
+                     currency_table_fname, lnr, "invalid decimal digits");
           continue;
         }
-      line[--n] = 0; /* Chop the LF. */
-      if (n && line[n-1] == '\r')
-        line[--n] = 0; /* Chop an optional CR. */
+      p = pend;
+      trim_spaces (p);
 
-      /* Allow leading spaces and skip empty and comment lines. */
-      for (p=line; spacep (p); p++)
-        ;
-      if (!*p || *p == '#')
+      if (!strcasecmp (name, "EUR"))
+        continue;  /* Always the first entry.  */
+      err = add_currency (tbl, name, decdigits, p);
+      if (err)
+        log_error ("error parsing '%s', line %d: %s\n",
+                   currency_table_fname, lnr, gpg_strerror (err));
+      if (gpg_err_code (err) == GPG_ERR_TOO_MANY)
+        break;
+      err = 0;
+    }
+
+  es_fclose (fp);
+  return err;
+}
+
+
+/* Parse the exchange rate at STRING and return it scaled by
+   RATE_SCALE.  Digits beyond the precision of RATE_SCALE are
+   rounded.  Returns 0 on error.  */
+static unsigned long long
+parse_rate (const char *string)
+{
+  unsigned long long value = 0;
+  unsigned long long scale = RATE_SCALE;
+  int ndigits = 0;
+  int ndots = 0;
+  int roundup = -1;
+
+  for (; *string; string++)
+    {
+      if (*string == '.')
+        {
+          if (++ndots > 1)
+            return 0;
+        }
+      else if (*string < '0' || *string > '9')
+        return 0;
+      else if (!ndots)
+        {
+          if (++ndigits > 7)
+            return 0; /* Larger than MAX_RATE.  */
+          value = 10 * value + (*string - '0');
+        }
+      else if (scale > 1)
+        {
+          scale /= 10;
+          value = 10 * value + (*string - '0');
+        }
+      else if (roundup == -1)
+        roundup = (*string >= '5');
+    }
+
+  value *= scale;
+  if (roundup == 1)
+    value++;
+  if (value > (unsigned long long)MAX_RATE * RATE_SCALE)
+    return 0;
+  return value;
+}
+
+
+/* Format the scaled RATE into BUFFER.  */
+static const char *
+format_rate (char *buffer, size_t bufsize, unsigned long long rate)
+{
+  snprintf (buffer, bufsize, "%llu.%06llu",
+            rate / RATE_SCALE, rate % RATE_SCALE);
+  return buffer;
+}
+
+
+/* Read the exchange rates from the euroxref file into TBL.  */
+static void
+load_exchange_rates (currency_table_t tbl)
+{
+  gpg_error_t err;
+  estream_t fp;
+  int lnr = 0;
+  int idx;
+  char line[256];
+  char *p, *pend;
+  unsigned long long rate;
+  const char *fname = (euroxref_fname_override? euroxref_fname_override
+                       : euroxref_fname);
+
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error ("error opening '%s': %s\n",
+                 fname, gpg_strerror (err));
+      return;
+    }
+
+  while ((p = read_conf_line (fp, fname, &lnr, line, sizeof line)))
+    {
+      if (!*p)
         continue;
 
       /* Parse the currency name. */
@@ -101,7 +416,7 @@ read_exchange_rates (void)
       if (!pend)
         {
           log_error ("error parsing '%s', line %d: %s\n",
-                     euroxref_fname, lnr, "missing '='");
+                     fname, lnr, "missing '='");
           continue;
         }
       *pend++ = 0;
@@ -109,66 +424,206 @@ read_exchange_rates (void)
       if (!*p)
         {
           log_error ("error parsing '%s', line %d: %s\n",
-                     euroxref_fname, lnr, "currency name missing");
+                     fname, lnr, "currency name missing");
           continue;
         }
 
-      /* Note that we start at 1 to skip the first entry which is
-         EUR.  */
-      for (idx=1; idx < DIM(currency_table); idx++)
-        if (!strcasecmp (currency_table[idx].name, p))
-          break;
-      if (!(idx < DIM(currency_table)))
+      /* Note that we skip the first entry which is EUR.  */
+      idx = lookup_currency (tbl, p);
+      if (idx < 1)
         continue; /* Currency not supported.  */
 
       /* Parse the rate. */
       p = pend;
-      errno = 0;
-      rate = strtod (p, &pend);
-      if ((!rate && p == pend) || errno || rate <= 0.0 || rate > 10000.0)
+      trim_spaces (p);
+      rate = parse_rate (p);
+      if (!rate)
         {
           log_error ("error parsing '%s', line %d: %s\n",
-                     euroxref_fname, lnr, "invalid exchange rate");
+                     fname, lnr, "invalid exchange rate");
           continue;
         }
-      p = pend;
-      trim_spaces (p);
-      if (*p)
+
+      tbl->currency[idx].rate = rate;
+    }
+
+  es_fclose (fp);
+}
+
+
+/* Read the currency table and the exchange rates and publish them
+   as a new snapshot.  This may be called at any time to reload the
+   tables.  */
+void
+read_exchange_rates (void)
+{
+  currency_table_t tbl;
+  currency_table_t old;
+  unsigned long long oldrate;
+  int idx, oldidx;
+  char buf1[32], buf2[32];
+  int res;
+
+  res = npth_mutex_lock (&reload_lock);
+  if (res)
+    log_fatal ("failed to acquire reload lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+  old = current_table;
+
+  tbl = xtrycalloc (1, sizeof *tbl);
+  if (!tbl)
+    {
+      log_error ("error allocating currency table: %s\n",
+                 gpg_strerror (gpg_error_from_syserror ()));
+      goto leave;
+    }
+  if (load_currencies (tbl) && old)
+    {
+      log_info ("keeping the current currency table\n");
+      xfree (tbl);
+      goto leave;
+    }
+  load_exchange_rates (tbl);
+
+  /* Log and journal the changes.  */
+  for (idx=1; idx < tbl->ncurrencies; idx++)
+    {
+      oldidx = lookup_currency (old, tbl->currency[idx].name);
+      oldrate = oldidx < 0? 0 : old->currency[oldidx].rate;
+      if (!tbl->currency[idx].rate)
         {
-          log_error ("error parsing '%s', line %d: %s\n",
-                     euroxref_fname, lnr, "garbage after exchange rate");
+          /* Keep a rate we already know.  */
+          tbl->currency[idx].rate = oldrate;
           continue;
         }
+      if (tbl->currency[idx].rate == oldrate)
+        continue;
+
+      if (!oldrate)
+        log_info ("setting exchange rate for %s to %s\n",
+                  tbl->currency[idx].name,
+                  format_rate (buf2, sizeof buf2, tbl->currency[idx].rate));
+      else
+        log_info ("changing exchange rate for %s from %s to %s\n",
+                  tbl->currency[idx].name,
+                  format_rate (buf1, sizeof buf1, oldrate),
+                  format_rate (buf2, sizeof buf2, tbl->currency[idx].rate));
+      jrnl_store_exchange_rate_record (tbl->currency[idx].name,
+                                       (double)tbl->currency[idx].rate
+                                       / RATE_SCALE);
+    }
+
+  /* Publish the new snapshot.  */
+  xfree (retired_table);
+  retired_table = old;
+  current_table = tbl;
+
+ leave:
+  res = npth_mutex_unlock (&reload_lock);
+  if (res)
+    log_fatal ("failed to release reload lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+}
 
-      /* Update the tbale.  */
-      if (currency_table[idx].rate != rate)
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* The thread watching the directory with the euroxref file.  The
+   geteuroxref script renames a new file into place; thus we watch
+   for renames and for files written in place.  */
+static void *
+rates_watcher_thread (void *arg)
+{
+  int fd = (int)(long)arg;
+  char buffer[4096]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  ssize_t n;
+  char *p;
+  int changed;
+
+  for (;;)
+    {
+      n = npth_read (fd, buffer, sizeof buffer);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
         {
-          if (!currency_table[idx].rate)
-            log_info ("setting exchange rate for %s to %.4f\n",
-                      currency_table[idx].name, rate);
-          else
-            log_info ("changing exchange rate for %s from %.4f to %.4f\n",
-                      currency_table[idx].name, currency_table[idx].rate, rate);
-
-          currency_table[idx].rate = rate;
-          jrnl_store_exchange_rate_record (currency_table[idx].name, rate);
+          log_error ("error reading inotify events: %s\n",
+                     n? strerror (errno) : "EOF");
+          break;
         }
+
+      changed = 0;
+      for (p = buffer; p < buffer + n; p += sizeof *ev + ev->len)
+        {
+          ev = (const struct inotify_event *)p;
+          if (ev->len && !strcmp (ev->name, euroxref_name))
+            changed = 1;
+        }
+      if (!changed)
+        continue;
+
+      /* Give a writer a moment to finish before we parse the file.  */
+      npth_sleep (1);
+      if (opt.verbose)
+        log_info ("'%s' changed - reloading\n", euroxref_fname);
+      read_exchange_rates ();
     }
 
-  es_fclose (fp);
+  log_info ("not watching '%s' anymore - polling for new rates\n",
+            euroxref_fname);
+  rates_watched = 0;
+  close (fd);
+  return NULL;
 }
+#endif /*HAVE_SYS_INOTIFY_H*/
 
 
-/* Return the exchange rate for CURRENCY or 0.0 is not known.  */
-static double
-get_exchange_rate (const char *currency)
+/* Start a thread to reload the exchange rates as soon as the
+   euroxref file changes.  */
+void
+currency_watch_rates (void)
 {
-  int i;
+#ifdef HAVE_SYS_INOTIFY_H
+  npth_attr_t tattr;
+  npth_t thread;
+  int fd;
+  int res;
+
+  fd = inotify_init1 (IN_CLOEXEC);
+  if (fd == -1)
+    {
+      log_error ("error initializing inotify: %s\n", strerror (errno));
+      return;
+    }
+  if (inotify_add_watch (fd, euroxref_dir, IN_CLOSE_WRITE|IN_MOVED_TO) == -1)
+    {
+      log_error ("error watching '%s': %s\n", euroxref_dir, strerror (errno));
+      close (fd);
+      return;
+    }
+
+  rates_watched = 1;
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+  res = npth_create (&thread, &tattr, rates_watcher_thread, (void*)(long)fd);
+  npth_attr_destroy (&tattr);
+  if (res)
+    {
+      log_error ("error spawning rates watcher: %s\n", strerror (res));
+      rates_watched = 0;
+      close (fd);
+    }
+#endif
+}
+
 
-  for (i=0; i < DIM(currency_table); i++)
-    if (!strcasecmp (currency, currency_table[i].name))
-      return currency_table[i].rate;
-  return 0.0;
+/* Return true if the euroxref file is watched for changes.  If not,
+   the caller needs to poll using read_exchange_rates.  */
+int
+currency_rates_watched_p (void)
+{
+  return rates_watched;
 }
 
 
@@ -178,73 +633,139 @@ get_exchange_rate (const char *currency)
 int
 valid_currency_p (const char *string, int *r_decdigits)
 {
-  int i;
+  currency_table_t tbl = current_table;
+  int idx;
 
-  for (i=0; i < DIM(currency_table); i++)
-    if (!strcasecmp (string, currency_table[i].name))
-      {
-        *r_decdigits = currency_table[i].decdigits;
-        return 1;
-      }
-  return 0;
+  idx = lookup_currency (tbl, string);
+  if (idx < 0)
+    return 0;
+  *r_decdigits = tbl->currency[idx].decdigits;
+  return 1;
 }
 
 
-/* Return information for currencies.  SEQ needs to be iterated from 0
-   upwards until the function returns NULL.  If not NULL a description
-   of the currency is stored at R_DESC.  if not NULL, the latest known
-   exchange rate is stored at R_RATE.  */
-const char *
-get_currency_info (int seq, char const **r_desc, double *r_rate)
+/* Return information for all supported currencies.  A malloced
+   array with the information is stored at R_INFO and the number of
+   items at R_COUNT.  All items are taken from the same snapshot of
+   the currency table.  */
+gpg_error_t
+get_currency_info (struct currency_info_s **r_info, int *r_count)
 {
-  if (seq < 0 || seq >= DIM (currency_table))
-    return NULL;
-  if (r_desc)
-    *r_desc = currency_table[seq].desc;
-  if (r_rate)
-    *r_rate = currency_table[seq].rate;
-  return currency_table[seq].name;
+  gpg_error_t err = 0;
+  currency_table_t tbl;
+  struct currency_info_s *info = NULL;
+  int idx, n = 0;
+  int res;
+
+  /* Hold the lock so that TBL is not released while we copy it.  */
+  res = npth_mutex_lock (&reload_lock);
+  if (res)
+    log_fatal ("failed to acquire reload lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+  tbl = current_table;
+  if (tbl && tbl->ncurrencies)
+    {
+      info = xtrycalloc (tbl->ncurrencies, sizeof *info);
+      if (!info)
+        err = gpg_error_from_syserror ();
+      else
+        {
+          n = tbl->ncurrencies;
+          for (idx=0; idx < n; idx++)
+            {
+              strcpy (info[idx].name, tbl->currency[idx].name);
+              strcpy (info[idx].desc, tbl->currency[idx].desc);
+              info[idx].rate = (double)tbl->currency[idx].rate / RATE_SCALE;
+            }
+        }
+    }
+  res = npth_mutex_unlock (&reload_lock);
+  if (res)
+    log_fatal ("failed to release reload lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+
+  *r_info = info;
+  *r_count = n;
+  return err;
 }
 
 
 /* Convert (AMOUNT, CURRENCY) to an Euro amount and store it in BUFFER
    up to a length of BUFSIZE-1.  Returns BUFFER.  If a conversion is
-   not possible an empty string is returned. */
+   not possible an empty string is returned.  The conversion is done
+   with integer arithmetic and the result is rounded half up to
+   cents.  */
 char *
 convert_currency (char *buffer, size_t bufsize,
                   const char *currency, const char *amount)
 {
-  double value, rate;
-  char *pend;
+  currency_table_t tbl = current_table;
+  unsigned long long value = 0;
+  unsigned long long divisor, cents, rest;
+  int negative = 0;
+  int ndigits = 0;
+  int nfrac = -1;
+  int idx;
+  const char *s;
 
   if (!bufsize)
     log_bug ("buffer too short in convert_currency\n");
 
   *buffer = 0;
-  errno = 0;
-  value = strtod (amount, &pend);
-  if ((!value && amount == pend) || errno)
+
+  /* Parse the amount into VALUE with NFRAC post decimal digits.  */
+  s = amount;
+  if (*s == '-' || *s == '+')
+    negative = (*s++ == '-');
+  for (; *s; s++)
+    {
+      if (*s == '.' && nfrac == -1)
+        nfrac = 0;
+      else if (*s >= '0' && *s <= '9' && ndigits < 11 && nfrac < 6)
+        {
+          value = 10 * value + (*s - '0');
+          ndigits++;
+          if (nfrac != -1)
+            nfrac++;
+        }
+      else
+        break;
+    }
+  if (!ndigits || *s)
     {
       log_error ("error converting %s %s to Euro: %s\n",
-                 amount, currency, strerror (errno));
+                 amount, currency, "invalid amount");
       return buffer;
     }
+  if (nfrac == -1)
+    nfrac = 0;
 
-  rate = get_exchange_rate (currency);
-  if (!rate)
+  idx = lookup_currency (tbl, currency);
+  if (idx < 0 || !tbl->currency[idx].rate)
     {
       if (opt.verbose)
         log_info ("error converting %s %s to Euro: %s\n",
                   amount, currency, "no exchange rate available");
       return buffer;
     }
-  if (rate != 1.0)
-    {
-      value /= rate;
-      value += 0.005; /* So that snprintf rounds the value. */
-    }
 
-  if (gpgrt_snprintf (buffer, bufsize, "%.2f", value) < 0)
+  /* cents = value * 100 / 10^nfrac / (rate / RATE_SCALE)
+   *
+   * With at most 11 digits for VALUE, VALUE * 100 * RATE_SCALE is
+   * less than 10^19.  With a rate less or equal than MAX_RATE *
+   * RATE_SCALE = 10^12 and at most 6 post decimal digits the divisor
+   * is at most 10^18.  Thus nothing overflows 64 bits.  */
+  divisor = tbl->currency[idx].rate;
+  for (; nfrac; nfrac--)
+    divisor *= 10;
+  value *= 100ULL * RATE_SCALE;
+  cents = value / divisor;
+  rest  = value % divisor;
+  if (rest >= divisor - rest)
+    cents++;
+
+  if (gpgrt_snprintf (buffer, bufsize, "%s%llu.%02llu",
+                      negative && cents? "-":"", cents / 100, cents % 100) < 0)
     {
       log_error ("error converting %s %s to Euro: %s\n",
                  amount, currency, strerror (errno));
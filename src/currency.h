@@ -20,10 +20,21 @@
 #ifndef CURRENCY_H
 #define CURRENCY_H
 
+/* Information about a currency as returned by get_currency_info.  */
+struct currency_info_s
+{
+  char name[4];
+  char desc[40];
+  double rate;   /* The exchange rate to Euro or 0 if not known.  */
+};
+
+void currency_set_table_file (const char *fname);
 void read_exchange_rates (void);
+void currency_watch_rates (void);
+int currency_rates_watched_p (void);
 
 int valid_currency_p (const char *string, int *r_decdigits);
-const char *get_currency_info (int seq, char const **r_desc, double *r_rate);
+gpg_error_t get_currency_info (struct currency_info_s **r_info, int *r_count);
 char *convert_currency (char *buffer, size_t bufsize,
                         const char *currency, const char *amount);
 
@@ -21,7 +21,10 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <npth.h>
 #include <gpgme.h>
+#include <gcrypt.h>
 
 #include "util.h"
 #include "logging.h"
@@ -36,6 +39,41 @@ static gpgme_key_t database_key;
  * public key is required.  NULL if not set. */
 static gpgme_key_t backoffice_key;
 
+/* The maximum number of idle GPGME contexts we keep around.  */
+#define MAX_CONTEXT_POOL 8
+
+/* A pool of idle GPGME contexts.  Creating a context requires to
+ * figure out the engine version and thus spawning gpg; we avoid this
+ * by handing out already used contexts.  A context taken from the
+ * pool belongs to the calling thread until it is put back.  */
+static gpgme_ctx_t context_pool[MAX_CONTEXT_POOL];
+static int context_pool_count;
+static npth_mutex_t context_pool_lock = NPTH_MUTEX_INITIALIZER;
+
+/* Parameters for the envelope encryption.  A data encryption key
+ * (DEK) is a random AES-256 key which is used for DEK_LIFETIME
+ * seconds to seal fields with AES-GCM.  The DEK itself is stored
+ * encrypted to the database and the backoffice key.  */
+#define DEK_LENGTH       32
+#define DEK_NONCE_LENGTH 12
+#define DEK_TAG_LENGTH   16
+#define DEK_LIFETIME     (24*3600)
+
+/* An object to hold a data encryption key.  */
+struct dek_s
+{
+  struct dek_s *next;
+  time_t created;       /* Creation time or 0 for a loaded key.  */
+  unsigned char *key;   /* DEK_LENGTH bytes allocated in secure memory.  */
+  char keyid[DEK_KEYID_SIZE];
+};
+typedef struct dek_s *dek_t;
+
+/* The list of known DEKs.  The current key, if any, is the one with
+ * the highest creation time.  */
+static dek_t dek_list;
+static npth_mutex_t dek_lock = NPTH_MUTEX_INITIALIZER;
+
 
 
 /* Create a new GPGME context for OpenPGP or print and return an
@@ -77,6 +115,125 @@ create_context (gpgme_ctx_t *r_ctx, gpgme_pinentry_mode_t pinmode)
 }
 
 
+/* Take a context from the pool or create a new one if the pool is
+ * empty.  All pooled contexts use GPGME_PINENTRY_MODE_CANCEL.  */
+static gpg_error_t
+get_pooled_context (gpgme_ctx_t *r_ctx)
+{
+  int res;
+
+  *r_ctx = NULL;
+
+  res = npth_mutex_lock (&context_pool_lock);
+  if (res)
+    log_fatal ("failed to acquire context pool lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+  if (context_pool_count)
+    *r_ctx = context_pool[--context_pool_count];
+  res = npth_mutex_unlock (&context_pool_lock);
+  if (res)
+    log_fatal ("failed to release context pool lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+
+  if (*r_ctx)
+    return 0;
+  return create_context (r_ctx, GPGME_PINENTRY_MODE_CANCEL);
+}
+
+
+/* Put CTX back into the pool.  If the pool is full or BROKEN is set
+ * the context is released instead.  CTX may be NULL.  */
+static void
+put_pooled_context (gpgme_ctx_t ctx, int broken)
+{
+  int res;
+
+  if (!ctx)
+    return;
+
+  if (!broken)
+    {
+      res = npth_mutex_lock (&context_pool_lock);
+      if (res)
+        log_fatal ("failed to acquire context pool lock: %s\n",
+                   gpg_strerror (gpg_error_from_errno (res)));
+      if (context_pool_count < MAX_CONTEXT_POOL)
+        {
+          context_pool[context_pool_count++] = ctx;
+          ctx = NULL;
+        }
+      res = npth_mutex_unlock (&context_pool_lock);
+      if (res)
+        log_fatal ("failed to release context pool lock: %s\n",
+                   gpg_strerror (gpg_error_from_errno (res)));
+    }
+
+  gpgme_release (ctx);
+}
+
+
+/* Release all idle contexts from the pool.  */
+static void
+release_context_pool (void)
+{
+  int res;
+
+  res = npth_mutex_lock (&context_pool_lock);
+  if (res)
+    log_fatal ("failed to acquire context pool lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+  while (context_pool_count)
+    gpgme_release (context_pool[--context_pool_count]);
+  res = npth_mutex_unlock (&context_pool_lock);
+  if (res)
+    log_fatal ("failed to release context pool lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+/* Lock the list of DEKs.  */
+static void
+lock_deks (void)
+{
+  int res;
+
+  res = npth_mutex_lock (&dek_lock);
+  if (res)
+    log_fatal ("failed to acquire DEK lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+/* Unlock the list of DEKs.  */
+static void
+unlock_deks (void)
+{
+  int res;
+
+  res = npth_mutex_unlock (&dek_lock);
+  if (res)
+    log_fatal ("failed to release DEK lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+/* Release all DEKs.  */
+static void
+release_deks (void)
+{
+  dek_t dek;
+
+  lock_deks ();
+  while ((dek = dek_list))
+    {
+      dek_list = dek->next;
+      gcry_free (dek->key);  /* Secure memory is wiped on free.  */
+      xfree (dek);
+    }
+  unlock_deks ();
+}
+
+
 
 /* Setup the required OpenPGP keys.  Returnc NULL on success and an
  * error code on failure.  Also uses log_error on error.  Can be used
@@ -90,7 +247,7 @@ encrypt_setup_keys (void)
   gpgme_key_t key = NULL;
   gpgme_key_t tmpkey;
 
-  err = create_context (&ctx, GPGME_PINENTRY_MODE_CANCEL);
+  err = get_pooled_context (&ctx);
   if (err)
     goto leave;
 
@@ -158,17 +315,20 @@ encrypt_setup_keys (void)
   if (firsterr)
     err = firsterr;
   gpgme_key_unref (key);
-  gpgme_release (ctx);
+  put_pooled_context (ctx, 0);
   return err;
 }
 
 
-/* Release all keys.  */
+/* Release all keys, the DEKs and the pooled contexts.  */
 void
 encrypt_release_keys (void)
 {
   gpgme_key_t tmpkey;
 
+  release_context_pool ();
+  release_deks ();
+
   tmpkey = database_key;
   database_key = NULL;
   gpgme_key_unref (tmpkey);
@@ -203,31 +363,23 @@ encrypt_show_keys (void)
 }
 
 
-/* Encrypt STRING to the keys specified by the bitflags in ENCRYPT_TO
- * and return an allocated, base64 encoded string at RESULT.  On error
- * NULL is stored at RESULT and an error code returned.  */
-gpg_error_t
-encrypt_string (char **result, const char *string, int encrypt_to)
+/* Encrypt STRING using the context CTX to the NULL terminated array
+ * of KEYS and return an allocated, base64 encoded string at RESULT.
+ * On error NULL is stored at RESULT and an error code returned.  */
+static gpg_error_t
+encrypt_one (gpgme_ctx_t ctx, gpgme_key_t *keys,
+             char **result, const char *string)
 {
   gpg_error_t err;
-  gpgme_ctx_t ctx;
   gpgme_data_t input = NULL;
   gpgme_data_t output = NULL;
-  gpgme_key_t keys[2+1];
-  int keycount = 0;
   gpgme_encrypt_result_t encres;
   gpgme_invalid_key_t invkey;
-  int i;
   char *outbuffer = NULL;
   size_t outbuflen;
 
   *result = NULL;
 
-  /* Check that a key is specified and allflags are known.  */
-  if (!encrypt_to
-      || (encrypt_to & ~(ENCRYPT_TO_DATABASE|ENCRYPT_TO_BACKOFFICE)))
-    return gpg_error (GPG_ERR_INV_FLAG);
-
   /* No need to encrypt an empty string.  Use shortcut. */
   if (!string || !*string)
     {
@@ -235,11 +387,6 @@ encrypt_string (char **result, const char *string, int encrypt_to)
       return *result? 0 : gpg_error_from_syserror ();
     }
 
-  /* No prepare the encryption.  */
-  err = create_context (&ctx, GPGME_PINENTRY_MODE_CANCEL);
-  if (err)
-    return err;
-
   /* Create data objects.  */
   err = gpgme_data_new_from_mem (&input, string, strlen (string), 0);
   if (err)
@@ -249,19 +396,6 @@ encrypt_string (char **result, const char *string, int encrypt_to)
   if (err)
     goto leave;
 
-  /* Encrypt.  */
-  if ((encrypt_to & ENCRYPT_TO_DATABASE) && database_key)
-    {
-      gpgme_key_ref (database_key);
-      keys[keycount++] = database_key;
-    }
-  if ((encrypt_to & ENCRYPT_TO_BACKOFFICE) && backoffice_key)
-    {
-      gpgme_key_ref (backoffice_key);
-      keys[keycount++] = backoffice_key;
-    }
-  keys[keycount] = NULL;
-
   /* NB. The data items are in general small and thus it does not make
    * sense to use compression.  */
   err = gpgme_op_encrypt (ctx, keys,
@@ -300,18 +434,89 @@ encrypt_string (char **result, const char *string, int encrypt_to)
       goto leave;
     }
 
-
  leave:
   gpgme_free (outbuffer);
-  for (i=0; i < keycount; i++)
-    gpgme_key_unref (keys[i]);
   gpgme_data_release (output);
   gpgme_data_release (input);
-  gpgme_release (ctx);
   return err;
 }
 
 
+/* Encrypt the NSTRINGS strings at STRINGS to the keys specified by
+ * the bitflags in ENCRYPT_TO and store allocated, base64 encoded
+ * strings at the respective index of RESULTS.  NULL or empty strings
+ * are stored as empty strings.  All strings are encrypted using the
+ * same context and the same set of resolved keys.  On error NULL is
+ * stored at all RESULTS and an error code returned.  */
+gpg_error_t
+encrypt_strings (char **results, const char **strings, int nstrings,
+                 int encrypt_to)
+{
+  gpg_error_t err;
+  gpgme_ctx_t ctx = NULL;
+  gpgme_key_t keys[2+1];
+  int keycount = 0;
+  int i;
+
+  for (i=0; i < nstrings; i++)
+    results[i] = NULL;
+
+  /* Check that a key is specified and allflags are known.  */
+  if (!encrypt_to
+      || (encrypt_to & ~(ENCRYPT_TO_DATABASE|ENCRYPT_TO_BACKOFFICE)))
+    return gpg_error (GPG_ERR_INV_FLAG);
+
+  /* Resolve the keys once for all strings.  */
+  if ((encrypt_to & ENCRYPT_TO_DATABASE) && database_key)
+    {
+      gpgme_key_ref (database_key);
+      keys[keycount++] = database_key;
+    }
+  if ((encrypt_to & ENCRYPT_TO_BACKOFFICE) && backoffice_key)
+    {
+      gpgme_key_ref (backoffice_key);
+      keys[keycount++] = backoffice_key;
+    }
+  keys[keycount] = NULL;
+
+  err = 0;
+  for (i=0; i < nstrings && !err; i++)
+    {
+      /* Take a context only if we really need to encrypt.  */
+      if (!ctx && strings[i] && *strings[i])
+        {
+          err = get_pooled_context (&ctx);
+          if (err)
+            break;
+        }
+      err = encrypt_one (ctx, keys, &results[i], strings[i]);
+    }
+
+  if (err)
+    {
+      for (i=0; i < nstrings; i++)
+        {
+          xfree (results[i]);
+          results[i] = NULL;
+        }
+    }
+  for (i=0; i < keycount; i++)
+    gpgme_key_unref (keys[i]);
+  put_pooled_context (ctx, !!err);
+  return err;
+}
+
+
+/* Encrypt STRING to the keys specified by the bitflags in ENCRYPT_TO
+ * and return an allocated, base64 encoded string at RESULT.  On error
+ * NULL is stored at RESULT and an error code returned.  */
+gpg_error_t
+encrypt_string (char **result, const char *string, int encrypt_to)
+{
+  return encrypt_strings (result, &string, 1, encrypt_to);
+}
+
+
 /* Decrypt an OpenPGP encrypted and Base64 encoded STRING and return
  * the plaintext as an allocated string at RESULT.  If the reult
  * contains embedded Nuls an error is returned.  On error NULL is
@@ -322,7 +527,7 @@ gpg_error_t
 decrypt_string (char **result, const char *string)
 {
   gpg_error_t err;
-  gpgme_ctx_t ctx;
+  gpgme_ctx_t ctx = NULL;
   gpgme_data_t input = NULL;
   gpgme_data_t output = NULL;
   char *outbuffer = NULL;
@@ -358,7 +563,7 @@ decrypt_string (char **result, const char *string)
 
   /* Prepare the decryption.  We expect that the secret key has no
    * passpharse set and thus we do not expect a Pinentry.  */
-  err = create_context (&ctx, GPGME_PINENTRY_MODE_CANCEL);
+  err = get_pooled_context (&ctx);
   if (err)
     goto leave;
 
@@ -387,6 +592,389 @@ decrypt_string (char **result, const char *string)
   gpgme_free (outbuffer);
   gpgme_data_release (output);
   gpgme_data_release (input);
-  gpgme_release (ctx);
+  put_pooled_context (ctx, !!err);
+  return err;
+}
+
+
+
+/*
+ * Envelope encryption
+ */
+
+/* Find the DEK with KEYID.  If KEYID is NULL the current DEK is
+ * returned if it has not yet expired.  Must be called with the DEK
+ * lock held.  Returns NULL if not found.  */
+static dek_t
+find_dek (const char *keyid)
+{
+  dek_t dek, best;
+
+  if (keyid)
+    {
+      for (dek = dek_list; dek; dek = dek->next)
+        if (!strcmp (dek->keyid, keyid))
+          return dek;
+      return NULL;
+    }
+
+  for (best = NULL, dek = dek_list; dek; dek = dek->next)
+    if (dek->created && (!best || dek->created > best->created))
+      best = dek;
+  if (best && best->created + DEK_LIFETIME < time (NULL))
+    best = NULL;  /* Expired.  */
+  return best;
+}
+
+
+/* Put a new DEK object with KEYID and the raw KEY of DEK_LENGTH
+ * bytes into the list.  CREATED is the creation time or 0 if the key
+ * shall only be used for decryption.  */
+static gpg_error_t
+add_dek (const char *keyid, const void *key, time_t created)
+{
+  dek_t dek;
+
+  if (strlen (keyid) >= DEK_KEYID_SIZE)
+    return gpg_error (GPG_ERR_INV_ID);
+
+  dek = xtrycalloc (1, sizeof *dek);
+  if (!dek)
+    return gpg_error_from_syserror ();
+  dek->key = gcry_malloc_secure (DEK_LENGTH);
+  if (!dek->key)
+    {
+      gpg_error_t err = gpg_error_from_syserror ();
+      xfree (dek);
+      return err;
+    }
+  memcpy (dek->key, key, DEK_LENGTH);
+  strcpy (dek->keyid, keyid);
+  dek->created = created;
+
+  lock_deks ();
+  if (find_dek (keyid))
+    {
+      /* Already known - no need to add it again.  */
+      unlock_deks ();
+      gcry_free (dek->key);
+      xfree (dek);
+      return 0;
+    }
+  dek->next = dek_list;
+  dek_list = dek;
+  unlock_deks ();
+  return 0;
+}
+
+
+/* Create a new DEK.  On success the allocated key id is stored at
+ * R_KEYID and the DEK, encrypted to the database and the backoffice
+ * key and base64 encoded, at R_WRAPPED.  The caller needs to store
+ * both so that the DEK can later be loaded using encrypt_load_dek
+ * and then call encrypt_activate_dek to make it the current DEK.
+ * Until then the DEK is only used for decryption.  */
+gpg_error_t
+encrypt_new_dek (char **r_keyid, char **r_wrapped)
+{
+  gpg_error_t err;
+  unsigned char *key = NULL;
+  char *b64key = NULL;
+  unsigned char nonce[10];
+
+  *r_keyid = NULL;
+  *r_wrapped = NULL;
+
+  if (!database_key)
+    return gpg_error (GPG_ERR_NO_SECKEY);
+
+  key = gcry_random_bytes_secure (DEK_LENGTH, GCRY_STRONG_RANDOM);
+  gcry_create_nonce (nonce, sizeof nonce);
+  *r_keyid = zb32_encode (nonce, 8 * sizeof nonce);
+  if (!*r_keyid)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  b64key = base64_encode (key, DEK_LENGTH);
+  if (!b64key)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  err = encrypt_string (r_wrapped, b64key,
+                        (ENCRYPT_TO_DATABASE | ENCRYPT_TO_BACKOFFICE));
+  if (err)
+    goto leave;
+
+  err = add_dek (*r_keyid, key, 0);
+  if (err)
+    goto leave;
+
+  if (opt.verbose)
+    log_info ("new data encryption key '%s' created\n", *r_keyid);
+
+ leave:
+  if (b64key)
+    {
+      wipememory (b64key, strlen (b64key));
+      xfree (b64key);
+    }
+  gcry_free (key);
+  if (err)
+    {
+      xfree (*r_keyid);
+      *r_keyid = NULL;
+      xfree (*r_wrapped);
+      *r_wrapped = NULL;
+    }
+  return err;
+}
+
+
+/* Make the DEK with KEYID the current one so that it is used by
+ * encrypt_seal_strings.  */
+gpg_error_t
+encrypt_activate_dek (const char *keyid)
+{
+  dek_t dek;
+
+  lock_deks ();
+  dek = find_dek (keyid);
+  if (dek)
+    dek->created = time (NULL);
+  unlock_deks ();
+  return dek? 0 : gpg_error (GPG_ERR_NO_KEY);
+}
+
+
+/* Decrypt the DEK WRAPPED as returned by encrypt_new_dek and make it
+ * available for decryption under KEYID.  */
+gpg_error_t
+encrypt_load_dek (const char *keyid, const char *wrapped)
+{
+  gpg_error_t err;
+  char *b64key = NULL;
+  void *key = NULL;
+  size_t keylen;
+
+  err = decrypt_string (&b64key, wrapped);
+  if (err)
+    goto leave;
+  err = base64_decode (b64key, &key, &keylen);
+  if (err)
+    goto leave;
+  if (keylen != DEK_LENGTH)
+    {
+      err = gpg_error (GPG_ERR_BAD_KEY);
+      goto leave;
+    }
+
+  err = add_dek (keyid, key, 0);
+
+ leave:
+  if (err)
+    log_error ("error loading data encryption key '%s': %s\n",
+               keyid, gpg_strerror (err));
+  if (b64key)
+    {
+      wipememory (b64key, strlen (b64key));
+      gpgme_free (b64key);
+    }
+  if (key)
+    {
+      wipememory (key, keylen);
+      xfree (key);
+    }
+  return err;
+}
+
+
+/* Open an AES-GCM cipher handle for DEK using NONCE.  KEYID is used
+ * as additional authenticated data.  */
+static gpg_error_t
+open_dek_cipher (gcry_cipher_hd_t *r_hd, dek_t dek, const void *nonce)
+{
+  gpg_error_t err;
+
+  err = gcry_cipher_open (r_hd, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_GCM,
+                          GCRY_CIPHER_SECURE);
+  if (err)
+    return err;
+  err = gcry_cipher_setkey (*r_hd, dek->key, DEK_LENGTH);
+  if (!err)
+    err = gcry_cipher_setiv (*r_hd, nonce, DEK_NONCE_LENGTH);
+  if (!err)
+    err = gcry_cipher_authenticate (*r_hd, dek->keyid, strlen (dek->keyid));
+  if (err)
+    {
+      gcry_cipher_close (*r_hd);
+      *r_hd = NULL;
+    }
+  return err;
+}
+
+
+/* Seal STRING with DEK and return an allocated, base64 encoded string
+ * of the nonce, the ciphertext, and the tag at RESULT.  */
+static gpg_error_t
+seal_one (dek_t dek, char **result, const char *string)
+{
+  gpg_error_t err;
+  gcry_cipher_hd_t hd;
+  unsigned char *buffer;
+  size_t len;
+
+  *result = NULL;
+
+  if (!string || !*string)
+    {
+      *result = xtrystrdup ("");
+      return *result? 0 : gpg_error_from_syserror ();
+    }
+
+  len = strlen (string);
+  buffer = xtrymalloc (DEK_NONCE_LENGTH + len + DEK_TAG_LENGTH);
+  if (!buffer)
+    return gpg_error_from_syserror ();
+  gcry_create_nonce (buffer, DEK_NONCE_LENGTH);
+
+  err = open_dek_cipher (&hd, dek, buffer);
+  if (err)
+    goto leave;
+  err = gcry_cipher_final (hd);
+  if (!err)
+    err = gcry_cipher_encrypt (hd, buffer + DEK_NONCE_LENGTH, len,
+                               string, len);
+  if (!err)
+    err = gcry_cipher_gettag (hd, buffer + DEK_NONCE_LENGTH + len,
+                              DEK_TAG_LENGTH);
+  gcry_cipher_close (hd);
+  if (err)
+    goto leave;
+
+  *result = base64_encode (buffer, DEK_NONCE_LENGTH + len + DEK_TAG_LENGTH);
+  if (!*result)
+    err = gpg_error_from_syserror ();
+
+ leave:
+  xfree (buffer);
+  return err;
+}
+
+
+/* Seal the NSTRINGS strings at STRINGS with the current DEK and store
+ * allocated, base64 encoded strings at the respective index of
+ * RESULTS.  NULL or empty strings are stored as empty strings.  The
+ * key id of the used DEK is copied to the caller provided buffer
+ * R_KEYID of size DEK_KEYID_SIZE.  If no current DEK is available or
+ * it has expired GPG_ERR_NO_KEY is returned; the caller should then
+ * create a new DEK using encrypt_new_dek and try again.  On error
+ * NULL is stored at all RESULTS and an error code returned.  */
+gpg_error_t
+encrypt_seal_strings (char **results, const char **strings, int nstrings,
+                      char *r_keyid)
+{
+  gpg_error_t err = 0;
+  dek_t dek;
+  int i;
+
+  for (i=0; i < nstrings; i++)
+    results[i] = NULL;
+  *r_keyid = 0;
+
+  lock_deks ();
+  dek = find_dek (NULL);
+  if (!dek)
+    err = gpg_error (GPG_ERR_NO_KEY);
+  for (i=0; i < nstrings && !err; i++)
+    err = seal_one (dek, &results[i], strings[i]);
+  if (!err)
+    strcpy (r_keyid, dek->keyid);
+  unlock_deks ();
+
+  if (err)
+    {
+      for (i=0; i < nstrings; i++)
+        {
+          xfree (results[i]);
+          results[i] = NULL;
+        }
+    }
+  return err;
+}
+
+
+/* Open the base64 encoded STRING which was sealed with the DEK KEYID
+ * and return the plaintext as an allocated string at RESULT.  If the
+ * DEK is not known GPG_ERR_NO_KEY is returned; the caller should then
+ * load the DEK using encrypt_load_dek and try again.  On error NULL
+ * is stored at RESULT and an error code returned.  */
+gpg_error_t
+decrypt_sealed_string (char **result, const char *keyid, const char *string)
+{
+  gpg_error_t err;
+  dek_t dek;
+  gcry_cipher_hd_t hd;
+  unsigned char *buffer = NULL;
+  size_t buflen, len = 0;
+
+  *result = NULL;
+
+  if (!string || !*string)
+    {
+      *result = xtrystrdup ("");
+      return *result? 0 : gpg_error_from_syserror ();
+    }
+
+  err = base64_decode (string, (void**)&buffer, &buflen);
+  if (err)
+    return err;
+  if (buflen < DEK_NONCE_LENGTH + DEK_TAG_LENGTH)
+    {
+      err = gpg_error (GPG_ERR_TOO_SHORT);
+      goto leave;
+    }
+  len = buflen - DEK_NONCE_LENGTH - DEK_TAG_LENGTH;
+
+  *result = xtrymalloc (len + 1);
+  if (!*result)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  lock_deks ();
+  dek = find_dek (keyid);
+  if (!dek)
+    err = gpg_error (GPG_ERR_NO_KEY);
+  else
+    err = open_dek_cipher (&hd, dek, buffer);
+  unlock_deks ();
+  if (err)
+    goto leave;
+  err = gcry_cipher_final (hd);
+  if (!err)
+    err = gcry_cipher_decrypt (hd, *result, len,
+                               buffer + DEK_NONCE_LENGTH, len);
+  if (!err)
+    err = gcry_cipher_checktag (hd, buffer + DEK_NONCE_LENGTH + len,
+                                DEK_TAG_LENGTH);
+  gcry_cipher_close (hd);
+  if (err)
+    goto leave;
+  (*result)[len] = 0;
+  if (strlen (*result) != len)
+    err = gpg_error (GPG_ERR_BOGUS_STRING);
+
+ leave:
+  if (err && *result)
+    {
+      wipememory (*result, len);
+      xfree (*result);
+      *result = NULL;
+    }
+  xfree (buffer);
   return err;
 }
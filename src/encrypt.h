@@ -24,10 +24,24 @@
 #define ENCRYPT_TO_DATABASE    1 /* Encrypt to the database.  */
 #define ENCRYPT_TO_BACKOFFICE  2 /* Encrypt to the backoffice.  */
 
+/* The size of a buffer to hold a key id of a data encryption key.  */
+#define DEK_KEYID_SIZE 17
+
 gpg_error_t encrypt_setup_keys (void);
 void encrypt_release_keys (void);
 void encrypt_show_keys (void);
 gpg_error_t encrypt_string (char **result, const char *string, int encrypt_to);
+gpg_error_t encrypt_strings (char **results, const char **strings,
+                             int nstrings, int encrypt_to);
+gpg_error_t decrypt_string (char **result, const char *string);
+
+gpg_error_t encrypt_new_dek (char **r_keyid, char **r_wrapped);
+gpg_error_t encrypt_activate_dek (const char *keyid);
+gpg_error_t encrypt_load_dek (const char *keyid, const char *wrapped);
+gpg_error_t encrypt_seal_strings (char **results, const char **strings,
+                                  int nstrings, char *r_keyid);
+gpg_error_t decrypt_sealed_string (char **result, const char *keyid,
+                                   const char *string);
 
 
 #endif /*ENCRYPT_H*/
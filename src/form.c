@@ -24,53 +24,288 @@
 #include <stdio.h>
 
 #include "util.h"
-#include "membuf.h"
-#include "http.h"
 #include "form.h"
 
 
-/* Encode the data in FORM for use with POST.  */
-gpg_error_t
-encode_formdata (keyvalue_t form, char **r_encoded)
+/* Classes of characters for the form encoding.  */
+enum
+  {
+    FORM_ESCAPE = 0,  /* Encode as %XX.  */
+    FORM_PLAIN,       /* Copy verbatim.  */
+    FORM_SPACE,       /* Encode as plus sign.  */
+    FORM_LF,          /* Encode as %0D%0A.  */
+    FORM_CR           /* Encode as %0D%0A if followed by a LF.  */
+  };
+
+/* The class of each byte.  All characters which are valid in an URI
+   except for "%;?&=" are copied verbatim.  */
+static const unsigned char form_chars[256] =
+  {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 3, 0, 0, 4, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    2, 1, 1, 1, 1, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0
+  };
+
+
+/* The target for the encoder.  If FP is set the data is written to
+   that stream in chunks of the size of STAGE, if BUFFER is set it is
+   stored there, and if both are NULL only the length is computed.  */
+struct encode_ctx_s
 {
-  gpg_error_t err;
-  membuf_t mb;
-  keyvalue_t kv;
-  char *escaped;
+  estream_t fp;
+  char *buffer;
+  size_t length;
+  int error;
+  size_t staged;
+  char stage[512];
+};
 
-  *r_encoded = NULL;
 
-  init_membuf (&mb, 0);
+static void
+flush_stage (struct encode_ctx_s *ctx)
+{
+  if (ctx->staged && es_write (ctx->fp, ctx->stage, ctx->staged, NULL))
+    ctx->error = 1;
+  ctx->staged = 0;
+}
+
+
+static void
+put_data (struct encode_ctx_s *ctx, const void *data, size_t len)
+{
+  if (ctx->fp)
+    {
+      if (ctx->staged + len > sizeof ctx->stage)
+        {
+          flush_stage (ctx);
+          if (len > sizeof ctx->stage)
+            {
+              if (es_write (ctx->fp, data, len, NULL))
+                ctx->error = 1;
+              len = 0;
+            }
+        }
+      memcpy (ctx->stage + ctx->staged, data, len);
+      ctx->staged += len;
+    }
+  else if (ctx->buffer)
+    memcpy (ctx->buffer + ctx->length, data, len);
+  ctx->length += len;
+}
+
+
+/* Put STRING using the form encoding.  This is the same as
+   http_escape_string with a NULL for SPECIALS but runs of plain
+   characters are put at once.  */
+static void
+encode_string (struct encode_ctx_s *ctx, const char *string)
+{
+  static const char hexdigits[16] = "0123456789ABCDEF";
+  const unsigned char *s = (const unsigned char *)string;
+  const unsigned char *run;
+  char tmp[3];
+
+  while (*s)
+    {
+      for (run = s; form_chars[*s] == FORM_PLAIN; s++)
+        ;
+      if (s != run)
+        put_data (ctx, run, s - run);
+      if (!*s)
+        break;
+
+      switch (form_chars[*s])
+        {
+        case FORM_SPACE:
+          put_data (ctx, "+", 1);
+          break;
+        case FORM_CR:
+          if (s[1] != '\n')
+            goto escape;
+          s++;
+          /*FALLTHRU*/
+        case FORM_LF:
+          put_data (ctx, "%0D%0A", 6);
+          break;
+        default:
+        escape:
+          tmp[0] = '%';
+          tmp[1] = hexdigits[*s >> 4];
+          tmp[2] = hexdigits[*s & 15];
+          put_data (ctx, tmp, 3);
+          break;
+        }
+      s++;
+    }
+}
+
+
+static void
+encode_form (struct encode_ctx_s *ctx, keyvalue_t form)
+{
+  keyvalue_t kv;
+
   for (kv = form; kv; kv = kv->next)
     {
       if (kv != form)
-        put_membuf_str (&mb, "&");
+        put_data (ctx, "&", 1);
       if (!kv->value)
         continue;  /* Deleted item.  */
-      escaped = http_escape_string (kv->name, NULL/*form-encoding*/);
-      if (!escaped)
-        {
-          err = gpg_error_from_syserror ();
-          xfree (get_membuf (&mb, NULL));
-          return err;
-        }
-      put_membuf_str (&mb, escaped);
-      xfree (escaped);
-      put_membuf_str (&mb, "=");
-      escaped = http_escape_string (kv->value, NULL/*form-encoding*/);
-      if (!escaped)
+      encode_string (ctx, kv->name);
+      put_data (ctx, "=", 1);
+      encode_string (ctx, kv->value);
+    }
+}
+
+
+/* Encode the data in FORM for use with POST.  */
+gpg_error_t
+encode_formdata (keyvalue_t form, char **r_encoded)
+{
+  struct encode_ctx_s ctx = { NULL };
+
+  *r_encoded = NULL;
+
+  encode_form (&ctx, form);
+  ctx.buffer = xtrymalloc (ctx.length + 1);
+  if (!ctx.buffer)
+    return gpg_error_from_syserror ();
+  ctx.length = 0;
+  encode_form (&ctx, form);
+  ctx.buffer[ctx.length] = 0;
+  *r_encoded = ctx.buffer;
+  return 0;
+}
+
+
+/* Return the length of FORM encoded for use with POST.  */
+size_t
+form_encoded_length (keyvalue_t form)
+{
+  struct encode_ctx_s ctx = { NULL };
+
+  encode_form (&ctx, form);
+  return ctx.length;
+}
+
+
+/* Encode the data in FORM for use with POST and write it to FP.  The
+   number of bytes written is the value returned by
+   form_encoded_length.  */
+gpg_error_t
+write_formdata (keyvalue_t form, estream_t fp)
+{
+  struct encode_ctx_s ctx = { NULL };
+
+  ctx.fp = fp;
+  encode_form (&ctx, form);
+  flush_stage (&ctx);
+  return ctx.error? gpg_error_from_syserror () : 0;
+}
+
+
+
+/* Return true if the two characters at S are available for a %XX
+   escape sequence in a field of the form.  INVALUE is true if we are
+   in the value part where an equal sign is an ordinary character.  */
+static int
+escape_available (const char *s, int invalue)
+{
+  return (s[0] && s[0] != '&' && (invalue || s[0] != '=')
+          && s[1] && s[1] != '&' && (invalue || s[1] != '='));
+}
+
+
+/* Parse the www-form-urlencoded data in BUFFER in place.  A pointer
+ * to the name and the value of each field is stored in the array
+ * FIELDS which has space for MAXFIELDS entries; the number of fields
+ * is stored at R_NFIELDS.  The pointers point into BUFFER which is
+ * modified.  The parsing follows parse_www_form_urlencoded; however,
+ * nothing is allocated and fields with the same name are all
+ * returned.  Returns GPG_ERR_TOO_LARGE if there are more than
+ * MAXFIELDS fields and GPG_ERR_INV_VALUE for an empty name or an
+ * escaped Nul.  */
+gpg_error_t
+form_parse (char *buffer, form_field_t fields,
+            unsigned int maxfields, unsigned int *r_nfields)
+{
+  const char *s = buffer;
+  char *d = buffer;
+  char *name, *value;
+  unsigned int nfields = 0;
+  int more;
+
+  *r_nfields = 0;
+
+  for (;;)
+    {
+      if (nfields == maxfields)
+        return gpg_error (GPG_ERR_TOO_LARGE);
+
+      /* D never advances past S, thus we can unescape in place.  */
+      name = d;
+      value = NULL;
+      for (; *s && *s != '&'; s++)
         {
-          err = gpg_error_from_syserror ();
-          xfree (get_membuf (&mb, NULL));
-          return err;
+          if (*s == '=' && !value)
+            {
+              *d++ = 0;
+              value = d;
+            }
+          else if (*s == '+')
+            *d++ = ' ';
+          else if (*s == '%' && escape_available (s+1, !!value))
+            {
+              *d = xtoi_2 (s+1);
+              if (!*d)
+                return gpg_error (GPG_ERR_INV_VALUE); /* Nul.  */
+              d++;
+              s += 2;
+            }
+          else
+            *d++ = *s;
         }
-      put_membuf_str (&mb, escaped);
-      xfree (escaped);
+      more = (*s == '&');
+      *d++ = 0;  /* This may overwrite the ampersand at S.  */
+      if (!*name)
+        return gpg_error (GPG_ERR_INV_VALUE); /* Empty name.  */
+
+      fields[nfields].name = name;
+      fields[nfields].value = value? value : d - 1;
+      nfields++;
+
+      if (!more)
+        break;
+      s++;
     }
 
-  put_membuf (&mb, "", 1);
-  *r_encoded = get_membuf (&mb, NULL);
-  if (!*r_encoded)
-    return gpg_error_from_syserror ();
+  *r_nfields = nfields;
   return 0;
 }
+
+
+/* Return the value of the field NAME from the NFIELDS FIELDS as
+   returned by form_parse or NULL if there is no such field.  If the
+   name is used several times the last value is returned.  */
+const char *
+form_get (form_field_t fields, unsigned int nfields, const char *name)
+{
+  while (nfields--)
+    if (!strcmp (fields[nfields].name, name))
+      return fields[nfields].value;
+  return NULL;
+}
+
+
+/* Same as form_get but returns an empty string instead of NULL.  */
+const char *
+form_get_string (form_field_t fields, unsigned int nfields, const char *name)
+{
+  const char *s = form_get (fields, nfields, name);
+  return s? s : "";
+}
@@ -20,6 +20,24 @@
 #ifndef FORM_H
 #define FORM_H
 
+/* A field of a form decoded by form_parse.  NAME and VALUE point
+   into the buffer given to form_parse.  */
+struct form_field_s
+{
+  const char *name;
+  const char *value;
+};
+typedef struct form_field_s *form_field_t;
+
 gpg_error_t encode_formdata (keyvalue_t form, char **r_encoded);
+size_t form_encoded_length (keyvalue_t form);
+gpg_error_t write_formdata (keyvalue_t form, estream_t fp);
+
+gpg_error_t form_parse (char *buffer, form_field_t fields,
+                        unsigned int maxfields, unsigned int *r_nfields);
+const char *form_get (form_field_t fields, unsigned int nfields,
+                      const char *name);
+const char *form_get_string (form_field_t fields, unsigned int nfields,
+                             const char *name);
 
 #endif /*FORM_H*/
@@ -0,0 +1,116 @@
+/* future.c - Asynchronous function calls
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Calls to the payment service providers are blocking HTTP requests.
+ * To run independent requests concurrently a connection thread may
+ * start a function as a future, do other work, and then wait for the
+ * result of the future.  Because all I/O in payprocd is done with
+ * npth, a future is simply a joinable thread; its result is the
+ * return value of the function.  Each started future must be waited
+ * for exactly once.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <npth.h>
+
+#include "util.h"
+#include "logging.h"
+#include "future.h"
+
+
+struct future_s
+{
+  npth_t thread;
+  future_func_t func;
+  void *arg;
+  gpg_error_t err;  /* The return value of FUNC.  */
+};
+
+
+
+/* The thread running a future.  */
+static void *
+future_thread (void *arg)
+{
+  future_t future = arg;
+
+  future->err = future->func (future->arg);
+  return NULL;
+}
+
+
+/* Start FUNC with ARG in a new thread and store an object to wait
+   for the result at R_FUTURE.  */
+gpg_error_t
+future_start (future_t *r_future, future_func_t func, void *arg)
+{
+  future_t future;
+  npth_attr_t tattr;
+  int res;
+
+  *r_future = NULL;
+
+  future = xtrycalloc (1, sizeof *future);
+  if (!future)
+    return gpg_error_from_syserror ();
+  future->func = func;
+  future->arg = arg;
+
+  res = npth_attr_init (&tattr);
+  if (res)
+    {
+      xfree (future);
+      return gpg_error_from_errno (res);
+    }
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  res = npth_create (&future->thread, &tattr, future_thread, future);
+  npth_attr_destroy (&tattr);
+  if (res)
+    {
+      log_error ("error spawning future: %s\n", strerror (res));
+      xfree (future);
+      return gpg_error_from_errno (res);
+    }
+
+  *r_future = future;
+  return 0;
+}
+
+
+/* Wait for FUTURE to finish, release it and return the value
+   returned by its function.  */
+gpg_error_t
+future_wait (future_t future)
+{
+  gpg_error_t err;
+  int res;
+
+  if (!future)
+    return gpg_error (GPG_ERR_INV_VALUE);
+
+  res = npth_join (future->thread, NULL);
+  if (res)
+    log_fatal ("error joining future: %s\n", strerror (res));
+  err = future->err;
+  xfree (future);
+  return err;
+}
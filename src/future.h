@@ -0,0 +1,34 @@
+/* future.h - Definitions for asynchronous function calls
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FUTURE_H
+#define FUTURE_H
+
+/* The object representing a function running in its own thread.  */
+struct future_s;
+typedef struct future_s *future_t;
+
+/* The type of the function run by a future.  */
+typedef gpg_error_t (*future_func_t) (void *arg);
+
+gpg_error_t future_start (future_t *r_future, future_func_t func, void *arg);
+gpg_error_t future_wait (future_t future);
+
+
+#endif /*FUTURE_H*/
@@ -57,6 +57,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #ifdef HAVE_W32_SYSTEM
 # ifdef HAVE_WINSOCK2_H
@@ -68,6 +69,7 @@
 # include <sys/socket.h>
 # include <sys/time.h>
 # include <time.h>
+# include <poll.h>
 # include <netinet/in.h>
 # include <arpa/inet.h>
 # include <netdb.h>
@@ -175,7 +177,7 @@ static gpg_error_t parse_response (http_t hd);
 
 static int connect_server (const char *server, unsigned short port,
                            unsigned int flags, const char *srvtag,
-                           int *r_host_not_found);
+                           unsigned int timeout, int *r_host_not_found);
 static gpg_error_t write_server (int sock, const char *data, size_t length);
 
 static ssize_t cookie_read (void *cookie, void *buffer, size_t size);
@@ -224,8 +226,9 @@ struct http_session_s
 {
   int refcount;    /* Number of references to this object.  */
 #ifdef HTTP_USE_GNUTLS
-  gnutls_certificate_credentials_t certcred;
+  struct tls_cred_s *cred;  /* Reference to the shared credentials.  */
   gnutls_session_t tls_session;
+  int resumable;   /* The session may be stored for resumption.  */
   struct {
     int done;      /* Verifciation has been done.  */
     int rc;        /* GnuTLS verification return code.  */
@@ -236,6 +239,7 @@ struct http_session_s
   /* A callback function to log details of TLS certifciates.  */
   void (*cert_log_cb) (http_session_t, gpg_error_t, const char *,
                        const void **, size_t *);
+  unsigned int timeout;  /* I/O timeout in milliseconds or 0.  */
 };
 
 
@@ -276,6 +280,34 @@ static gpg_error_t (*tls_callback) (http_t, http_session_t, int);
 /* The list of files with trusted CA certificates.  */
 static strlist_t tls_ca_certlist;
 
+#ifdef HTTP_USE_GNUTLS
+/* The certificate credentials are shared by all sessions.  A new
+   object is created by http_reload_tls_ca; the old one is released
+   when the last session using it has been released.  */
+struct tls_cred_s
+{
+  int refcount;
+  gnutls_certificate_credentials_t certcred;
+};
+static struct tls_cred_s *tls_cred;
+
+/* A cache with TLS session data to resume sessions with hosts we
+   already talked to.  The data is used only once because a TLS 1.3
+   server sends a new ticket with each connection.  */
+#define TLS_TICKET_CACHE_SIZE 8
+#define TLS_TICKET_MAX_AGE 3600
+static struct
+{
+  char *host;          /* Malloced host name or NULL if not used.  */
+  gnutls_datum_t data; /* Session data from gnutls.  */
+  time_t stored;       /* Time the data was stored.  */
+} tls_tickets[TLS_TICKET_CACHE_SIZE];
+
+#ifdef USE_NPTH
+static npth_mutex_t tls_cache_lock = NPTH_MUTEX_INITIALIZER;
+#endif
+#endif /*HTTP_USE_GNUTLS*/
+
 
 
 #if defined(HAVE_W32_SYSTEM) && !defined(HTTP_NO_WSASTARTUP)
@@ -392,13 +424,25 @@ static ssize_t
 my_npth_read (gnutls_transport_ptr_t ptr, void *buffer, size_t size)
 {
   my_socket_t sock = ptr;
-  return npth_read (sock->fd, buffer, size);
+  ssize_t n;
+
+  /* A timeout set with SO_RCVTIMEO is indicated by EAGAIN; we map it
+     to ETIMEDOUT so that gnutls does not retry.  */
+  n = npth_read (sock->fd, buffer, size);
+  if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    gpg_err_set_errno (ETIMEDOUT);
+  return n;
 }
 static ssize_t
 my_npth_write (gnutls_transport_ptr_t ptr, const void *buffer, size_t size)
 {
   my_socket_t sock = ptr;
-  return npth_write (sock->fd, buffer, size);
+  ssize_t n;
+
+  n = npth_write (sock->fd, buffer, size);
+  if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    gpg_err_set_errno (ETIMEDOUT);
+  return n;
 }
 #endif /*USE_NPTH && HTTP_USE_GNUTLS*/
 
@@ -528,6 +572,207 @@ http_register_tls_ca (const char *fname)
 }
 
 
+
+#ifdef HTTP_USE_GNUTLS
+static void
+lock_tls_cache (void)
+{
+#ifdef USE_NPTH
+  int res = npth_mutex_lock (&tls_cache_lock);
+  if (res)
+    log_fatal ("failed to acquire tls cache lock: %s\n", strerror (res));
+#endif
+}
+
+static void
+unlock_tls_cache (void)
+{
+#ifdef USE_NPTH
+  int res = npth_mutex_unlock (&tls_cache_lock);
+  if (res)
+    log_fatal ("failed to release tls cache lock: %s\n", strerror (res));
+#endif
+}
+
+
+/* Create a new credentials object with the registered CA
+   certificates.  Returns NULL on error.  */
+static struct tls_cred_s *
+new_tls_cred (void)
+{
+  struct tls_cred_s *cred;
+  strlist_t sl;
+  int rc;
+
+  cred = xtrycalloc (1, sizeof *cred);
+  if (!cred)
+    return NULL;
+  cred->refcount = 1;
+
+  rc = gnutls_certificate_allocate_credentials (&cred->certcred);
+  if (rc < 0)
+    {
+      log_error ("gnutls_certificate_allocate_credentials failed: %s\n",
+                 gnutls_strerror (rc));
+      xfree (cred);
+      return NULL;
+    }
+
+  for (sl = tls_ca_certlist; sl; sl = sl->next)
+    {
+      rc = gnutls_certificate_set_x509_trust_file
+        (cred->certcred, sl->d,
+         (sl->flags & 1)? GNUTLS_X509_FMT_PEM : GNUTLS_X509_FMT_DER);
+      if (rc < 0)
+        log_info ("setting CA from file '%s' failed: %s\n",
+                  sl->d, gnutls_strerror (rc));
+    }
+
+  return cred;
+}
+
+
+/* Drop a reference to CRED.  Must be called with the lock held.  */
+static void
+unref_tls_cred (struct tls_cred_s *cred)
+{
+  if (!cred || --cred->refcount)
+    return;
+  gnutls_certificate_free_credentials (cred->certcred);
+  xfree (cred);
+}
+
+
+/* Return a reference to the shared credentials or NULL on error.  */
+static struct tls_cred_s *
+get_tls_cred (void)
+{
+  struct tls_cred_s *cred;
+
+  lock_tls_cache ();
+  if (!tls_cred)
+    tls_cred = new_tls_cred ();
+  cred = tls_cred;
+  if (cred)
+    cred->refcount++;
+  unlock_tls_cache ();
+  return cred;
+}
+
+
+static void
+release_tls_cred (struct tls_cred_s *cred)
+{
+  lock_tls_cache ();
+  unref_tls_cred (cred);
+  unlock_tls_cache ();
+}
+#endif /*HTTP_USE_GNUTLS*/
+
+
+/* Reload the CA certificates registered with http_register_tls_ca.
+   New sessions use the new certificates; existing sessions keep
+   using the old ones.  The session resumption cache is flushed.  */
+gpg_error_t
+http_reload_tls_ca (void)
+{
+#ifdef HTTP_USE_GNUTLS
+  struct tls_cred_s *cred;
+  int i;
+
+  cred = new_tls_cred ();
+  if (!cred)
+    return gpg_error (GPG_ERR_GENERAL);
+
+  lock_tls_cache ();
+  unref_tls_cred (tls_cred);
+  tls_cred = cred;
+  for (i=0; i < TLS_TICKET_CACHE_SIZE; i++)
+    {
+      xfree (tls_tickets[i].host);
+      tls_tickets[i].host = NULL;
+      gnutls_free (tls_tickets[i].data.data);
+      tls_tickets[i].data.data = NULL;
+    }
+  unlock_tls_cache ();
+#endif /*HTTP_USE_GNUTLS*/
+  return 0;
+}
+
+
+#ifdef HTTP_USE_GNUTLS
+/* Store the data of SESS for resumption of later sessions with
+   HOST.  */
+static void
+store_tls_ticket (const char *host, gnutls_session_t session)
+{
+  gnutls_datum_t data;
+  int i, slot;
+  int rc;
+
+  rc = gnutls_session_get_data2 (session, &data);
+  if (rc < 0)
+    return;
+
+  lock_tls_cache ();
+  slot = 0;
+  for (i=0; i < TLS_TICKET_CACHE_SIZE; i++)
+    {
+      if (tls_tickets[i].host && !strcmp (tls_tickets[i].host, host))
+        {
+          slot = i;
+          break;
+        }
+      if (!tls_tickets[i].host
+          || tls_tickets[i].stored < tls_tickets[slot].stored)
+        slot = i;
+    }
+  if (!tls_tickets[slot].host || strcmp (tls_tickets[slot].host, host))
+    {
+      xfree (tls_tickets[slot].host);
+      tls_tickets[slot].host = xtrystrdup (host);
+    }
+  gnutls_free (tls_tickets[slot].data.data);
+  tls_tickets[slot].data = data;
+  tls_tickets[slot].stored = time (NULL);
+  if (!tls_tickets[slot].host)
+    {
+      gnutls_free (tls_tickets[slot].data.data);
+      tls_tickets[slot].data.data = NULL;
+    }
+  unlock_tls_cache ();
+}
+
+
+/* Prepare SESSION to resume an earlier session with HOST.  */
+static void
+load_tls_ticket (const char *host, gnutls_session_t session)
+{
+  int i, rc;
+
+  lock_tls_cache ();
+  for (i=0; i < TLS_TICKET_CACHE_SIZE; i++)
+    if (tls_tickets[i].host && !strcmp (tls_tickets[i].host, host))
+      {
+        if (tls_tickets[i].stored + TLS_TICKET_MAX_AGE > time (NULL))
+          {
+            rc = gnutls_session_set_data (session, tls_tickets[i].data.data,
+                                          tls_tickets[i].data.size);
+            if (rc < 0)
+              log_info ("gnutls_session_set_data failed: %s\n",
+                        gnutls_strerror (rc));
+          }
+        xfree (tls_tickets[i].host);
+        tls_tickets[i].host = NULL;
+        gnutls_free (tls_tickets[i].data.data);
+        tls_tickets[i].data.data = NULL;
+        break;
+      }
+  unlock_tls_cache ();
+}
+#endif /*HTTP_USE_GNUTLS*/
+
+
 /* Release a session.  Take care not to release it while it is being
    used by a http context object.  */
 static void
@@ -547,11 +792,13 @@ session_unref (int lnr, http_session_t sess)
   if (sess->tls_session)
     {
       my_socket_t sock = gnutls_transport_get_ptr (sess->tls_session);
+      if (sess->resumable && sess->servername)
+        store_tls_ticket (sess->servername, sess->tls_session);
       my_socket_unref (sock, NULL, NULL);
       gnutls_deinit (sess->tls_session);
     }
-  if (sess->certcred)
-    gnutls_certificate_free_credentials (sess->certcred);
+  if (sess->cred)
+    release_tls_cred (sess->cred);
   xfree (sess->servername);
 #endif /*HTTP_USE_GNUTLS*/
 
@@ -585,27 +832,14 @@ http_session_new (http_session_t *r_session, const char *tls_priority)
   {
     const char *errpos;
     int rc;
-    strlist_t sl;
 
-    rc = gnutls_certificate_allocate_credentials (&sess->certcred);
-    if (rc < 0)
+    sess->cred = get_tls_cred ();
+    if (!sess->cred)
       {
-        log_error ("gnutls_certificate_allocate_credentials failed: %s\n",
-                   gnutls_strerror (rc));
         err = gpg_error (GPG_ERR_GENERAL);
         goto leave;
       }
 
-    for (sl = tls_ca_certlist; sl; sl = sl->next)
-      {
-        rc = gnutls_certificate_set_x509_trust_file
-          (sess->certcred, sl->d,
-           (sl->flags & 1)? GNUTLS_X509_FMT_PEM : GNUTLS_X509_FMT_DER);
-        if (rc < 0)
-          log_info ("setting CA from file '%s' failed: %s\n",
-                    sl->d, gnutls_strerror (rc));
-      }
-
     rc = gnutls_init (&sess->tls_session, GNUTLS_CLIENT);
     if (rc < 0)
       {
@@ -629,7 +863,8 @@ http_session_new (http_session_t *r_session, const char *tls_priority)
       }
 
     rc = gnutls_credentials_set (sess->tls_session,
-                                 GNUTLS_CRD_CERTIFICATE, sess->certcred);
+                                 GNUTLS_CRD_CERTIFICATE,
+                                 sess->cred->certcred);
     if (rc < 0)
       {
         log_error ("gnutls_credentials_set failed: %s\n", gnutls_strerror (rc));
@@ -677,6 +912,16 @@ http_session_set_log_cb (http_session_t sess,
 }
 
 
+/* Set a timeout of TIMEOUT milliseconds for connections made with
+   SESS.  The timeout applies to the connect and to each read and
+   write on the connection; 0 uses the system defaults.  */
+void
+http_session_set_timeout (http_session_t sess, unsigned int timeout)
+{
+  sess->timeout = timeout;
+}
+
+
 
 
 /* Start a HTTP retrieval and on success store at R_HD a context
@@ -696,7 +941,8 @@ http_open (http_t *r_hd, http_req_t reqtype, const char *url,
 
   if (!(reqtype == HTTP_REQ_GET
         || reqtype == HTTP_REQ_POST
-        || reqtype == HTTP_REQ_PATCH))
+        || reqtype == HTTP_REQ_PATCH
+        || reqtype == HTTP_REQ_DELETE))
     return gpg_err_make (default_errsource, GPG_ERR_INV_ARG);
 
   /* Create the handle. */
@@ -750,7 +996,7 @@ http_raw_connect (http_t *r_hd, const char *server, unsigned short port,
   hd->flags = flags;
 
   /* Connect.  */
-  sock = connect_server (server, port, hd->flags, srvtag, &hnf);
+  sock = connect_server (server, port, hd->flags, srvtag, 0, &hnf);
   if (sock == -1)
     {
       err = gpg_err_make (default_errsource,
@@ -977,15 +1223,23 @@ http_get_status_code (http_t hd)
      (NULL) := Only check whether TLS is is use.  Returns an
                unspecified string if TLS is in use.  That string may
                even be the empty string.
+     "resumed" := Returns an unspecified string if the TLS session
+                  has been resumed.
  */
 const char *
 http_get_tls_info (http_t hd, const char *what)
 {
-  (void)what;
-
   if (!hd)
     return NULL;
 
+#ifdef HTTP_USE_GNUTLS
+  if (what && !strcmp (what, "resumed"))
+    return (hd->uri->use_tls && hd->session && hd->session->tls_session
+            && gnutls_session_is_resumed (hd->session->tls_session))? "":NULL;
+#else
+  (void)what;
+#endif
+
   return hd->uri->use_tls? "":NULL;
 }
 
@@ -1266,13 +1520,19 @@ escape_data (char *buffer, const void *data, size_t datalen,
       else if (forms && *s == '\n')
         {
 	  if (buffer)
-	    memcpy (buffer, "%0D%0A", 6);
+            {
+              memcpy (buffer, "%0D%0A", 6);
+              buffer += 6;
+            }
 	  n += 6;
         }
       else if (forms && *s == '\r' && datalen > 1 && s[1] == '\n')
         {
 	  if (buffer)
-	    memcpy (buffer, "%0D%0A", 6);
+            {
+              memcpy (buffer, "%0D%0A", 6);
+              buffer += 6;
+            }
 	  n += 6;
           s++;
           datalen--;
@@ -1405,6 +1665,7 @@ send_request (http_t hd, const char *httphost, const char *auth,
   char *authstr = NULL;
   int sock;
   int hnf;
+  unsigned int timeout = hd->session? hd->session->timeout : 0;
 
   if (hd->uri->use_tls && !hd->session)
     {
@@ -1441,6 +1702,7 @@ send_request (http_t hd, const char *httphost, const char *auth,
                                    server, strlen (server));
       if (rc < 0)
         log_info ("gnutls_server_name_set failed: %s\n", gnutls_strerror (rc));
+      load_tls_ticket (hd->session->servername, hd->session->tls_session);
     }
 #endif /*HTTP_USE_GNUTLS*/
 
@@ -1482,7 +1744,7 @@ send_request (http_t hd, const char *httphost, const char *auth,
 
       sock = connect_server (*uri->host ? uri->host : "localhost",
                              uri->port ? uri->port : 80,
-                             hd->flags, srvtag, &hnf);
+                             hd->flags, srvtag, timeout, &hnf);
       save_errno = errno;
       http_release_parsed_uri (uri);
       if (sock == -1)
@@ -1490,7 +1752,7 @@ send_request (http_t hd, const char *httphost, const char *auth,
     }
   else
     {
-      sock = connect_server (server, port, hd->flags, srvtag, &hnf);
+      sock = connect_server (server, port, hd->flags, srvtag, timeout, &hnf);
     }
 
   if (sock == -1)
@@ -1500,6 +1762,16 @@ send_request (http_t hd, const char *httphost, const char *auth,
                            (hnf? GPG_ERR_UNKNOWN_HOST
                                : gpg_err_code_from_syserror ()));
     }
+  if (timeout)
+    {
+      struct timeval tv;
+
+      tv.tv_sec = timeout / 1000;
+      tv.tv_usec = (timeout % 1000) * 1000;
+      if (setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv)
+          || setsockopt (sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv))
+        log_info ("error setting socket timeout: %s\n", strerror (errno));
+    }
   hd->sock = my_socket_new (sock);
   if (!hd->sock)
     {
@@ -1566,6 +1838,7 @@ send_request (http_t hd, const char *httphost, const char *auth,
           xfree (proxy_authstr);
           return err;
         }
+      hd->session->resumable = 1;
     }
 #endif /*HTTP_USE_GNUTLS*/
 
@@ -1617,7 +1890,8 @@ send_request (http_t hd, const char *httphost, const char *auth,
          hd->req_type == HTTP_REQ_GET ? "GET" :
          hd->req_type == HTTP_REQ_HEAD ? "HEAD" :
          hd->req_type == HTTP_REQ_POST ? "POST" :
-         hd->req_type == HTTP_REQ_PATCH ? "PATCH" : "OOPS",
+         hd->req_type == HTTP_REQ_PATCH ? "PATCH" :
+         hd->req_type == HTTP_REQ_DELETE ? "DELETE" : "OOPS",
          hd->uri->use_tls? "https" : "http",
          httphost? httphost : server,
          port, *p == '/' ? "" : "/", p,
@@ -1638,7 +1912,8 @@ send_request (http_t hd, const char *httphost, const char *auth,
          hd->req_type == HTTP_REQ_GET ? "GET" :
          hd->req_type == HTTP_REQ_HEAD ? "HEAD" :
          hd->req_type == HTTP_REQ_POST ? "POST" :
-         hd->req_type == HTTP_REQ_PATCH ? "PATCH" : "OOPS",
+         hd->req_type == HTTP_REQ_PATCH ? "PATCH" :
+         hd->req_type == HTTP_REQ_DELETE ? "DELETE" : "OOPS",
          *p == '/' ? "" : "/", p,
          httphost? httphost : server,
          portstr,
@@ -2087,11 +2362,431 @@ start_server ()
 }
 #endif
 
+#ifdef HAVE_GETADDRINFO
+/* A small resolver cache shared by all threads.  getaddrinfo does
+   not tell us the TTL of the records, thus entries are used for at
+   most DNS_CACHE_TTL seconds.  Names which do not exist are cached
+   for DNS_NEGATIVE_TTL seconds.  If a refresh fails temporarily the
+   previous addresses are used for another DNS_NEGATIVE_TTL seconds;
+   other failures are not cached.  Addresses which could not be connected
+   are put at the end of the list for ADDR_BAD_TTL seconds.  */
+#define DNS_CACHE_SIZE     16
+#define DNS_CACHE_MAXADDR   8
+#define DNS_CACHE_TTL     300
+#define DNS_NEGATIVE_TTL   30
+#define ADDR_BAD_TTL       60
+
+/* Delay in milliseconds before a connection attempt to the next
+   address is started while the previous one is still pending.  */
+#define CONNECT_ATTEMPT_DELAY 250
+
+/* Maximum time in seconds to wait for a connection.  */
+#define CONNECT_TIMEOUT 30
+
+struct dns_addr_s
+{
+  int family;
+  socklen_t addrlen;
+  struct sockaddr_storage addr;
+  time_t bad_until;  /* Address is considered bad until this time.  */
+};
+
+struct dns_cache_s
+{
+  char *name;          /* Malloced host name or NULL if not used.  */
+  unsigned short port;
+  time_t expires;
+  int naddrs;          /* 0 for a negative entry.  */
+  struct dns_addr_s addrs[DNS_CACHE_MAXADDR];
+};
+
+static struct dns_cache_s dns_cache[DNS_CACHE_SIZE];
+
+/* Counters for the lookups done and for those served from the
+   cache.  */
+static unsigned long dns_stats_lookups;
+static unsigned long dns_stats_hits;
+
+#ifdef USE_NPTH
+static npth_mutex_t dns_cache_lock = NPTH_MUTEX_INITIALIZER;
+#endif
+
+
+static void
+lock_dns_cache (void)
+{
+#ifdef USE_NPTH
+  int res = npth_mutex_lock (&dns_cache_lock);
+  if (res)
+    log_fatal ("failed to acquire dns cache lock: %s\n", strerror (res));
+#endif
+}
+
+static void
+unlock_dns_cache (void)
+{
+#ifdef USE_NPTH
+  int res = npth_mutex_unlock (&dns_cache_lock);
+  if (res)
+    log_fatal ("failed to release dns cache lock: %s\n", strerror (res));
+#endif
+}
+
+
+/* Return the number of DNS lookups done and the number of lookups
+   served from the cache.  */
+void
+http_get_dns_stats (unsigned long *r_lookups, unsigned long *r_hits)
+{
+  lock_dns_cache ();
+  if (r_lookups)
+    *r_lookups = dns_stats_lookups;
+  if (r_hits)
+    *r_hits = dns_stats_hits;
+  unlock_dns_cache ();
+}
+
+
+/* Return the cache entry for (NAME,PORT) or NULL.  Must be called
+   with the lock held.  */
+static struct dns_cache_s *
+find_dns_entry (const char *name, unsigned short port)
+{
+  int i;
+
+  for (i=0; i < DNS_CACHE_SIZE; i++)
+    if (dns_cache[i].name && dns_cache[i].port == port
+        && !strcmp (dns_cache[i].name, name))
+      return dns_cache + i;
+  return NULL;
+}
+
+
+/* Copy the usable addresses of ENTRY to ADDRS which must have space
+   for DNS_CACHE_MAXADDR items.  The addresses are ordered with
+   alternating address families as recommended by RFC-8305; bad
+   addresses come last.  Returns the number of addresses.  Must be
+   called with the lock held.  */
+static int
+copy_dns_entry (struct dns_cache_s *entry, unsigned int flags,
+                struct dns_addr_s *addrs, time_t now)
+{
+  int n = 0;
+  int i, pass, family, lastfamily;
+  char used[DNS_CACHE_MAXADDR];
+
+  memset (used, 0, sizeof used);
+  for (i=0; i < entry->naddrs; i++)
+    if ((entry->addrs[i].family == AF_INET
+         && (flags & HTTP_FLAG_IGNORE_IPv4))
+        || (entry->addrs[i].family == AF_INET6
+            && (flags & HTTP_FLAG_IGNORE_IPv6)))
+      used[i] = 1;
+
+  /* Pass 0 takes the good addresses and pass 1 the bad ones.  */
+  for (pass=0; pass < 2; pass++)
+    {
+      lastfamily = -1;
+      for (;;)
+        {
+          family = -1;
+          for (i=0; i < entry->naddrs; i++)
+            {
+              if (used[i])
+                continue;
+              if (!pass && entry->addrs[i].bad_until > now)
+                continue;
+              if (family == -1)
+                family = i;
+              if (entry->addrs[i].family != lastfamily)
+                {
+                  family = i;
+                  break;
+                }
+            }
+          if (family == -1)
+            break;
+          used[family] = 1;
+          addrs[n++] = entry->addrs[family];
+          lastfamily = entry->addrs[family].family;
+        }
+    }
+
+  return n;
+}
+
+
+/* Resolve NAME and store up to DNS_CACHE_MAXADDR addresses at ADDRS.
+   Returns the number of addresses; 0 if the host was not found.  */
+static int
+resolve_cached (const char *name, unsigned short port, unsigned int flags,
+                struct dns_addr_s *addrs)
+{
+  struct dns_cache_s *entry;
+  struct addrinfo hints, *res, *ai;
+  char portstr[35];
+  time_t now = time (NULL);
+  int i, n, rc, saved_errno;
+
+  lock_dns_cache ();
+  dns_stats_lookups++;
+  entry = find_dns_entry (name, port);
+  if (entry && entry->expires > now)
+    {
+      dns_stats_hits++;
+      n = copy_dns_entry (entry, flags, addrs, now);
+      unlock_dns_cache ();
+      return n;
+    }
+  unlock_dns_cache ();
+
+  snprintf (portstr, sizeof portstr, "%hu", port);
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_socktype = SOCK_STREAM;
+#ifdef USE_NPTH
+  npth_unprotect ();
+#endif
+  rc = getaddrinfo (name, portstr, &hints, &res);
+  saved_errno = errno;
+#ifdef USE_NPTH
+  npth_protect ();
+#endif
+
+  lock_dns_cache ();
+  entry = find_dns_entry (name, port);
+  if (rc && rc != EAI_NONAME
+#ifdef EAI_NODATA
+      && rc != EAI_NODATA
+#endif
+      )
+    {
+      /* A temporary or local failure.  Keep on using the previous
+         addresses for a while but do not cache the failure.  */
+      n = 0;
+      if (entry && entry->naddrs)
+        {
+          entry->expires = now + DNS_NEGATIVE_TTL;
+          n = copy_dns_entry (entry, flags, addrs, now);
+        }
+      unlock_dns_cache ();
+      log_info ("resolving '%s' failed: %s%s\n", name,
+                rc == EAI_SYSTEM? strerror (saved_errno) : gai_strerror (rc),
+                n? " - using cached addresses" : "");
+      return n;
+    }
+  if (!entry)
+    {
+      /* Take an unused slot or the one which expires first.  */
+      entry = dns_cache;
+      for (i=0; i < DNS_CACHE_SIZE; i++)
+        {
+          if (!dns_cache[i].name)
+            {
+              entry = dns_cache + i;
+              break;
+            }
+          if (dns_cache[i].expires < entry->expires)
+            entry = dns_cache + i;
+        }
+      xfree (entry->name);
+      entry->name = xtrystrdup (name);
+      entry->port = port;
+    }
+  entry->naddrs = 0;
+  if (!rc)
+    {
+      for (ai = res; ai && entry->naddrs < DNS_CACHE_MAXADDR; ai = ai->ai_next)
+        {
+          if ((ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+              || ai->ai_addrlen > sizeof entry->addrs[0].addr)
+            continue;
+          entry->addrs[entry->naddrs].family = ai->ai_family;
+          entry->addrs[entry->naddrs].addrlen = ai->ai_addrlen;
+          memcpy (&entry->addrs[entry->naddrs].addr, ai->ai_addr,
+                  ai->ai_addrlen);
+          entry->addrs[entry->naddrs].bad_until = 0;
+          entry->naddrs++;
+        }
+      freeaddrinfo (res);
+    }
+  entry->expires = now + (entry->naddrs? DNS_CACHE_TTL : DNS_NEGATIVE_TTL);
+  n = copy_dns_entry (entry, flags, addrs, now);
+  if (!entry->name)  /* Out of core - do not cache.  */
+    entry->expires = 0;
+  unlock_dns_cache ();
+  return n;
+}
+
+
+/* Mark ADDR of (NAME,PORT) as bad or, if BAD is false, as good.  */
+static void
+mark_dns_addr (const char *name, unsigned short port,
+               const struct dns_addr_s *addr, int bad)
+{
+  struct dns_cache_s *entry;
+  int i;
+
+  lock_dns_cache ();
+  entry = find_dns_entry (name, port);
+  for (i=0; entry && i < entry->naddrs; i++)
+    if (entry->addrs[i].addrlen == addr->addrlen
+        && !memcmp (&entry->addrs[i].addr, &addr->addr, addr->addrlen))
+      {
+        entry->addrs[i].bad_until = bad? time (NULL) + ADDR_BAD_TTL : 0;
+        break;
+      }
+  unlock_dns_cache ();
+}
+
+
+/* Connect to one of the NADDRS addresses at ADDRS.  A connection
+   attempt to the next address is started if the previous one did not
+   succeed within CONNECT_ATTEMPT_DELAY milliseconds; the first
+   established connection is used (RFC-8305 "Happy Eyeballs").  If
+   TIMEOUT is not 0 it gives the maximum time in milliseconds to wait
+   for a connection.  Returns the socket or -1 with ERRNO set.  NAME
+   and PORT are used to mark failed addresses.  */
+static int
+connect_addresses (const char *name, unsigned short port,
+                   struct dns_addr_s *addrs, int naddrs, unsigned int timeout)
+{
+  int socks[DNS_CACHE_MAXADDR];
+  struct pollfd pfds[DNS_CACHE_MAXADDR];
+  int pidx[DNS_CACHE_MAXADDR];  /* Maps PFDS to SOCKS.  */
+  int npending = 0;
+  int next = 0;
+  int sock = -1;
+  int last_errno = ECONNREFUSED;
+  int i, j, fl, err, nfds, rc, wait_ms;
+  socklen_t errlen;
+  time_t deadline;
+
+  if (!timeout || timeout > CONNECT_TIMEOUT * 1000)
+    timeout = CONNECT_TIMEOUT * 1000;
+  deadline = time (NULL) + (timeout + 999) / 1000;
+
+  for (i=0; i < naddrs; i++)
+    socks[i] = -1;
+
+  while (sock == -1 && (next < naddrs || npending))
+    {
+      /* Start the next attempt.  */
+      if (next < naddrs)
+        {
+          i = next++;
+          socks[i] = socket (addrs[i].family, SOCK_STREAM, 0);
+          if (socks[i] == -1)
+            {
+              last_errno = errno;
+              log_error ("error creating socket: %s\n", strerror (errno));
+              continue;
+            }
+          fl = fcntl (socks[i], F_GETFL);
+          if (fl == -1 || fcntl (socks[i], F_SETFL, fl | O_NONBLOCK) == -1
+              || (connect (socks[i], (struct sockaddr *)&addrs[i].addr,
+                           addrs[i].addrlen)
+                  && errno != EINPROGRESS))
+            {
+              last_errno = errno;
+              sock_close (socks[i]);
+              socks[i] = -1;
+              mark_dns_addr (name, port, addrs + i, 1);
+              continue;
+            }
+          npending++;
+        }
+
+      /* Wait for one of the pending attempts.  We use poll and not
+         select because the sockets may be beyond FD_SETSIZE.  */
+      nfds = 0;
+      for (i=0; i < next; i++)
+        if (socks[i] != -1)
+          {
+            pfds[nfds].fd = socks[i];
+            pfds[nfds].events = POLLOUT;
+            pfds[nfds].revents = 0;
+            pidx[nfds++] = i;
+          }
+      if (next < naddrs)
+        wait_ms = CONNECT_ATTEMPT_DELAY;
+      else
+        {
+          wait_ms = (deadline - time (NULL)) * 1000;
+          if (wait_ms < 0)
+            wait_ms = 0;
+        }
+#ifdef USE_NPTH
+      npth_unprotect ();
+#endif
+      rc = poll (pfds, nfds, wait_ms);
+      err = errno;
+#ifdef USE_NPTH
+      npth_protect ();
+#endif
+      if (rc < 0)
+        {
+          if (err == EINTR)
+            continue;
+          last_errno = err;
+          break;
+        }
+
+      for (j=0; j < nfds; j++)
+        {
+          if (!pfds[j].revents)
+            continue;
+          i = pidx[j];
+          errlen = sizeof err;
+          if (getsockopt (socks[i], SOL_SOCKET, SO_ERROR, &err, &errlen))
+            err = errno;
+          if (!err && sock == -1)
+            {
+              sock = socks[i];
+              socks[i] = -1;
+              mark_dns_addr (name, port, addrs + i, 0);
+            }
+          else if (err)
+            {
+              last_errno = err;
+              sock_close (socks[i]);
+              socks[i] = -1;
+              mark_dns_addr (name, port, addrs + i, 1);
+            }
+          npending--;
+        }
+
+      if (sock == -1 && next >= naddrs && npending && time (NULL) >= deadline)
+        {
+          last_errno = ETIMEDOUT;
+          break;
+        }
+    }
+
+  /* Close the losers.  */
+  for (i=0; i < next; i++)
+    if (socks[i] != -1)
+      sock_close (socks[i]);
+
+  if (sock == -1)
+    {
+      gpg_err_set_errno (last_errno);
+      return -1;
+    }
+
+  fl = fcntl (sock, F_GETFL);
+  if (fl != -1)
+    fcntl (sock, F_SETFL, fl & ~O_NONBLOCK);
+  return sock;
+}
+#endif /*HAVE_GETADDRINFO*/
+
+
 /* Actually connect to a server.  Returns the file descriptor or -1 on
    error.  ERRNO is set on error. */
 static int
 connect_server (const char *server, unsigned short port,
-                unsigned int flags, const char *srvtag, int *r_host_not_found)
+                unsigned int flags, const char *srvtag,
+                unsigned int timeout, int *r_host_not_found)
 {
   int sock = -1;
   int srvcount = 0;
@@ -2172,42 +2867,20 @@ connect_server (const char *server, unsigned short port,
   connected = 0;
   for (srv=0; srv < srvcount && !connected; srv++)
     {
-      struct addrinfo hints, *res, *ai;
-      char portstr[35];
+      struct dns_addr_s addrs[DNS_CACHE_MAXADDR];
+      int naddrs;
 
-      snprintf (portstr, sizeof portstr, "%hu", port);
-      memset (&hints, 0, sizeof (hints));
-      hints.ai_socktype = SOCK_STREAM;
-      if (getaddrinfo (serverlist[srv].target, portstr, &hints, &res))
+      naddrs = resolve_cached (serverlist[srv].target, port, flags, addrs);
+      if (!naddrs)
         continue; /* Not found - try next one. */
       hostfound = 1;
 
-      for (ai = res; ai && !connected; ai = ai->ai_next)
-        {
-          if (ai->ai_family == AF_INET && (flags & HTTP_FLAG_IGNORE_IPv4))
-            continue;
-          if (ai->ai_family == AF_INET6 && (flags & HTTP_FLAG_IGNORE_IPv6))
-            continue;
-
-          if (sock != -1)
-            sock_close (sock);
-          sock = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-          if (sock == -1)
-            {
-              int save_errno = errno;
-              log_error ("error creating socket: %s\n", strerror (errno));
-              freeaddrinfo (res);
-              xfree (serverlist);
-              errno = save_errno;
-              return -1;
-            }
-
-          if (my_connect (sock, ai->ai_addr, ai->ai_addrlen))
-            last_errno = errno;
-          else
-            connected = 1;
-        }
-      freeaddrinfo (res);
+      sock = connect_addresses (serverlist[srv].target, port,
+                                addrs, naddrs, timeout);
+      if (sock == -1)
+        last_errno = errno;
+      else
+        connected = 1;
     }
 #else /* !HAVE_GETADDRINFO */
   connected = 0;
@@ -2366,12 +3039,20 @@ cookie_read (void *cookie, void *buffer, size_t size)
             goto again;
           if (nread == GNUTLS_E_AGAIN)
             {
+#ifdef USE_NPTH
+              /* Our transport functions are blocking and map socket
+                 timeouts to ETIMEDOUT; thus EAGAIN only indicates
+                 that a post-handshake message (e.g. a TLS 1.3
+                 session ticket) has been processed.  */
+              goto again;
+#else
               struct timeval tv;
 
               tv.tv_sec = 0;
               tv.tv_usec = 50000;
               my_select (0, NULL, NULL, NULL, &tv);
               goto again;
+#endif
             }
           if (nread == GNUTLS_E_REHANDSHAKE)
             goto again; /* A client is allowed to just ignore this request. */
@@ -2481,12 +3162,16 @@ send_gnutls_bye (void *opaque)
   while (ret == GNUTLS_E_INTERRUPTED);
   if (ret == GNUTLS_E_AGAIN)
     {
+#ifdef USE_NPTH
+      goto again;  /* See cookie_read.  */
+#else
       struct timeval tv;
 
       tv.tv_sec = 0;
       tv.tv_usec = 50000;
       my_select (0, NULL, NULL, NULL, &tv);
       goto again;
+#endif
     }
 }
 #endif /*HTTP_USE_GNUTLS*/
@@ -68,7 +68,8 @@ typedef enum
     HTTP_REQ_HEAD = 2,
     HTTP_REQ_POST = 3,
     HTTP_REQ_PATCH = 4,
-    HTTP_REQ_OPAQUE = 5  /* Internal use.  */
+    HTTP_REQ_OPAQUE = 5, /* Internal use.  */
+    HTTP_REQ_DELETE = 6
   }
 http_req_t;
 
@@ -94,12 +95,15 @@ typedef struct http_context_s *http_t;
 
 void http_register_tls_callback (gpg_error_t (*cb)(http_t,http_session_t,int));
 void http_register_tls_ca (const char *fname);
+gpg_error_t http_reload_tls_ca (void);
+void http_get_dns_stats (unsigned long *r_lookups, unsigned long *r_hits);
 
 gpg_error_t http_session_new (http_session_t *r_session,
                               const char *tls_priority);
 http_session_t http_session_ref (http_session_t sess);
 void http_session_release (http_session_t sess);
 
+void http_session_set_timeout (http_session_t sess, unsigned int timeout);
 void http_session_set_log_cb (http_session_t sess,
                               void (*cb)(http_session_t, gpg_error_t,
                                          const char *,
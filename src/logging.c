@@ -60,6 +60,9 @@
 #define JNLIB_NEED_AFLOCAL 1
 #include "libjnlib-config.h"
 #include "logging.h"
+#ifndef WITHOUT_NPTH
+# include <npth.h>
+#endif
 
 #ifdef HAVE_W32_SYSTEM
 # define S_IRGRP S_IRUSR
@@ -635,65 +638,71 @@ log_get_stream ()
   return logstream;
 }
 
-static void
-do_logv (int level, int ignore_arg_ptr, const char *fmt, va_list arg_ptr)
+/* Return the time stamp used as line prefix.  The string is cached
+   and only rebuilt once per second; the caller must hold the lock of
+   the log stream or, in async mode, the queue lock.  */
+static const char *
+get_time_string (void)
 {
-  if (!logstream)
-    {
-#ifdef HAVE_W32_SYSTEM
-      char *tmp;
+  static time_t cached_time;
+  static char cached_string[48];
+  time_t atime = time (NULL);
 
-      tmp = (no_registry
-             ? NULL
-             : read_w32_registry_string (NULL, GNUPG_REGISTRY_DIR,
-                                         "DefaultLogFile"));
-      log_set_file (tmp && *tmp? tmp : NULL);
-      jnlib_free (tmp);
-#else
-      log_set_file (NULL); /* Make sure a log stream has been set.  */
-#endif
-      assert (logstream);
+  if (atime != cached_time || !*cached_string)
+    {
+      struct tm *tp;
+
+      tp = localtime (&atime);
+      snprintf (cached_string, sizeof cached_string,
+                "%04d-%02d-%02d %02d:%02d:%02d ",
+                1900+tp->tm_year, tp->tm_mon+1, tp->tm_mday,
+                tp->tm_hour, tp->tm_min, tp->tm_sec);
+      cached_time = atime;
     }
+  return cached_string;
+}
 
-  es_flockfile (logstream);
-  if (missing_lf && level != JNLIB_LOG_CONT)
-    es_putc_unlocked ('\n', logstream );
-  missing_lf = 0;
 
+/* Build the line prefix for a message of LEVEL into BUFFER of
+   BUFSIZE and return its length.  A leading backspace in *FMT is
+   consumed.  */
+static size_t
+build_line_prefix (char *buffer, size_t bufsize, int level, const char **fmt)
+{
+  size_t n = 0;
+
+#define APPEND(a) do { n += snprintf (buffer+n, bufsize-n, "%s", (a)); \
+                       if (n >= bufsize) n = bufsize - 1; } while (0)
+
+  *buffer = 0;
   if (level != JNLIB_LOG_CONT)
     { /* Note this does not work for multiple line logging as we would
        * need to print to a buffer first */
       if (with_time && !force_prefixes)
-        {
-          struct tm *tp;
-          time_t atime = time (NULL);
-
-          tp = localtime (&atime);
-          es_fprintf_unlocked (logstream, "%04d-%02d-%02d %02d:%02d:%02d ",
-                               1900+tp->tm_year, tp->tm_mon+1, tp->tm_mday,
-                               tp->tm_hour, tp->tm_min, tp->tm_sec );
-        }
+        APPEND (get_time_string ());
       if (with_prefix || force_prefixes)
-        es_fputs_unlocked (prefix_buffer, logstream);
+        APPEND (prefix_buffer);
       if (with_pid || force_prefixes)
         {
           unsigned long pidsuf;
           int pidfmt;
+          char tmp[40];
 
           if (get_pid_suffix_cb && (pidfmt=get_pid_suffix_cb (&pidsuf)))
-            es_fprintf_unlocked (logstream, pidfmt == 1? "[%u.%lu]":"[%u.%lx]",
-                                 (unsigned int)getpid (), pidsuf);
+            snprintf (tmp, sizeof tmp, pidfmt == 1? "[%u.%lu]":"[%u.%lx]",
+                      (unsigned int)getpid (), pidsuf);
           else
-            es_fprintf_unlocked (logstream, "[%u]", (unsigned int)getpid ());
+            snprintf (tmp, sizeof tmp, "[%u]", (unsigned int)getpid ());
+          APPEND (tmp);
         }
       if (!with_time || force_prefixes)
-        es_putc_unlocked (':', logstream);
+        APPEND (":");
       /* A leading backspace suppresses the extra space so that we can
          correctly output, programname, filename and linenumber. */
-      if (fmt && *fmt == '\b')
-        fmt++;
+      if (*fmt && **fmt == '\b')
+        (*fmt)++;
       else
-        es_putc_unlocked (' ', logstream);
+        APPEND (" ");
     }
 
   switch (level)
@@ -703,14 +712,374 @@ do_logv (int level, int ignore_arg_ptr, const char *fmt, va_list arg_ptr)
     case JNLIB_LOG_INFO: break;
     case JNLIB_LOG_WARN: break;
     case JNLIB_LOG_ERROR: break;
-    case JNLIB_LOG_FATAL: es_fputs_unlocked ("Fatal: ",logstream ); break;
-    case JNLIB_LOG_BUG:   es_fputs_unlocked ("Ohhhh jeeee: ", logstream); break;
-    case JNLIB_LOG_DEBUG: es_fputs_unlocked ("DBG: ", logstream ); break;
+    case JNLIB_LOG_FATAL: APPEND ("Fatal: "); break;
+    case JNLIB_LOG_BUG:   APPEND ("Ohhhh jeeee: "); break;
+    case JNLIB_LOG_DEBUG: APPEND ("DBG: "); break;
     default:
-      es_fprintf_unlocked (logstream,"[Unknown log level %d]: ", level);
+      {
+        char tmp[40];
+
+        snprintf (tmp, sizeof tmp, "[Unknown log level %d]: ", level);
+        APPEND (tmp);
+      }
       break;
     }
 
+#undef APPEND
+  return n;
+}
+
+
+
+#ifndef WITHOUT_NPTH
+/* Async logging.  In async mode all log lines are formatted by the
+   caller and copied into a ring buffer which is drained by a
+   separate writer thread.  Thus a slow log file or log socket does
+   not stall the connection threads.  If the ring buffer is full the
+   message is dropped and counted; the writer thread reports the
+   number of dropped messages.  */
+static npth_mutex_t async_lock = NPTH_MUTEX_INITIALIZER;
+static npth_cond_t async_cond = NPTH_COND_INITIALIZER;
+static npth_cond_t async_drained_cond = NPTH_COND_INITIALIZER;
+static int async_mode;
+static char *async_buffer;
+static size_t async_size;  /* Size of ASYNC_BUFFER.  */
+static size_t async_head;  /* Offset for the next write.  */
+static size_t async_tail;  /* Offset of the first unwritten byte.  */
+static size_t async_used;  /* Number of unwritten bytes.  */
+static int async_writing;  /* The writer is working on the buffer.  */
+static unsigned long async_dropped;
+
+
+static void
+async_lock_queue (void)
+{
+  int res = npth_mutex_lock (&async_lock);
+  if (res)
+    abort ();
+}
+
+static void
+async_unlock_queue (void)
+{
+  int res = npth_mutex_unlock (&async_lock);
+  if (res)
+    abort ();
+}
+
+
+/* Copy LENGTH bytes from DATA to the ring buffer.  The caller must
+   hold the lock and must have checked that there is enough room.  */
+static void
+async_put (const char *data, size_t length)
+{
+  size_t n;
+
+  while (length)
+    {
+      n = async_size - async_head;
+      if (n > length)
+        n = length;
+      memcpy (async_buffer + async_head, data, n);
+      async_head = (async_head + n) % async_size;
+      async_used += n;
+      data += n;
+      length -= n;
+    }
+}
+
+
+/* Queue the log line TEXT of TEXTLEN bytes along with the prefix for
+   LEVEL.  Returns true if the line was queued.  */
+static int
+async_queue_line (int level, const char *text, size_t textlen)
+{
+  char prefix[160];
+  size_t prefixlen;
+  const char *fmt = text;
+  int need_lf;
+  int queued = 0;
+
+  async_lock_queue ();
+  prefixlen = build_line_prefix (prefix, sizeof prefix, level, &fmt);
+  textlen -= fmt - text;
+  text = fmt;
+  need_lf = (missing_lf && level != JNLIB_LOG_CONT);
+  if (async_size - async_used < need_lf + prefixlen + textlen + 1)
+    async_dropped++;
+  else
+    {
+      if (need_lf)
+        async_put ("\n", 1);
+      async_put (prefix, prefixlen);
+      async_put (text, textlen);
+      missing_lf = (textlen && text[textlen-1] != '\n');
+      if (missing_lf && (level == JNLIB_LOG_FATAL || level == JNLIB_LOG_BUG))
+        {
+          async_put ("\n", 1);
+          missing_lf = 0;
+        }
+      queued = 1;
+      npth_cond_signal (&async_cond);
+    }
+  async_unlock_queue ();
+  return queued;
+}
+
+
+/* Write LENGTH bytes of DATA to the log stream.  The npth lock is
+   released so that other threads may run while we are writing.  */
+static void
+async_write (const void *data, size_t length)
+{
+  npth_unprotect ();
+  es_fwrite (data, length, 1, logstream);
+  npth_protect ();
+}
+
+
+/* The thread draining the ring buffer.  */
+static void *
+async_writer_thread (void *arg)
+{
+  size_t n;
+  unsigned long dropped;
+  int need_lf = 0;
+  char note[80];
+
+  (void)arg;
+
+  async_lock_queue ();
+  for (;;)
+    {
+      while (!async_used && !async_dropped)
+        npth_cond_wait (&async_cond, &async_lock);
+
+      n = async_used;
+      if (n > async_size - async_tail)
+        n = async_size - async_tail;
+      /* Report dropped messages only at the end of the queued data.  */
+      dropped = 0;
+      if (n == async_used)
+        {
+          dropped = async_dropped;
+          async_dropped = 0;
+          if (n)
+            need_lf = (async_buffer[async_tail + n - 1] != '\n');
+          else
+            need_lf = missing_lf;
+        }
+      async_writing = 1;
+      async_unlock_queue ();
+
+      /* The bytes between TAIL and TAIL+N are not touched by the
+         producers until we advance TAIL.  Thus we can write them
+         without holding the lock.  */
+      if (n)
+        async_write (async_buffer + async_tail, n);
+      if (dropped)
+        {
+          snprintf (note, sizeof note,
+                    "%s[%lu log messages dropped]\n",
+                    need_lf? "\n":"", dropped);
+          async_write (note, strlen (note));
+        }
+      npth_unprotect ();
+      es_fflush (logstream);
+      npth_protect ();
+
+      async_lock_queue ();
+      async_tail = (async_tail + n) % async_size;
+      async_used -= n;
+      async_writing = 0;
+      if (!async_used)
+        npth_cond_broadcast (&async_drained_cond);
+    }
+
+  /*NOTREACHED*/
+  return NULL;
+}
+
+
+/* Wait until the writer thread has written all queued lines.  To
+   avoid a hang in case the log device blocks forever, we give up
+   after a few seconds.  */
+static void
+async_drain (void)
+{
+  struct timespec abstime;
+
+  if (!async_mode)
+    return;
+
+  npth_clock_gettime (&abstime);
+  abstime.tv_sec += 5;
+  async_lock_queue ();
+  while (async_used || async_writing)
+    if (npth_cond_timedwait (&async_drained_cond, &async_lock, &abstime))
+      break;
+  async_unlock_queue ();
+}
+
+
+/* Switch to async logging using a ring buffer of BUFSIZE bytes.
+   This must be called after npth_init and after the log file has
+   been set.  Returns 0 on success or an errno value.  */
+int
+log_set_async (size_t bufsize)
+{
+  npth_attr_t tattr;
+  npth_t thread;
+  int res;
+
+  if (async_mode)
+    return 0;
+  if (bufsize < 4096)
+    bufsize = 4096;
+
+  log_get_stream ();  /* Make sure a log stream has been set.  */
+  async_buffer = jnlib_malloc (bufsize);
+  if (!async_buffer)
+    return errno;
+  async_size = bufsize;
+  async_head = async_tail = async_used = 0;
+
+  res = npth_attr_init (&tattr);
+  if (res)
+    goto leave;
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+  res = npth_create (&thread, &tattr, async_writer_thread, NULL);
+  npth_attr_destroy (&tattr);
+  if (res)
+    goto leave;
+
+  /* Flush whatever is buffered in the stream before we start
+     writing from the writer thread.  */
+  es_fflush (logstream);
+  async_mode = 1;
+  atexit (async_drain);
+
+ leave:
+  if (res)
+    {
+      jnlib_free (async_buffer);
+      async_buffer = NULL;
+      async_size = 0;
+    }
+  return res;
+}
+
+
+/* Format a log message and queue it.  Returns true if async mode is
+   active; in this case the message has been handled.  */
+static int
+async_logv (int level, int ignore_arg_ptr, const char *fmt, va_list arg_ptr)
+{
+  char buffer[512];
+  char *line = buffer;
+  int n;
+
+  if (!async_mode)
+    return 0;
+
+  *buffer = 0;
+  if (!fmt)
+    n = 0;
+  else if (ignore_arg_ptr)
+    {
+      line = (char*)fmt;
+      n = strlen (fmt);
+    }
+  else
+    {
+      va_list arg_copy;
+
+      va_copy (arg_copy, arg_ptr);
+      n = vsnprintf (buffer, sizeof buffer, fmt, arg_ptr);
+      if (n >= 0 && (size_t)n >= sizeof buffer)
+        {
+          line = NULL;
+          n = es_vasprintf (&line, fmt, arg_copy);
+        }
+      va_end (arg_copy);
+      if (n < 0 || !line)
+        {
+          async_lock_queue ();
+          async_dropped++;
+          npth_cond_signal (&async_cond);
+          async_unlock_queue ();
+          if (line != buffer)
+            es_free (line);
+          line = NULL;
+        }
+    }
+
+  if (line)
+    async_queue_line (level, line, n);
+  if (line && line != buffer && line != fmt)
+    es_free (line);
+
+  if (level == JNLIB_LOG_FATAL)
+    {
+      async_drain ();
+      exit (2);
+    }
+  else if (level == JNLIB_LOG_BUG)
+    {
+      async_drain ();
+      abort ();
+    }
+  return 1;
+}
+
+#else /*WITHOUT_NPTH*/
+
+int
+log_set_async (size_t bufsize)
+{
+  (void)bufsize;
+  return ENOSYS;
+}
+
+#endif /*WITHOUT_NPTH*/
+
+
+
+static void
+do_logv (int level, int ignore_arg_ptr, const char *fmt, va_list arg_ptr)
+{
+  char prefix[160];
+
+  if (!logstream)
+    {
+#ifdef HAVE_W32_SYSTEM
+      char *tmp;
+
+      tmp = (no_registry
+             ? NULL
+             : read_w32_registry_string (NULL, GNUPG_REGISTRY_DIR,
+                                         "DefaultLogFile"));
+      log_set_file (tmp && *tmp? tmp : NULL);
+      jnlib_free (tmp);
+#else
+      log_set_file (NULL); /* Make sure a log stream has been set.  */
+#endif
+      assert (logstream);
+    }
+
+#ifndef WITHOUT_NPTH
+  if (async_logv (level, ignore_arg_ptr, fmt, arg_ptr))
+    return;
+#endif
+
+  es_flockfile (logstream);
+  if (missing_lf && level != JNLIB_LOG_CONT)
+    es_putc_unlocked ('\n', logstream );
+  missing_lf = 0;
+
+  build_line_prefix (prefix, sizeof prefix, level, &fmt);
+  es_fputs_unlocked (prefix, logstream);
+
   if (fmt)
     {
       if (ignore_arg_ptr)
@@ -855,6 +1224,9 @@ void
 log_flush (void)
 {
   do_log_ignore_arg (JNLIB_LOG_CONT, NULL);
+#ifndef WITHOUT_NPTH
+  async_drain ();
+#endif
 }
 
 
@@ -22,15 +22,24 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <npth.h>
+#include <sqlite3.h>
 
 #include "util.h"
 #include "logging.h"
 #include "http.h"
 #include "membuf.h"
 #include "payprocd.h"
+#include "dbutil.h"
+#include "form.h"
 #include "paypal.h"
 
 
+static char *make_dedup_key (form_field_t form, unsigned int nform);
+static int claim_ipn (sqlite3_int64 id, int tries, const char *dedup_key);
+
+
 /* Perform a call to paypal.com.  KEYSTRING is the secret key, METHOD
    is the method without the version (e.g. "tokens") and DATA the
    individual part to be appended to the URL (e.g. a token-id).  If
@@ -42,7 +51,7 @@ static gpg_error_t
 call_verify (int live, const char *request)
 {
   gpg_error_t err;
-  const char *url;
+  char *url;
   http_session_t session = NULL;
   http_t http = NULL;
   estream_t fp;
@@ -50,9 +59,13 @@ call_verify (int live, const char *request)
   const char cmd[] = "cmd=_notify-validate&";
   char response[20];
 
-  url = (live? "https://www.paypal.com/cgi-bin/webscr"
-         /**/: "https://www.sandbox.paypal.com/cgi-bin/webscr");
-
+  if (opt.fake_psp_url)
+    url = strconcat (opt.fake_psp_url, "/paypal/cgi-bin/webscr", NULL);
+  else
+    url = xtrystrdup (live? "https://www.paypal.com/cgi-bin/webscr"
+                      /**/: "https://www.sandbox.paypal.com/cgi-bin/webscr");
+  if (!url)
+    return gpg_error_from_syserror ();
 
   err = http_session_new (&session, NULL);
   if (err)
@@ -124,73 +137,669 @@ call_verify (int live, const char *request)
  leave:
   http_close (http, 0);
   http_session_release (session);
+  xfree (url);
   return err;
 }
 
 
+/* Parse the IPN REQUEST.  A copy of REQUEST is stored at R_BUFFER
+ * and an array with its fields at R_FORM; the number of fields is
+ * stored at R_NFORM.  The caller must free R_BUFFER and R_FORM, also
+ * on error.  */
+static gpg_error_t
+parse_ipn (const char *request, char **r_buffer,
+           form_field_t *r_form, unsigned int *r_nform)
+{
+  const char *s;
+  unsigned int n;
+
+  *r_form = NULL;
+  *r_nform = 0;
+
+  /* The number of fields is limited by the number of ampersands.  */
+  for (n=1, s=request; (s = strchr (s, '&')); s++)
+    n++;
+
+  *r_buffer = xtrystrdup (request);
+  if (!*r_buffer)
+    return gpg_error_from_syserror ();
+  *r_form = xtrycalloc (n, sizeof **r_form);
+  if (!*r_form)
+    return gpg_error_from_syserror ();
+  return form_parse (*r_buffer, *r_form, n, r_nform);
+}
 
 
-
-/* The connection has already been shutdown but the request has been
-   stored in the dictionary DICT.  We extract the original full
-   request, validate it with Paypal and then do something with the
-   received notification.  */
-void
-paypal_proc_ipn (keyvalue_t *dict)
+/* Check the IPN REQUEST with ID and TRIES from the queue with PayPal
+ * and act on it.  Returns 0 on success.  On error R_RETRY is set if
+ * it makes sense to try again later.  */
+static gpg_error_t
+process_ipn (sqlite3_int64 id, int tries, const char *request, int *r_retry)
 {
   gpg_error_t err;
-  keyvalue_t kv;
-  char *request;
-  keyvalue_t form;
+  char *buffer = NULL;
+  form_field_t form = NULL;
+  unsigned int nform, i;
+  char *dedup_key = NULL;
 
-  if ((kv = keyvalue_find (*dict, "Request")))
-    keyvalue_remove_nl (kv);
-  request = keyvalue_snatch (*dict, "Request");
-  if (!request || !*request)
-    {
-      log_error ("ppipnhd: no request given\n");
-      xfree (request);
-      return;
-    }
+  *r_retry = 0;
 
   log_info ("ppipnhd: length of request=%zu\n", strlen (request));
 
-  /* Parse it into a dictionary.  */
-  err = parse_www_form_urlencoded (&form, request);
+  /* Parse it into fields.  We need to keep REQUEST intact for the
+     verification and thus parse a copy.  */
+  err = parse_ipn (request, &buffer, &form, &nform);
   if (err)
     {
       log_error ("ppipnhd: error parsing request: %s\n",
                  gpg_strerror (err));
+      if (gpg_err_code (err) == GPG_ERR_ENOMEM)
+        *r_retry = 1;
       goto leave;
     }
 
-  for (kv = form; kv; kv = kv->next)
-    log_printkeyval ("  ", kv->name, kv->value);
+  for (i=0; i < nform; i++)
+    log_printkeyval ("  ", form[i].name, form[i].value);
 
   /* To avoid useless verification against Paypal we first check the
      mail address.  */
-  if (strcmp (keyvalue_get_string (form, "receiver_email"),
+  if (strcmp (form_get_string (form, nform, "receiver_email"),
               "paypal-test@g10code.com"))
     {
       log_error ("ppipnhd: wrong receiver_email\n");
-      log_printval ("  mail=", keyvalue_get_string (form, "receiver_email"));
+      log_printval ("  mail=",
+                    form_get_string (form, nform, "receiver_email"));
+      err = gpg_error (GPG_ERR_WRONG_NAME);
       goto leave;
     }
 
-  if (call_verify (!keyvalue_get_int (form, "test_ipn"), request))
+  err = call_verify (!atoi (form_get_string (form, nform, "test_ipn")),
+                     request);
+  if (gpg_err_code (err) == GPG_ERR_NOT_FOUND)
     {
       log_error ("ppipnhd: IPN is not authentic\n");
       goto leave;
     }
+  else if (err)
+    {
+      log_error ("ppipnhd: error verifying IPN: %s\n", gpg_strerror (err));
+      *r_retry = 1;
+      goto leave;
+    }
 
   log_info ("ppipnhd: IPN accepted\n");
 
-  /* Check for duplicates.  */
+  /* Only now that we know that the IPN is authentic we may check for
+   * duplicates; a forged IPN could otherwise suppress the real one.  */
+  dedup_key = make_dedup_key (form, nform);
+  if (!claim_ipn (id, tries, dedup_key))
+    {
+      log_info ("ppipnhd: duplicate IPN ignored (%s)\n", dedup_key);
+      goto leave;
+    }
 
   /* Check status of transaction.  */
 
 
  leave:
+  es_free (dedup_key);
+  xfree (form);
+  xfree (buffer);
+  return err;
+}
+
+
+
+/*
+ * The IPN queue
+ */
+
+/* The IPNs are stored in a database before the PPIPNHD command
+ * returns.  A fixed number of worker threads takes them from the
+ * database for verification so that an IPN is not lost if the
+ * verification fails or payprocd is restarted.
+ *
+ * CREATE TABLE ipn (
+ *   id INTEGER PRIMARY KEY,
+ *   dedup_key TEXT,           -- "txn_id/payment_status" or the
+ *                             -- ipn_track_id; NULL if not known.
+ *   received TEXT NOT NULL,
+ *   request TEXT NOT NULL,    -- The original request.
+ *   state INTEGER NOT NULL,   -- See enum ipn_states.
+ *   tries INTEGER NOT NULL,   -- Number of verification attempts.
+ *   next_try INTEGER NOT NULL -- Time of the next attempt.
+ * )
+ *
+ * CREATE INDEX ipn_dedup_key ON ipn (dedup_key)
+ * CREATE INDEX ipn_state_received ON ipn (state, received)
+ *
+ * PayPal may send the same IPN several times; those duplicates are
+ * detected using the dedup_key and ignored.  Because the dedup_key is
+ * taken from the unverified request, only IPNs in the DONE state are
+ * considered; the check is repeated by the worker after the
+ * verification.  Processed IPNs are kept for 30 days for this.
+ */
+
+/* The name of the IPN database file.  */
+static const char ipn_db_fname[] = "/var/lib/payproc/ipn.db";
+static const char ipn_test_db_fname[] = "/var/lib/payproc-test/ipn.db";
+
+/* The number of verifier threads.  */
+#define IPN_WORKERS 2
+
+/* The delay in seconds before the first retry and the maximum delay.
+ * The delay is doubled for each retry.  */
+#define IPN_RETRY_DELAY      60
+#define IPN_MAX_RETRY_DELAY  (6*3600)
+
+/* The number of verification attempts before we give up.  With the
+ * above delays this covers about three days.  */
+#define IPN_MAX_TRIES 18
+
+/* The states of an IPN in the database.  */
+enum ipn_states
+  {
+    IPN_STATE_PENDING = 0,
+    IPN_STATE_ACTIVE  = 1,  /* Currently processed by a worker.  */
+    IPN_STATE_DONE    = 2,
+    IPN_STATE_FAILED  = 3
+  };
+
+
+/* The database handle for the IPN database, the prepared
+ * statements, and the flag telling that the workers are running.
+ * All are protected by IPN_DB_LOCK which is also used with
+ * IPN_DB_COND to wake up the workers.  */
+static sqlite3 *ipn_db;
+static sqlite3_stmt *ipn_insert_stmt;
+static sqlite3_stmt *ipn_next_stmt;
+static sqlite3_stmt *ipn_state_stmt;
+static sqlite3_stmt *ipn_done_stmt;
+static npth_mutex_t ipn_db_lock = NPTH_MUTEX_INITIALIZER;
+static npth_cond_t ipn_db_cond = NPTH_COND_INITIALIZER;
+static int ipn_workers_started;
+
+
+static void
+lock_ipn_db (void)
+{
+  int res;
+
+  res = npth_mutex_lock (&ipn_db_lock);
+  if (res)
+    log_fatal ("failed to acquire IPN db lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+static void
+unlock_ipn_db (void)
+{
+  int res;
+
+  res = npth_mutex_unlock (&ipn_db_lock);
+  if (res)
+    log_fatal ("failed to release IPN db lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+/* Execute the SQL statement STMTSTR.  Must be called with the lock
+ * held.  */
+static gpg_error_t
+exec_ipn_sql (const char *stmtstr)
+{
+  int res;
+  char *errmsg;
+
+  res = sqlite3_exec (ipn_db, stmtstr, NULL, NULL, &errmsg);
+  if (res)
+    {
+      log_error ("error executing IPN db statement: %s\n", errmsg);
+      sqlite3_free (errmsg);
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+  return 0;
+}
+
+
+/* Open the IPN database, create the table if needed, and prepare the
+ * statements.  Must be called with the lock held.  */
+static gpg_error_t
+open_ipn_db (void)
+{
+  int res;
+  const char *db_fname = opt.livemode? ipn_db_fname : ipn_test_db_fname;
+
+  if (ipn_db)
+    return 0;
+
+  res = sqlite3_open_v2 (db_fname, &ipn_db,
+                         (SQLITE_OPEN_READWRITE
+                          | SQLITE_OPEN_CREATE
+                          | SQLITE_OPEN_NOMUTEX),
+                         NULL);
+  if (res)
+    {
+      log_error ("error opening '%s': %s\n", db_fname, sqlite3_errstr (res));
+      goto fail;
+    }
+  sqlite3_extended_result_codes (ipn_db, 1);
+
+  if (exec_ipn_sql ("CREATE TABLE IF NOT EXISTS ipn (\n"
+                    "id        INTEGER PRIMARY KEY,\n"
+                    "dedup_key TEXT,\n"
+                    "received  TEXT NOT NULL,\n"
+                    "request   TEXT NOT NULL,\n"
+                    "state     INTEGER NOT NULL,\n"
+                    "tries     INTEGER NOT NULL,\n"
+                    "next_try  INTEGER NOT NULL"
+                    ")"))
+    goto fail;
+  if (exec_ipn_sql ("CREATE INDEX IF NOT EXISTS ipn_dedup_key"
+                    " ON ipn (dedup_key)"))
+    goto fail;
+  /* For the housekeeping which would otherwise scan the table.  */
+  if (exec_ipn_sql ("CREATE INDEX IF NOT EXISTS ipn_state_received"
+                    " ON ipn (state, received)"))
+    goto fail;
+
+  /* IPNs which were being processed when payprocd was stopped need
+   * to be processed again.  */
+  if (exec_ipn_sql ("UPDATE ipn SET state = 0 WHERE state = 1"))
+    goto fail;
+
+  res = sqlite3_prepare_v2 (ipn_db,
+                            "INSERT INTO ipn (dedup_key, received, request,"
+                            "                 state, tries, next_try)\n"
+                            "         VALUES (?1,?2,?3,0,0,0)",
+                            -1, &ipn_insert_stmt, NULL);
+  if (!res)
+    res = sqlite3_prepare_v2 (ipn_db,
+                              "SELECT id, request, tries, next_try FROM ipn"
+                              " WHERE state = 0 ORDER BY next_try LIMIT 1",
+                              -1, &ipn_next_stmt, NULL);
+  if (!res)
+    res = sqlite3_prepare_v2 (ipn_db,
+                              "UPDATE ipn SET state = ?2, tries = ?3,"
+                              " next_try = ?4 WHERE id = ?1",
+                              -1, &ipn_state_stmt, NULL);
+  if (!res)
+    res = sqlite3_prepare_v2 (ipn_db,
+                              "SELECT id FROM ipn WHERE dedup_key = ?1"
+                              " AND state = 2 AND id <> ?2 LIMIT 1",
+                              -1, &ipn_done_stmt, NULL);
+  if (res)
+    {
+      log_error ("error preparing IPN db statements: %s\n",
+                 sqlite3_errstr (res));
+      goto fail;
+    }
+
+  return 0;
+
+ fail:
+  sqlite3_finalize (ipn_insert_stmt);
+  ipn_insert_stmt = NULL;
+  sqlite3_finalize (ipn_next_stmt);
+  ipn_next_stmt = NULL;
+  sqlite3_finalize (ipn_state_stmt);
+  ipn_state_stmt = NULL;
+  sqlite3_finalize (ipn_done_stmt);
+  ipn_done_stmt = NULL;
+  sqlite3_close (ipn_db);
+  ipn_db = NULL;
+  return gpg_error (GPG_ERR_GENERAL);
+}
+
+
+/* Set the state of the IPN with ID.  Must be called with the lock
+ * held.  */
+static gpg_error_t
+set_ipn_state (sqlite3_int64 id, int state, int tries, time_t next_try)
+{
+  int res;
+
+  sqlite3_reset (ipn_state_stmt);
+  res = sqlite3_bind_int64 (ipn_state_stmt, 1, id);
+  if (!res)
+    res = sqlite3_bind_int (ipn_state_stmt, 2, state);
+  if (!res)
+    res = sqlite3_bind_int (ipn_state_stmt, 3, tries);
+  if (!res)
+    res = sqlite3_bind_int64 (ipn_state_stmt, 4, (sqlite3_int64)next_try);
+  if (!res)
+    res = sqlite3_step (ipn_state_stmt);
+  sqlite3_reset (ipn_state_stmt);
+  if (res != SQLITE_DONE)
+    {
+      log_error ("error updating the IPN db: %s\n", sqlite3_errstr (res));
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+  return 0;
+}
+
+
+/* Return true if an IPN other than the one with ID and with the
+ * same DEDUP_KEY has already been processed.  Use 0 for ID to check
+ * all IPNs.  Must be called with the lock held.  */
+static int
+is_duplicate_ipn (const char *dedup_key, sqlite3_int64 id)
+{
+  int res;
+
+  if (!dedup_key)
+    return 0;
+
+  sqlite3_reset (ipn_done_stmt);
+  res = sqlite3_bind_text (ipn_done_stmt, 1, dedup_key, -1,
+                           SQLITE_TRANSIENT);
+  if (!res)
+    res = sqlite3_bind_int64 (ipn_done_stmt, 2, id);
+  if (!res)
+    res = sqlite3_step (ipn_done_stmt);
+  sqlite3_reset (ipn_done_stmt);
+  if (res == SQLITE_ROW)
+    return 1;
+  if (res != SQLITE_DONE)
+    log_error ("error reading the IPN db: %s\n", sqlite3_errstr (res));
+  return 0;
+}
+
+
+/* Mark the verified IPN with ID and DEDUP_KEY as done unless another
+ * IPN with the same key has already been processed.  TRIES is the
+ * number of attempts before this one.  Returns true if the caller
+ * shall process the IPN.  */
+static int
+claim_ipn (sqlite3_int64 id, int tries, const char *dedup_key)
+{
+  int claimed;
+
+  lock_ipn_db ();
+  claimed = !is_duplicate_ipn (dedup_key, id);
+  if (claimed)
+    set_ipn_state (id, IPN_STATE_DONE, tries + 1, time (NULL));
+  unlock_ipn_db ();
+  return claimed;
+}
+
+
+/* Take the next due IPN from the queue, mark it as active, and store
+ * its id, request and number of tries at the provided addresses.  If
+ * no IPN is due, wait until one is due or a new one has been queued.
+ * Must be called with the lock held.  */
+static void
+take_next_ipn (sqlite3_int64 *r_id, char **r_request, int *r_tries)
+{
+  int res;
+  time_t now, next_try;
+  struct timespec abstime;
+  const char *s;
+
+  *r_request = NULL;
+  for (;;)
+    {
+      now = time (NULL);
+      next_try = now + 3600;
+
+      sqlite3_reset (ipn_next_stmt);
+      res = sqlite3_step (ipn_next_stmt);
+      if (res == SQLITE_ROW)
+        {
+          next_try = (time_t)sqlite3_column_int64 (ipn_next_stmt, 3);
+          if (next_try <= now)
+            {
+              *r_id = sqlite3_column_int64 (ipn_next_stmt, 0);
+              *r_tries = sqlite3_column_int (ipn_next_stmt, 2);
+              s = (const char *)sqlite3_column_text (ipn_next_stmt, 1);
+              *r_request = xtrystrdup (s? s : "");
+              sqlite3_reset (ipn_next_stmt);
+              if (!*r_request)
+                {
+                  log_error ("ppipnhd: error taking IPN: %s\n",
+                             gpg_strerror (gpg_error_from_syserror ()));
+                  next_try = now + IPN_RETRY_DELAY;
+                }
+              else if (!set_ipn_state (*r_id, IPN_STATE_ACTIVE,
+                                       *r_tries, next_try))
+                return;
+              else
+                {
+                  xfree (*r_request);
+                  *r_request = NULL;
+                  next_try = now + IPN_RETRY_DELAY;
+                }
+            }
+        }
+      else if (res != SQLITE_DONE)
+        {
+          log_error ("error reading the IPN db: %s\n", sqlite3_errstr (res));
+          next_try = now + IPN_RETRY_DELAY;
+        }
+      sqlite3_reset (ipn_next_stmt);
+
+      npth_clock_gettime (&abstime);
+      abstime.tv_sec += next_try - now;
+      npth_cond_timedwait (&ipn_db_cond, &ipn_db_lock, &abstime);
+    }
+}
+
+
+/* The thread to verify and process queued IPNs.  */
+static void *
+ipn_worker_thread (void *arg)
+{
+  gpg_error_t err;
+  sqlite3_int64 id;
+  char *request;
+  int tries, retry, state;
+  time_t delay;
+
+  (void)arg;
+
+  for (;;)
+    {
+      lock_ipn_db ();
+      take_next_ipn (&id, &request, &tries);
+      unlock_ipn_db ();
+
+      err = process_ipn (id, tries, request, &retry);
+      tries++;
+      delay = 0;
+      if (!err)
+        state = IPN_STATE_DONE;
+      else if (retry && tries < IPN_MAX_TRIES)
+        {
+          state = IPN_STATE_PENDING;
+          delay = (time_t)IPN_RETRY_DELAY << (tries < 10? tries - 1 : 9);
+          if (delay > IPN_MAX_RETRY_DELAY)
+            delay = IPN_MAX_RETRY_DELAY;
+          log_info ("ppipnhd: will retry IPN %lld in %lu seconds\n",
+                    (long long)id, (unsigned long)delay);
+        }
+      else
+        {
+          state = IPN_STATE_FAILED;
+          log_error ("ppipnhd: giving up on IPN %lld after %d attempt%s\n",
+                     (long long)id, tries, tries == 1? "":"s");
+        }
+      xfree (request);
+
+      lock_ipn_db ();
+      set_ipn_state (id, state, tries, time (NULL) + delay);
+      unlock_ipn_db ();
+    }
+
+  return NULL;
+}
+
+
+/* Compute the key to detect duplicate IPNs from the NFORM fields of
+ * the parsed FORM.  Returns NULL if no key is available.  */
+static char *
+make_dedup_key (form_field_t form, unsigned int nform)
+{
+  const char *s;
+
+  s = form_get_string (form, nform, "txn_id");
+  if (*s)
+    return es_bsprintf ("%s/%s", s,
+                        form_get_string (form, nform, "payment_status"));
+  s = form_get_string (form, nform, "ipn_track_id");
+  if (*s)
+    return es_bsprintf ("%s", s);
+  return NULL;
+}
+
+
+
+/* Open the IPN queue and start the worker threads unless this has
+ * already been done.  Must be called with the lock held.  */
+static gpg_error_t
+start_ipn_workers (void)
+{
+  gpg_error_t err;
+  npth_attr_t tattr;
+  npth_t thread;
+  int i, res, count;
+
+  if (ipn_workers_started)
+    return 0;
+
+  err = open_ipn_db ();
+  if (err)
+    return err;
+
+  res = npth_attr_init (&tattr);
+  if (res)
+    {
+      log_error ("error preparing IPN worker thread: %s\n", strerror (res));
+      return gpg_error_from_errno (res);
+    }
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+  for (i=count=0; i < IPN_WORKERS; i++)
+    {
+      res = npth_create (&thread, &tattr, ipn_worker_thread, NULL);
+      if (res)
+        log_error ("error spawning IPN worker thread: %s\n", strerror (res));
+      else
+        count++;
+    }
+  npth_attr_destroy (&tattr);
+  if (!count)
+    return gpg_error_from_errno (res);
+
+  ipn_workers_started = 1;
+  return 0;
+}
+
+
+/* Open the IPN queue and start the worker threads.  This is called
+ * once at startup.  If that fails, it is tried again with the next
+ * IPN.  */
+void
+paypal_ipn_start_workers (void)
+{
+  gpg_error_t err;
+
+  lock_ipn_db ();
+  err = start_ipn_workers ();
+  unlock_ipn_db ();
+  if (err)
+    log_error ("ppipnhd: IPN queue not available\n");
+}
+
+
+/* Put the IPN request from the dictionary DICT into the queue for
+ * verification.  Returns an error if the request could not be stored
+ * or no worker is running so that the caller can tell PayPal to send
+ * it again.  Duplicates of already processed requests are silently
+ * ignored.  */
+gpg_error_t
+paypal_queue_ipn (keyvalue_t *dict)
+{
+  gpg_error_t err;
+  keyvalue_t kv;
+  char *request;
+  char *buffer;
+  form_field_t form;
+  unsigned int nform;
+  char *dedup_key = NULL;
+  char datetime_buf [DB_DATETIME_SIZE];
+  int res;
+
+  if ((kv = keyvalue_find (*dict, "Request")))
+    keyvalue_remove_nl (kv);
+  request = keyvalue_snatch (*dict, "Request");
+  if (!request || !*request)
+    {
+      log_error ("ppipnhd: no request given\n");
+      xfree (request);
+      return gpg_error (GPG_ERR_MISSING_VALUE);
+    }
+
+  /* We only need the form to get the key for duplicate detection;
+   * a parse error is handled by the worker.  */
+  if (!parse_ipn (request, &buffer, &form, &nform))
+    dedup_key = make_dedup_key (form, nform);
+  xfree (form);
+  xfree (buffer);
+
+  lock_ipn_db ();
+  err = start_ipn_workers ();
+  if (err)
+    {
+      log_error ("ppipnhd: IPN queue not available\n");
+      goto leave;
+    }
+
+  if (is_duplicate_ipn (dedup_key, 0))
+    {
+      log_info ("ppipnhd: duplicate IPN ignored (%s)\n", dedup_key);
+      goto leave;
+    }
+
+  sqlite3_reset (ipn_insert_stmt);
+  res = sqlite3_bind_text (ipn_insert_stmt, 1, dedup_key, -1,
+                           SQLITE_TRANSIENT);
+  if (!res)
+    res = sqlite3_bind_text (ipn_insert_stmt,
+                             2, db_datetime_now (datetime_buf), -1,
+                             SQLITE_TRANSIENT);
+  if (!res)
+    res = sqlite3_bind_text (ipn_insert_stmt, 3, request, -1,
+                             SQLITE_TRANSIENT);
+  if (!res)
+    res = sqlite3_step (ipn_insert_stmt);
+  sqlite3_reset (ipn_insert_stmt);
+  if (res == SQLITE_DONE)
+    {
+      log_info ("ppipnhd: IPN queued (%s)\n", dedup_key? dedup_key : "-");
+      npth_cond_signal (&ipn_db_cond);
+    }
+  else
+    {
+      log_error ("error inserting into the IPN db: %s (%d)\n",
+                 sqlite3_errstr (res), res);
+      err = gpg_error (GPG_ERR_GENERAL);
+    }
+
+ leave:
+  unlock_ipn_db ();
+  es_free (dedup_key);
   xfree (request);
-  keyvalue_release (form);
+  return err;
+}
+
+
+/* Remove old IPNs from the queue.  */
+void
+paypal_ipn_housekeeping (void)
+{
+  lock_ipn_db ();
+  if (ipn_db)
+    exec_ipn_sql ("DELETE FROM ipn WHERE state >= 2"
+                  " AND received < datetime('now','-30 days')");
+  unlock_ipn_db ();
 }
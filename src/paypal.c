@@ -34,6 +34,8 @@
 #include "form.h"
 #include "session.h"
 #include "account.h"
+#include "plancache.h"
+#include "backend.h"
 #include "paypal.h"
 
 
@@ -47,14 +49,25 @@
  * access a new access token is retrieved.  */
 static int status_unauthorized_seen;
 
-/* An object to cache plan IDs.  */
-static struct
-{
-  int counter;
-  char *planname;
-  char *planid;
-} plan_cache[50];
-static int plan_counter;
+/* The cached OAUTH2 access token and its expiration time.  Both are
+ * protected by ACCESS_TOKEN_RWLOCK so that readers of a valid token
+ * do not block each other.  */
+static char *access_token;
+static time_t access_token_expires_on;
+static npth_rwlock_t access_token_rwlock = NPTH_RWLOCK_INITIALIZER;
+
+/* Flag and result of an ongoing refresh of the access token.  Threads
+ * waiting for the refresh use ACCESS_TOKEN_REFRESH_COND.  */
+static int access_token_refresh_active;
+static gpg_error_t access_token_refresh_err;
+static npth_mutex_t access_token_refresh_lock = NPTH_MUTEX_INITIALIZER;
+static npth_cond_t access_token_refresh_cond = NPTH_COND_INITIALIZER;
+
+/* The number of seconds before the expiration time at which the
+ * housekeeping refreshes the access token.  This needs to be larger
+ * than the housekeeping interval.  */
+#define ACCESS_TOKEN_REFRESH_AHEAD 600
+
 
 
 /* Perform a call to paypal.  REQ_METHOD is the HTTP request method to
@@ -74,16 +87,26 @@ call_paypal (http_req_t req_method, int bearer, const char *authstring,
 {
   gpg_error_t err;
   const char *urlprefix;
+  char *fakeprefix = NULL;
   char *url = NULL;
   http_session_t session = NULL;
   http_t http = NULL;
-  unsigned int status;
+  unsigned int status = 0;
+  struct backend_call_s call;
+  unsigned int timeout;
   estream_t fp;
 
   *r_status = 0;
   *r_json = NULL;
 
-  if (opt.livemode)
+  if (opt.fake_psp_url)
+    {
+      fakeprefix = strconcat (opt.fake_psp_url, "/paypal/v1/", NULL);
+      if (!fakeprefix)
+        return gpg_error_from_syserror ();
+      urlprefix = fakeprefix;
+    }
+  else if (opt.livemode)
     urlprefix = PAYPAL_LIVE_HOST "/v1/";
   else
     urlprefix = PAYPAL_TEST_HOST "/v1/";
@@ -97,12 +120,23 @@ call_paypal (http_req_t req_method, int bearer, const char *authstring,
     method += strlen (urlprefix);
 
   url = strconcat (urlprefix, method, data? "/": NULL, data, NULL);
+  xfree (fakeprefix);
   if (!url)
     return gpg_error_from_syserror ();
 
+  err = backend_acquire (&call, BACKEND_PAYPAL, req_method == HTTP_REQ_GET,
+                         &timeout);
+  if (err)
+    {
+      log_error ("paypal: not contacting '%s': %s\n", url, gpg_strerror (err));
+      xfree (url);
+      return err;
+    }
+
   err = http_session_new (&session, NULL);
   if (err)
     goto leave;
+  http_session_set_timeout (session, timeout);
 
   if (opt.debug_paypal)
     {
@@ -119,6 +153,7 @@ call_paypal (http_req_t req_method, int bearer, const char *authstring,
         log_printval ("          data: ", formdata);
     }
 
+  call.contacted = 1;
   err = http_open (&http,
                    req_method,
                    url,
@@ -140,36 +175,28 @@ call_paypal (http_req_t req_method, int bearer, const char *authstring,
   fp = http_get_write_ptr (http);
   es_fprintf (fp, "Accept: application/json\r\n");
 
-  if (kvformdata || formdata)
+  if (kvformdata)
     {
-      char *escaped;
-      const char *ct;
-
-      if (kvformdata)
-        {
-          err = encode_formdata (kvformdata, &escaped);
-          if (err)
-            goto leave;
-          ct = "x-www-form-urlencoded";
-        }
-      else
-        {
-          escaped = xtrystrdup (formdata);
-          if (!escaped)
-            {
-              err = gpg_error_from_syserror ();
-              goto leave;
-            }
-          ct = "json";
-        }
-
       es_fprintf (fp,
-                  "Content-Type: application/%s\r\n"
-                  "Content-Length: %zu\r\n", ct, strlen (escaped));
+                  "Content-Type: application/x-www-form-urlencoded\r\n"
+                  "Content-Length: %zu\r\n",
+                  form_encoded_length (kvformdata));
       http_start_data (http);
-      if (es_fputs (escaped, fp))
-        err = gpg_error_from_syserror ();
-      xfree (escaped);
+      err = write_formdata (kvformdata, fp);
+      if (err)
+        goto leave;
+    }
+  else if (formdata)
+    {
+      es_fprintf (fp,
+                  "Content-Type: application/json\r\n"
+                  "Content-Length: %zu\r\n", strlen (formdata));
+      http_start_data (http);
+      if (es_fputs (formdata, fp))
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
     }
 
   err = http_wait_response (http);
@@ -234,6 +261,7 @@ call_paypal (http_req_t req_method, int bearer, const char *authstring,
  leave:
   http_close (http, 0);
   http_session_release (session);
+  backend_release (&call, err, status);
   xfree (url);
   return err;
 }
@@ -524,78 +552,21 @@ restore_field (keyvalue_t *targetp, keyvalue_t dict, const char *name)
 }
 
 
-/* Return a paypal OAUTH2 access token.  */
+/* Fetch a new OAUTH2 access token from PayPal and store it at
+ * R_ACCESS_TOKEN and its expiration time at R_EXPIRES_ON.  No locks
+ * are held while doing this.  */
 static gpg_error_t
-get_access_token (char **r_access_token)
+fetch_access_token (char **r_access_token, time_t *r_expires_on)
 {
-  static char *access_token;
-  static time_t expires_on = 60; /* Init so that gcc does not complain
-                                  * about the initial compare.  */
-  static npth_mutex_t my_lock = NPTH_MUTEX_INITIALIZER;
-
   gpg_error_t err;
   int status;
-  int max_retries = 10;
   keyvalue_t hlpdict = NULL;
   cjson_t json = NULL;
   cjson_t j_obj;
-  time_t request_time, now;
+  time_t request_time, expires_on;
 
   *r_access_token = NULL;
 
-  {
-    int res = npth_mutex_lock (&my_lock);
-    if (res)
-      log_fatal ("paypal: failed to acquire access token lock: %s\n",
-                 gpg_strerror (gpg_error_from_errno (res)));
-  }
-
-  /* Hack to speed up debugging */
-  /* if (!access_token) */
-  /*   { */
-  /*     access_token = xstrdup ("A21AAHr9LXxrE8MBBNKVdHPGrG_6PgHYY6ysPgUYGtVuttKco8uV49aPhFVR3WQ-lJdY05QENMCYKFG68cgW6wvoWVep-TLWA"); */
-  /*     expires_on = time (NULL) + 3600; */
-  /*   } */
-
-
- retry:
-  keyvalue_release (hlpdict); hlpdict = NULL;
-  cJSON_Delete (json); json = NULL;
-
-  now = time (NULL);
-  if (now == (time_t)(-1))
-    {
-      log_error ("time() failed: %s\n",
-                 gpg_strerror (gpg_error_from_syserror()));
-      severe_error ();
-    }
-
-  /* Check whether we can use the last access token.  */
-  if (!access_token)
-    log_info ("paypal: cached access token: %s\n", "not yet cached");
-  else if (status_unauthorized_seen)
-    log_info ("paypal: cached access token: %s\n", "401 recently seen");
-  else if (now + 30 < expires_on)
-    {
-      *r_access_token = xtrystrdup (access_token);
-      if (!*r_access_token)
-        err = gpg_error_from_syserror ();
-      else
-        err = 0; /* Success.  */
-      goto leave;
-    }
-  else
-    log_info ("paypal: cached access token: %s\n", "expire time too close");
-
-  status_unauthorized_seen = 0;
-
-  if (!max_retries--)
-    {
-      log_error ("paypal: error getting access token: too many retries\n");
-      err = gpg_error (GPG_ERR_TIMEOUT);
-      goto leave;
-    }
-
   /* Ask for an access token.  */
   err = keyvalue_put (&hlpdict, "grant_type", "client_credentials");
   if (err)
@@ -630,21 +601,6 @@ get_access_token (char **r_access_token)
       goto leave;
     }
 
-  j_obj = cJSON_GetObjectItem (json, "access_token");
-  if (!j_obj || !cjson_is_string (j_obj) || !*j_obj->valuestring)
-    {
-      log_error ("paypal: error getting access token: bad 'access_token'\n");
-      err = gpg_error (GPG_ERR_GENERAL);
-      goto leave;
-    }
-  xfree (access_token); access_token = NULL;
-  access_token = xtrystrdup (j_obj->valuestring);
-  if (!access_token)
-    {
-      err = gpg_error_from_syserror ();
-      goto leave;
-    }
-
   j_obj = cJSON_GetObjectItem (json, "expires_in");
   if (!j_obj || !cjson_is_number (j_obj) || j_obj->valueint < 60)
     {
@@ -660,80 +616,150 @@ get_access_token (char **r_access_token)
   else if (j_obj->valueint > 600)
     expires_on -= 300;
 
-  goto retry;
+  j_obj = cJSON_GetObjectItem (json, "access_token");
+  if (!j_obj || !cjson_is_string (j_obj) || !*j_obj->valuestring)
+    {
+      log_error ("paypal: error getting access token: bad 'access_token'\n");
+      err = gpg_error (GPG_ERR_GENERAL);
+      goto leave;
+    }
+  *r_access_token = xtrystrdup (j_obj->valuestring);
+  if (!*r_access_token)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  *r_expires_on = expires_on;
 
  leave:
-  {
-    int res = npth_mutex_unlock (&my_lock);
-    if (res)
-      log_fatal ("paypal: failed to release access token lock: %s\n",
-                 gpg_strerror (gpg_error_from_errno (res)));
-  }
   keyvalue_release (hlpdict);
   cJSON_Delete (json);
   return err;
 }
 
 
-/* Cache a plan_id */
-static void
-cache_plan_id (const char *name, const char *plan_id)
+/* Fetch a new access token and make it the current one.  If another
+ * thread is already fetching a token we wait for it and return its
+ * result.  Thus there is only one request for a token in flight.  */
+static gpg_error_t
+refresh_access_token (void)
+{
+  gpg_error_t err;
+  int res;
+  char *token, *tmp;
+  time_t expires_on = 0;
+
+  res = npth_mutex_lock (&access_token_refresh_lock);
+  if (res)
+    log_fatal ("paypal: failed to acquire access token lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+  if (access_token_refresh_active)
+    {
+      while (access_token_refresh_active)
+        npth_cond_wait (&access_token_refresh_cond,
+                        &access_token_refresh_lock);
+      err = access_token_refresh_err;
+      npth_mutex_unlock (&access_token_refresh_lock);
+      return err;
+    }
+  access_token_refresh_active = 1;
+  npth_mutex_unlock (&access_token_refresh_lock);
+
+  err = fetch_access_token (&token, &expires_on);
+  if (!err)
+    {
+      res = npth_rwlock_wrlock (&access_token_rwlock);
+      if (res)
+        log_fatal ("paypal: failed to acquire access token lock: %s\n",
+                   gpg_strerror (gpg_error_from_errno (res)));
+      tmp = access_token;
+      access_token = token;
+      access_token_expires_on = expires_on;
+      status_unauthorized_seen = 0;
+      npth_rwlock_unlock (&access_token_rwlock);
+      xfree (tmp);
+    }
+
+  res = npth_mutex_lock (&access_token_refresh_lock);
+  if (res)
+    log_fatal ("paypal: failed to acquire access token lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+  access_token_refresh_active = 0;
+  access_token_refresh_err = err;
+  npth_cond_broadcast (&access_token_refresh_cond);
+  npth_mutex_unlock (&access_token_refresh_lock);
+
+  return err;
+}
+
+
+/* Store a copy of the current access token at R_ACCESS_TOKEN if it
+ * is still usable.  Stores NULL if a new token is required.  */
+static gpg_error_t
+get_cached_access_token (char **r_access_token)
 {
-  int idx;
-  char *plan_id_copy;
-  char *name_copy;
-  int low, low_idx;
-  char *tmp, *tmp2;  /* Helper to delay the free.  */
-
-  /* First that a copy to that we don't need to call a system function
-   * (free, strdup) while walking the list (thread-safeness).  */
-  plan_id_copy = xtrystrdup (plan_id);
-  if (!plan_id_copy)
-    return;  /* out of core */
-
-  /* First check whether we need to update an existing plan. */
-  for (idx=0; idx < DIM (plan_cache); idx++)
-    if (plan_cache[idx].planname && plan_cache[idx].planid
-        && !strcmp (plan_cache[idx].planname, name))
-      {
-        tmp = plan_cache[idx].planid;
-        plan_cache[idx].planid = plan_id_copy;
-        xfree (tmp);
-        return; /* Updated.  */
-      }
-
-  /* Second find a free slot and allocate a new entry.  */
-  name_copy = xtrystrdup (name);
-  if (!name_copy)
-    return;  /* out of core */
-
-  for (idx=0; idx < DIM (plan_cache); idx++)
-    if (!plan_cache[idx].planname)
-      {
-        plan_cache[idx].planname = name_copy;
-        plan_cache[idx].planid = plan_id_copy;
-        plan_cache[idx].counter = ++plan_counter;
-        return; /* New entry.  */
-      }
-
-  /* No entries found.  Recycle the oldest slot.  */
-  low = plan_counter;
-  low_idx = 0;
-  for (idx=0; idx < DIM (plan_cache); idx++)
-    if (plan_cache[idx].planname
-        && plan_cache[idx].counter < low)
-      {
-        low = plan_cache[idx].counter;
-        low_idx = idx;
-      }
-
-  tmp = plan_cache[low_idx].planname;
-  tmp2 = plan_cache[low_idx].planid;
-  plan_cache[low_idx].planname = name_copy;
-  plan_cache[low_idx].planid = plan_id_copy;
-  plan_cache[low_idx].counter = ++plan_counter;
-  xfree (tmp);
-  xfree (tmp2);
+  gpg_error_t err = 0;
+  int res;
+  const char *reason = NULL;
+  time_t now;
+
+  *r_access_token = NULL;
+
+  now = time (NULL);
+  if (now == (time_t)(-1))
+    {
+      log_error ("time() failed: %s\n",
+                 gpg_strerror (gpg_error_from_syserror()));
+      severe_error ();
+    }
+
+  res = npth_rwlock_rdlock (&access_token_rwlock);
+  if (res)
+    log_fatal ("paypal: failed to acquire access token lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+  if (!access_token)
+    reason = "not yet cached";
+  else if (status_unauthorized_seen)
+    reason = "401 recently seen";
+  else if (now + 30 < access_token_expires_on)
+    {
+      *r_access_token = xtrystrdup (access_token);
+      if (!*r_access_token)
+        err = gpg_error_from_syserror ();
+    }
+  else
+    reason = "expire time too close";
+  npth_rwlock_unlock (&access_token_rwlock);
+
+  if (reason)
+    log_info ("paypal: cached access token: %s\n", reason);
+  return err;
+}
+
+
+/* Return a paypal OAUTH2 access token.  The common case of a valid
+ * cached token only takes a read lock.  */
+static gpg_error_t
+get_access_token (char **r_access_token)
+{
+  gpg_error_t err;
+
+  err = get_cached_access_token (r_access_token);
+  if (err || *r_access_token)
+    return err;
+
+  err = refresh_access_token ();
+  if (err)
+    return err;
+
+  err = get_cached_access_token (r_access_token);
+  if (!err && !*r_access_token)
+    {
+      log_error ("paypal: error getting access token: %s\n",
+                 "new token not usable");
+      err = gpg_error (GPG_ERR_GENERAL);
+    }
+  return err;
 }
 
 
@@ -761,21 +787,7 @@ find_plan (const char *name, const char *access_token, char **r_plan_id)
 
   *r_plan_id = NULL;
 
-  /* First check the cache.  */
-  for (idx=0; idx < DIM (plan_cache); idx++)
-    if (plan_cache[idx].planname && plan_cache[idx].planid
-        && !strcmp (plan_cache[idx].planname, name))
-      {
-        *r_plan_id = xtrystrdup (plan_cache[idx].planid);
-        if (!*r_plan_id)
-          return gpg_error_from_syserror ();
-        /* Fixme: this debug outout is not thread-safe */
-        log_debug ("paypal: plan-cache: Found %s as %s at %d\n",
-                   plan_cache[idx].planname, plan_cache[idx].planid, idx);
-        return 0;
-      }
-
-  /* Then ask Paypal.  */
+  /* Ask Paypal.  */
   do
     {
       es_free (method); method = NULL;
@@ -865,7 +877,6 @@ find_plan (const char *name, const char *access_token, char **r_plan_id)
     {
       *r_plan_id = last_plan_id;
       last_plan_id = NULL;
-      cache_plan_id (name, *r_plan_id);
     }
   cJSON_Delete (json);
   es_free (method);
@@ -886,6 +897,7 @@ find_plan (const char *name, const char *access_token, char **r_plan_id)
  *
  *  _plan-name: The name of the plan.
  *    _plan-id: The PayPal plan id.
+ * _plan-cached: Set to 1 if the plan id was taken from the cache.
  */
 gpg_error_t
 paypal_find_create_plan (keyvalue_t *dict)
@@ -945,6 +957,19 @@ paypal_find_create_plan (keyvalue_t *dict)
   if (err)
     goto leave;
 
+  err = plancache_get (PLAN_SERVICE_PAYPAL, currency, amount, recur,
+                       &plan_id);
+  if (err)
+    goto leave;
+  if (plan_id)
+    {
+      if (opt.debug_paypal)
+        log_debug ("paypal: plan '%s' with id '%s' from cache\n",
+                   plan_name, plan_id);
+      err = keyvalue_put (dict, "_plan-cached", "1");
+      goto leave;
+    }
+
   err = get_access_token (&access_token);
   if (err)
     goto leave;
@@ -956,6 +981,7 @@ paypal_find_create_plan (keyvalue_t *dict)
   if (plan_id)
     {
       log_info ("found plan '%s' with id '%s'\n", plan_name, plan_id);
+      plancache_put (PLAN_SERVICE_PAYPAL, currency, amount, recur, plan_id);
       goto leave;
     }
 
@@ -1054,7 +1080,7 @@ paypal_find_create_plan (keyvalue_t *dict)
     }
   log_info ("paypal: new plan '%s' with id '%s' activated\n",
             plan_name, plan_id);
-  cache_plan_id (plan_name, plan_id);
+  plancache_put (PLAN_SERVICE_PAYPAL, currency, amount, recur, plan_id);
 
 
  leave:
@@ -1069,6 +1095,45 @@ paypal_find_create_plan (keyvalue_t *dict)
 }
 
 
+/* Return a malloced JSON request to create a billing agreement for
+ * a subscription.  Returns NULL on error with ERRNO set.  */
+static char *
+build_agreement_request (const char *plan_name, const char *account_id,
+                         const char *desc, const char *start_date,
+                         const char *plan_id, const char *email,
+                         const char *cancel_url, const char *return_url,
+                         const char *aliasid)
+{
+  return es_bsprintf ("{"
+                      "  \"name\": \"Subscription %s (%s)\","
+                      "  \"description\": \"%s\","
+                      "  \"start_date\": \"%s\","
+                      "  \"plan\": {"
+                      "      \"id\": \"%s\""
+                      "  },"
+                      "  \"payer\": {"
+                      "      \"payment_method\": \"paypal\","
+                      "      \"payer_info\": {"
+                      "          \"email\": \"%s\""
+                      "      }"
+                      "  },"
+                      "  \"override_merchant_preferences\": {"
+                      "    \"cancel_url\": \"%s%caliasid=%s\","
+                      "    \"return_url\": \"%s%caliasid=%s\""
+                      "  }"
+                      "}",
+                      plan_name, account_id,
+                      desc,
+                      start_date,
+                      plan_id,
+                      email,
+                      cancel_url,
+                      strchr (return_url, '?')? '&' : '?', aliasid,
+                      return_url,
+                      strchr (return_url, '?')? '&' : '?', aliasid);
+}
+
+
 /* The implementation of the PPCHECKOUT sub-command "prepare" for
  * recurring donations.  The exepcted value in DICT are:
  *
@@ -1194,33 +1259,9 @@ paypal_create_subscription (keyvalue_t *dict)
     }
 
   /* Prepare the payment.  */
-  request = es_bsprintf ("{"
-                         "  \"name\": \"Subscription %s (%s)\","
-                         "  \"description\": \"%s\","
-                         "  \"start_date\": \"%s\","
-                         "  \"plan\": {"
-                         "      \"id\": \"%s\""
-                         "  },"
-                         "  \"payer\": {"
-                         "      \"payment_method\": \"paypal\","
-                         "      \"payer_info\": {"
-                         "          \"email\": \"%s\""
-                         "      }"
-                         "  },"
-                         "  \"override_merchant_preferences\": {"
-                         "    \"cancel_url\": \"%s%caliasid=%s\","
-                         "    \"return_url\": \"%s%caliasid=%s\""
-                         "  }"
-                         "}",
-                         plan_name, account_id,
-                         desc,
-                         start_date,
-                         plan_id,
-                         email,
-                         cancel_url,
-                         strchr (return_url, '?')? '&' : '?', aliasid,
-                         return_url,
-                         strchr (return_url, '?')? '&' : '?', aliasid);
+  request = build_agreement_request (plan_name, account_id, desc,
+                                     start_date, plan_id, email,
+                                     cancel_url, return_url, aliasid);
   if (!request)
     {
       err = gpg_error_from_syserror ();
@@ -1233,6 +1274,42 @@ paypal_create_subscription (keyvalue_t *dict)
                      &status, &json);
   if (err)
     goto leave;
+  if ((status == 400 || status == 404)
+      && keyvalue_get_int (*dict, "_plan-cached"))
+    {
+      /* PayPal may not know the cached plan anymore.  Forget it,
+       * find or create the plan again and retry once.  */
+      log_info ("paypal: agreement with cached plan '%s' failed - retrying\n",
+                plan_id);
+      plancache_remove (PLAN_SERVICE_PAYPAL,
+                        keyvalue_get_string (*dict, "Currency"),
+                        keyvalue_get_string (*dict, "Amount"),
+                        keyvalue_get_int (*dict, "Recur"));
+      keyvalue_del (*dict, "_plan-cached");
+      cJSON_Delete (json);
+      json = NULL;
+      err = paypal_find_create_plan (dict);
+      if (err)
+        goto leave;
+      /* The old pointers are not valid anymore.  */
+      plan_id = keyvalue_get_string (*dict, "_plan-id");
+      plan_name = keyvalue_get_string (*dict, "_plan-name");
+      xfree (request);
+      request = build_agreement_request (plan_name, account_id, desc,
+                                         start_date, plan_id, email,
+                                         cancel_url, return_url, aliasid);
+      if (!request)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      err = call_paypal (HTTP_REQ_POST, 1, access_token,
+                         "payments/billing-agreements", NULL,
+                         NULL, request,
+                         &status, &json);
+      if (err)
+        goto leave;
+    }
   if (status != 200 && status != 201)
     {
       log_error ("paypal: error sending payment: status=%u\n", status);
@@ -1697,3 +1774,30 @@ paypal_checkout_execute (keyvalue_t *dict)
   xfree (paypal_payer);
   return err;
 }
+
+
+/* Refresh the access token ahead of its expiration so that requests
+ * do not need to wait for a new token.  Nothing is done if PayPal has
+ * not yet been used.  This is called by the housekeeping thread.  */
+void
+paypal_housekeeping (void)
+{
+  int res;
+  int need_refresh;
+
+  res = npth_rwlock_rdlock (&access_token_rwlock);
+  if (res)
+    log_fatal ("paypal: failed to acquire access token lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+  need_refresh = (access_token
+                  && (time (NULL) + ACCESS_TOKEN_REFRESH_AHEAD
+                      >= access_token_expires_on));
+  npth_rwlock_unlock (&access_token_rwlock);
+
+  if (need_refresh)
+    {
+      if (opt.verbose)
+        log_info ("paypal: refreshing access token\n");
+      refresh_access_token ();
+    }
+}
@@ -25,10 +25,13 @@ gpg_error_t paypal_find_create_plan (keyvalue_t *dict);
 gpg_error_t paypal_create_subscription (keyvalue_t *dict);
 gpg_error_t paypal_checkout_prepare (keyvalue_t *dict);
 gpg_error_t paypal_checkout_execute (keyvalue_t *dict);
+void paypal_housekeeping (void);
 
 
 /*-- paypal-ipn.c --*/
-void paypal_proc_ipn (keyvalue_t *dict);
+void paypal_ipn_start_workers (void);
+gpg_error_t paypal_queue_ipn (keyvalue_t *dict);
+void paypal_ipn_housekeeping (void);
 
 
 #endif /*PAYPAL_H*/
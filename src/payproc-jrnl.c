@@ -670,14 +670,27 @@ print_string (const char *string)
     {
       const char *s;
       char *raw;
+      char specials[7] = "<>&\n\r";
+      size_t n;
 
       raw = percent_unescape (string, ' ');
       if (!raw)
         log_fatal ("percent_unescape failed: %s\n",
                    gpg_strerror (gpg_error_from_syserror ()));
 
+      specials[5] = opt.separator;
       for (s = raw; *s; s++)
         {
+          /* Write the run of characters which need no escaping.  */
+          n = strcspn (s, specials);
+          if (n)
+            {
+              es_write (es_stdout, s, n, NULL);
+              s += n;
+              if (!*s)
+                break;
+            }
+
           if (*s == opt.separator)
             es_printf ("&#%d;", opt.separator);
           else if (*s == '<')
@@ -690,8 +703,6 @@ print_string (const char *string)
             es_fputs ("<br/>", es_stdout);
           else if (*s == '\r')
             ;
-          else
-            es_putc (*s, es_stdout);
         }
 
       xfree (raw);
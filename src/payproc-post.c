@@ -33,14 +33,11 @@
 #include <ctype.h>
 #include <errno.h>
 #include <unistd.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <sys/un.h>
 
 #include "util.h"
 #include "logging.h"
 #include "argparse.h"
-#include "protocol-io.h"
+#include "client.h"
 
 
 /* Constants to identify the options. */
@@ -59,6 +56,7 @@ enum opt_values
 
     oLive,
     oTest,
+    oBinary,
 
     oLast
   };
@@ -78,6 +76,7 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_n (oVerbose, "verbose",  "verbose diagnostics"),
   ARGPARSE_s_n (oLive, "live",  "enable live mode"),
   ARGPARSE_s_n (oTest, "test",  "enable test mode"),
+  ARGPARSE_s_n (oBinary, "binary",  "use the binary protocol"),
 
   ARGPARSE_end ()
 };
@@ -87,6 +86,7 @@ static struct
 {
   int verbose;
   int livemode;
+  int binary;
 
 } opt;
 
@@ -175,6 +175,7 @@ main (int argc, char **argv)
         case oVerbose: opt.verbose++; break;
         case oLive: opt.livemode = 1; live_or_test = 1; break;
         case oTest: opt.livemode = 0; live_or_test = 1; break;
+        case oBinary: opt.binary = 1; break;
 
         default: pargs.err = ARGPARSE_PRINT_ERROR; break;
 	}
@@ -242,88 +243,18 @@ main (int argc, char **argv)
 }
 
 
-/* Connect to the daemon and return an estream for the connected
-   socket.  On error returns NULL and sets ERRNO.  */
-static estream_t
-connect_daemon (const char *name)
-{
-  int sock;
-  struct sockaddr_un addr_un;
-  struct sockaddr    *addrp;
-  size_t addrlen;
-  estream_t fp;
-
-  if (strlen (name)+1 >= sizeof addr_un.sun_path)
-    {
-      gpg_err_set_errno (EINVAL);
-      return NULL;
-    }
-
-  memset (&addr_un, 0, sizeof addr_un);
-  addr_un.sun_family = AF_LOCAL;
-  strncpy (addr_un.sun_path, name, sizeof (addr_un.sun_path) - 1);
-  addr_un.sun_path[sizeof (addr_un.sun_path) - 1] = 0;
-  addrlen = SUN_LEN (&addr_un);
-  addrp = (struct sockaddr *)&addr_un;
-
-  sock = socket (AF_LOCAL, SOCK_STREAM, 0);
-  if (sock == -1)
-    return NULL;
-
-  if (connect (sock, addrp, addrlen))
-    {
-      int saveerr = errno;
-      close (sock);
-      errno = saveerr;
-      return NULL;
-    }
-
-  fp = es_fdopen (sock, "r+b");
-  if (!fp)
-    {
-      int saveerr = errno;
-      close (sock);
-      gpg_err_set_errno (saveerr);
-      return NULL;
-    }
-
-  return fp;
-}
-
-
 /* Send COMMAND and INDATA to the daemon.  On return OUTDATA is updated with the
    response values.  */
 static gpg_error_t
 send_request (const char *command, keyvalue_t indata, keyvalue_t *outdata)
 {
   gpg_error_t err;
-  estream_t fp;
-  keyvalue_t kv;
   const char *s;
 
-  fp = connect_daemon (opt.livemode? PAYPROCD_SOCKET_NAME
-                       /**/        : PAYPROCD_TEST_SOCKET_NAME);
-  if (!fp)
-    {
-      err = gpg_error_from_syserror ();
-      log_error ("Error connecting payprocd: %s\n", gpg_strerror (err));
-      return err;
-    }
-
-  es_fprintf (fp, "%s\n", command);
-  for (kv = indata; kv; kv = kv->next)
-    es_fprintf (fp, "%s: %s\n", kv->name, kv->value);
-
-  es_putc ('\n', fp);
-
-  if (es_ferror (fp) || es_fflush (fp))
-    {
-      err = gpg_error_from_syserror ();
-      log_error ("Error writing to payprocd: %s\n", gpg_strerror (err));
-      exit (1);
-    }
-
-  err = protocol_read_response (fp, outdata);
+  err = client_request (opt.livemode? PAYPROCD_SOCKET_NAME
+                        /**/        : PAYPROCD_TEST_SOCKET_NAME,
+                        opt.binary? CLIENT_FLAG_BINARY : 0,
+                        command, indata, outdata);
   if (err && (s=keyvalue_get (*outdata, "_errdesc")))
     {
       log_error ("Command failed: %s %s%s%s\n",
@@ -334,13 +265,7 @@ send_request (const char *command, keyvalue_t indata, keyvalue_t *outdata)
         log_info("                %s\n", s);
     }
   else if (err)
-    log_error ("Error reading from payprocd: %s\n", gpg_strerror (err));
-
-  /* Eat the response for a clean connection shutdown.  */
-  while (es_getc (fp) != EOF)
-    ;
-
-  es_fclose (fp);
+    log_error ("Error talking to payprocd: %s\n", gpg_strerror (err));
 
   return err;
 }
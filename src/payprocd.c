@@ -39,12 +39,15 @@
 #include "logging.h"
 #include "argparse.h"
 #include "commands.h"
+#include "http.h"
 #include "tlssupport.h"
 #include "cred.h"
 #include "journal.h"
 #include "session.h"
 #include "currency.h"
 #include "encrypt.h"
+#include "account.h"
+#include "paypal.h"
 #include "payprocd.h"
 
 
@@ -64,12 +67,29 @@ static int shutdown_pending;
 /* Number of active connections.  */
 static int active_connections;
 
+/* To avoid flooding the log at high connection rates, connections
+   are only counted per uid and the counters are logged by the
+   housekeeping thread in verbose mode.  Uids which do not fit into the table are
+   counted in CONN_STATS_OTHER.  No lock is required because the
+   table is only changed between npth scheduling points.  */
+#define MAX_CONN_STATS 16
+static struct
+{
+  uid_t uid;
+  unsigned int count;
+} conn_stats[MAX_CONN_STATS];
+static int n_conn_stats;
+static unsigned int conn_stats_other;
+
 /* The thread specific data key.  */
 static npth_key_t my_tsd_key;
 
 /* The log file.  */
 static const char *logfile;
 
+/* Write the log via a writer thread.  */
+static int async_log;
+
 
 
 /* Constants to identify the options. */
@@ -84,6 +104,7 @@ enum opt_values
     oNoConfig   = 500,
     oLogFile,
     oNoLogFile,
+    oAsyncLog,
     oNoDetach,
     oJournal,
     oStripeKey,
@@ -94,6 +115,10 @@ enum opt_values
     oAdminGID,
     oDatabaseKey,
     oBackofficeKey,
+    oEnvelopeEncryption,
+    oCurrencyTable,
+    oFakePsp,
+    oTlsCa,
     oDebugClient,
     oDebugStripe,
     oDebugPaypal,
@@ -114,6 +139,8 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_n (oNoDetach, "no-detach", "run in foreground"),
   ARGPARSE_s_s (oLogFile,  "log-file",  "|FILE|write log output to FILE"),
   ARGPARSE_s_n (oNoLogFile,"no-log-file", "@"),
+  ARGPARSE_s_n (oAsyncLog, "async-log",
+                "write the log from a separate thread"),
   ARGPARSE_s_s (oAllowUID, "allow-uid", "|N|allow access from uid N"),
   ARGPARSE_s_s (oAllowGID, "allow-gid", "|N|allow access from gid N"),
   ARGPARSE_s_s (oAdminUID, "admin-uid", "|N|allow admin access from uid N"),
@@ -127,6 +154,13 @@ static ARGPARSE_OPTS opts[] = {
                 "database-key", "|FPR|secret key for the database"),
   ARGPARSE_s_s (oBackofficeKey,
                 "backoffice-key", "|FPR|public key for the backoffice"),
+  ARGPARSE_s_n (oEnvelopeEncryption, "envelope-encryption",
+                "seal database fields with a data encryption key"),
+  ARGPARSE_s_s (oCurrencyTable, "currency-table",
+                "|FILE|read the supported currencies from FILE"),
+  ARGPARSE_s_s (oFakePsp, "fake-psp",
+                "|URL|send all Stripe and PayPal requests to URL"),
+  ARGPARSE_s_s (oTlsCa, "tls-ca", "|FILE|also trust the CAs from FILE"),
 
   ARGPARSE_s_n (oDebugClient, "debug-client", "debug I/O with the client"),
   ARGPARSE_s_n (oDebugStripe, "debug-stripe", "debug the Stripe REST"),
@@ -269,6 +303,81 @@ add_allowed_uid (const char *string, int also_admin)
 }
 
 
+/* Count a new connection from UID.  */
+static void
+count_connection (uid_t uid)
+{
+  int i;
+
+  for (i=0; i < n_conn_stats; i++)
+    if (conn_stats[i].uid == uid)
+      {
+        conn_stats[i].count++;
+        return;
+      }
+  if (n_conn_stats < MAX_CONN_STATS)
+    {
+      conn_stats[n_conn_stats].uid = uid;
+      conn_stats[n_conn_stats++].count = 1;
+    }
+  else
+    conn_stats_other++;
+}
+
+
+/* Log and reset the connection counters.  */
+static void
+log_connection_stats (void)
+{
+  unsigned int counts[MAX_CONN_STATS];
+  uid_t uids[MAX_CONN_STATS];
+  unsigned int other;
+  int i, n;
+
+  /* Take a copy before logging because logging may let other threads
+     run.  */
+  n = n_conn_stats;
+  for (i=0; i < n; i++)
+    {
+      uids[i] = conn_stats[i].uid;
+      counts[i] = conn_stats[i].count;
+    }
+  other = conn_stats_other;
+  n_conn_stats = 0;
+  conn_stats_other = 0;
+
+  if (!n)
+    return;
+  log_info ("connections since last report:");
+  for (i=0; i < n; i++)
+    log_printf (" uid %u: %u", (unsigned int)uids[i], counts[i]);
+  if (other)
+    log_printf (" other: %u", other);
+  log_printf ("\n");
+}
+
+
+/* Return the CONN_PERM_ flags for a client with UID.  */
+static unsigned int
+client_permissions (uid_t uid)
+{
+  unsigned int perms = 0;
+  int i;
+
+  if (!opt.n_allowed_uids)
+    perms |= CONN_PERM_USER;
+  for (i=0; !perms && i < opt.n_allowed_uids; i++)
+    if (opt.allowed_uids[i] == uid)
+      perms |= CONN_PERM_USER;
+
+  for (i=0; i < opt.n_allowed_admin_uids; i++)
+    if (opt.allowed_admin_uids[i] == uid)
+      perms |= CONN_PERM_ADMIN;
+
+  return perms;
+}
+
+
 /* This callback is used by the log functions to return an identifier
    for the current thread.  */
 static int
@@ -299,6 +408,7 @@ parse_options (int argc, char **argv)
   unsigned int configlineno;
   FILE *configfp = NULL;
   int live_or_test = 0;
+  int tls_ca_given = 0;
 
   /* First check whether we have a config file on the commandline.  We
    * also check for the --test and --live flag to decide on the
@@ -364,6 +474,7 @@ parse_options (int argc, char **argv)
         case oNoDetach: opt.nodetach = 1; break;
         case oLogFile:  logfile = pargs.r.ret_str; break;
         case oNoLogFile: logfile = NULL; break;
+        case oAsyncLog: async_log = 1; break;
         case oJournal:  jrnl_set_file (pargs.r.ret_str); break;
         case oAllowUID: add_allowed_uid (pargs.r.ret_str, 0); break;
         case oAllowGID: /*FIXME*/ break;
@@ -382,6 +493,16 @@ parse_options (int argc, char **argv)
           xfree (opt.backoffice_key_fpr);
           opt.backoffice_key_fpr = xstrdup (pargs.r.ret_str);
           break;
+        case oEnvelopeEncryption: opt.envelope_encryption = 1; break;
+        case oCurrencyTable: currency_set_table_file (pargs.r.ret_str); break;
+        case oFakePsp:
+          xfree (opt.fake_psp_url);
+          opt.fake_psp_url = xstrdup (pargs.r.ret_str);
+          break;
+        case oTlsCa:
+          http_register_tls_ca (pargs.r.ret_str);
+          tls_ca_given = 1;
+          break;
 
         case oConfig:
           if (!configfp)
@@ -411,6 +532,17 @@ parse_options (int argc, char **argv)
 
   if (!live_or_test)
     log_info ("implicitly using --test\n");
+
+  if (opt.fake_psp_url && opt.livemode)
+    {
+      log_error ("option --fake-psp may only be used in test mode\n");
+      exit (2);
+    }
+  if (tls_ca_given && opt.livemode)
+    {
+      log_error ("option --tls-ca may only be used in test mode\n");
+      exit (2);
+    }
 }
 
 
@@ -449,12 +581,19 @@ main (int argc, char **argv)
 
 
   /* Check that Libgcrypt is suitable.  */
-  gcry_control (GCRYCTL_DISABLE_SECMEM, 0);
   if (!gcry_check_version (NEED_LIBGCRYPT_VERSION) )
     {
       log_fatal ("%s is too old (need %s, have %s)\n", "libgcrypt",
                  NEED_LIBGCRYPT_VERSION, gcry_check_version (NULL) );
     }
+  /* We use secure memory for the data encryption keys and the cache
+   * of decrypted account records so that they are never swapped
+   * out.  The account cache is limited to 32 KiB; the rest is for
+   * the DEKs and the cipher handles of concurrent connections.  */
+  gcry_control (GCRYCTL_SUSPEND_SECMEM_WARN);
+  gcry_control (GCRYCTL_INIT_SECMEM, 131072, 0);
+  gcry_control (GCRYCTL_RESUME_SECMEM_WARN);
+  gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
 
   /* Initialze processing subsystems.  */
   init_tls_subsystem ();
@@ -686,6 +825,7 @@ static void
 launch_server (void)
 {
   int fd;
+  int ret;
 
   fd = create_socket (server_socket_name ());
   fflush (NULL);
@@ -772,9 +912,15 @@ launch_server (void)
     sigaction (SIGPIPE, &sa, NULL);
   }
 
+  /* The writer thread needs to be started after the fork.  */
+  if (async_log && (ret = log_set_async (256*1024)))
+    log_error ("error starting the log writer: %s\n", strerror (ret));
+
   log_info ("payprocd %s started\n", PACKAGE_VERSION);
   jrnl_store_sys_record ("payprocd "PACKAGE_VERSION" started");
   read_exchange_rates ();
+  currency_watch_rates ();
+  paypal_ipn_start_workers ();
   server_loop (fd);
   close (fd);
 }
@@ -889,9 +1035,31 @@ server_loop (int listen_fd)
           else
             {
 	      npth_t thread;
+              pid_t pid;
+              uid_t uid;
+              gid_t gid;
 
               init_connection_obj (conn, fd);
               fd = -1; /* Now owned by CONN.  */
+
+              /* Get the credentials only once per connection; the
+                 permissions are then taken from CONN.  */
+              if (credentials_from_socket (fd_from_connection_obj (conn),
+                                           &pid, &uid, &gid))
+                {
+                  log_error ("credentials missing - closing\n");
+                  release_connection_obj (conn);
+                  continue;
+                }
+              set_permissions_connection_obj (conn,
+                                              client_permissions (uid));
+              if (opt.verbose)
+                count_connection (uid);
+              if (opt.verbose > 1)
+                log_info ("new connection %u - pid=%u uid=%u gid=%u\n",
+                          id_from_connection_obj (conn), (unsigned int)pid,
+                          (unsigned int)uid, (unsigned int)gid);
+
 	      ret = npth_create (&thread, &tattr, connection_thread, conn);
               if (ret)
                 {
@@ -956,13 +1124,19 @@ housekeeping_thread (void *arg)
   if (opt.verbose > 1)
     log_info ("starting housekeeping\n");
 
+  if (opt.verbose)
+    log_connection_stats ();
   session_housekeeping ();
+  account_housekeeping ();
+  paypal_housekeeping ();
+  paypal_ipn_housekeeping ();
 
   /* Stuff we do only every hour:  */
   if (count >= 3600 / HOUSEKEEPING_INTERVAL)
     {
       count = 0;
-      read_exchange_rates ();
+      if (!currency_rates_watched_p ())
+        read_exchange_rates ();
     }
 
   if (opt.verbose > 1)
@@ -1015,6 +1189,14 @@ shutdown_server (void)
 }
 
 
+/* Return true if a shutdown has been requested.  */
+int
+shutdown_pending_p (void)
+{
+  return !!shutdown_pending;
+}
+
+
 /* The signal handler for payprocd.  It is expected to be run in its
    own thread and not in the context of a signal handler.  */
 static void
@@ -1023,6 +1205,10 @@ handle_signal (int signo)
   switch (signo)
     {
     case SIGHUP:
+      log_info ("SIGHUP received - reloading the currency table"
+                " and the CA certificates\n");
+      read_exchange_rates ();
+      reload_tls_subsystem ();
       break;
 
     case SIGUSR1:
@@ -1071,31 +1257,16 @@ connection_thread (void *arg)
 {
   conn_t conn = arg;
   unsigned int idno;
-  pid_t pid;
-  uid_t uid;
-  gid_t gid;
 
   idno = id_from_connection_obj (conn);
   npth_setspecific (my_tsd_key, &idno);
 
-  if (credentials_from_socket (fd_from_connection_obj (conn), &pid, &uid, &gid))
-    {
-      log_error ("credentials missing - closing\n");
-      goto leave;
-    }
-
   active_connections++;
-  if (opt.verbose)
-    log_info ("new connection - pid=%u uid=%u gid=%u\n",
-              (unsigned int)pid, (unsigned int)uid, (unsigned int)gid);
-
-  connection_handler (conn, uid);
-
-  if (opt.verbose)
+  connection_handler (conn);
+  if (opt.verbose > 1)
     log_info ("connection terminated\n");
   active_connections--;
 
- leave:
   release_connection_obj (conn);
   npth_setspecific (my_tsd_key, NULL);  /* To be safe.  */
   return NULL;
@@ -35,6 +35,7 @@ struct
   int livemode;  /* Expect to be in live mode.  Default is test mode.  */
   char *stripe_secret_key;  /* The secret key for stripe.com */
   char *paypal_secret_key;  /* The secret key for PayPal */
+  char *fake_psp_url;  /* Base URL of a fake Stripe/PayPal for testing.  */
 
   /* The fingerprint of the OpenPGP key used to encrypt items in the
    * database.  A secret and a public key is required.  */
@@ -42,6 +43,9 @@ struct
   /* The fingerprint of the OpenPGP key used to encrypt data for use
    * by the backoffice.  Only the public key is required.  */
   char *backoffice_key_fpr;
+  /* Seal database fields with a data encryption key instead of
+   * encrypting each field using OpenPGP.  */
+  int envelope_encryption;
 
   /* The count and the list of clients allowed to use the service.  */
   int n_allowed_uids;
@@ -57,6 +61,7 @@ struct
 const char *server_socket_name (void);
 
 void shutdown_server (void);
+int shutdown_pending_p (void);
 
 
 #endif /*PAYPROCD_H*/
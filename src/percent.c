@@ -30,13 +30,24 @@
 #include <config.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <ctype.h>
-#include <assert.h>
 
 #include "util.h"
 
 
+/* Table of the bytes which are escaped by percent_plus_escape.  */
+static const unsigned char plus_escape_chars[256] =
+  {
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    ['"'] = 1, ['%'] = 1, ['+'] = 1
+  };
+
+static const char hexdigits[16] = "0123456789ABCDEF";
+
+
 /* Create a newly alloced string from STRING with all spaces and
    control characters converted to plus signs or %xx sequences.  The
    function returns the new string or NULL in case of a malloc
@@ -52,29 +63,23 @@ char *
 percent_plus_escape (const char *string)
 {
   char *buffer, *p;
-  const char *s;
+  const unsigned char *s;
   size_t length;
 
-  for (length=1, s=string; *s; s++)
-    {
-      if (*s == '+' || *s == '\"' || *s == '%'
-          || *(const unsigned char *)s < 0x20)
-        length += 3;
-      else
-        length++;
-    }
+  for (length=1, s=(const unsigned char *)string; *s; s++)
+    length += plus_escape_chars[*s]? 3 : 1;
 
   buffer = p = xtrymalloc (length);
   if (!buffer)
     return NULL;
 
-  for (s=string; *s; s++)
+  for (s=(const unsigned char *)string; *s; s++)
     {
-      if (*s == '+' || *s == '\"' || *s == '%'
-          || *(const unsigned char *)s < 0x20)
+      if (plus_escape_chars[*s])
         {
-          snprintf (p, 4, "%%%02X", *(unsigned char *)s);
-          p += 3;
+          *p++ = '%';
+          *p++ = hexdigits[*s >> 4];
+          *p++ = hexdigits[*s & 15];
         }
       else if (*s == ' ')
         *p++ = '+';
@@ -88,57 +93,63 @@ percent_plus_escape (const char *string)
 }
 
 
+/* Table of the bytes which stop a run of characters for do_unescape.
+   Bit 0 is set for the characters which always stop a run and bit 1
+   for the plus sign.  */
+static const unsigned char unescape_stop[256] =
+  {
+    [0] = 1, ['%'] = 1, ['+'] = 2
+  };
+
+
 /* Do the percent and plus/space unescaping from STRING to BUFFER and
-   return the length of the valid buffer.  Plus unescaping is only
-   done if WITHPLUS is true.  An escaped Nul character will be
-   replaced by NULREPL.  */
+   return the length of the valid buffer.  BUFFER may be the same as
+   STRING; it never needs more than strlen (STRING) bytes.  Plus
+   unescaping is only done if WITHPLUS is true.  An escaped Nul
+   character will be replaced by NULREPL.  */
 static size_t
 do_unescape (unsigned char *buffer, const unsigned char *string,
              int withplus, int nulrepl)
 {
+  const unsigned char mask = withplus? 3 : 1;
   unsigned char *p = buffer;
 
-  while (*string)
+  for (;;)
     {
-      if (*string == '%' && string[1] && string[2])
+      /* Nothing needs to be copied for an in-place operation as long
+         as no escape sequence has been seen.  */
+      if (p == string)
         {
-          string++;
-          *p = xtoi_2 (string);
-          if (!*p)
-            *p = nulrepl;
-          string++;
+          while (!(unescape_stop[*string] & mask))
+            string++;
+          p = (unsigned char *)string;
         }
-      else if (*string == '+' && withplus)
-        *p = ' ';
       else
-        *p = *string;
-      p++;
-      string++;
-    }
-
-  return (p - buffer);
-}
-
-
-/* Count space required after unescaping STRING.  Note that this will
-   never be larger than strlen (STRING).  */
-static size_t
-count_unescape (const unsigned char *string)
-{
-  size_t n = 0;
+        {
+          while (!(unescape_stop[*string] & mask))
+            *p++ = *string++;
+        }
+      if (!*string)
+        break;
 
-  while (*string)
-    {
       if (*string == '%' && string[1] && string[2])
         {
-          string++;
+          *p = xtoi_2 (string+1);
+          if (!*p)
+            *p = nulrepl;
+          string += 3;
+        }
+      else if (*string == '+')
+        {
+          *p = ' ';
           string++;
         }
-      string++;
-      n++;
+      else /* Truncated escape sequence.  */
+        *p = *string++;
+      p++;
     }
 
-  return n;
+  return (p - buffer);
 }
 
 
@@ -146,17 +157,11 @@ count_unescape (const unsigned char *string)
 static char *
 do_plus_or_plain_unescape (const char *string, int withplus, int nulrepl)
 {
-  size_t nbytes, n;
   char *newstring;
 
-  nbytes = count_unescape (string);
-  newstring = xtrymalloc (nbytes+1);
+  newstring = xtrymalloc (strlen (string)+1);
   if (newstring)
-    {
-      n = do_unescape (newstring, string, withplus, nulrepl);
-      assert (n == nbytes);
-      newstring[n] = 0;
-    }
+    newstring[do_unescape (newstring, string, withplus, nulrepl)] = 0;
   return newstring;
 }
 
@@ -183,34 +188,6 @@ percent_unescape (const char *string, int nulrepl)
 }
 
 
-static size_t
-do_unescape_inplace (char *string, int withplus, int nulrepl)
-{
-  unsigned char *p, *p0;
-
-  p = p0 = string;
-  while (*string)
-    {
-      if (*string == '%' && string[1] && string[2])
-        {
-          string++;
-          *p = xtoi_2 (string);
-          if (!*p)
-            *p = nulrepl;
-          string++;
-        }
-      else if (*string == '+' && withplus)
-        *p = ' ';
-      else
-        *p = *string;
-      p++;
-      string++;
-    }
-
-  return (p - p0);
-}
-
-
 /* Perform percent and plus unescaping in STRING and return the new
    valid length of the string.  Embedded Nul characters are replaced
    by the value of NULREPL.  A terminating Nul character is not
@@ -221,7 +198,7 @@ do_unescape_inplace (char *string, int withplus, int nulrepl)
 size_t
 percent_plus_unescape_inplace (char *string, int nulrepl)
 {
-  return do_unescape_inplace (string, 1, nulrepl);
+  return do_unescape (string, string, 1, nulrepl);
 }
 
 
@@ -235,5 +212,5 @@ percent_plus_unescape_inplace (char *string, int nulrepl)
 size_t
 percent_unescape_inplace (char *string, int nulrepl)
 {
-  return do_unescape_inplace (string, 0, nulrepl);
+  return do_unescape (string, string, 0, nulrepl);
 }
@@ -0,0 +1,436 @@
+/* plancache.c - Cache for Stripe and PayPal plan ids
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Finding a plan for a recurring payment requires one or, in the case
+ * of PayPal, several requests to the payment service provider.
+ * Because plans are never changed we cache the plan ids in memory and
+ * in a small database so that the cache survives a restart:
+ *
+ * CREATE TABLE plan (
+ *   service INTEGER NOT NULL,  -- See enum plan_services.
+ *   currency TEXT NOT NULL,    -- Lowercase currency code.
+ *   amount TEXT NOT NULL,      -- The amount as used in the plan name.
+ *   recur INTEGER NOT NULL,    -- The recurrence interval.
+ *   plan_id TEXT NOT NULL,     -- The plan id as used by the service.
+ *   created TEXT NOT NULL,
+ *   PRIMARY KEY (service, currency, amount, recur)
+ * )
+ *
+ * The database is read into the hash table on first use.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <npth.h>
+#include <sqlite3.h>
+
+#include "util.h"
+#include "logging.h"
+#include "payprocd.h"
+#include "dbutil.h"
+#include "plancache.h"
+
+
+/* The name of the plan database file.  */
+static const char plan_db_fname[] = "/var/lib/payproc/plan.db";
+static const char plan_test_db_fname[] = "/var/lib/payproc-test/plan.db";
+
+/* If set this file is used instead of the above.  This is only used
+ * by the regression tests.  */
+static const char *plan_db_fname_override;
+
+/* The number of hash buckets and the maximum number of cached
+ * plans.  */
+#define PLAN_BUCKETS    64
+#define MAX_PLANS     1024
+
+/* The maximum length of a currency code and an amount string.  */
+#define MAX_CURRENCY_LEN  3
+#define MAX_AMOUNT_LEN   15
+
+
+/* An object describing a cached plan.  */
+struct plan_s
+{
+  struct plan_s *next;  /* The next plan in the bucket.  */
+  int service;
+  int recur;
+  char currency[MAX_CURRENCY_LEN+1];
+  char amount[MAX_AMOUNT_LEN+1];
+  char plan_id[1];
+};
+typedef struct plan_s *plan_t;
+
+
+/* The hash table with all cached plans and the number of plans.  */
+static plan_t plan_table[PLAN_BUCKETS];
+static int plan_count;
+
+/* The database handle for the plan database or NULL if not yet
+ * opened.  The flag is set after the table has been read.  */
+static sqlite3 *plan_db;
+static int plan_db_loaded;
+
+/* This lock protects the above variables.  */
+static npth_mutex_t plan_lock = NPTH_MUTEX_INITIALIZER;
+
+
+
+static void
+lock_plans (void)
+{
+  int res;
+
+  res = npth_mutex_lock (&plan_lock);
+  if (res)
+    log_fatal ("failed to acquire plan cache lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+static void
+unlock_plans (void)
+{
+  int res;
+
+  res = npth_mutex_unlock (&plan_lock);
+  if (res)
+    log_fatal ("failed to release plan cache lock: %s\n",
+               gpg_strerror (gpg_error_from_errno (res)));
+}
+
+
+/* Copy CURRENCY lowercased to BUFFER which must have a size of
+ * MAX_CURRENCY_LEN+1.  Returns true on success.  */
+static int
+normalize_currency (char *buffer, const char *currency)
+{
+  if (!currency || strlen (currency) > MAX_CURRENCY_LEN)
+    return 0;
+  strcpy (buffer, currency);
+  ascii_strlwr (buffer);
+  return 1;
+}
+
+
+/* Compute the hash bucket for the given key.  */
+static unsigned int
+plan_hash (int service, const char *currency, const char *amount, int recur)
+{
+  unsigned int hash = 2166136261u; /* FNV-1a */
+
+  hash = (hash ^ service) * 16777619u;
+  hash = (hash ^ recur) * 16777619u;
+  for (; *currency; currency++)
+    hash = (hash ^ *(const unsigned char *)currency) * 16777619u;
+  for (; *amount; amount++)
+    hash = (hash ^ *(const unsigned char *)amount) * 16777619u;
+  return hash % PLAN_BUCKETS;
+}
+
+
+/* Find a plan.  CURRENCY must be normalized.  Must be called with
+ * the lock held.  Returns NULL if not found.  */
+static plan_t
+find_cached_plan (int service, const char *currency, const char *amount,
+                  int recur)
+{
+  plan_t plan;
+
+  for (plan = plan_table[plan_hash (service, currency, amount, recur)];
+       plan; plan = plan->next)
+    if (plan->service == service && plan->recur == recur
+        && !strcmp (plan->currency, currency)
+        && !strcmp (plan->amount, amount))
+      return plan;
+  return NULL;
+}
+
+
+/* Insert or update a plan in the hash table.  CURRENCY must be
+ * normalized.  Must be called with the lock held.  Returns true if
+ * the hash table has been changed.  */
+static int
+insert_plan (int service, const char *currency, const char *amount,
+             int recur, const char *plan_id)
+{
+  plan_t plan, *pp;
+  unsigned int hash;
+
+  if (strlen (amount) > MAX_AMOUNT_LEN)
+    return 0;
+
+  hash = plan_hash (service, currency, amount, recur);
+  for (pp = &plan_table[hash]; *pp; pp = &(*pp)->next)
+    if ((*pp)->service == service && (*pp)->recur == recur
+        && !strcmp ((*pp)->currency, currency)
+        && !strcmp ((*pp)->amount, amount))
+      {
+        if (!strcmp ((*pp)->plan_id, plan_id))
+          return 0; /* No change.  */
+        /* Remove the old entry.  */
+        plan = *pp;
+        *pp = plan->next;
+        xfree (plan);
+        plan_count--;
+        break;
+      }
+
+  if (plan_count >= MAX_PLANS)
+    return 0;
+
+  plan = xtrymalloc (sizeof *plan + strlen (plan_id));
+  if (!plan)
+    return 0;  /* Out of core - not a problem for a cache.  */
+  plan->service = service;
+  plan->recur = recur;
+  strcpy (plan->currency, currency);
+  strcpy (plan->amount, amount);
+  strcpy (plan->plan_id, plan_id);
+  plan->next = plan_table[hash];
+  plan_table[hash] = plan;
+  plan_count++;
+  return 1;
+}
+
+
+/* Run the SQL statement STMTSTR which may have up to 6 parameters.
+ * The parameters are given as strings; a NULL terminates the list.
+ * Must be called with the lock held and an open database.  */
+static gpg_error_t
+run_sql (const char *stmtstr, const char *arg1, const char *arg2,
+         const char *arg3, const char *arg4, const char *arg5,
+         const char *arg6)
+{
+  int res;
+  sqlite3_stmt *stmt;
+  const char *args[6];
+  int i;
+
+  args[0] = arg1;
+  args[1] = arg2;
+  args[2] = arg3;
+  args[3] = arg4;
+  args[4] = arg5;
+  args[5] = arg6;
+
+  res = sqlite3_prepare_v2 (plan_db, stmtstr, -1, &stmt, NULL);
+  if (res)
+    {
+      log_error ("error preparing plan db statement: %s\n",
+                 sqlite3_errstr (res));
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+  for (i=0; !res && i < DIM (args) && args[i]; i++)
+    res = sqlite3_bind_text (stmt, i+1, args[i], -1, SQLITE_TRANSIENT);
+  if (!res)
+    res = sqlite3_step (stmt);
+  sqlite3_finalize (stmt);
+  if (res != SQLITE_DONE)
+    {
+      log_error ("error updating the plan db: %s\n", sqlite3_errstr (res));
+      return gpg_error (GPG_ERR_GENERAL);
+    }
+  return 0;
+}
+
+
+/* Open the plan database and read all plans into the hash table.
+ * Must be called with the lock held.  Errors are logged but
+ * otherwise ignored; the cache then works only in memory.  */
+static void
+load_plans (void)
+{
+  int res;
+  sqlite3_stmt *stmt;
+  const char *db_fname = (plan_db_fname_override? plan_db_fname_override :
+                          opt.livemode? plan_db_fname : plan_test_db_fname);
+  const char *currency, *amount, *plan_id;
+  char curbuf[MAX_CURRENCY_LEN+1];
+  int count = 0;
+
+  if (plan_db_loaded)
+    return;
+  plan_db_loaded = 1;  /* Try only once.  */
+
+  res = sqlite3_open_v2 (db_fname, &plan_db,
+                         (SQLITE_OPEN_READWRITE
+                          | SQLITE_OPEN_CREATE
+                          | SQLITE_OPEN_NOMUTEX),
+                         NULL);
+  if (res)
+    {
+      log_error ("error opening '%s': %s\n", db_fname, sqlite3_errstr (res));
+      goto fail;
+    }
+  sqlite3_extended_result_codes (plan_db, 1);
+
+  if (run_sql ("CREATE TABLE IF NOT EXISTS plan (\n"
+               "service  INTEGER NOT NULL,\n"
+               "currency TEXT NOT NULL,\n"
+               "amount   TEXT NOT NULL,\n"
+               "recur    INTEGER NOT NULL,\n"
+               "plan_id  TEXT NOT NULL,\n"
+               "created  TEXT NOT NULL,\n"
+               "PRIMARY KEY (service, currency, amount, recur)"
+               ")", NULL, NULL, NULL, NULL, NULL, NULL))
+    goto fail;
+
+  res = sqlite3_prepare_v2 (plan_db,
+                            "SELECT service, currency, amount, recur, plan_id"
+                            " FROM plan",
+                            -1, &stmt, NULL);
+  if (res)
+    {
+      log_error ("error preparing plan select statement: %s\n",
+                 sqlite3_errstr (res));
+      goto fail;
+    }
+  while ((res = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      currency = (const char *)sqlite3_column_text (stmt, 1);
+      amount   = (const char *)sqlite3_column_text (stmt, 2);
+      plan_id  = (const char *)sqlite3_column_text (stmt, 4);
+      if (currency && amount && plan_id
+          && normalize_currency (curbuf, currency)
+          && insert_plan (sqlite3_column_int (stmt, 0), curbuf, amount,
+                          sqlite3_column_int (stmt, 3), plan_id))
+        count++;
+    }
+  sqlite3_finalize (stmt);
+  if (res != SQLITE_DONE)
+    {
+      log_error ("error reading the plan db: %s\n", sqlite3_errstr (res));
+      goto fail;
+    }
+
+  if (opt.verbose)
+    log_info ("%d plan ids loaded from '%s'\n", count, db_fname);
+  return;
+
+ fail:
+  if (plan_db)
+    sqlite3_close (plan_db);
+  plan_db = NULL;
+}
+
+
+
+/* Lookup the plan id for the plan described by SERVICE, CURRENCY,
+ * AMOUNT, and RECUR.  On success 0 is returned and the plan id is
+ * stored as a malloced string at R_PLAN_ID.  If no plan was found 0
+ * is returned and NULL stored at R_PLAN_ID.  */
+gpg_error_t
+plancache_get (int service, const char *currency, const char *amount,
+               int recur, char **r_plan_id)
+{
+  gpg_error_t err = 0;
+  char curbuf[MAX_CURRENCY_LEN+1];
+  plan_t plan;
+
+  *r_plan_id = NULL;
+
+  if (!normalize_currency (curbuf, currency) || !amount)
+    return 0;
+
+  lock_plans ();
+  load_plans ();
+  plan = find_cached_plan (service, curbuf, amount, recur);
+  if (plan)
+    {
+      *r_plan_id = xtrystrdup (plan->plan_id);
+      if (!*r_plan_id)
+        err = gpg_error_from_syserror ();
+    }
+  unlock_plans ();
+
+  return err;
+}
+
+
+/* Store the PLAN_ID for the plan described by SERVICE, CURRENCY,
+ * AMOUNT, and RECUR in the cache.  Errors are ignored.  */
+void
+plancache_put (int service, const char *currency, const char *amount,
+               int recur, const char *plan_id)
+{
+  char curbuf[MAX_CURRENCY_LEN+1];
+  char servicebuf[25], recurbuf[25];
+  char datetime_buf [DB_DATETIME_SIZE];
+
+  if (!normalize_currency (curbuf, currency) || !amount
+      || !plan_id || !*plan_id)
+    return;
+
+  lock_plans ();
+  load_plans ();
+  if (insert_plan (service, curbuf, amount, recur, plan_id) && plan_db)
+    {
+      snprintf (servicebuf, sizeof servicebuf, "%d", service);
+      snprintf (recurbuf, sizeof recurbuf, "%d", recur);
+      run_sql ("INSERT OR REPLACE INTO plan"
+               " (service, currency, amount, recur, plan_id, created)"
+               " VALUES (?1,?2,?3,?4,?5,?6)",
+               servicebuf, curbuf, amount, recurbuf, plan_id,
+               db_datetime_now (datetime_buf));
+    }
+  unlock_plans ();
+}
+
+
+/* Remove the plan described by SERVICE, CURRENCY, AMOUNT, and RECUR
+ * from the cache.  This shall be used if the service does not know
+ * the plan anymore.  */
+void
+plancache_remove (int service, const char *currency, const char *amount,
+                  int recur)
+{
+  char curbuf[MAX_CURRENCY_LEN+1];
+  char servicebuf[25], recurbuf[25];
+  plan_t plan, *pp;
+
+  if (!normalize_currency (curbuf, currency) || !amount)
+    return;
+
+  lock_plans ();
+  load_plans ();
+  for (pp = &plan_table[plan_hash (service, curbuf, amount, recur)];
+       *pp; pp = &(*pp)->next)
+    if ((*pp)->service == service && (*pp)->recur == recur
+        && !strcmp ((*pp)->currency, curbuf)
+        && !strcmp ((*pp)->amount, amount))
+      {
+        plan = *pp;
+        *pp = plan->next;
+        xfree (plan);
+        plan_count--;
+        break;
+      }
+  if (plan_db)
+    {
+      snprintf (servicebuf, sizeof servicebuf, "%d", service);
+      snprintf (recurbuf, sizeof recurbuf, "%d", recur);
+      run_sql ("DELETE FROM plan WHERE service=?1 AND currency=?2"
+               " AND amount=?3 AND recur=?4",
+               servicebuf, curbuf, amount, recurbuf, NULL, NULL);
+    }
+  unlock_plans ();
+}
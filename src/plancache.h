@@ -0,0 +1,38 @@
+/* plancache.h - Definition for the plan id cache
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLANCACHE_H
+#define PLANCACHE_H
+
+/* The services for which we cache plan ids.  */
+enum plan_services
+  {
+    PLAN_SERVICE_STRIPE = 1,
+    PLAN_SERVICE_PAYPAL = 2
+  };
+
+gpg_error_t plancache_get (int service, const char *currency,
+                           const char *amount, int recur, char **r_plan_id);
+void plancache_put (int service, const char *currency,
+                    const char *amount, int recur, const char *plan_id);
+void plancache_remove (int service, const char *currency,
+                       const char *amount, int recur);
+
+
+#endif /*PLANCACHE_H*/
@@ -19,7 +19,18 @@
 
 /* This is a CGI acting as a proxy for IPN messages from PayPal.  It
    merely reads the request, passes it on to payprocd, and sends back
-   a 200 HTTP response.  */
+   a 200 HTTP response.
+
+   To avoid the fork and exec of a CGI for each notification, ppipnhd
+   can also be run as a resident SCGI server:
+
+     ppipnhd --scgi SOCKETNAME [NWORKERS]
+
+   This creates a Unix domain socket SOCKETNAME for use by the web
+   server and starts NWORKERS processes (default 4) which accept
+   connections on that socket.  The socket is only accessible by the
+   user and group of the process; thus ppipnhd should be run with the
+   group of the web server.  */
 
 #ifdef HAVE_CONFIG_H
 # include <config.h>
@@ -30,11 +41,17 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
 #define PGM "ppipnhd"
 #define MAX_REQUEST (64*1024)
+#define MAX_SCGI_HEADER (16*1024)
+#define MAX_SCGI_WORKERS 64
 
 
 /* Allow building standalone.  */
@@ -51,18 +68,29 @@
 
 
 static void
-print_status (int n, const char *text)
+print_status (FILE *fp, int n, const char *text)
 {
-  printf ("Status: %d %s\r\n", n, text);
+  fprintf (fp, "Status: %d %s\r\n", n, text);
+  fputs ("Content-Type: text/plain\r\n\r\n", fp);
 }
 
 
-static void
-exit_status (int n, const char *text)
+/* Fill in the sockaddr for NAME.  Returns false and sets ERRNO if
+   the name is too long.  */
+static int
+make_sockaddr (struct sockaddr_un *addr_un, const char *name)
 {
-  print_status (n, text);
-  fputs ("Content-Type: text/plain\r\n\r\n", stdout);
-  exit (0);
+  if (strlen (name)+1 >= sizeof addr_un->sun_path)
+    {
+      errno = EINVAL;
+      return 0;
+    }
+
+  memset (addr_un, 0, sizeof *addr_un);
+  addr_un->sun_family = AF_LOCAL;
+  strncpy (addr_un->sun_path, name, sizeof (addr_un->sun_path) - 1);
+  addr_un->sun_path[sizeof (addr_un->sun_path) - 1] = 0;
+  return 1;
 }
 
 
@@ -73,28 +101,16 @@ connect_daemon (const char *name)
 {
   int sock;
   struct sockaddr_un addr_un;
-  struct sockaddr    *addrp;
-  size_t addrlen;
   FILE *fp;
 
-  if (strlen (name)+1 >= sizeof addr_un.sun_path)
-    {
-      errno = EINVAL;
-      return NULL;
-    }
-
-  memset (&addr_un, 0, sizeof addr_un);
-  addr_un.sun_family = AF_LOCAL;
-  strncpy (addr_un.sun_path, name, sizeof (addr_un.sun_path) - 1);
-  addr_un.sun_path[sizeof (addr_un.sun_path) - 1] = 0;
-  addrlen = SUN_LEN (&addr_un);
-  addrp = (struct sockaddr *)&addr_un;
+  if (!make_sockaddr (&addr_un, name))
+    return NULL;
 
   sock = socket (AF_LOCAL, SOCK_STREAM, 0);
   if (sock == -1)
     return NULL;
 
-  if (connect (sock, addrp, addrlen))
+  if (connect (sock, (struct sockaddr *)&addr_un, SUN_LEN (&addr_un)))
     {
       int saveerr = errno;
       close (sock);
@@ -115,16 +131,20 @@ connect_daemon (const char *name)
 }
 
 
-/* Send the payload to the daemon.  Does not return an error.  */
-static void
-send_to_daemon (const char *buffer)
+/* Send the payload to the daemon.  Returns 0 on success or an HTTP
+   status code and a description at R_TEXT.  */
+static int
+send_to_daemon (const char *buffer, const char **r_text)
 {
   FILE *fp;
   int n, c;
 
   fp = connect_daemon (PAYPROCD_SOCKET_NAME);
   if (!fp)
-    exit_status (500, "Error connecting payprocd");
+    {
+      *r_text = "Error connecting payprocd";
+      return 500;
+    }
 
   fputs ("PPIPNHD\nRequest: ", fp);
   n = 9;
@@ -141,75 +161,354 @@ send_to_daemon (const char *buffer)
     }
   putc ('\n', fp);
   putc ('\n', fp);
+  fflush (fp);
   if (ferror (fp))
-    exit_status (500, "Error writing to payprocd");
+    {
+      fclose (fp);
+      *r_text = "Error writing to payprocd";
+      return 500;
+    }
 
-  /* Payproc daemon does not return anything real but in case of an
-     error in this code we check whether the response is OK and not ERR.  */
+  /* Payproc daemon returns OK only after the IPN has been queued.  On
+     ERR we return an error so that PayPal will send it again.  */
   c = fgetc (fp);
-  if (c != 'O')
-    exit_status (500, "Error talking to payprocd");
   /* Eat the response for a clean connection shutdown.  */
   while (getc (fp) != EOF)
     ;
-
   fclose (fp);
+  if (c != 'O')
+    {
+      *r_text = "Error talking to payprocd";
+      return 500;
+    }
+
+  return 0;
 }
 
 
-int
-main (int argc, char **argv)
+/* Read a request with the given method, length and type from FP and
+   pass it on to payprocd.  Returns an HTTP status code and its
+   description at R_TEXT.  */
+static int
+process_request (const char *request_method, const char *content_length,
+                 const char *content_type, FILE *fp, const char **r_text)
 {
-  const char *request_method = getenv("REQUEST_METHOD");
-  const char *content_length = getenv("CONTENT_LENGTH");
-  const char *content_type   = getenv("CONTENT_TYPE");
   unsigned long length, n;
   char *buffer;
+  int status;
 
-  /* FIXME: Figure out whether this is a test or a live version and
-   * adjust the socket accordingly.  */
-
-  /* Allow the usual "--version" option only if run outside of the CGI
-     environment.  */
-  if (argc > 1 && !strcmp (argv[1], "--version") && !request_method)
+  if (!request_method || strcmp (request_method, "POST"))
     {
-      fputs (PGM " (" PACKAGE_NAME ") " PACKAGE_VERSION "\n", stdout);
-      return 0;
+      *r_text = "Only POST allowed";
+      return 501;
     }
 
-  if (!request_method || strcmp (request_method, "POST"))
-    exit_status (501, "Only POST allowed");
-
   length = content_length? strtoul (content_length, NULL, 10) : 0;
   if (!length)
-    exit_status (411, "Content-Length missing");
+    {
+      *r_text = "Content-Length missing";
+      return 411;
+    }
   if (length >= MAX_REQUEST)
-    exit_status (413, "Payload too large");
+    {
+      *r_text = "Payload too large";
+      return 413;
+    }
 
   if (!content_type || !*content_type)
-    exit_status (400, "Content-type missing");
+    {
+      *r_text = "Content-type missing";
+      return 400;
+    }
 
   buffer = malloc (length+1);
   if (!buffer)
-    exit_status (503, "Service currently unavailable");
+    {
+      *r_text = "Service currently unavailable";
+      return 503;
+    }
 
-  if (fread (buffer, length, 1, stdin) != 1)
-    exit_status (400, feof (stdin)? "Payload shorter than indicated"
-                 /*            */ : "Error reading payload");
+  if (fread (buffer, length, 1, fp) != 1)
+    {
+      *r_text = feof (fp)? "Payload shorter than indicated"
+        /*             */: "Error reading payload";
+      status = 400;
+      goto leave;
+    }
   buffer[length] = 0; /* Make it a string.  */
   for (n=0; n < length; n++)
     {
       if (!buffer[n])
-        exit_status (400, "Binary data in payload not allowed");
+        {
+          *r_text = "Binary data in payload not allowed";
+          status = 400;
+          goto leave;
+        }
       if (strchr (" \t\r\n", buffer[n]))
-        exit_status (400, "Whitespaces in payload not allowed");
+        {
+          *r_text = "Whitespaces in payload not allowed";
+          status = 400;
+          goto leave;
+        }
     }
 
+  status = send_to_daemon (buffer, r_text);
+  if (!status)
+    {
+      *r_text = "OK";
+      status = 200;
+    }
 
-  send_to_daemon (buffer);
+ leave:
   free (buffer);
+  return status;
+}
+
+
+
+/*
+ * SCGI server mode
+ */
+
+/* Return the value of the SCGI header NAME from the header block
+   HEADER of length LENGTH or NULL if not found.  */
+static const char *
+get_scgi_header (const char *header, size_t length, const char *name)
+{
+  const char *p, *end, *value;
+
+  end = header + length;
+  for (p = header; p < end; )
+    {
+      value = p + strlen (p) + 1;
+      if (value >= end)
+        break;
+      if (!strcmp (p, name))
+        return value;
+      p = value + strlen (value) + 1;
+    }
+  return NULL;
+}
+
+
+/* Handle one SCGI request read from the connected stream IN and
+   write the response to OUT.  The request starts with a netstring
+   with the headers followed by the body.  */
+static void
+handle_scgi_request (FILE *in, FILE *out)
+{
+  char *header = NULL;
+  size_t length = 0;
+  int c, status;
+  const char *text;
+
+  while ((c = getc (in)) != EOF && c >= '0' && c <= '9')
+    {
+      length = length * 10 + (c - '0');
+      if (length > MAX_SCGI_HEADER)
+        break;
+    }
+  if (c != ':' || !length || length > MAX_SCGI_HEADER)
+    {
+      text = "Invalid SCGI request";
+      status = 400;
+      goto leave;
+    }
+
+  header = malloc (length + 1);
+  if (!header)
+    {
+      text = "Service currently unavailable";
+      status = 503;
+      goto leave;
+    }
+  if (fread (header, length, 1, in) != 1 || getc (in) != ',')
+    {
+      text = "Invalid SCGI request";
+      status = 400;
+      goto leave;
+    }
+  header[length] = 0;
+
+  status = process_request (get_scgi_header (header, length,
+                                             "REQUEST_METHOD"),
+                            get_scgi_header (header, length,
+                                             "CONTENT_LENGTH"),
+                            get_scgi_header (header, length,
+                                             "CONTENT_TYPE"),
+                            in, &text);
+
+ leave:
+  free (header);
+  print_status (out, status, text);
+}
+
+
+/* The main loop of a worker process: Accept connections on LISTEN_FD
+   and process them one after the other.  */
+static void
+scgi_worker (int listen_fd)
+{
+  int fd, fd2;
+  FILE *in, *out;
+
+  for (;;)
+    {
+      fd = accept (listen_fd, NULL, NULL);
+      if (fd == -1)
+        {
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+          fprintf (stderr, PGM ": accept failed: %s\n", strerror (errno));
+          sleep (1);
+          continue;
+        }
+      /* Reading and writing the same stdio stream would require a
+         seek in between, which is not possible on a socket.  Thus we
+         use separate streams.  */
+      in = NULL;
+      out = NULL;
+      fd2 = dup (fd);
+      if (fd2 == -1 || !(in = fdopen (fd, "rb")))
+        {
+          close (fd);
+          if (fd2 != -1)
+            close (fd2);
+          continue;
+        }
+      if (!(out = fdopen (fd2, "wb")))
+        {
+          close (fd2);
+          fclose (in);
+          continue;
+        }
+      handle_scgi_request (in, out);
+      fclose (out);
+      fclose (in);
+    }
+}
+
+
+/* Start a worker process.  Returns the pid or -1 on error.  */
+static pid_t
+start_scgi_worker (int listen_fd)
+{
+  pid_t pid;
+
+  pid = fork ();
+  if (pid == -1)
+    fprintf (stderr, PGM ": fork failed: %s\n", strerror (errno));
+  else if (!pid)
+    {
+      scgi_worker (listen_fd);
+      _exit (0);
+    }
+  return pid;
+}
+
+
+/* Run as SCGI server listening on SOCKETNAME with NWORKERS worker
+   processes.  Workers which terminate are restarted.  */
+static int
+run_scgi_server (const char *socketname, int nworkers)
+{
+  int fd;
+  struct sockaddr_un addr_un;
+  pid_t pids[MAX_SCGI_WORKERS];
+  pid_t pid;
+  int i;
+
+  if (nworkers < 1)
+    nworkers = 1;
+  else if (nworkers > MAX_SCGI_WORKERS)
+    nworkers = MAX_SCGI_WORKERS;
+
+  if (!make_sockaddr (&addr_un, socketname))
+    {
+      fprintf (stderr, PGM ": socket name '%s' is too long\n", socketname);
+      return 1;
+    }
+
+  fd = socket (AF_LOCAL, SOCK_STREAM, 0);
+  if (fd == -1)
+    {
+      fprintf (stderr, PGM ": error creating socket: %s\n", strerror (errno));
+      return 1;
+    }
+  remove (socketname);
+  if (bind (fd, (struct sockaddr *)&addr_un, SUN_LEN (&addr_un)))
+    {
+      fprintf (stderr, PGM ": error binding socket to '%s': %s\n",
+               socketname, strerror (errno));
+      close (fd);
+      return 1;
+    }
+  /* The web server usually runs under a different user but shares
+     our group.  */
+  if (chmod (socketname, 0660))
+    {
+      fprintf (stderr, PGM ": error setting mode of '%s': %s\n",
+               socketname, strerror (errno));
+      close (fd);
+      return 1;
+    }
+  if (listen (fd, 64))
+    {
+      fprintf (stderr, PGM ": listen on socket '%s' failed: %s\n",
+               socketname, strerror (errno));
+      close (fd);
+      return 1;
+    }
+
+  /* We write to the web server and to payprocd; a closed connection
+     shall not terminate the worker.  */
+  signal (SIGPIPE, SIG_IGN);
+
+  for (i=0; i < nworkers; i++)
+    pids[i] = start_scgi_worker (fd);
+
+  for (;;)
+    {
+      pid = wait (NULL);
+      if (pid == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          /* No more children - this should not happen.  */
+          sleep (1);
+        }
+      for (i=0; i < nworkers; i++)
+        if (pids[i] == pid || pids[i] == -1)
+          pids[i] = start_scgi_worker (fd);
+    }
+
+  return 0;
+}
+
+
+
+int
+main (int argc, char **argv)
+{
+  const char *request_method = getenv("REQUEST_METHOD");
+  const char *text;
+  int status;
+
+  /* FIXME: Figure out whether this is a test or a live version and
+   * adjust the socket accordingly.  */
+
+  /* Allow the usual "--version" option only if run outside of the CGI
+     environment.  */
+  if (argc > 1 && !strcmp (argv[1], "--version") && !request_method)
+    {
+      fputs (PGM " (" PACKAGE_NAME ") " PACKAGE_VERSION "\n", stdout);
+      return 0;
+    }
+  if (argc > 2 && !strcmp (argv[1], "--scgi") && !request_method)
+    return run_scgi_server (argv[2], argc > 3? atoi (argv[3]) : 4);
 
-  print_status (200, "OK");
-  fputs ("Content-Type: text/plain\r\n\r\n", stdout);
+  status = process_request (request_method, getenv ("CONTENT_LENGTH"),
+                            getenv ("CONTENT_TYPE"), stdin, &text);
+  print_status (stdout, status, text);
   return 0;
 }
@@ -25,6 +25,7 @@
 
 #include "util.h"
 #include "logging.h"
+#include "membuf.h"
 #include "payprocd.h"
 #include "protocol-io.h"
 
@@ -65,26 +66,69 @@ capitalize_name (char *name)
 }
 
 
+/* To avoid reallocating a value for each continuation line, a data
+   item is collected in a membuf until the next item starts or the
+   request ends.  The membuf holds the name, a Nul, and the value; it
+   is reused for all items of a request.  */
+struct data_item_s
+{
+  membuf_t mb;
+  size_t namelen;   /* Length of the name or 0 if no item pending.  */
+};
+
+
+/* Store the pending data item from ITEM in DATAITEMS and reset ITEM
+   for the next one.  */
+static gpg_error_t
+flush_data_item (struct data_item_s *item, keyvalue_t *dataitems)
+{
+  gpg_error_t err;
+  const char *buf;
+  size_t len;
+
+  if (!item->namelen)
+    return 0;
+
+  put_membuf (&item->mb, "", 1);
+  buf = peek_membuf (&item->mb, &len);
+  if (!buf)
+    return gpg_error_from_syserror ();
+  err = keyvalue_put (dataitems, buf, buf + item->namelen + 1);
+  clear_membuf (&item->mb, len);
+  item->namelen = 0;
+  return err;
+}
+
+
 /* Store a data LINE away.  The function expects that the terminating
    linefeed has already been stripped.  Line continuation is supported
    as well as merging of headers with the same name.  This function
-   may modify LINE.  DATAITEMS is a pointer to a key-value list which
-   received the the data.  With FILTER set capitalize field names and
-   do not allow special names.  */
+   may modify LINE.  ITEM is the pending data item and DATAITEMS is a
+   pointer to a key-value list which received the the data.  With
+   FILTER set capitalize field names and do not allow special
+   names.  */
 static gpg_error_t
-store_data_line (char *line, int filter, keyvalue_t *dataitems)
+store_data_line (char *line, int filter,
+                 struct data_item_s *item, keyvalue_t *dataitems)
 {
+  gpg_error_t err;
   char *p, *value;
   keyvalue_t kv;
 
   if (*line == ' ' || *line == '\t')
     {
       /* Continuation.  */
-      if (!*dataitems)
+      if (!item->namelen)
         return gpg_error (GPG_ERR_PROTOCOL_VIOLATION);
-      return keyvalue_append_with_nl (*dataitems, line+1);
+      put_membuf_chr (&item->mb, '\n');
+      put_membuf_str (&item->mb, line+1);
+      return 0;
     }
 
+  err = flush_data_item (item, dataitems);
+  if (err)
+    return err;
+
   /* A name must start with a letter.  Note that for items used only
      internally a name may start with an underscore. */
   if (filter)
@@ -95,7 +139,7 @@ store_data_line (char *line, int filter, keyvalue_t *dataitems)
     }
 
   p = strchr (line, ':');
-  if (!p)
+  if (!p || p == line)
     return GPG_ERR_PROTOCOL_VIOLATION;
   *p++ = 0;
   while (*p == ' ' || *p == '\t')
@@ -113,125 +157,113 @@ store_data_line (char *line, int filter, keyvalue_t *dataitems)
       return GPG_ERR_PROTOCOL_VIOLATION;
     }
 
-  /* Insert a new data item. */
-  return keyvalue_put (dataitems, line, value);
+  /* Start a new data item. */
+  item->namelen = strlen (line);
+  put_membuf (&item->mb, line, item->namelen + 1);
+  put_membuf_str (&item->mb, value);
+  return 0;
 }
 
 
-/* Read a protocol chunk into R_COMMAND and update DATATITEMS with
-   the data item.  Return 0 on success.  Note that on error NULL is
-   stored at R_command but DATAITEMS may have changed.  With FILTER
-   set capitalize field names and do not allow special names. */
+/* Read a line from STREAM into the line buffer described by BUFFER
+   and BUFFER_SIZE and strip the linefeed.  WHAT is used for
+   diagnostics.  */
 static gpg_error_t
-read_data (estream_t stream, int filter,
-           char **r_command, keyvalue_t *dataitems)
+read_line (estream_t stream, char **buffer, size_t *buffer_size,
+           const char *what)
 {
   gpg_error_t err;
-  char *buffer = NULL;       /* Line buffer. */
-  size_t buffer_size = 0;    /* Current length of buffer.  */
   ssize_t nread;
   size_t maxlen;
   size_t n;
 
-  *r_command = NULL;
-
-  /* Read the command line. */
   maxlen = MAX_LINELEN;
-  nread = es_read_line (stream, &buffer, &buffer_size, &maxlen);
+  nread = es_read_line (stream, buffer, buffer_size, &maxlen);
   if (nread < 0)
     {
-      err = gpg_error_from_syserror ();
-      es_free (buffer);
+      err = gpg_err_code_from_syserror ();
       log_error ("reading request failed: %s\n", gpg_strerror (err));
       return err;
     }
   if (!maxlen)
     {
-      es_free (buffer);
-      log_error ("reading request failed: %s\n", "command line too long");
+      log_error ("reading request failed: %s line too long\n", what);
       return GPG_ERR_TRUNCATED;
     }
   if (!nread)
     {
-      es_free (buffer);
-      log_error ("reading request failed: %s\n",
-                 "EOF while reading command line");
+      log_error ("reading request failed: EOF while reading %s line\n", what);
       return GPG_ERR_EOF;
     }
-  /* Strip linefeed.  */
-  n = strlen (buffer);
-  if (n && buffer[n-1] == '\n')
+
+  /* Strip linefeed.  Note that NREAD is the length of the line.  */
+  n = nread;
+  if (n && (*buffer)[n-1] == '\n')
     {
-      buffer[--n] = 0;
-      if (n && buffer[n-1] == '\r')
-        buffer[--n] = 0;
+      (*buffer)[--n] = 0;
+      if (n && (*buffer)[n-1] == '\r')
+        (*buffer)[--n] = 0;
     }
+  return 0;
+}
+
+
+/* Read a protocol chunk into R_COMMAND and update DATATITEMS with
+   the data item.  Return 0 on success.  Note that on error NULL is
+   stored at R_command but DATAITEMS may have changed.  With FILTER
+   set capitalize field names and do not allow special names. */
+static gpg_error_t
+read_data (estream_t stream, int filter,
+           char **r_command, keyvalue_t *dataitems)
+{
+  gpg_error_t err;
+  char *buffer = NULL;       /* Line buffer. */
+  size_t buffer_size = 0;    /* Current length of buffer.  */
+  struct data_item_s item;
+
+  *r_command = NULL;
+  item.namelen = 0;
+  init_membuf (&item.mb, 1024);
+
+  /* Read the command line. */
+  err = read_line (stream, &buffer, &buffer_size, "command");
+  if (err)
+    goto leave;
 
   *r_command = xtrystrdup (buffer);
   if (!*r_command)
     {
       err = gpg_err_code_from_syserror ();
-      es_free (buffer);
-      return err;
+      goto leave;
     }
 
   /* Read data lines and wait for the terminating empty line. */
   do
     {
-      maxlen = MAX_LINELEN;
-      nread = es_read_line (stream, &buffer, &buffer_size, &maxlen);
-      if (nread < 0)
-        {
-          err = gpg_err_code_from_syserror ();
-          es_free (buffer);
-          log_error ("reading request failed: %s\n", gpg_strerror (err));
-          xfree (*r_command);
-          *r_command = NULL;
-          return err;
-        }
-      if (!maxlen)
-        {
-          es_free (buffer);
-          log_error ("reading request failed: %s\n", "data line too long");
-          xfree (*r_command);
-          *r_command = NULL;
-          return GPG_ERR_TRUNCATED;
-        }
-      if (!nread)
-        {
-          es_free (buffer);
-          log_error ("reading request failed: %s\n",
-                     "EOF while reading data line");
-          xfree (*r_command);
-          *r_command = NULL;
-          return GPG_ERR_EOF;
-        }
-
-      /* Strip linefeed.  */
-      n = strlen (buffer);
-      if (n && buffer[n-1] == '\n')
-        {
-          buffer[--n] = 0;
-          if (n && buffer[n-1] == '\r')
-            buffer[--n] = 0;
-        }
+      err = read_line (stream, &buffer, &buffer_size, "data");
+      if (err)
+        goto leave;
 
       if (*buffer && *buffer != '#' )
         {
-          err = store_data_line (buffer, filter, dataitems);
+          err = store_data_line (buffer, filter, &item, dataitems);
           if (err)
-            {
-              es_free (buffer);
-              xfree (*r_command);
-              *r_command = NULL;
-              return err;
-            }
+            goto leave;
         }
     }
   while (*buffer);
-  es_free (buffer);
 
-  return 0;
+  err = flush_data_item (&item, dataitems);
+
+ leave:
+  if (err)
+    {
+      xfree (*r_command);
+      *r_command = NULL;
+    }
+  xfree (get_membuf (&item.mb, NULL));
+  es_free (buffer);
+  return err;
 }
 
 
@@ -246,25 +278,17 @@ protocol_read_request (estream_t stream,
 }
 
 
-/* Read the response and update DATAITEMS with the data from the
-   response.  Return 0 on success.  On error an error is returned.  If
-   that error has been returned by the server the description of the
-   error is stored in DATAITEM under the key "_errdesc"; if the error
-   is local "_errdesc" is not set.  */
-gpg_error_t
-protocol_read_response (estream_t stream, keyvalue_t *dataitems)
+/* Evaluate the STATUS line of a response.  Returns 0 for "OK" or the
+   error code from an "ERR" line in which case the description is
+   stored in DATAITEMS under the key "_errdesc".  */
+static gpg_error_t
+parse_status_line (const char *status, keyvalue_t *dataitems)
 {
   gpg_error_t err, err2;
-  char *status;
   const char *s;
 
-  keyvalue_del (*dataitems, "_errdesc");
-  err = read_data (stream, 0, &status, dataitems);
-  if (err)
-    return err;
-
   if (has_leading_keyword (status, "OK"))
-    ;
+    err = 0;
   else if ((s = has_leading_keyword (status, "ERR")))
     {
       unsigned long n;
@@ -292,6 +316,294 @@ protocol_read_response (estream_t stream, keyvalue_t *dataitems)
   else
     err = gpg_error (GPG_ERR_INV_RESPONSE);
 
+  return err;
+}
+
+
+/* Read the response and update DATAITEMS with the data from the
+   response.  Return 0 on success.  On error an error is returned.  If
+   that error has been returned by the server the description of the
+   error is stored in DATAITEM under the key "_errdesc"; if the error
+   is local "_errdesc" is not set.  */
+gpg_error_t
+protocol_read_response (estream_t stream, keyvalue_t *dataitems)
+{
+  gpg_error_t err;
+  char *status;
+
+  keyvalue_del (*dataitems, "_errdesc");
+  err = read_data (stream, 0, &status, dataitems);
+  if (err)
+    return err;
+
+  err = parse_status_line (status, dataitems);
+  xfree (status);
+  return err;
+}
+
+
+
+/*
+ * Binary framing
+ */
+
+/* Clients which send many requests may use a binary framing instead
+ * of the line based protocol.  Such a request starts with the byte
+ * PROTOCOL_BINARY_MAGIC followed by
+ *
+ *   u32 length of the command line
+ *       the command line
+ *
+ * and then for each data item
+ *
+ *   u16 length of the name (not 0)
+ *       the name
+ *   u32 length of the value
+ *       the value
+ *
+ * terminated by a u16 of zero.  All integers are in network byte
+ * order.  Names and values are not escaped and linefeeds in a value
+ * are allowed; Nul bytes are not allowed.  The response uses the same
+ * framing with the status line ("OK" or "ERR ...") in place of the
+ * command line.  Comment lines are sent as items with the name "#".
+ */
+
+/* Limits for the binary framing.  */
+#define MAX_BINARY_NAMELEN   256
+#define MAX_BINARY_VALUELEN  (1024*1024)
+
+
+/* Read exactly LENGTH bytes from STREAM into BUFFER.  */
+static gpg_error_t
+read_exact (estream_t stream, void *buffer, size_t length)
+{
+  size_t nread;
+
+  if (!length)
+    return 0;
+  if (es_read (stream, buffer, length, &nread))
+    return gpg_err_code_from_syserror ();
+  if (nread != length)
+    return GPG_ERR_EOF;
+  return 0;
+}
+
+
+/* Read a string of LENGTH bytes into a newly allocated buffer stored
+   at R_STRING.  */
+static gpg_error_t
+read_binary_string (estream_t stream, size_t length, char **r_string)
+{
+  gpg_error_t err;
+  char *string;
+
+  *r_string = NULL;
+  string = xtrymalloc (length + 1);
+  if (!string)
+    return gpg_err_code_from_syserror ();
+  err = read_exact (stream, string, length);
+  if (!err && memchr (string, 0, length))
+    err = GPG_ERR_PROTOCOL_VIOLATION;
+  if (err)
+    {
+      xfree (string);
+      return err;
+    }
+  string[length] = 0;
+  *r_string = string;
+  return 0;
+}
+
+
+/* Read a binary framed protocol chunk from STREAM.  The magic byte
+   must already have been read.  This is the counterpart to read_data
+   and has the same semantics.  */
+static gpg_error_t
+read_binary_data (estream_t stream, int filter,
+                  char **r_command, keyvalue_t *dataitems)
+{
+  gpg_error_t err;
+  unsigned char hdr[4];
+  char name[MAX_BINARY_NAMELEN+1];
+  size_t length;
+  char *value = NULL;
+  keyvalue_t kv;
+
+  *r_command = NULL;
+
+  err = read_exact (stream, hdr, 4);
+  if (err)
+    goto leave;
+  length = (((size_t)hdr[0] << 24) | (hdr[1] << 16)
+            | (hdr[2] << 8) | hdr[3]);
+  if (length > MAX_LINELEN)
+    {
+      err = GPG_ERR_TRUNCATED;
+      goto leave;
+    }
+  err = read_binary_string (stream, length, r_command);
+  if (err)
+    goto leave;
+
+  for (;;)
+    {
+      err = read_exact (stream, hdr, 2);
+      if (err)
+        goto leave;
+      length = ((hdr[0] << 8) | hdr[1]);
+      if (!length)
+        break;  /* End of items.  */
+      if (length > MAX_BINARY_NAMELEN)
+        {
+          err = GPG_ERR_TRUNCATED;
+          goto leave;
+        }
+      err = read_exact (stream, name, length);
+      if (err)
+        goto leave;
+      name[length] = 0;
+      if (strlen (name) != length || strpbrk (name, ":\n"))
+        {
+          err = GPG_ERR_PROTOCOL_VIOLATION;
+          goto leave;
+        }
+
+      err = read_exact (stream, hdr, 4);
+      if (err)
+        goto leave;
+      length = (((size_t)hdr[0] << 24) | (hdr[1] << 16)
+            | (hdr[2] << 8) | hdr[3]);
+      if (length > MAX_BINARY_VALUELEN)
+        {
+          err = GPG_ERR_TRUNCATED;
+          goto leave;
+        }
+      err = read_binary_string (stream, length, &value);
+      if (err)
+        goto leave;
+
+      if (*name == '#')
+        ; /* A comment.  */
+      else
+        {
+          if (filter)
+            {
+              capitalize_name (name);
+              if (*name < 'A' || *name > 'Z')
+                {
+                  err = gpg_error (GPG_ERR_INV_NAME);
+                  goto leave;
+                }
+            }
+          for (kv = *dataitems; kv; kv = kv->next)
+            if (!strcmp (kv->name, name))
+              break;
+          if (kv)
+            {
+              err = GPG_ERR_PROTOCOL_VIOLATION;
+              goto leave;
+            }
+          err = keyvalue_put (dataitems, name, value);
+          if (err)
+            goto leave;
+        }
+      xfree (value);
+      value = NULL;
+    }
+
+ leave:
+  if (err)
+    {
+      log_error ("reading binary request failed: %s\n", gpg_strerror (err));
+      xfree (*r_command);
+      *r_command = NULL;
+    }
+  xfree (value);
+  return err;
+}
+
+
+/* Read a request in binary framing into R_COMMAND and update
+   DATATITEMS.  The caller must already have read the magic byte.
+   This is the counterpart of protocol_read_request.  */
+gpg_error_t
+protocol_read_binary_request (estream_t stream,
+                              char **r_command, keyvalue_t *dataitems)
+{
+  return read_binary_data (stream, 1, r_command, dataitems);
+}
+
+
+/* Read a response in binary framing and update DATAITEMS.  This is
+   the counterpart of protocol_read_response.  */
+gpg_error_t
+protocol_read_binary_response (estream_t stream, keyvalue_t *dataitems)
+{
+  gpg_error_t err;
+  char *status;
+
+  keyvalue_del (*dataitems, "_errdesc");
+  if (es_getc (stream) != PROTOCOL_BINARY_MAGIC)
+    return gpg_error (GPG_ERR_INV_RESPONSE);
+  err = read_binary_data (stream, 0, &status, dataitems);
+  if (err)
+    return err;
+
+  err = parse_status_line (status, dataitems);
   xfree (status);
   return err;
 }
+
+
+/* Write the binary framed string S with a length prefix of NBYTES
+   (2 or 4) to STREAM.  */
+static void
+write_binary_string (estream_t stream, int nbytes, const char *s)
+{
+  unsigned char hdr[4];
+  size_t n = strlen (s);
+
+  if (nbytes == 2)
+    {
+      hdr[0] = n >> 8;
+      hdr[1] = n;
+    }
+  else
+    {
+      hdr[0] = n >> 24;
+      hdr[1] = n >> 16;
+      hdr[2] = n >> 8;
+      hdr[3] = n;
+    }
+  es_write (stream, hdr, nbytes, NULL);
+  es_write (stream, s, n, NULL);
+}
+
+
+/* Write the start of a binary framed message with the command or
+   status line LINE to STREAM.  */
+void
+protocol_write_binary_start (estream_t stream, const char *line)
+{
+  es_putc (PROTOCOL_BINARY_MAGIC, stream);
+  write_binary_string (stream, 4, line);
+}
+
+
+/* Write a binary framed item with NAME and VALUE to STREAM.  */
+void
+protocol_write_binary_item (estream_t stream,
+                            const char *name, const char *value)
+{
+  write_binary_string (stream, 2, name);
+  write_binary_string (stream, 4, value);
+}
+
+
+/* Terminate a binary framed message on STREAM.  */
+void
+protocol_write_binary_end (estream_t stream)
+{
+  es_putc (0, stream);
+  es_putc (0, stream);
+}
@@ -24,4 +24,17 @@ gpg_error_t protocol_read_request (estream_t stream,
                                    char **r_command, keyvalue_t *dataitems);
 gpg_error_t protocol_read_response (estream_t stream, keyvalue_t *dataitems);
 
+/* The first byte of a request or response using binary framing.  */
+#define PROTOCOL_BINARY_MAGIC 0x80
+
+gpg_error_t protocol_read_binary_request (estream_t stream,
+                                          char **r_command,
+                                          keyvalue_t *dataitems);
+gpg_error_t protocol_read_binary_response (estream_t stream,
+                                           keyvalue_t *dataitems);
+void protocol_write_binary_start (estream_t stream, const char *line);
+void protocol_write_binary_item (estream_t stream,
+                                 const char *name, const char *value);
+void protocol_write_binary_end (estream_t stream);
+
 #endif /*PROTOCOL_IO_H*/
@@ -32,6 +32,9 @@
 #include "payprocd.h"
 #include "form.h"
 #include "account.h"
+#include "plancache.h"
+#include "future.h"
+#include "backend.h"
 #include "stripe.h"
 
 
@@ -42,35 +45,59 @@
    is the method without the version (e.g. "tokens") and DATA the
    individual part to be appended to the URL (e.g. a token-id).  If
    FORMDATA is not NULL, a POST operaion is used with that data instead
-   of the default GET operation.  On success the function returns 0
-   and a status code at R_STATUS.  The data send with certain status
-   code is stored in parsed format at R_JSON - this might be NULL.  */
+   of the default GET operation; REQ_METHOD may be used to request a
+   different HTTP method.  On success the function returns 0 and a
+   status code at R_STATUS.  The data send with certain status code is
+   stored in parsed format at R_JSON - this might be NULL.  */
 static gpg_error_t
-call_stripe (const char *keystring, const char *method, const char *data,
-             keyvalue_t formdata, int *r_status, cjson_t *r_json)
+call_stripe_ext (http_req_t req_method,
+                 const char *keystring, const char *method, const char *data,
+                 keyvalue_t formdata, int *r_status, cjson_t *r_json)
 {
   gpg_error_t err;
   char *url = NULL;
   http_session_t session = NULL;
   http_t http = NULL;
-  unsigned int status;
+  unsigned int status = 0;
+  struct backend_call_s call;
+  unsigned int timeout;
 
   *r_status = 0;
   *r_json = NULL;
 
-  url = strconcat (STRIPE_HOST, "/v1/", method, data? "/": NULL, data, NULL);
+  if (opt.fake_psp_url)
+    url = strconcat (opt.fake_psp_url, "/stripe/v1/", method,
+                     data? "/": NULL, data, NULL);
+  else
+    url = strconcat (STRIPE_HOST, "/v1/", method,
+                     data? "/": NULL, data, NULL);
   if (!url)
     return gpg_error_from_syserror ();
+  if (!req_method)
+    req_method = formdata? HTTP_REQ_POST : HTTP_REQ_GET;
+
+  err = backend_acquire (&call, BACKEND_STRIPE, req_method == HTTP_REQ_GET,
+                         &timeout);
+  if (err)
+    {
+      log_error ("stripe: not contacting '%s': %s\n", url, gpg_strerror (err));
+      xfree (url);
+      return err;
+    }
 
   err = http_session_new (&session, NULL);
   if (err)
     goto leave;
+  http_session_set_timeout (session, timeout);
 
   if (opt.debug_stripe)
-    log_debug ("stripe-req: %s %s\n", formdata? "POST" : "GET", url);
+    log_debug ("stripe-req: %s %s\n",
+               req_method == HTTP_REQ_POST? "POST" :
+               req_method == HTTP_REQ_DELETE? "DELETE" : "GET", url);
 
+  call.contacted = 1;
   err = http_open (&http,
-                   formdata? HTTP_REQ_POST : HTTP_REQ_GET,
+                   req_method,
                    url,
                    NULL,
                    keystring,
@@ -88,19 +115,15 @@ call_stripe (const char *keystring, const char *method, const char *data,
   if (formdata)
     {
       estream_t fp = http_get_write_ptr (http);
-      char *escaped;
-
-      err = encode_formdata (formdata, &escaped);
-      if (err)
-        goto leave;
 
       es_fprintf (fp,
                   "Content-Type: application/x-www-form-urlencoded\r\n"
-                  "Content-Length: %zu\r\n", strlen (escaped));
+                  "Content-Length: %zu\r\n",
+                  form_encoded_length (formdata));
       http_start_data (http);
-      if (es_fputs (escaped, fp))
-        err = gpg_error_from_syserror ();
-      xfree (escaped);
+      err = write_formdata (formdata, fp);
+      if (err)
+        goto leave;
     }
 
   err = http_wait_response (http);
@@ -159,11 +182,22 @@ call_stripe (const char *keystring, const char *method, const char *data,
  leave:
   http_close (http, 0);
   http_session_release (session);
+  backend_release (&call, err, status);
   xfree (url);
   return err;
 }
 
 
+/* Same as call_stripe_ext using POST if FORMDATA is given or GET.  */
+static gpg_error_t
+call_stripe (const char *keystring, const char *method, const char *data,
+             keyvalue_t formdata, int *r_status, cjson_t *r_json)
+{
+  return call_stripe_ext (0, keystring, method, data, formdata,
+                          r_status, r_json);
+}
+
+
 /* Extract the error information from JSON and put useful stuff into
    DICT.  */
 static gpg_error_t
@@ -503,6 +537,7 @@ stripe_charge_card (keyvalue_t *dict)
  *
  *  _plan-id: The Stripe plan id.  This is computed from the other
  *            information given
+ * _plan-cached: Set to 1 if the plan id was taken from the cache.
  */
 gpg_error_t
 stripe_find_create_plan (keyvalue_t *dict)
@@ -515,6 +550,7 @@ stripe_find_create_plan (keyvalue_t *dict)
   cjson_t j_obj;
   int recur;
   char *plan_id = NULL;
+  char *cached_plan_id = NULL;
   char *stmt_desc = NULL;
 
   s = keyvalue_get_string (*dict, "Currency");
@@ -555,6 +591,19 @@ stripe_find_create_plan (keyvalue_t *dict)
     }
   ascii_strlwr (plan_id); /* This is for the currency part.  */
 
+  /* Check whether we already know that plan.  */
+  err = plancache_get (PLAN_SERVICE_STRIPE,
+                       keyvalue_get_string (request, "currency"),
+                       s, recur, &cached_plan_id);
+  if (err)
+    goto leave;
+  if (cached_plan_id)
+    {
+      err = keyvalue_put (dict, "_plan-id", cached_plan_id);
+      if (!err)
+        err = keyvalue_put (dict, "_plan-cached", "1");
+      goto leave;
+    }
 
   err = call_stripe (opt.stripe_secret_key,
                      "plans", plan_id, NULL, &status, &json);
@@ -654,9 +703,14 @@ stripe_find_create_plan (keyvalue_t *dict)
   err = keyvalue_put (dict, "_plan-id", j_obj->valuestring);
   if (err)
     goto leave;
+  plancache_put (PLAN_SERVICE_STRIPE,
+                 keyvalue_get_string (request, "currency"),
+                 keyvalue_get_string (request, "amount"),
+                 recur, j_obj->valuestring);
 
 
  leave:
+  xfree (cached_plan_id);
   es_free (stmt_desc);
   es_free (plan_id);
   keyvalue_release (request);
@@ -666,10 +720,101 @@ stripe_find_create_plan (keyvalue_t *dict)
 
 
 
+/* Remove the plan described by DICT from the plan cache.  This is
+ * used if Stripe rejected a cached plan id.  */
+static void
+forget_cached_plan (keyvalue_t dict)
+{
+  plancache_remove (PLAN_SERVICE_STRIPE,
+                    keyvalue_get_string (dict, "Currency"),
+                    keyvalue_get_string (dict, "_amount"),
+                    keyvalue_get_int (dict, "Recur"));
+  keyvalue_del (dict, "_plan-cached");
+}
+
+
+/* Parameters for create_customer.  */
+struct create_customer_parm_s
+{
+  keyvalue_t request;  /* The request for Stripe.  */
+  keyvalue_t errdict;  /* Error information returned by Stripe.  */
+  char *customer_id;   /* Malloced Stripe customer id on success.  */
+};
+
+
+/* Create a customer as described by the request in ARG, which is a
+ * struct create_customer_parm_s.  This is run as a future and thus
+ * does not touch the caller's dictionary.  */
+static gpg_error_t
+create_customer (void *arg)
+{
+  struct create_customer_parm_s *parm = arg;
+  gpg_error_t err;
+  int status;
+  cjson_t json = NULL;
+  cjson_t j_obj;
+
+  err = call_stripe (opt.stripe_secret_key,
+                     "customers", NULL, parm->request, &status, &json);
+  if (err)
+    goto leave;
+  if (status != 200)
+    {
+      log_error ("create_customer: error: status=%u\n", status);
+      err = extract_error_from_json (&parm->errdict, json);
+      if (!err)
+        err = gpg_error (GPG_ERR_GENERAL);
+      goto leave;
+    }
+
+  j_obj = cJSON_GetObjectItem (json, "id");
+  if (!j_obj || !cjson_is_string (j_obj))
+    {
+      log_error ("create_customer: bad or missing 'id'\n");
+      err = gpg_error (GPG_ERR_GENERAL);
+      goto leave;
+    }
+
+  parm->customer_id = xtrystrdup (j_obj->valuestring);
+  if (!parm->customer_id)
+    err = gpg_error_from_syserror ();
+
+ leave:
+  cJSON_Delete (json);
+  return err;
+}
+
+
+/* Delete the customer CUSTOMER_ID.  This is used to remove a
+ * customer which we just created but can't use.  Errors are only
+ * logged.  */
+static void
+delete_customer (const char *customer_id)
+{
+  gpg_error_t err;
+  int status;
+  cjson_t json = NULL;
+
+  err = call_stripe_ext (HTTP_REQ_DELETE, opt.stripe_secret_key,
+                         "customers", customer_id, NULL, &status, &json);
+  if (!err && status != 200)
+    err = gpg_error (GPG_ERR_GENERAL);
+  if (err)
+    log_error ("%s: error deleting customer '%s': %s (status=%d)\n",
+               __func__, customer_id, gpg_strerror (err), status);
+  else
+    log_info ("%s: customer '%s' deleted\n", __func__, customer_id);
+  cJSON_Delete (json);
+}
+
+
 /* Using the values from DICT find or create a new customer and
- * subscribe it to a provided plan.  Required items:
+ * subscribe it to a plan.  Required items:
  *
- *   _plan_id: The plan to subscribe the customer to.
+ *   _plan_id: The plan to subscribe the customer to.  If this is
+ *             not given the plan is looked up or created using
+ *             stripe_find_create_plan.  This is done concurrently
+ *             with the creation of the customer.
  * Card-Token: The token returned by the CARDTOKEN command.
  *
  * On success the following items are inserted/updated:
@@ -679,24 +824,24 @@ stripe_find_create_plan (keyvalue_t *dict)
 gpg_error_t
 stripe_create_subscription (keyvalue_t *dict)
 {
-  gpg_error_t err;
+  gpg_error_t err, plan_err;
   int status;
   keyvalue_t request = NULL;
   keyvalue_t accountdict = NULL;
+  keyvalue_t kv;
   cjson_t json = NULL;
   const char *s;
   cjson_t j_obj;
   char *customer_id = NULL; /* The Stripe customer id.  */
   char *account_id = NULL;  /* Our account id. */
+  int need_plan;
+  future_t future;
+  struct create_customer_parm_s parm;
+
+  memset (&parm, 0, sizeof parm);
 
   /* First check that we have all required data. */
-  s = keyvalue_get_string (*dict, "_plan-id");
-  if (!*s)
-    {
-      log_error ("%s: missing '_plan-id'\n", __func__);
-      err = gpg_error (GPG_ERR_MISSING_VALUE);
-      goto leave;
-    }
+  need_plan = !*keyvalue_get_string (*dict, "_plan-id");
   s = keyvalue_get_string (*dict, "Card-Token");
   if (!*s)
     {
@@ -728,38 +873,31 @@ stripe_create_subscription (keyvalue_t *dict)
   if (err)
     goto leave;
 
-  /* Create a customer.  */
-  err = call_stripe (opt.stripe_secret_key,
-                     "customers", NULL, request, &status, &json);
+  /* Create a customer and, at the same time, find or create the
+   * plan.  */
+  parm.request = request;
+  err = future_start (&future, create_customer, &parm);
   if (err)
     goto leave;
-  if (status != 200)
+  plan_err = need_plan? stripe_find_create_plan (dict) : 0;
+  err = future_wait (future);
+  customer_id = parm.customer_id;
+  for (kv = parm.errdict; kv; kv = kv->next)
+    if (!*keyvalue_get_string (*dict, kv->name))
+      keyvalue_put (dict, kv->name, kv->value);
+  if (plan_err)
     {
-      log_error ("create_customer: error: status=%u\n", status);
-      err = extract_error_from_json (dict, json);
-      if (!err)
-        err = gpg_error (GPG_ERR_GENERAL);
-      goto leave;
-    }
-
-  /* Get the customer ID and put it right away into the request.  */
-  j_obj = cJSON_GetObjectItem (json, "id");
-  if (!j_obj || !cjson_is_string (j_obj))
-    {
-      log_error ("create_customer: bad or missing 'id'\n");
-      err = gpg_error (GPG_ERR_GENERAL);
-      goto leave;
-    }
-
-  customer_id = xtrystrdup (j_obj->valuestring);
-  if (!customer_id)
-    {
-      err = gpg_error_from_syserror ();
-      goto leave;
+      /* Do not leave a customer without a subscription behind.  */
+      if (customer_id)
+        {
+          log_info ("%s: customer '%s' created but no plan\n",
+                    __func__, customer_id);
+          delete_customer (customer_id);
+        }
+      err = plan_err;
     }
-  /* We don't need the result anymore.  */
-  cJSON_Delete (json);
-  json = NULL;
+  if (err)
+    goto leave;
 
   /* Create the subscription.  */
 
@@ -790,6 +928,7 @@ stripe_create_subscription (keyvalue_t *dict)
   s = keyvalue_get_string (*dict, "_plan-id");
   if (!*s)
     {
+      log_error ("%s: missing '_plan-id'\n", __func__);
       err = gpg_error (GPG_ERR_MISSING_VALUE);
       goto leave;
     }
@@ -801,6 +940,27 @@ stripe_create_subscription (keyvalue_t *dict)
                      "subscriptions", NULL, request, &status, &json);
   if (err)
     goto leave;
+  if ((status == 400 || status == 404)
+      && keyvalue_get_int (*dict, "_plan-cached"))
+    {
+      /* Stripe may not know the cached plan anymore.  Forget it,
+       * find or create the plan again and retry once.  */
+      log_info ("%s: subscription with cached plan '%s' failed - retrying\n",
+                __func__, keyvalue_get_string (*dict, "_plan-id"));
+      forget_cached_plan (*dict);
+      cJSON_Delete (json);
+      json = NULL;
+      err = stripe_find_create_plan (dict);
+      if (!err)
+        err = keyvalue_put (&request, "plan",
+                            keyvalue_get_string (*dict, "_plan-id"));
+      if (err)
+        goto leave;
+      err = call_stripe (opt.stripe_secret_key,
+                         "subscriptions", NULL, request, &status, &json);
+      if (err)
+        goto leave;
+    }
   if (status != 200)
     {
       log_error ("create_subscriptions: error: status=%u\n", status);
@@ -848,6 +1008,7 @@ stripe_create_subscription (keyvalue_t *dict)
   xfree (customer_id);
   keyvalue_release (accountdict);
   keyvalue_release (request);
+  keyvalue_release (parm.errdict);
   cJSON_Delete (json);
   return err;
 }
@@ -0,0 +1,191 @@
+/* t-account.c - Regression tests for account.c
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "t-common.h"
+
+#include "account.c" /* The module under test.  */
+
+
+/* Return true if a record for ACCOUNT_ID is in the cache.  */
+static int
+is_cached (const char *account_id)
+{
+  int found;
+
+  lock_account_cache ();
+  found = !!account_cache_find (account_id);
+  unlock_account_cache ();
+  return found;
+}
+
+
+static void
+test_cache_hit (void)
+{
+  gpg_error_t err;
+  keyvalue_t dict = NULL;
+
+  account_cache_put (account_cache_generation, "Atest000000001", 1,
+                     "foo@example.org", "cus_1234", "");
+  if (!is_cached ("Atest000000001"))
+    fail (0);
+  if (is_cached ("Atest000000002"))
+    fail (0);
+
+  /* A hit must not touch the database.  */
+  err = account_get_record ("Atest000000001", &dict);
+  if (err)
+    {
+      fail (0);
+      goto leave;
+    }
+  if (strcmp (keyvalue_get_string (dict, "account-id"), "Atest000000001"))
+    fail (1);
+  if (strcmp (keyvalue_get_string (dict, "Email"), "foo@example.org"))
+    fail (2);
+  if (keyvalue_get_int (dict, "Verified") != 1)
+    fail (3);
+  if (strcmp (keyvalue_get_string (dict, "_stripe_cus"), "cus_1234"))
+    fail (4);
+  if (*keyvalue_get_string (dict, "_paypal_payer_id"))
+    fail (5);
+
+  /* A second put for the same id is ignored.  */
+  account_cache_put (account_cache_generation, "Atest000000001", 0,
+                     "bar@example.org", "cus_5678", "");
+  keyvalue_release (dict);
+  dict = NULL;
+  err = account_get_record ("Atest000000001", &dict);
+  if (err || strcmp (keyvalue_get_string (dict, "_stripe_cus"), "cus_1234"))
+    fail (6);
+
+ leave:
+  keyvalue_release (dict);
+}
+
+
+static void
+test_cache_eviction (void)
+{
+  char id[16];
+  char email[200];
+  int i;
+
+  /* Fill the cache and touch the first record so that the second
+   * one is the least recently used.  */
+  for (i=0; i < ACCOUNT_CACHE_SIZE; i++)
+    {
+      snprintf (id, sizeof id, "Aevict%08d", i);
+      account_cache_put (account_cache_generation, id, 0, "", "", "");
+    }
+  if (account_cache_count != ACCOUNT_CACHE_SIZE)
+    fail (account_cache_count);
+  if (!is_cached ("Aevict00000000"))
+    fail (0);
+
+  account_cache_put (account_cache_generation, "Aevict99999999", 0,
+                     "", "", "");
+  if (account_cache_count != ACCOUNT_CACHE_SIZE)
+    fail (account_cache_count);
+  if (!is_cached ("Aevict00000000"))
+    fail (1);
+  if (is_cached ("Aevict00000001"))
+    fail (2);
+  if (!is_cached ("Aevict99999999"))
+    fail (3);
+
+  /* Large records are limited by the byte limit.  */
+  memset (email, 'x', sizeof email - 1);
+  email[sizeof email - 1] = 0;
+  for (i=0; i < ACCOUNT_CACHE_SIZE; i++)
+    {
+      snprintf (id, sizeof id, "Abytes%08d", i);
+      account_cache_put (account_cache_generation, id, 0, email, email, "");
+      if (account_cache_bytes > ACCOUNT_CACHE_MAXBYTES)
+        fail (i);
+    }
+  if (!is_cached (id))
+    fail (4);
+  if (is_cached ("Abytes00000000"))
+    fail (5);
+
+  /* Expired records are removed.  */
+  account_cache_lru_tail->expires = time (NULL) - 1;
+  snprintf (id, sizeof id, "%s", account_cache_lru_tail->account_id);
+  account_cache_expire ();
+  if (is_cached (id))
+    fail (6);
+}
+
+
+static void
+test_cache_invalidate (void)
+{
+  unsigned int generation;
+
+  account_cache_put (account_cache_generation, "Ainval00000001", 0,
+                     "foo@example.org", "cus_1", "");
+  if (!is_cached ("Ainval00000001"))
+    fail (0);
+
+  /* This is what update_account_record does after the UPDATE.  */
+  generation = account_cache_generation;
+  account_cache_invalidate ("Ainval00000001");
+  if (is_cached ("Ainval00000001"))
+    fail (1);
+
+  /* A record read before the update may not be cached.  */
+  account_cache_put (generation, "Ainval00000001", 0,
+                     "foo@example.org", "cus_1", "");
+  if (is_cached ("Ainval00000001"))
+    fail (2);
+  account_cache_put (account_cache_generation, "Ainval00000001", 1,
+                     "foo@example.org", "cus_2", "");
+  if (!is_cached ("Ainval00000001"))
+    fail (3);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  if (argc > 1 && !strcmp (argv[1], "--verbose"))
+    verbose = 1;
+
+  if (!gcry_check_version (NEED_LIBGCRYPT_VERSION))
+    log_fatal ("%s is too old (need %s, have %s)\n", "libgcrypt",
+               NEED_LIBGCRYPT_VERSION, gcry_check_version (NULL));
+  gcry_control (GCRYCTL_SUSPEND_SECMEM_WARN);
+  gcry_control (GCRYCTL_INIT_SECMEM, 131072, 0);
+  gcry_control (GCRYCTL_RESUME_SECMEM_WARN);
+  gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+
+  test_cache_hit ();
+  test_cache_eviction ();
+  test_cache_invalidate ();
+
+  return !!errorcount;
+}
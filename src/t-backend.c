@@ -0,0 +1,270 @@
+/* t-backend.c - Regression tests for backend.c
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "t-common.h"
+
+#include "backend.c" /* The module under test.  */
+
+
+/* Finish CALL as if the backend answered after LATENCY milliseconds
+ * with STATUS.  A STATUS of 0 is a transport error.  */
+static void
+finish_call (backend_call_t call, unsigned int latency, unsigned int status)
+{
+  call->contacted = 1;
+  call->start.tv_sec -= latency / 1000;
+  call->start.tv_nsec -= (latency % 1000) * 1000000L;
+  if (call->start.tv_nsec < 0)
+    {
+      call->start.tv_sec--;
+      call->start.tv_nsec += 1000000000L;
+    }
+  backend_release (call, status? 0 : gpg_error (GPG_ERR_ETIMEDOUT), status);
+}
+
+
+/* Reset the state of backend IDX.  */
+static void
+reset_backend (int idx)
+{
+  const char *name = backends[idx].name;
+
+  memset (&backends[idx], 0, sizeof backends[idx]);
+  backends[idx].name = name;
+}
+
+
+/* Let the cooldown of backend IDX expire.  */
+static void
+expire_cooldown (int idx)
+{
+  backends[idx].opened_at -= backends[idx].cooldown;
+}
+
+
+static void
+test_circuit (void)
+{
+  struct backend_call_s call, call2;
+  unsigned int timeout;
+  int i;
+
+  reset_backend (BACKEND_STRIPE);
+
+  /* The circuit opens after MAX_FAILURES consecutive failures.  */
+  for (i=0; i < MAX_FAILURES; i++)
+    {
+      if (backend_acquire (&call, BACKEND_STRIPE, 1, &timeout))
+        fail (1);
+      finish_call (&call, 10, i % 2? 0 : 503);
+      if (backends[BACKEND_STRIPE].state
+          != (i + 1 < MAX_FAILURES? BACKEND_CLOSED : BACKEND_OPEN))
+        fail (2);
+    }
+  if (backends[BACKEND_STRIPE].cooldown != MIN_COOLDOWN)
+    fail (3);
+  if (gpg_err_code (backend_acquire (&call, BACKEND_STRIPE, 1, &timeout))
+      != GPG_ERR_EHOSTDOWN)
+    fail (4);
+  if (backends[BACKEND_STRIPE].fastfails != 1)
+    fail (5);
+
+  /* The other backend is not affected.  */
+  if (backend_acquire (&call, BACKEND_PAYPAL, 1, &timeout))
+    fail (6);
+  else
+    finish_call (&call, 10, 200);
+
+  /* After the cooldown only one probe is allowed.  */
+  expire_cooldown (BACKEND_STRIPE);
+  if (backend_acquire (&call, BACKEND_STRIPE, 1, &timeout) || !call.probe)
+    fail (7);
+  if (backends[BACKEND_STRIPE].state != BACKEND_HALF_OPEN)
+    fail (8);
+  if (gpg_err_code (backend_acquire (&call2, BACKEND_STRIPE, 1, &timeout))
+      != GPG_ERR_EHOSTDOWN)
+    fail (9);
+
+  /* A failed probe re-opens the circuit with a doubled cooldown.  */
+  finish_call (&call, 10, 500);
+  if (backends[BACKEND_STRIPE].state != BACKEND_OPEN
+      || backends[BACKEND_STRIPE].cooldown != 2 * MIN_COOLDOWN)
+    fail (10);
+  if (gpg_err_code (backend_acquire (&call, BACKEND_STRIPE, 1, &timeout))
+      != GPG_ERR_EHOSTDOWN)
+    fail (11);
+
+  /* The cooldown is limited to MAX_COOLDOWN.  */
+  for (i=0; i < 10; i++)
+    {
+      expire_cooldown (BACKEND_STRIPE);
+      if (backend_acquire (&call, BACKEND_STRIPE, 1, &timeout))
+        fail (12);
+      finish_call (&call, 10, 0);
+    }
+  if (backends[BACKEND_STRIPE].cooldown != MAX_COOLDOWN)
+    fail (13);
+
+  /* A successful probe closes the circuit.  A 4xx status is not a
+   * failure of the backend.  */
+  expire_cooldown (BACKEND_STRIPE);
+  if (backend_acquire (&call, BACKEND_STRIPE, 1, &timeout) || !call.probe)
+    fail (14);
+  finish_call (&call, 10, 402);
+  if (backends[BACKEND_STRIPE].state != BACKEND_CLOSED
+      || backends[BACKEND_STRIPE].failures
+      || backends[BACKEND_STRIPE].probe_active)
+    fail (15);
+  if (backend_acquire (&call, BACKEND_STRIPE, 1, &timeout) || call.probe)
+    fail (16);
+  finish_call (&call, 10, 200);
+}
+
+
+static void
+test_local_errors (void)
+{
+  struct backend_call_s call;
+  unsigned int timeout;
+  int i;
+
+  reset_backend (BACKEND_PAYPAL);
+
+  /* Errors before the backend was contacted are not counted.  */
+  for (i=0; i < 2 * MAX_FAILURES; i++)
+    {
+      if (backend_acquire (&call, BACKEND_PAYPAL, 1, &timeout))
+        fail (1);
+      backend_release (&call, gpg_error (GPG_ERR_ENOMEM), 0);
+    }
+  if (backends[BACKEND_PAYPAL].state != BACKEND_CLOSED
+      || backends[BACKEND_PAYPAL].failures
+      || backends[BACKEND_PAYPAL].nsamples)
+    fail (2);
+
+  /* A probe failing locally lets the next call probe.  */
+  for (i=0; i < MAX_FAILURES; i++)
+    {
+      backend_acquire (&call, BACKEND_PAYPAL, 1, &timeout);
+      finish_call (&call, 10, 0);
+    }
+  expire_cooldown (BACKEND_PAYPAL);
+  if (backend_acquire (&call, BACKEND_PAYPAL, 1, &timeout) || !call.probe)
+    fail (3);
+  backend_release (&call, gpg_error (GPG_ERR_ENOMEM), 0);
+  if (backends[BACKEND_PAYPAL].state != BACKEND_HALF_OPEN
+      || backends[BACKEND_PAYPAL].cooldown != MIN_COOLDOWN)
+    fail (4);
+  if (backend_acquire (&call, BACKEND_PAYPAL, 1, &timeout) || !call.probe)
+    fail (5);
+  finish_call (&call, 10, 200);
+  if (backends[BACKEND_PAYPAL].state != BACKEND_CLOSED)
+    fail (6);
+}
+
+
+static void
+test_timeout (void)
+{
+  struct backend_call_s call;
+  struct backend_info_s info;
+  unsigned int timeout;
+  int i;
+
+  reset_backend (BACKEND_STRIPE);
+
+  /* Without enough samples the maximum is used.  */
+  for (i=0; i < MIN_SAMPLES; i++)
+    {
+      if (backend_acquire (&call, BACKEND_STRIPE, 1, &timeout))
+        fail (1);
+      if (timeout != MAX_TIMEOUT)
+        fail (2);
+      finish_call (&call, 100, 200);
+    }
+
+  /* Fast responses are clamped to MIN_TIMEOUT.  */
+  if (backend_acquire (&call, BACKEND_STRIPE, 1, &timeout))
+    fail (3);
+  if (timeout != MIN_TIMEOUT)
+    fail (4);
+  finish_call (&call, 100, 200);
+
+  /* Three times the 95th percentile.  */
+  for (i=0; i < MAX_SAMPLES; i++)
+    {
+      backend_acquire (&call, BACKEND_STRIPE, 1, &timeout);
+      finish_call (&call, 1000, 200);
+    }
+  if (backend_acquire (&call, BACKEND_STRIPE, 1, &timeout))
+    fail (5);
+  if (timeout < 3000 || timeout > 3100)
+    fail (6);
+  /* Calls which are not idempotent always use the maximum.  */
+  if (backend_acquire (&call, BACKEND_STRIPE, 0, &timeout))
+    fail (7);
+  if (timeout != MAX_TIMEOUT)
+    fail (8);
+  finish_call (&call, 1000, 200);
+
+  /* Slow responses are clamped to MAX_TIMEOUT.  */
+  for (i=0; i < MAX_SAMPLES; i++)
+    {
+      backend_acquire (&call, BACKEND_STRIPE, 1, &timeout);
+      finish_call (&call, 20000, 200);
+    }
+  if (backend_acquire (&call, BACKEND_STRIPE, 1, &timeout))
+    fail (9);
+  if (timeout != MAX_TIMEOUT)
+    fail (10);
+  finish_call (&call, 20000, 200);
+
+  if (!get_backend_info (BACKEND_STRIPE, &info))
+    fail (11);
+  else if (info.state != BACKEND_CLOSED || info.nsamples != MAX_SAMPLES
+           || info.timeout != MAX_TIMEOUT
+           || info.p50 < 20000 || info.p95 < 20000)
+    fail (12);
+  if (get_backend_info (NBACKENDS, &info))
+    fail (13);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  if (argc > 1 && !strcmp (argv[1], "--verbose"))
+    verbose = 1;
+
+  if (!verbose)
+    log_set_file ("/dev/null");
+
+  test_circuit ();
+  test_local_errors ();
+  test_timeout ();
+
+  return !!errorcount;
+}
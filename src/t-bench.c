@@ -0,0 +1,721 @@
+/* t-bench.c - Micro benchmarks for libcommon
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This program is run by "make bench".  For each benchmark it runs a
+ * warmup, calibrates the number of iterations so that one repetition
+ * takes about --min-time milliseconds, and then runs --repeat
+ * repetitions.  The best and the median time per operation and the
+ * number of allocations per operation are reported.  With --colons
+ * the output is a colon delimited record per benchmark:
+ *
+ *   version:PACKAGE_VERSION:
+ *   bench:NAME:ITERATIONS:BEST_NS:MEDIAN_NS:ALLOCS:
+ *
+ * ALLOCS is empty if allocations can't be counted on this platform.
+ * Benchmarks with the suffix "_ref" run the previous implementation
+ * of a function for comparison.
+ * A regular expression may be given to run only matching
+ * benchmarks.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <regex.h>
+
+#include "t-common.h"
+
+#include "util.h"
+#include "membuf.h"
+#include "form.h"
+
+
+/* Counting the allocations requires replacing malloc and friends.  */
+#ifdef __GLIBC__
+# define COUNT_ALLOCS 1
+static unsigned long alloc_count;
+
+extern void *__libc_malloc (size_t n);
+extern void *__libc_calloc (size_t n, size_t m);
+extern void *__libc_realloc (void *a, size_t n);
+
+void *
+malloc (size_t n)
+{
+  alloc_count++;
+  return __libc_malloc (n);
+}
+
+void *
+calloc (size_t n, size_t m)
+{
+  alloc_count++;
+  return __libc_calloc (n, m);
+}
+
+void *
+realloc (void *a, size_t n)
+{
+  alloc_count++;
+  return __libc_realloc (a, n);
+}
+#endif /*__GLIBC__*/
+
+
+static int opt_colons;
+static unsigned int opt_min_time = 50;   /* Milliseconds.  */
+static unsigned int opt_repeat = 5;
+
+/* Sink to keep the compiler from optimizing results away.  */
+static volatile size_t sink;
+
+/* Test data.  FORM_DATA is a PayPal IPN with 40 fields.  */
+static const char form_data[] =
+  "mc_gross=19.95&protection_eligibility=Eligible&address_status=confirmed"
+  "&payer_id=LPLWNMTBWMFAY&tax=0.00&address_street=1+Main+St"
+  "&payment_date=20%3A12%3A59+Jan+13%2C+2009+PST&payment_status=Completed"
+  "&charset=windows-1252&address_zip=95131&first_name=Test&mc_fee=0.88"
+  "&address_country_code=US&address_name=Test+User&notify_version=2.6"
+  "&custom=&payer_status=verified&address_country=United+States"
+  "&address_city=San+Jose&quantity=1&payer_email=gpmac_1231902590_per"
+  "%40paypal.com&txn_id=61E67681CH3238416&payment_type=instant"
+  "&last_name=User&address_state=CA&receiver_email=gpmac_1231902686_biz"
+  "%40paypal.com&payment_fee=0.88&receiver_id=S8XGHLYDW9T3S"
+  "&txn_type=express_checkout&item_name=&mc_currency=USD&item_number="
+  "&residence_country=US&test_ipn=1&handling_amount=0.00"
+  "&transaction_subject=&payment_gross=19.95&shipping=0.00"
+  "&verify_sign=AtkOfCXbDm2hu0ZELryHFjY-Vb7PAUvS6nMXgysbElEn9v-1XcmSoGtf";
+
+static const char escaped_string[] =
+  "Name=Werner%20Koch&Email=wk%40gnupg.org&Desc=a%3ab%3Ac%26d%0A";
+
+static const char plain_string[] =
+  "Some text: with a colon & an ampersand\nand a second line";
+
+static const unsigned char binary_data[32] =
+  { 0x9f, 0x86, 0xd0, 0x81, 0x88, 0x4c, 0x7d, 0x65,
+    0x9a, 0x2f, 0xea, 0xa0, 0xc5, 0x5a, 0xd0, 0x15,
+    0xa3, 0xbf, 0x4f, 0x1b, 0x2b, 0x0b, 0x82, 0x2c,
+    0xd1, 0x5d, 0x6c, 0x15, 0xb0, 0xf0, 0x0a, 0x08 };
+
+static keyvalue_t lookup_dict;
+static char form_buffer[sizeof form_data];
+static estream_t escape_fp;
+static char *base64_string;
+
+
+static void
+bench_convert_amount (unsigned long n)
+{
+  for (; n; n--)
+    sink += convert_amount ("1234.56", 2);
+}
+
+
+static void
+bench_reconvert_amount (unsigned long n)
+{
+  char *p;
+
+  for (; n; n--)
+    {
+      p = reconvert_amount (123456, 2);
+      sink += *p;
+      xfree (p);
+    }
+}
+
+
+static void
+bench_keyvalue_put (unsigned long n)
+{
+  static const char *keys[] = { "Amount", "Currency", "Desc", "Email",
+                                "Name", "Stmt-Desc", "Recur", "_timestamp" };
+  keyvalue_t dict = NULL;
+  int i;
+
+  for (; n; n--)
+    {
+      for (i=0; i < DIM (keys); i++)
+        if (keyvalue_put (&dict, keys[i], "some value"))
+          fail (0);
+      keyvalue_release (dict);
+      dict = NULL;
+    }
+}
+
+
+static void
+bench_keyvalue_get (unsigned long n)
+{
+  for (; n; n--)
+    sink += !!keyvalue_get (lookup_dict, "mc_currency");
+}
+
+
+static void
+bench_percent_unescape (unsigned long n)
+{
+  char *p;
+
+  for (; n; n--)
+    {
+      p = percent_unescape (escaped_string, 0);
+      sink += *p;
+      xfree (p);
+    }
+}
+
+
+static void
+bench_write_escaped (unsigned long n)
+{
+  for (; n; n--)
+    {
+      es_rewind (escape_fp);
+      write_escaped (plain_string, escape_fp);
+    }
+}
+
+
+/* The byte-by-byte versions of write_escaped and percent_unescape
+   which were used before the table driven ones.  */
+static void
+ref_write_escaped (const char *string, estream_t fp)
+{
+  const unsigned char *s;
+
+  for (s = (const unsigned char *)string; *s; s++)
+    {
+      if (!strchr (":&\n\r", *s))
+        es_putc (*s, fp);
+      else
+        es_fprintf (fp, "%%%02X", *s);
+    }
+}
+
+
+static void
+bench_write_escaped_ref (unsigned long n)
+{
+  for (; n; n--)
+    {
+      es_rewind (escape_fp);
+      ref_write_escaped (plain_string, escape_fp);
+    }
+}
+
+
+static char *
+ref_percent_unescape (const char *string, int nulrepl)
+{
+  unsigned char *buffer, *p;
+  const char *s;
+  size_t n = 0;
+
+  for (s = string; *s; s++, n++)
+    if (*s == '%' && s[1] && s[2])
+      s += 2;
+
+  buffer = p = xmalloc (n + 1);
+  while (*string)
+    {
+      if (*string == '%' && string[1] && string[2])
+        {
+          string++;
+          *p = xtoi_2 (string);
+          if (!*p)
+            *p = nulrepl;
+          string++;
+        }
+      else
+        *p = *string;
+      p++;
+      string++;
+    }
+  *p = 0;
+  return (char *)buffer;
+}
+
+
+static void
+bench_percent_unescape_ref (unsigned long n)
+{
+  char *p;
+
+  for (; n; n--)
+    {
+      p = ref_percent_unescape (escaped_string, 0);
+      sink += *p;
+      xfree (p);
+    }
+}
+
+
+static void
+bench_percent_plus_escape (unsigned long n)
+{
+  char *p;
+
+  for (; n; n--)
+    {
+      p = percent_plus_escape (plain_string);
+      sink += *p;
+      xfree (p);
+    }
+}
+
+
+static void
+bench_zb32_encode (unsigned long n)
+{
+  char *p;
+
+  for (; n; n--)
+    {
+      p = zb32_encode (binary_data, 8 * 20);
+      sink += *p;
+      xfree (p);
+    }
+}
+
+
+static void
+bench_base64_encode (unsigned long n)
+{
+  char *p;
+
+  for (; n; n--)
+    {
+      p = base64_encode (binary_data, sizeof binary_data);
+      sink += *p;
+      xfree (p);
+    }
+}
+
+
+static void
+bench_base64_decode (unsigned long n)
+{
+  void *buf;
+  size_t len;
+
+  for (; n; n--)
+    {
+      if (base64_decode (base64_string, &buf, &len))
+        fail (0);
+      sink += len;
+      xfree (buf);
+    }
+}
+
+
+static void
+bench_parse_www_form_urlencoded (unsigned long n)
+{
+  keyvalue_t dict;
+
+  for (; n; n--)
+    {
+      if (parse_www_form_urlencoded (&dict, form_data))
+        fail (0);
+      keyvalue_release (dict);
+    }
+}
+
+
+static void
+bench_form_parse (unsigned long n)
+{
+  struct form_field_s fields[64];
+  unsigned int nfields;
+
+  for (; n; n--)
+    {
+      memcpy (form_buffer, form_data, sizeof form_data);
+      if (form_parse (form_buffer, fields, DIM (fields), &nfields))
+        fail (0);
+      sink += nfields;
+    }
+}
+
+
+static void
+bench_encode_formdata (unsigned long n)
+{
+  char *p;
+
+  for (; n; n--)
+    {
+      if (encode_formdata (lookup_dict, &p))
+        fail (0);
+      sink += *p;
+      xfree (p);
+    }
+}
+
+
+/* The form encoding using http_escape_string as used before the
+   table driven encoder.  */
+static char *
+ref_escape_form (const char *string)
+{
+  static const char special[] = "%;?&=";
+  static const char valid[] = "abcdefghijklmnopqrstuvwxyz"
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZ" "01234567890@"
+    "!\"#$%&'()*+,-./:;<=>?[\\]^_{|}~";
+  const unsigned char *s;
+  char *buffer, *p;
+  size_t n;
+  int pass;
+
+  for (pass = 0, buffer = NULL; pass < 2; pass++)
+    {
+      for (n = 0, p = buffer, s = (const unsigned char *)string; *s; s++)
+        {
+          if (*s == ' ')
+            {
+              if (p)
+                *p++ = '+';
+              n++;
+            }
+          else if (*s == '\n' || (*s == '\r' && s[1] == '\n'))
+            {
+              if (p)
+                {
+                  memcpy (p, "%0D%0A", 6);
+                  p += 6;
+                }
+              n += 6;
+              if (*s == '\r')
+                s++;
+            }
+          else if (strchr (valid, *s) && !strchr (special, *s))
+            {
+              if (p)
+                *p++ = *s;
+              n++;
+            }
+          else
+            {
+              if (p)
+                {
+                  snprintf (p, 4, "%%%02X", *s);
+                  p += 3;
+                }
+              n += 3;
+            }
+        }
+      if (!buffer)
+        buffer = xmalloc (n + 1);
+      else
+        *p = 0;
+    }
+  return buffer;
+}
+
+
+static void
+bench_encode_formdata_ref (unsigned long n)
+{
+  membuf_t mb;
+  keyvalue_t kv;
+  char *escaped, *p;
+
+  for (; n; n--)
+    {
+      init_membuf (&mb, 0);
+      for (kv = lookup_dict; kv; kv = kv->next)
+        {
+          if (kv != lookup_dict)
+            put_membuf_str (&mb, "&");
+          escaped = ref_escape_form (kv->name);
+          put_membuf_str (&mb, escaped);
+          xfree (escaped);
+          put_membuf_str (&mb, "=");
+          escaped = ref_escape_form (kv->value);
+          put_membuf_str (&mb, escaped);
+          xfree (escaped);
+        }
+      put_membuf (&mb, "", 1);
+      p = get_membuf (&mb, NULL);
+      sink += *p;
+      xfree (p);
+    }
+}
+
+
+static void
+bench_write_formdata (unsigned long n)
+{
+  for (; n; n--)
+    {
+      es_rewind (escape_fp);
+      sink += form_encoded_length (lookup_dict);
+      if (write_formdata (lookup_dict, escape_fp))
+        fail (0);
+    }
+}
+
+
+static void
+bench_has_leading_keyword (unsigned long n)
+{
+  for (; n; n--)
+    {
+      sink += !!has_leading_keyword ("SESSION", "CHARGECARD");
+      sink += !!has_leading_keyword ("CHARGECARD 42", "CHARGECARD");
+    }
+}
+
+
+static struct
+{
+  const char *name;
+  void (*func)(unsigned long n);
+} benchmarks[] =
+  {
+    { "convert_amount",            bench_convert_amount },
+    { "reconvert_amount",          bench_reconvert_amount },
+    { "keyvalue_put",              bench_keyvalue_put },
+    { "keyvalue_get",              bench_keyvalue_get },
+    { "percent_unescape",          bench_percent_unescape },
+    { "percent_unescape_ref",      bench_percent_unescape_ref },
+    { "percent_plus_escape",       bench_percent_plus_escape },
+    { "write_escaped",             bench_write_escaped },
+    { "write_escaped_ref",         bench_write_escaped_ref },
+    { "zb32_encode",               bench_zb32_encode },
+    { "base64_encode",             bench_base64_encode },
+    { "base64_decode",             bench_base64_decode },
+    { "parse_www_form_urlencoded", bench_parse_www_form_urlencoded },
+    { "form_parse",                bench_form_parse },
+    { "encode_formdata",           bench_encode_formdata },
+    { "encode_formdata_ref",       bench_encode_formdata_ref },
+    { "write_formdata",            bench_write_formdata },
+    { "has_leading_keyword",       bench_has_leading_keyword }
+  };
+
+
+static double
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static int
+compare_double (const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return x < y? -1 : x > y;
+}
+
+
+static void
+run_benchmark (int idx)
+{
+  void (*func)(unsigned long) = benchmarks[idx].func;
+  unsigned long iterations;
+  double start, elapsed;
+  double *times;
+  unsigned int rep;
+#ifdef COUNT_ALLOCS
+  unsigned long allocs;
+#endif
+
+  times = xcalloc (opt_repeat, sizeof *times);
+
+  /* Warmup and calibration: Double the number of iterations until a
+     run takes at least a tenth of the minimum time.  */
+  for (iterations = 1; ; iterations *= 2)
+    {
+      start = now_ns ();
+      func (iterations);
+      elapsed = now_ns () - start;
+      if (elapsed >= opt_min_time * 1e5)
+        break;
+    }
+  iterations = iterations * 10 + 1;
+
+#ifdef COUNT_ALLOCS
+  allocs = alloc_count;
+  func (1);
+  allocs = alloc_count - allocs;
+#endif
+
+  for (rep = 0; rep < opt_repeat; rep++)
+    {
+      start = now_ns ();
+      func (iterations);
+      times[rep] = (now_ns () - start) / iterations;
+    }
+  qsort (times, opt_repeat, sizeof *times, compare_double);
+
+  if (opt_colons)
+    {
+      printf ("bench:%s:%lu:%.1f:%.1f:",
+              benchmarks[idx].name, iterations,
+              times[0], times[opt_repeat/2]);
+#ifdef COUNT_ALLOCS
+      printf ("%lu", allocs);
+#endif
+      printf (":\n");
+    }
+  else
+    {
+      printf ("%-26s %10lu %10.1f %10.1f",
+              benchmarks[idx].name, iterations,
+              times[0], times[opt_repeat/2]);
+#ifdef COUNT_ALLOCS
+      printf (" %7lu", allocs);
+#else
+      printf ("       -");
+#endif
+      putchar ('\n');
+    }
+  fflush (stdout);
+
+  xfree (times);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  const char *pattern = NULL;
+  regex_t re;
+  int idx;
+
+  if (argc)
+    {
+      argc--; argv++;
+    }
+  while (argc && **argv == '-')
+    {
+      if (!strcmp (*argv, "--"))
+        {
+          argc--; argv++;
+          break;
+        }
+      else if (!strcmp (*argv, "--help"))
+        {
+          fputs ("usage: t-bench [options] [REGEX]\n"
+                 "Options:\n"
+                 "  --colons        print colon delimited records\n"
+                 "  --min-time N    run each repetition N ms [50]\n"
+                 "  --repeat N      run N repetitions [5]\n"
+                 "  --verbose       print extra diagnostics\n",
+                 stdout);
+          exit (0);
+        }
+      else if (!strcmp (*argv, "--verbose"))
+        {
+          verbose = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--colons"))
+        {
+          opt_colons = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--min-time") && argc > 1)
+        {
+          opt_min_time = strtoul (argv[1], NULL, 10);
+          argc -= 2; argv += 2;
+        }
+      else if (!strcmp (*argv, "--repeat") && argc > 1)
+        {
+          opt_repeat = strtoul (argv[1], NULL, 10);
+          argc -= 2; argv += 2;
+        }
+      else
+        {
+          fprintf (stderr, "t-bench: unknown option '%s'\n", *argv);
+          exit (2);
+        }
+    }
+  if (argc > 1)
+    {
+      fprintf (stderr, "usage: t-bench [options] [REGEX]\n");
+      exit (2);
+    }
+  if (argc)
+    {
+      pattern = *argv;
+      if (regcomp (&re, pattern, REG_EXTENDED|REG_NOSUB))
+        {
+          fprintf (stderr, "t-bench: invalid regex '%s'\n", pattern);
+          exit (2);
+        }
+    }
+  if (!opt_min_time)
+    opt_min_time = 1;
+  if (!opt_repeat)
+    opt_repeat = 1;
+
+  /* Prepare the test data.  */
+  if (parse_www_form_urlencoded (&lookup_dict, form_data))
+    {
+      fprintf (stderr, "t-bench: error parsing the form data\n");
+      exit (1);
+    }
+  escape_fp = es_fopenmem (0, "w");
+  if (!escape_fp)
+    {
+      fprintf (stderr, "t-bench: es_fopenmem failed\n");
+      exit (1);
+    }
+  base64_string = base64_encode (binary_data, sizeof binary_data);
+  if (!base64_string)
+    {
+      fprintf (stderr, "t-bench: base64_encode failed\n");
+      exit (1);
+    }
+
+  if (opt_colons)
+    printf ("version:%s:\n", PACKAGE_VERSION);
+  else
+    printf ("%-26s %10s %10s %10s %7s\n",
+            "benchmark", "iterations", "best ns/op", "median", "allocs");
+
+  for (idx=0; idx < DIM (benchmarks); idx++)
+    {
+      if (pattern && regexec (&re, benchmarks[idx].name, 0, NULL, 0))
+        continue;
+      if (verbose)
+        fprintf (stderr, "t-bench: running %s\n", benchmarks[idx].name);
+      run_benchmark (idx);
+    }
+
+  if (pattern)
+    regfree (&re);
+  es_fclose (escape_fp);
+  xfree (base64_string);
+  keyvalue_release (lookup_dict);
+
+  return !!errorcount;
+}
@@ -0,0 +1,420 @@
+/* t-client.c - Regression tests for client.c
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <assert.h>
+#include <sys/wait.h>
+
+#include "t-common.h"
+
+#include "client.c" /* The module under test.  */
+
+
+static const char socket_name[] = "t-client.sock";
+
+/* The pid of the fake daemon.  */
+static pid_t server_pid;
+
+
+/* Serve the binary requests on the connection FD.  The commands are:
+ *
+ *   PING - Return "OK" with the items "Pid" and "Seq" telling the pid
+ *          of the process serving the connection and the number of
+ *          the request on the connection.
+ *   ECHO - Return "OK" with the item "Data" of the request.
+ *   FAIL - Return "ERR 58 No data".
+ *   QUIT - Return "OK" and close the connection.
+ */
+static void
+serve_connection (int fd)
+{
+  estream_t in, out;
+  char *command;
+  keyvalue_t dict;
+  char buf[50];
+  int seq;
+
+  in = es_fdopen (fd, "rb");
+  out = es_fdopen_nc (fd, "wb");
+  if (!in || !out)
+    _exit (1);
+
+  for (seq = 1; es_getc (in) == PROTOCOL_BINARY_MAGIC; seq++)
+    {
+      dict = NULL;
+      if (protocol_read_binary_request (in, &command, &dict))
+        break;
+      if (!strcmp (command, "FAIL"))
+        protocol_write_binary_start (out, "ERR 58 No data");
+      else if (!strcmp (command, "ECHO"))
+        {
+          protocol_write_binary_start (out, "OK");
+          protocol_write_binary_item (out, "Data",
+                                      keyvalue_get_string (dict, "Data"));
+        }
+      else
+        {
+          protocol_write_binary_start (out, "OK");
+          snprintf (buf, sizeof buf, "%d", (int)getpid ());
+          protocol_write_binary_item (out, "Pid", buf);
+          snprintf (buf, sizeof buf, "%d", seq);
+          protocol_write_binary_item (out, "Seq", buf);
+        }
+      protocol_write_binary_end (out);
+      es_fflush (out);
+      keyvalue_release (dict);
+      if (!strcmp (command, "QUIT"))
+        {
+          xfree (command);
+          break;
+        }
+      xfree (command);
+    }
+  es_fclose (out);
+  es_fclose (in);
+  _exit (0);
+}
+
+
+/* Start a fake daemon which serves each connection in a new
+ * process.  */
+static void
+start_server (void)
+{
+  int fd, conn_fd;
+  struct sockaddr_un addr_un;
+
+  remove (socket_name);
+  memset (&addr_un, 0, sizeof addr_un);
+  addr_un.sun_family = AF_LOCAL;
+  strcpy (addr_un.sun_path, socket_name);
+  fd = socket (AF_LOCAL, SOCK_STREAM, 0);
+  if (fd == -1
+      || bind (fd, (struct sockaddr *)&addr_un, SUN_LEN (&addr_un))
+      || listen (fd, 16))
+    {
+      fprintf (stderr, "error creating socket: %s\n", strerror (errno));
+      exit (1);
+    }
+
+  server_pid = fork ();
+  if (server_pid == -1)
+    {
+      fprintf (stderr, "fork failed: %s\n", strerror (errno));
+      exit (1);
+    }
+  if (!server_pid)
+    {
+      /* Do not outlive a test killed by its alarm.  */
+      alarm (70);
+      signal (SIGCHLD, SIG_IGN);
+      for (;;)
+        {
+          conn_fd = accept (fd, NULL, NULL);
+          if (conn_fd == -1)
+            continue;
+          if (!fork ())
+            {
+              alarm (70);
+              close (fd);
+              serve_connection (conn_fd);
+            }
+          close (conn_fd);
+        }
+    }
+  close (fd);
+}
+
+
+static void
+stop_server (void)
+{
+  kill (server_pid, SIGTERM);
+  waitpid (server_pid, NULL, 0);
+  remove (socket_name);
+}
+
+
+/* Run COMMAND via POOL and return the response items at R_PID and
+ * R_SEQ.  */
+static gpg_error_t
+pool_request (client_pool_t pool, const char *command, int *r_pid, int *r_seq)
+{
+  gpg_error_t err;
+  keyvalue_t outdata = NULL;
+
+  err = client_pool_request (pool, command, NULL, &outdata);
+  *r_pid = keyvalue_get_int (outdata, "Pid");
+  *r_seq = keyvalue_get_int (outdata, "Seq");
+  if (gpg_err_code (err) == GPG_ERR_NO_DATA
+      && strcmp (keyvalue_get_string (outdata, "_errdesc"), "No data"))
+    err = gpg_error (GPG_ERR_BUG);
+  keyvalue_release (outdata);
+  return err;
+}
+
+
+static void
+test_pool (void)
+{
+  gpg_error_t err;
+  client_pool_t pool;
+  int pid, seq, pid2;
+
+  err = client_pool_new (&pool, socket_name, 1);
+  if (err)
+    {
+      fail (0);
+      return;
+    }
+
+  /* The connection is kept open for the second request.  */
+  err = pool_request (pool, "PING", &pid, &seq);
+  if (err || !pid || seq != 1)
+    fail (1);
+  err = pool_request (pool, "PING", &pid2, &seq);
+  if (err || pid2 != pid || seq != 2)
+    fail (2);
+  if (pool->nidle != 1)
+    fail (3);
+
+  /* An error returned by the daemon does not close it.  */
+  err = pool_request (pool, "FAIL", &pid2, &seq);
+  if (gpg_err_code (err) != GPG_ERR_NO_DATA)
+    fail (4);
+  err = pool_request (pool, "PING", &pid2, &seq);
+  if (err || pid2 != pid || seq != 4)
+    fail (5);
+
+  /* A connection closed by the daemon is detected and replaced.  */
+  err = pool_request (pool, "QUIT", &pid2, &seq);
+  if (err || pid2 != pid)
+    fail (6);
+  usleep (100000);
+  err = pool_request (pool, "PING", &pid2, &seq);
+  if (err || pid2 == pid || seq != 1)
+    fail (7);
+
+  client_pool_release (pool);
+}
+
+
+/* The state for the batch callback.  */
+struct batch_parm_s
+{
+  int ncalls;
+  int seq[10];
+  gpg_error_t err[10];
+};
+
+
+static void
+batch_cb (void *opaque, gpg_error_t err, keyvalue_t outdata)
+{
+  struct batch_parm_s *parm = opaque;
+
+  if (parm->ncalls < DIM (parm->seq))
+    {
+      parm->seq[parm->ncalls] = keyvalue_get_int (outdata, "Seq");
+      parm->err[parm->ncalls] = err;
+    }
+  parm->ncalls++;
+}
+
+
+static void
+test_batch (void)
+{
+  gpg_error_t err;
+  client_pool_t pool;
+  client_batch_t batch, batch2;
+  struct batch_parm_s parm, parm2;
+  int i, pid, seq;
+
+  err = client_pool_new (&pool, socket_name, 1);
+  if (err)
+    {
+      fail (0);
+      return;
+    }
+
+  /* The responses are delivered in request order; a daemon error
+   * does not affect the other requests.  */
+  memset (&parm, 0, sizeof parm);
+  err = client_batch_new (&batch, pool);
+  for (i=0; !err && i < 10; i++)
+    err = client_batch_add (batch, i == 4? "FAIL":"PING", NULL,
+                            batch_cb, &parm);
+  if (err)
+    {
+      fail (1);
+      goto leave;
+    }
+
+  /* A second batch needs a second connection.  */
+  memset (&parm2, 0, sizeof parm2);
+  err = client_batch_new (&batch2, pool);
+  if (!err)
+    err = client_batch_add (batch2, "PING", NULL, batch_cb, &parm2);
+  if (!err)
+    err = client_batch_run (batch2);
+  if (err || parm2.ncalls != 1 || parm2.seq[0] != 1)
+    fail (2);
+
+  err = client_batch_run (batch);
+  if (err || parm.ncalls != 10)
+    fail (3);
+  for (i=0; i < 10; i++)
+    if (i == 4)
+      {
+        if (gpg_err_code (parm.err[i]) != GPG_ERR_NO_DATA)
+          fail (4);
+      }
+    else if (parm.err[i] || parm.seq[i] != i + 1)
+      fail (5);
+
+  /* Only MAXIDLE connections are kept.  */
+  if (pool->nidle != 1)
+    fail (6);
+
+  /* The pool can be used for a batch and single requests.  */
+  err = pool_request (pool, "PING", &pid, &seq);
+  if (err || seq == 1)
+    fail (7);
+
+  /* A local error is reported to the remaining callbacks.  */
+  memset (&parm, 0, sizeof parm);
+  err = client_batch_new (&batch, pool);
+  if (!err)
+    err = client_batch_add (batch, "QUIT", NULL, batch_cb, &parm);
+  if (!err)
+    err = client_batch_add (batch, "PING", NULL, batch_cb, &parm);
+  if (!err)
+    err = client_batch_add (batch, "PING", NULL, batch_cb, &parm);
+  if (err)
+    {
+      fail (8);
+      goto leave;
+    }
+  err = client_batch_run (batch);
+  if (!err || parm.ncalls != 3 || parm.err[0]
+      || !parm.err[1] || parm.err[2] != parm.err[1])
+    fail (9);
+  if (pool->nidle)
+    fail (10);
+
+ leave:
+  client_pool_release (pool);
+}
+
+
+/* The state for the echo callback.  */
+struct echo_parm_s
+{
+  const char *data;
+  int ncalls;
+  int nerrors;
+};
+
+
+static void
+echo_cb (void *opaque, gpg_error_t err, keyvalue_t outdata)
+{
+  struct echo_parm_s *parm = opaque;
+
+  if (err || strcmp (keyvalue_get_string (outdata, "Data"), parm->data))
+    parm->nerrors++;
+  parm->ncalls++;
+}
+
+
+/* Send far more data in a batch than fits into the socket buffers.
+ * The daemon writes a response of the same size for each request;
+ * thus this blocks if the client does not read the responses while
+ * sending.  */
+static void
+test_large_batch (void)
+{
+  gpg_error_t err;
+  client_pool_t pool;
+  client_batch_t batch;
+  struct echo_parm_s parm;
+  keyvalue_t indata = NULL;
+  char *data;
+  int i;
+
+  data = xmalloc (4096);
+  memset (data, 'x', 4095);
+  data[4095] = 0;
+  memset (&parm, 0, sizeof parm);
+  parm.data = data;
+
+  err = client_pool_new (&pool, socket_name, 1);
+  if (err)
+    {
+      fail (0);
+      goto leave;
+    }
+  err = keyvalue_put (&indata, "Data", data);
+  if (!err)
+    err = client_batch_new (&batch, pool);
+  for (i=0; !err && i < 2000; i++)
+    err = client_batch_add (batch, "ECHO", indata, echo_cb, &parm);
+  if (err)
+    {
+      fail (1);
+      goto leave;
+    }
+  err = client_batch_run (batch);
+  if (err || parm.ncalls != 2000 || parm.nerrors)
+    fail (2);
+
+ leave:
+  keyvalue_release (indata);
+  client_pool_release (pool);
+  xfree (data);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  if (argc > 1 && !strcmp (argv[1], "--verbose"))
+    verbose = 1;
+
+  /* The fake daemon may close connections.  */
+  signal (SIGPIPE, SIG_IGN);
+  /* A blocked batch shall fail the test and not hang it.  */
+  alarm (60);
+
+  start_server ();
+
+  test_pool ();
+  test_batch ();
+  test_large_batch ();
+
+  stop_server ();
+
+  return !!errorcount;
+}
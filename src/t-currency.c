@@ -0,0 +1,343 @@
+/* t-currency.c - Regression tests for currency.c
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "t-common.h"
+
+#include "currency.c" /* The module under test.  */
+
+
+static const char test_table_fname[] = "t-currency.tbl";
+static const char test_rates_fname[] = "t-currency.dat";
+
+
+/* Write the string DATA to the file FNAME.  */
+static void
+write_file (const char *fname, const char *data)
+{
+  FILE *fp;
+
+  fp = fopen (fname, "w");
+  if (!fp || fputs (data, fp) == EOF || fclose (fp))
+    {
+      fprintf (stderr, "error writing '%s': %s\n", fname, strerror (errno));
+      exit (1);
+    }
+}
+
+
+static void
+test_parse_rate (void)
+{
+  static struct {
+    const char *string;
+    unsigned long long expected;
+  } tv[] = {
+    { "1",            1000000 },
+    { "1.0",          1000000 },
+    { ".5",            500000 },
+    { "0.000001",           1 },
+    { "1.1234564",    1123456 },
+    { "1.1234565",    1123457 },
+    { "1.12345649",   1123456 },
+    { "1.9999995",    2000000 },
+    { "10000",    10000000000ULL },
+    { "17123.45", 17123450000ULL },
+    { "99999",    99999000000ULL },
+    { "1000000", 1000000000000ULL },
+    { "1000000.000001",     0 },
+    { "9999999",            0 },
+    { "10000000",           0 },
+    { "",                   0 },
+    { ".",                  0 },
+    { "0",                  0 },
+    { "1..2",               0 },
+    { "1.2.3",              0 },
+    { "-1.5",               0 },
+    { "+1.5",               0 },
+    { "1,5",                0 },
+    { "1.5 ",               0 },
+    { "1e3",                0 }
+  };
+  int tidx;
+  unsigned long long rate;
+
+  for (tidx=0; tidx < DIM (tv); tidx++)
+    {
+      rate = parse_rate (tv[tidx].string);
+      if (rate != tv[tidx].expected)
+        {
+          if (verbose)
+            fprintf (stderr, "test %d: got %llu\n", tidx, rate);
+          fail (tidx);
+        }
+    }
+}
+
+
+static void
+test_load_currencies (void)
+{
+  currency_table_t tbl;
+  char longline[300];
+  char *data;
+  int idx;
+
+  memset (longline, 'A', sizeof longline - 2);
+  longline[sizeof longline - 2] = '\n';
+  longline[sizeof longline - 1] = 0;
+  data = strconcat ("# Test table\n"
+                    "\n"
+                    "USD 2 US Dollar\n"
+                    "  jpy   0   Yen  \n"
+                    "CHF 2 Swiss Franc\r\n",
+                    longline,
+                    "GBP x British Pound\n"
+                    "GB 2 Too short\n"
+                    "GBPX 2 Too long\n"
+                    "BHD 4 Too many digits\n"
+                    "USD 2 Duplicate\n"
+                    "EUR 3 Euro\n"
+                    "SEK", NULL);
+  if (!data)
+    {
+      fail (0);
+      return;
+    }
+  write_file (test_table_fname, data);
+  xfree (data);
+
+  tbl = xcalloc (1, sizeof *tbl);
+  currency_set_table_file (test_table_fname);
+  if (load_currencies (tbl))
+    fail (1);
+  currency_set_table_file (NULL);
+
+  /* EUR is always the first entry and can't be changed.  */
+  if (tbl->ncurrencies != 4)
+    fail (tbl->ncurrencies);
+  if (lookup_currency (tbl, "EUR") != 0
+      || tbl->currency[0].decdigits != 2
+      || tbl->currency[0].rate != RATE_SCALE)
+    fail (2);
+  idx = lookup_currency (tbl, "usd");
+  if (idx != 1 || tbl->currency[idx].decdigits != 2
+      || strcmp (tbl->currency[idx].desc, "US Dollar"))
+    fail (3);
+  idx = lookup_currency (tbl, "JPY");
+  if (idx != 2 || tbl->currency[idx].decdigits != 0
+      || strcmp (tbl->currency[idx].name, "JPY")
+      || strcmp (tbl->currency[idx].desc, "Yen"))
+    fail (4);
+  idx = lookup_currency (tbl, "CHF");
+  if (idx != 3 || strcmp (tbl->currency[idx].desc, "Swiss Franc"))
+    fail (5);
+  /* Malformed lines and the incomplete last line are skipped.  */
+  if (lookup_currency (tbl, "GBP") != -1
+      || lookup_currency (tbl, "BHD") != -1
+      || lookup_currency (tbl, "SEK") != -1)
+    fail (6);
+  xfree (tbl);
+
+  /* Without a table file the builtin list is used.  */
+  tbl = xcalloc (1, sizeof *tbl);
+  if (load_currencies (tbl))
+    fail (7);
+  if (tbl->ncurrencies != DIM (builtin_currencies))
+    fail (8);
+  idx = lookup_currency (tbl, "ISK");
+  if (idx < 1 || tbl->currency[idx].decdigits != 0)
+    fail (9);
+  xfree (tbl);
+
+  unlink (test_table_fname);
+}
+
+
+static void
+test_read_exchange_rates (void)
+{
+  struct currency_info_s *info;
+  int i, n;
+
+  write_file (test_rates_fname,
+              "# Test rates\n"
+              "USD=1.2\n"
+              " JPY = 130 \n"
+              "GBP=abc\n"
+              "CHF\n"
+              "=1.5\n"
+              "XYZ=2.0\n"
+              "SEK=10.5\n");
+  read_exchange_rates ();
+  if (!current_table || retired_table)
+    {
+      fail (0);
+      return;
+    }
+  if (current_table->currency[lookup_currency (current_table, "USD")].rate
+      != 1200000)
+    fail (1);
+  if (current_table->currency[lookup_currency (current_table, "JPY")].rate
+      != 130000000)
+    fail (2);
+  if (current_table->currency[lookup_currency (current_table, "GBP")].rate)
+    fail (3);
+
+  /* A reload keeps the rates missing in the new file.  */
+  write_file (test_rates_fname,
+              "USD=1.25\n"
+              "SEK=-1\n");
+  read_exchange_rates ();
+  if (!retired_table)
+    fail (4);
+  if (current_table->currency[lookup_currency (current_table, "USD")].rate
+      != 1250000)
+    fail (5);
+  if (current_table->currency[lookup_currency (current_table, "JPY")].rate
+      != 130000000)
+    fail (6);
+  if (current_table->currency[lookup_currency (current_table, "SEK")].rate
+      != 10500000)
+    fail (7);
+
+  if (get_currency_info (&info, &n))
+    fail (8);
+  else
+    {
+      for (i=0; i < n; i++)
+        if (!strcmp (info[i].name, "USD")
+            && (info[i].rate != 1.25 || strcmp (info[i].desc, "US Dollar")))
+          fail (8);
+      if (n != DIM (builtin_currencies))
+        fail (9);
+      xfree (info);
+    }
+
+  /* Restore the rates used by the conversion tests.  */
+  write_file (test_rates_fname,
+              "USD=1.2\n"
+              "IDR=17123.45\n"
+              "KRW=1000000\n");
+  read_exchange_rates ();
+}
+
+
+static void
+test_convert_currency (void)
+{
+  static struct {
+    const char *currency;
+    const char *amount;
+    const char *expected;
+  } tv[] = {
+    { "EUR", "17.5",         "17.50" },
+    { "USD", "12",           "10.00" },
+    { "usd", "12.00",        "10.00" },
+    { "USD", "+12",          "10.00" },
+    { "USD", "1",            "0.83" },
+    { "USD", "2",            "1.67" },
+    /* Rounding half up.  */
+    { "USD", "0.006",        "0.01" },
+    { "USD", "0.005999",     "0.00" },
+    { "USD", "0.01",         "0.01" },
+    { "USD", "0.000001",     "0.00" },
+    { "JPY", "130",          "1.00" },
+    { "JPY", "1",            "0.01" },
+    { "JPY", "0.65",         "0.01" },
+    { "JPY", "0.64",         "0.00" },
+    /* Negative values.  */
+    { "USD", "-12",          "-10.00" },
+    { "USD", "-0.006",       "-0.01" },
+    { "USD", "-0.001",       "0.00" },
+    /* The largest amounts.  */
+    { "USD", "99999999999",  "83333333332.50" },
+    { "USD", "99999.999999", "83333.33" },
+    { "IDR", "17123.45",     "1.00" },
+    { "IDR", "100000",       "5.84" },
+    { "IDR", "99999999999",  "5839944.64" },
+    { "KRW", "500000",       "0.50" },
+    { "KRW", "499999.99999", "0.50" },
+    { "KRW", "99999.999999", "0.10" },
+    { "KRW", "99999999999",  "100000.00" },
+    { "USD", "123456789012", "" },
+    { "USD", "1.1234567",    "" },
+    /* Malformed amounts.  */
+    { "USD", "",             "" },
+    { "USD", "-",            "" },
+    { "USD", ".",            "" },
+    { "USD", "1.2.3",        "" },
+    { "USD", "1,5",          "" },
+    { "USD", "1e3",          "" },
+    { "USD", " 1",           "" },
+    { "USD", "1 ",           "" },
+    { "USD", "--1",          "" },
+    /* No exchange rate.  */
+    { "GBP", "1",            "" },
+    { "XYZ", "1",            "" },
+    { "US",  "1",            "" }
+  };
+  int tidx;
+  char buffer[32];
+
+  for (tidx=0; tidx < DIM (tv); tidx++)
+    {
+      convert_currency (buffer, sizeof buffer,
+                        tv[tidx].currency, tv[tidx].amount);
+      if (strcmp (buffer, tv[tidx].expected))
+        {
+          if (verbose)
+            fprintf (stderr, "test %d: got '%s'\n", tidx, buffer);
+          fail (tidx);
+        }
+    }
+
+  /* The result is truncated to the buffer.  */
+  convert_currency (buffer, 5, "USD", "12");
+  if (strcmp (buffer, "10.0"))
+    fail (0);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  if (argc > 1 && !strcmp (argv[1], "--verbose"))
+    verbose = 1;
+
+  if (!verbose)
+    log_set_file ("/dev/null");
+  euroxref_fname_override = test_rates_fname;
+
+  test_parse_rate ();
+  test_load_currencies ();
+  test_read_exchange_rates ();
+  test_convert_currency ();
+
+  unlink (test_rates_fname);
+
+  return !!errorcount;
+}
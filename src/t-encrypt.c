@@ -73,6 +73,146 @@ test_encrypt_string (void)
 }
 
 
+static void
+test_encrypt_strings (void)
+{
+  gpg_error_t err;
+  const char *fortunes[3] = {
+    "Let me help you with your baggage.",
+    "",
+    "Oh, a beautiful woman who thinks I'm charming!"
+  };
+  char *ciphertexts[3];
+  char *plaintext = NULL;
+  int i;
+
+  err = encrypt_strings (ciphertexts, fortunes, DIM (fortunes),
+                         (ENCRYPT_TO_DATABASE | ENCRYPT_TO_BACKOFFICE));
+  if (err)
+    {
+      log_info ("test batch encryption failed: %s <%s>\n",
+                gpg_strerror (err), gpg_strsource (err));
+      fail (0);
+      return;
+    }
+
+  for (i=0; i < DIM (fortunes); i++)
+    {
+      err = decrypt_string (&plaintext, ciphertexts[i]);
+      if (err)
+        {
+          log_info ("test batch decryption %d failed: %s <%s>\n",
+                    i, gpg_strerror (err), gpg_strsource (err));
+          fail (i);
+        }
+      else if (strcmp (fortunes[i], plaintext))
+        {
+          log_info ("batch encryption/decryption mismatch at %d\n", i);
+          fail (i);
+        }
+      xfree (plaintext);
+      plaintext = NULL;
+    }
+
+  for (i=0; i < DIM (fortunes); i++)
+    xfree (ciphertexts[i]);
+}
+
+
+static void
+test_seal_strings (void)
+{
+  gpg_error_t err;
+  const char *fortunes[2] = {
+    "I'm not a Starfleet officer, I'm a merchant.",
+    "Mudd's Women"
+  };
+  char *sealed[2] = { NULL, NULL };
+  char *keyid = NULL;
+  char *wrapped = NULL;
+  char usedkeyid[DEK_KEYID_SIZE];
+  char *plaintext = NULL;
+  int pass, i;
+
+  err = encrypt_seal_strings (sealed, fortunes, DIM (fortunes), usedkeyid);
+  if (gpg_err_code (err) != GPG_ERR_NO_KEY)
+    fail (0);
+
+  err = encrypt_new_dek (&keyid, &wrapped);
+  if (err)
+    {
+      log_info ("creating a DEK failed: %s <%s>\n",
+                gpg_strerror (err), gpg_strsource (err));
+      fail (0);
+      goto leave;
+    }
+
+  /* The new DEK must not be used before it has been activated.  */
+  err = encrypt_seal_strings (sealed, fortunes, DIM (fortunes), usedkeyid);
+  if (gpg_err_code (err) != GPG_ERR_NO_KEY)
+    fail (0);
+  err = encrypt_activate_dek (keyid);
+  if (err)
+    {
+      fail (0);
+      goto leave;
+    }
+
+  err = encrypt_seal_strings (sealed, fortunes, DIM (fortunes), usedkeyid);
+  if (err)
+    {
+      log_info ("sealing failed: %s\n", gpg_strerror (err));
+      fail (0);
+      goto leave;
+    }
+  if (strcmp (usedkeyid, keyid))
+    fail (0);
+
+  /* Check with the created DEK and then with the re-loaded one.  */
+  for (pass=0; pass < 2; pass++)
+    {
+      if (pass)
+        {
+          release_deks ();
+          err = decrypt_sealed_string (&plaintext, keyid, sealed[0]);
+          if (gpg_err_code (err) != GPG_ERR_NO_KEY)
+            fail (pass);
+          err = encrypt_load_dek (keyid, wrapped);
+          if (err)
+            {
+              fail (pass);
+              goto leave;
+            }
+        }
+      for (i=0; i < DIM (fortunes); i++)
+        {
+          err = decrypt_sealed_string (&plaintext, keyid, sealed[i]);
+          if (err)
+            {
+              log_info ("unsealing %d failed: %s\n", i, gpg_strerror (err));
+              fail (i);
+            }
+          else if (strcmp (fortunes[i], plaintext))
+            fail (i);
+          xfree (plaintext);
+          plaintext = NULL;
+        }
+    }
+
+  /* A modified ciphertext must be detected.  */
+  sealed[1][1] = sealed[1][1] == 'A'? 'B' : 'A';
+  err = decrypt_sealed_string (&plaintext, keyid, sealed[1]);
+  if (gpg_err_code (err) != GPG_ERR_CHECKSUM)
+    fail (0);
+
+ leave:
+  for (i=0; i < DIM (sealed); i++)
+    xfree (sealed[i]);
+  xfree (keyid);
+  xfree (wrapped);
+}
+
+
 int
 main (int argc, char **argv)
 {
@@ -91,6 +231,8 @@ main (int argc, char **argv)
     encrypt_show_keys ();
 
   test_encrypt_string ();
+  test_encrypt_strings ();
+  test_seal_strings ();
 
   encrypt_release_keys ();
 
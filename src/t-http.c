@@ -119,12 +119,20 @@ main (int argc, char **argv)
   http_t hd;
   int c;
   http_session_t session = NULL;
+  int repeat = 1;
+  int resumed = 0;
 
   gpgrt_init ();
   log_set_prefix ("t-http", 1 | 4);
-  if (argc != 2)
+  if (argc > 2 && !strcmp (argv[1], "--repeat"))
     {
-      fprintf (stderr, "usage: t-http uri\n");
+      repeat = atoi (argv[2]);
+      argc -= 2;
+      argv += 2;
+    }
+  if (argc != 2 || repeat < 1)
+    {
+      fprintf (stderr, "usage: t-http [--repeat N] uri\n");
       return 1;
     }
   argc--;
@@ -241,6 +249,35 @@ main (int argc, char **argv)
     }
   http_close (hd, 0);
 
+  /* Fetch the document again to show that the DNS cache is used and
+     that TLS sessions are resumed.  Like the real users we use a new
+     session object for each request.  */
+  while (--repeat)
+    {
+      http_session_release (session);
+      err = http_session_new (&session, NULL);
+      if (err)
+        log_fatal ("http_session_new failed: %s\n", gpg_strerror (err));
+      rc = http_open_document (&hd, *argv, NULL, 0, NULL, session, NULL, NULL);
+      if (rc)
+        {
+          log_error ("can't get '%s': %s\n", *argv, gpg_strerror (rc));
+          return 1;
+        }
+      while (es_getc (http_get_read_ptr (hd)) != EOF)
+        ;
+      if (http_get_tls_info (hd, "resumed"))
+        resumed++;
+      http_close (hd, 0);
+    }
+  {
+    unsigned long lookups, hits;
+
+    http_get_dns_stats (&lookups, &hits);
+    log_info ("DNS lookups: %lu (%lu from the cache)\n", lookups, hits);
+    log_info ("TLS sessions resumed: %d\n", resumed);
+  }
+
   http_session_release (session);
 #ifdef HTTP_USE_GNUTLS
   gnutls_global_deinit ();
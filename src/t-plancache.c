@@ -0,0 +1,149 @@
+/* t-plancache.c - Regression tests for plancache.c
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "t-common.h"
+
+#include "plancache.c" /* The module under test.  */
+
+
+static const char test_db_fname[] = "t-plancache.db";
+
+
+/* Drop the in-memory cache and close the database so that the next
+ * access reads the plans from the database again.  */
+static void
+reload_plans (void)
+{
+  plan_t plan;
+  int i;
+
+  lock_plans ();
+  for (i=0; i < PLAN_BUCKETS; i++)
+    while ((plan = plan_table[i]))
+      {
+        plan_table[i] = plan->next;
+        xfree (plan);
+      }
+  plan_count = 0;
+  if (plan_db)
+    sqlite3_close (plan_db);
+  plan_db = NULL;
+  plan_db_loaded = 0;
+  unlock_plans ();
+}
+
+
+/* Check that the plan for (SERVICE, CURRENCY, AMOUNT, RECUR) has the
+ * id EXPECTED or is not known if EXPECTED is NULL.  */
+static void
+check_plan (int lineno, int service, const char *currency,
+            const char *amount, int recur, const char *expected)
+{
+  gpg_error_t err;
+  char *plan_id;
+
+  err = plancache_get (service, currency, amount, recur, &plan_id);
+  if (err)
+    fail (lineno);
+  else if (!expected && plan_id)
+    fail (lineno);
+  else if (expected && (!plan_id || strcmp (plan_id, expected)))
+    fail (lineno);
+  xfree (plan_id);
+}
+
+
+static void
+test_plancache (void)
+{
+  int persistent;
+
+  /* Lookup of an unknown plan.  */
+  check_plan (__LINE__, PLAN_SERVICE_STRIPE, "EUR", "500", 12, NULL);
+  persistent = !!plan_db;
+
+  /* Insert and lookup; the currency is case insensitive and the
+   * other parts of the key must match.  */
+  plancache_put (PLAN_SERVICE_STRIPE, "EUR", "500", 12, "gnupg-12-500-eur");
+  plancache_put (PLAN_SERVICE_PAYPAL, "eur", "5", 12, "P-1234");
+  check_plan (__LINE__, PLAN_SERVICE_STRIPE, "eur", "500", 12,
+              "gnupg-12-500-eur");
+  check_plan (__LINE__, PLAN_SERVICE_PAYPAL, "EUR", "5", 12, "P-1234");
+  check_plan (__LINE__, PLAN_SERVICE_STRIPE, "EUR", "500", 4, NULL);
+  check_plan (__LINE__, PLAN_SERVICE_STRIPE, "USD", "500", 12, NULL);
+  check_plan (__LINE__, PLAN_SERVICE_PAYPAL, "EUR", "500", 12, NULL);
+
+  /* An update replaces the old id.  */
+  plancache_put (PLAN_SERVICE_PAYPAL, "EUR", "5", 12, "P-5678");
+  check_plan (__LINE__, PLAN_SERVICE_PAYPAL, "EUR", "5", 12, "P-5678");
+
+  /* Bad keys are ignored.  */
+  plancache_put (PLAN_SERVICE_STRIPE, "EURO", "500", 12, "x");
+  check_plan (__LINE__, PLAN_SERVICE_STRIPE, "EURO", "500", 12, NULL);
+  plancache_put (PLAN_SERVICE_STRIPE, "EUR", "1234567890123456", 12, "x");
+  check_plan (__LINE__, PLAN_SERVICE_STRIPE, "EUR", "1234567890123456", 12,
+              NULL);
+
+  /* The plans survive a restart.  */
+  if (!persistent)
+    fail (0);
+  reload_plans ();
+  check_plan (__LINE__, PLAN_SERVICE_STRIPE, "EUR", "500", 12,
+              "gnupg-12-500-eur");
+  check_plan (__LINE__, PLAN_SERVICE_PAYPAL, "EUR", "5", 12, "P-5678");
+
+  /* Removal also removes the plan from the database.  */
+  plancache_remove (PLAN_SERVICE_STRIPE, "eur", "500", 12);
+  check_plan (__LINE__, PLAN_SERVICE_STRIPE, "EUR", "500", 12, NULL);
+  check_plan (__LINE__, PLAN_SERVICE_PAYPAL, "EUR", "5", 12, "P-5678");
+  reload_plans ();
+  check_plan (__LINE__, PLAN_SERVICE_STRIPE, "EUR", "500", 12, NULL);
+  check_plan (__LINE__, PLAN_SERVICE_PAYPAL, "EUR", "5", 12, "P-5678");
+
+  /* Removing an unknown plan does no harm.  */
+  plancache_remove (PLAN_SERVICE_STRIPE, "eur", "500", 12);
+  check_plan (__LINE__, PLAN_SERVICE_PAYPAL, "EUR", "5", 12, "P-5678");
+}
+
+
+int
+main (int argc, char **argv)
+{
+  if (argc > 1 && !strcmp (argv[1], "--verbose"))
+    verbose = 1;
+
+  opt.verbose = verbose;
+  unlink (test_db_fname);
+  plan_db_fname_override = test_db_fname;
+
+  test_plancache ();
+
+  reload_plans ();
+  unlink (test_db_fname);
+
+  return !!errorcount;
+}
@@ -0,0 +1,317 @@
+/* t-protocol-io.c - Regression tests for protocol-io.c
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "t-common.h"
+
+#include "protocol-io.c" /* The module under test.  */
+
+
+/* Return a memory stream with the LENGTH bytes from BUFFER.  */
+static estream_t
+make_stream (const void *buffer, size_t length)
+{
+  estream_t fp;
+
+  fp = es_fopenmem (0, "w+b");
+  if (!fp)
+    {
+      fprintf (stderr, "es_fopenmem failed: %s\n", strerror (errno));
+      exit (1);
+    }
+  if (length)
+    es_write (fp, buffer, length, NULL);
+  es_rewind (fp);
+  return fp;
+}
+
+
+/* Read a binary request from the LENGTH bytes in BUFFER.  The
+ * command is stored at R_COMMAND and the items at R_DICT.  */
+static gpg_error_t
+read_request_from_buffer (const void *buffer, size_t length,
+                          char **r_command, keyvalue_t *r_dict)
+{
+  gpg_error_t err;
+  estream_t fp;
+
+  *r_dict = NULL;
+  fp = make_stream (buffer, length);
+  if (es_getc (fp) != PROTOCOL_BINARY_MAGIC)
+    err = GPG_ERR_EOF;
+  else
+    err = protocol_read_binary_request (fp, r_command, r_dict);
+  es_fclose (fp);
+  return err;
+}
+
+
+/* Build a binary request with some items into a malloced buffer
+ * stored at R_BUFFER and return its length.  */
+static size_t
+make_request (char **r_buffer)
+{
+  estream_t fp;
+  void *buffer;
+  size_t length;
+
+  fp = es_fopenmem (0, "w+b");
+  if (!fp)
+    {
+      fprintf (stderr, "es_fopenmem failed: %s\n", strerror (errno));
+      exit (1);
+    }
+  protocol_write_binary_start (fp, "CHARGECARD");
+  protocol_write_binary_item (fp, "Amount", "17.50");
+  protocol_write_binary_item (fp, "desc", "");
+  protocol_write_binary_item (fp, "Meta[Mail]", "line1\nline2");
+  protocol_write_binary_item (fp, "#", "a comment");
+  protocol_write_binary_item (fp, "Email", "");
+  protocol_write_binary_end (fp);
+  if (es_fclose_snatch (fp, &buffer, &length))
+    {
+      fprintf (stderr, "es_fclose_snatch failed: %s\n", strerror (errno));
+      exit (1);
+    }
+  *r_buffer = buffer;
+  return length;
+}
+
+
+static void
+test_binary_request (void)
+{
+  gpg_error_t err;
+  char *buffer;
+  size_t length;
+  char *command = NULL;
+  keyvalue_t dict = NULL;
+
+  length = make_request (&buffer);
+  err = read_request_from_buffer (buffer, length, &command, &dict);
+  if (err)
+    {
+      fail (0);
+      goto leave;
+    }
+  if (!command || strcmp (command, "CHARGECARD"))
+    fail (1);
+  if (strcmp (keyvalue_get_string (dict, "Amount"), "17.50"))
+    fail (2);
+  /* Empty values are allowed and the names are capitalized.  */
+  if (!keyvalue_find (dict, "Desc")
+      || strcmp (keyvalue_get_string (dict, "Desc"), ""))
+    fail (3);
+  if (!keyvalue_find (dict, "Email")
+      || strcmp (keyvalue_get_string (dict, "Email"), ""))
+    fail (4);
+  if (strcmp (keyvalue_get_string (dict, "Meta[Mail]"), "line1\nline2"))
+    fail (5);
+  if (keyvalue_find (dict, "#"))
+    fail (6);
+
+ leave:
+  xfree (command);
+  keyvalue_release (dict);
+  es_free (buffer);
+}
+
+
+/* All prefixes of a valid request must be rejected.  */
+static void
+test_truncated_request (void)
+{
+  gpg_error_t err;
+  char *buffer;
+  size_t length, n;
+  char *command;
+  keyvalue_t dict;
+
+  length = make_request (&buffer);
+  for (n=0; n < length; n++)
+    {
+      command = NULL;
+      err = read_request_from_buffer (buffer, n, &command, &dict);
+      if (gpg_err_code (err) != GPG_ERR_EOF)
+        fail ((int)n);
+      if (command)
+        fail ((int)n);
+      xfree (command);
+      keyvalue_release (dict);
+    }
+  es_free (buffer);
+}
+
+
+static void
+test_bad_request (void)
+{
+  /* Helper to give a string literal and its length.  */
+#define S(a) (a), sizeof (a) - 1
+  static struct {
+    const char *data;
+    size_t length;
+    gpg_err_code_t ec;
+  } tv[] = {
+    /* Command line too long.  */
+    { S("\x80" "\x00\x00\x08\x01" "PING"),
+      GPG_ERR_TRUNCATED },
+    { S("\x80" "\xff\xff\xff\xff" "PING"),
+      GPG_ERR_TRUNCATED },
+    /* Name too long.  */
+    { S("\x80" "\x00\x00\x00\x04" "PING" "\x01\x01" "Foo"),
+      GPG_ERR_TRUNCATED },
+    { S("\x80" "\x00\x00\x00\x04" "PING" "\xff\xff" "Foo"),
+      GPG_ERR_TRUNCATED },
+    /* Value too long.  */
+    { S("\x80" "\x00\x00\x00\x04" "PING" "\x00\x03" "Foo"
+      "\x00\x10\x00\x01" "bar"),
+      GPG_ERR_TRUNCATED },
+    { S("\x80" "\x00\x00\x00\x04" "PING" "\x00\x03" "Foo"
+      "\xff\xff\xff\xff" "bar"),
+      GPG_ERR_TRUNCATED },
+    /* Value longer than the data.  */
+    { S("\x80" "\x00\x00\x00\x04" "PING" "\x00\x03" "Foo"
+      "\x00\x00\x00\x10" "bar\x00\x00"),
+      GPG_ERR_EOF },
+    /* Nul in the command, the name, and the value.  */
+    { S("\x80" "\x00\x00\x00\x04" "PI\x00G" "\x00\x00"),
+      GPG_ERR_PROTOCOL_VIOLATION },
+    { S("\x80" "\x00\x00\x00\x04" "PING" "\x00\x03" "F\x00o"
+      "\x00\x00\x00\x03" "bar" "\x00\x00"),
+      GPG_ERR_PROTOCOL_VIOLATION },
+    { S("\x80" "\x00\x00\x00\x04" "PING" "\x00\x03" "Foo"
+      "\x00\x00\x00\x03" "b\x00r" "\x00\x00"),
+      GPG_ERR_PROTOCOL_VIOLATION },
+    /* Colon or linefeed in the name.  */
+    { S("\x80" "\x00\x00\x00\x04" "PING" "\x00\x03" "F:o"
+      "\x00\x00\x00\x03" "bar" "\x00\x00"),
+      GPG_ERR_PROTOCOL_VIOLATION },
+    { S("\x80" "\x00\x00\x00\x04" "PING" "\x00\x03" "F\no"
+      "\x00\x00\x00\x03" "bar" "\x00\x00"),
+      GPG_ERR_PROTOCOL_VIOLATION },
+    /* Duplicate name.  */
+    { S("\x80" "\x00\x00\x00\x04" "PING"
+      "\x00\x03" "Foo" "\x00\x00\x00\x01" "a"
+      "\x00\x03" "foo" "\x00\x00\x00\x01" "b" "\x00\x00"),
+      GPG_ERR_PROTOCOL_VIOLATION },
+    /* Invalid name.  */
+    { S("\x80" "\x00\x00\x00\x04" "PING" "\x00\x03" "_fo"
+      "\x00\x00\x00\x03" "bar" "\x00\x00"),
+      GPG_ERR_INV_NAME },
+    /* Valid request with an empty command and an empty value.  */
+    { S("\x80" "\x00\x00\x00\x00" "\x00\x03" "Foo"
+      "\x00\x00\x00\x00" "\x00\x00"),
+      GPG_ERR_NO_ERROR }
+  };
+  gpg_error_t err;
+  int tidx;
+  char *command;
+  keyvalue_t dict;
+
+#undef S
+  for (tidx=0; tidx < DIM (tv); tidx++)
+    {
+      command = NULL;
+      err = read_request_from_buffer (tv[tidx].data, tv[tidx].length,
+                                      &command, &dict);
+      if (gpg_err_code (err) != tv[tidx].ec)
+        {
+          if (verbose)
+            fprintf (stderr, "test %d: got '%s'\n", tidx, gpg_strerror (err));
+          fail (tidx);
+        }
+      else if (!err && (!command || *command
+                        || !keyvalue_find (dict, "Foo")
+                        || *keyvalue_get_string (dict, "Foo")))
+        fail (tidx);
+      else if (err && command)
+        fail (tidx);
+      xfree (command);
+      keyvalue_release (dict);
+    }
+}
+
+
+static void
+test_binary_response (void)
+{
+  gpg_error_t err;
+  estream_t fp;
+  keyvalue_t dict = NULL;
+
+  fp = es_fopenmem (0, "w+b");
+  if (!fp)
+    {
+      fprintf (stderr, "es_fopenmem failed: %s\n", strerror (errno));
+      exit (1);
+    }
+  protocol_write_binary_start (fp, "OK");
+  protocol_write_binary_item (fp, "Charge-Id", "ch_1234");
+  protocol_write_binary_item (fp, "_timestamp", "");
+  protocol_write_binary_end (fp);
+  protocol_write_binary_start (fp, "ERR 58 No data");
+  protocol_write_binary_end (fp);
+  es_rewind (fp);
+
+  err = protocol_read_binary_response (fp, &dict);
+  if (err)
+    fail (0);
+  if (strcmp (keyvalue_get_string (dict, "Charge-Id"), "ch_1234"))
+    fail (1);
+  /* Responses are not filtered.  */
+  if (!keyvalue_find (dict, "_timestamp"))
+    fail (2);
+
+  err = protocol_read_binary_response (fp, &dict);
+  if (gpg_err_code (err) != GPG_ERR_NO_DATA)
+    fail (3);
+  if (strcmp (keyvalue_get_string (dict, "_errdesc"), "No data"))
+    fail (4);
+
+  /* Nothing left.  */
+  err = protocol_read_binary_response (fp, &dict);
+  if (gpg_err_code (err) != GPG_ERR_INV_RESPONSE)
+    fail (5);
+
+  es_fclose (fp);
+  keyvalue_release (dict);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  if (argc > 1 && !strcmp (argv[1], "--verbose"))
+    verbose = 1;
+
+  test_binary_request ();
+  test_truncated_request ();
+  test_bad_request ();
+  test_binary_response ();
+
+  return !!errorcount;
+}
@@ -27,6 +27,9 @@
 #include "t-common.h"
 
 #include "util.h" /* The module under test.  */
+#include "membuf.h"
+#include "http.h"
+#include "form.h"
 
 
 static void
@@ -191,6 +194,349 @@ test_convert_amount (void)
 }
 
 
+/* The byte-by-byte unescaping as used before the table driven
+   version; used as reference.  */
+static char *
+ref_unescape (const char *string, int withplus, int nulrepl)
+{
+  unsigned char *buffer, *p;
+
+  buffer = p = xmalloc (strlen (string) + 1);
+  while (*string)
+    {
+      if (*string == '%' && string[1] && string[2])
+        {
+          string++;
+          *p = xtoi_2 (string);
+          if (!*p)
+            *p = nulrepl;
+          string++;
+        }
+      else if (*string == '+' && withplus)
+        *p = ' ';
+      else
+        *p = *string;
+      p++;
+      string++;
+    }
+  *p = 0;
+  return (char *)buffer;
+}
+
+
+/* Compare the unescape functions against the reference for all
+   strings up to length 5 over an alphabet with the interesting
+   characters.  */
+static void
+test_percent_unescape (void)
+{
+  static const char alphabet[] = "%+0aFg \x01";
+  const int nalpha = sizeof alphabet - 1;
+  char string[6], buffer[6];
+  char *ref, *res;
+  int len, i, idx, count;
+  size_t n;
+
+  for (len=0; len < sizeof string; len++)
+    {
+      for (count=1, i=0; i < len; i++)
+        count *= nalpha;
+      for (idx=0; idx < count; idx++)
+        {
+          for (i=0, n=idx; i < len; i++, n /= nalpha)
+            string[i] = alphabet[n % nalpha];
+          string[len] = 0;
+
+          ref = ref_unescape (string, 0, '~');
+          res = percent_unescape (string, '~');
+          if (!res || strcmp (res, ref))
+            fail (len);
+          xfree (res);
+          strcpy (buffer, string);
+          n = percent_unescape_inplace (buffer, '~');
+          if (n != strlen (ref) || memcmp (buffer, ref, n))
+            fail (len);
+          xfree (ref);
+
+          ref = ref_unescape (string, 1, '~');
+          res = percent_plus_unescape (string, '~');
+          if (!res || strcmp (res, ref))
+            fail (len);
+          xfree (res);
+          strcpy (buffer, string);
+          n = percent_plus_unescape_inplace (buffer, '~');
+          if (n != strlen (ref) || memcmp (buffer, ref, n))
+            fail (len);
+          xfree (ref);
+        }
+    }
+}
+
+
+/* Check that percent_plus_unescape reverts percent_plus_escape for
+   all strings of one and two bytes.  */
+static void
+test_percent_plus_escape (void)
+{
+  char string[3];
+  char *escaped, *plain;
+  const unsigned char *s;
+  int c1, c2;
+
+  for (c1=1; c1 < 256; c1++)
+    for (c2=0; c2 < 256; c2++)
+      {
+        string[0] = c1;
+        string[1] = c2;
+        string[2] = 0;
+        escaped = percent_plus_escape (string);
+        if (!escaped)
+          {
+            fail (c1);
+            continue;
+          }
+        for (s = (const unsigned char *)escaped; *s; s++)
+          if (*s < 0x20 || *s == ' ' || *s == '\"')
+            fail (c1);
+        plain = percent_plus_unescape (escaped, 0);
+        if (!plain || strcmp (plain, string))
+          fail (c1);
+        xfree (plain);
+        xfree (escaped);
+      }
+}
+
+
+/* Check write_escaped against the byte-by-byte reference for all
+   strings of one and two bytes.  */
+static void
+test_write_escaped (void)
+{
+  estream_t fp, reffp;
+  char string[3];
+  const unsigned char *s;
+  void *buf, *refbuf;
+  size_t len, reflen;
+  char *plain;
+  int c1, c2;
+
+  fp = es_fopenmem (0, "w+");
+  reffp = es_fopenmem (0, "w+");
+  if (!fp || !reffp)
+    {
+      fail (0);
+      return;
+    }
+
+  for (c1=1; c1 < 256; c1++)
+    for (c2=0; c2 < 256; c2++)
+      {
+        string[0] = c1;
+        string[1] = c2;
+        string[2] = 0;
+        write_escaped (string, fp);
+        for (s = (const unsigned char *)string; *s; s++)
+          if (!strchr (":&\n\r", *s))
+            es_putc (*s, reffp);
+          else
+            es_fprintf (reffp, "%%%02X", *s);
+        es_putc ('\n', fp);
+        es_putc ('\n', reffp);
+      }
+
+  if (es_fclose_snatch (fp, &buf, &len)
+      || es_fclose_snatch (reffp, &refbuf, &reflen))
+    fail (0);
+  else if (len != reflen || memcmp (buf, refbuf, len))
+    fail (0);
+  es_free (buf);
+  es_free (refbuf);
+
+  /* Without a percent sign in the input the result can be
+     unescaped.  */
+  for (c1=1; c1 < 256; c1++)
+    {
+      if (c1 == '%')
+        continue;
+      string[0] = c1;
+      string[1] = 0;
+      fp = es_fopenmem (0, "w+");
+      if (!fp)
+        {
+          fail (c1);
+          continue;
+        }
+      write_escaped (string, fp);
+      es_putc (0, fp);
+      if (es_fclose_snatch (fp, &buf, &len))
+        {
+          fail (c1);
+          continue;
+        }
+      plain = percent_unescape (buf, 0);
+      if (!plain || strcmp (plain, string) || strpbrk (buf, ":&\n\r"))
+        fail (c1);
+      xfree (plain);
+      es_free (buf);
+    }
+}
+
+
+/* Compare form_parse with parse_www_form_urlencoded for all strings
+   up to length 6 over an alphabet with the interesting
+   characters.  */
+static void
+test_form_parse (void)
+{
+  static const char alphabet[] = "a=&%+04";
+  const int nalpha = sizeof alphabet - 1;
+  char string[7], buffer[8];
+  struct form_field_s fields[4];
+  unsigned int nfields;
+  keyvalue_t dict, kv;
+  gpg_error_t err, referr;
+  int len, i, idx, count;
+  size_t n;
+
+  for (len=0; len < sizeof string; len++)
+    {
+      for (count=1, i=0; i < len; i++)
+        count *= nalpha;
+      for (idx=0; idx < count; idx++)
+        {
+          for (i=0, n=idx; i < len; i++, n /= nalpha)
+            string[i] = alphabet[n % nalpha];
+          string[len] = 0;
+
+          referr = parse_www_form_urlencoded (&dict, string);
+          strcpy (buffer, string);
+          err = form_parse (buffer, fields, DIM (fields), &nfields);
+          if (!err != !referr)
+            {
+              fprintf (stderr, "form_parse ('%s'): %s\n",
+                       string, gpg_strerror (err));
+              fail (len);
+            }
+          else if (!err)
+            {
+              for (kv = dict, i = 0; kv; kv = kv->next, i++)
+                {
+                  const char *value = form_get (fields, nfields, kv->name);
+                  if (!value || strcmp (value, kv->value))
+                    fail (len);
+                }
+              if (i > nfields)
+                fail (len);
+              for (i=0; i < nfields; i++)
+                if (!keyvalue_get (dict, fields[i].name))
+                  fail (len);
+            }
+          keyvalue_release (dict);
+        }
+    }
+
+  /* Check the limit.  */
+  strcpy (buffer, "a&b&c&d");
+  if (form_parse (buffer, fields, 3, &nfields) == 0)
+    fail (0);
+  strcpy (buffer, "a&b&c&d");
+  if (form_parse (buffer, fields, 4, &nfields) || nfields != 4
+      || strcmp (fields[3].name, "d") || *fields[3].value)
+    fail (0);
+}
+
+
+/* The encoding as done before the table driven encoder; used as
+   reference.  */
+static char *
+ref_encode_formdata (keyvalue_t form)
+{
+  membuf_t mb;
+  keyvalue_t kv;
+  char *escaped;
+
+  init_membuf (&mb, 0);
+  for (kv = form; kv; kv = kv->next)
+    {
+      if (kv != form)
+        put_membuf_str (&mb, "&");
+      if (!kv->value)
+        continue;
+      escaped = http_escape_string (kv->name, NULL);
+      put_membuf_str (&mb, escaped);
+      xfree (escaped);
+      put_membuf_str (&mb, "=");
+      escaped = http_escape_string (kv->value, NULL);
+      put_membuf_str (&mb, escaped);
+      xfree (escaped);
+    }
+  put_membuf (&mb, "", 1);
+  return get_membuf (&mb, NULL);
+}
+
+
+/* Check the encoder against the reference for all values of one and
+   two bytes.  */
+static void
+test_encode_formdata (void)
+{
+  keyvalue_t form = NULL;
+  char string[3];
+  char *encoded, *ref;
+  estream_t fp;
+  void *buf;
+  size_t len;
+  int c1, c2;
+
+  if (keyvalue_put (&form, "deleted", "x")
+      || keyvalue_del (form, "deleted")
+      || keyvalue_put (&form, "na me", "v"))
+    {
+      fail (0);
+      return;
+    }
+
+  for (c1=1; c1 < 256; c1++)
+    for (c2=0; c2 < 256; c2++)
+      {
+        string[0] = c1;
+        string[1] = c2;
+        string[2] = 0;
+        if (keyvalue_put (&form, "key", string))
+          {
+            fail (c1);
+            continue;
+          }
+        ref = ref_encode_formdata (form);
+        if (!ref)
+          {
+            fail (c1);
+            continue;
+          }
+        if (encode_formdata (form, &encoded) || strcmp (encoded, ref))
+          fail (c1);
+        if (form_encoded_length (form) != strlen (ref))
+          fail (c1);
+
+        fp = es_fopenmem (0, "w+");
+        if (!fp || write_formdata (form, fp)
+            || es_fclose_snatch (fp, &buf, &len))
+          fail (c1);
+        else
+          {
+            if (len != strlen (ref) || memcmp (buf, ref, len))
+              fail (c1);
+            es_free (buf);
+          }
+
+        xfree (encoded);
+        xfree (ref);
+      }
+
+  keyvalue_release (form);
+}
+
+
 int
 main (int argc, char **argv)
 {
@@ -200,6 +546,11 @@ main (int argc, char **argv)
   test_keyvalue_put_meta ();
   test_base64_encoding ();
   test_convert_amount ();
+  test_percent_unescape ();
+  test_percent_plus_escape ();
+  test_write_escaped ();
+  test_form_parse ();
+  test_encode_formdata ();
 
   return !!errorcount;
 }
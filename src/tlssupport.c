@@ -72,6 +72,19 @@ init_tls_subsystem (void)
   http_register_tls_ca ("/etc/payproc/tls-ca.pem");
 }
 
+/* Reload the CA certificates.  */
+void
+reload_tls_subsystem (void)
+{
+  gpg_error_t err;
+
+  err = http_reload_tls_ca ();
+  if (err)
+    log_error ("error reloading the CA certificates: %s\n",
+               gpg_strerror (err));
+}
+
+
 /* Deinitialize the TLS subsystem.  Thisis intended to be run from an
    atexit handler.  */
 void
@@ -21,6 +21,7 @@
 #define TLSSUPPORT_H
 
 void init_tls_subsystem (void);
+void reload_tls_subsystem (void);
 void deinit_tls_subsystem (void);
 
 
@@ -1065,20 +1065,40 @@ reconvert_amount (int cents, int decdigits)
 
 
 
+/* Table of the bytes which are escaped by write_escaped_buf.  */
+static const unsigned char escaped_chars[256] =
+  {
+    [0] = 1, ['\n'] = 1, ['\r'] = 1, ['&'] = 1, [':'] = 1
+  };
+
+
 /* Write buffer BUF of length LEN to stream FP.  Escape all characters
    in a way that the stream can be used for a colon delimited line
-   format including structured URL like fields.  */
+   format including structured URL like fields.  Runs of characters
+   which need no escaping are written at once.  */
 static void
 write_escaped_buf (const void *buf, size_t len, estream_t fp)
 {
-  const unsigned char *s;
+  static const char hexdigits[16] = "0123456789ABCDEF";
+  const unsigned char *s = buf;
+  const unsigned char *run;
+  char tmp[3];
 
-  for (s = buf; len; s++, len--)
+  while (len)
     {
-      if (!strchr (":&\n\r", *s))
-        es_putc (*s, fp);
-      else
-        es_fprintf (fp, "%%%02X", *s);
+      for (run = s; len && !escaped_chars[*s]; s++, len--)
+        ;
+      if (s != run)
+        es_write (fp, run, s - run, NULL);
+      if (!len)
+        break;
+
+      tmp[0] = '%';
+      tmp[1] = hexdigits[*s >> 4];
+      tmp[2] = hexdigits[*s & 15];
+      es_write (fp, tmp, 3, NULL);
+      s++;
+      len--;
     }
 }
 
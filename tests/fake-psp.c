@@ -0,0 +1,760 @@
+/* fake-psp.c - A local stand-in for the Stripe and PayPal services
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This server answers the requests payprocd sends to Stripe and
+ * PayPal with canned but plausible responses so that payprocd can be
+ * exercised and benchmarked without access to the real services.
+ * The Stripe API is served below "/stripe/v1/", the PayPal REST API
+ * below "/paypal/v1/" and the IPN verification at
+ * "/paypal/cgi-bin/webscr".  Run payprocd in test mode with
+ *
+ *   --fake-psp https://127.0.0.1:8443 --tls-ca fake-psp-cert.pem
+ *
+ * A suitable self-signed certificate can be created with
+ *
+ *   openssl req -x509 -newkey rsa:2048 -nodes -days 3650 \
+ *           -subj /CN=127.0.0.1 -addext subjectAltName=IP:127.0.0.1 \
+ *           -keyout fake-psp-key.pem -out fake-psp-cert.pem
+ *
+ * Without --cert and --key plain HTTP is used.  Latency and failures
+ * can be injected with --delay, --jitter, --error-rate and
+ * --drop-rate.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <gnutls/gnutls.h>
+
+#include "util.h"
+#include "logging.h"
+#include "argparse.h"
+
+
+/* The maximum size of a request header and body.  */
+#define MAX_HEADER (16*1024)
+#define MAX_BODY   (64*1024)
+
+
+/* Constants to identify the options. */
+enum opt_values
+  {
+    aNull = 0,
+    oVerbose	= 'v',
+    oPort       = 'p',
+
+    oCert       = 500,
+    oKey,
+    oDelay,
+    oJitter,
+    oErrorRate,
+    oDropRate,
+
+    oLast
+  };
+
+
+/* The list of commands and options. */
+static ARGPARSE_OPTS opts[] = {
+  ARGPARSE_group (301, "@Options:\n "),
+
+  ARGPARSE_s_n (oVerbose, "verbose", "verbose diagnostics"),
+  ARGPARSE_s_i (oPort,    "port",    "|N|listen on port N (default 8443)"),
+  ARGPARSE_s_s (oCert,    "cert",    "|FILE|read the certificate from FILE"),
+  ARGPARSE_s_s (oKey,     "key",     "|FILE|read the private key from FILE"),
+  ARGPARSE_s_i (oDelay,   "delay",   "|N|delay each response by N ms"),
+  ARGPARSE_s_i (oJitter,  "jitter",  "|N|add a random delay of up to N ms"),
+  ARGPARSE_s_i (oErrorRate, "error-rate",
+                "|N|answer N percent of the requests with status 500"),
+  ARGPARSE_s_i (oDropRate, "drop-rate",
+                "|N|close the connection for N percent of the requests"),
+
+  ARGPARSE_end ()
+};
+
+
+static struct
+{
+  int verbose;
+  int port;
+  const char *certfile;
+  const char *keyfile;
+  unsigned int delay;
+  unsigned int jitter;
+  unsigned int error_rate;
+  unsigned int drop_rate;
+} opt;
+
+
+/* The TLS credentials or NULL for plain HTTP.  */
+static gnutls_certificate_credentials_t tls_cred;
+
+/* The key used to encrypt session tickets.  */
+static gnutls_datum_t ticket_key;
+
+/* A counter to create unique object ids.  */
+static unsigned long id_counter;
+static pthread_mutex_t id_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Object describing a client connection.  */
+struct conn_s
+{
+  int fd;
+  gnutls_session_t tls;
+  unsigned int seed;
+};
+typedef struct conn_s *conn_t;
+
+/* Object describing a request.  */
+struct request_s
+{
+  char *method;
+  char *path;
+  char *host;
+  char *body;
+  size_t bodylen;
+};
+typedef struct request_s *request_t;
+
+
+
+static const char *
+my_strusage( int level )
+{
+  const char *p;
+
+  switch (level)
+    {
+    case 11: p = "fake-psp"; break;
+    case 13: p = PACKAGE_VERSION; break;
+    case 19: p = "Please report bugs to bugs@g10code.com.\n"; break;
+    case 1:
+    case 40:
+      p = ("Usage: fake-psp [options] (-h for help)");
+      break;
+    case 41:
+      p = ("Syntax: fake-psp [options]\n"
+           "Local stand-in for the Stripe and PayPal services\n");
+      break;
+    default: p = NULL; break;
+    }
+  return p;
+}
+
+
+/* Return a new unique number for object ids.  */
+static unsigned long
+next_id (void)
+{
+  unsigned long id;
+
+  pthread_mutex_lock (&id_lock);
+  id = ++id_counter;
+  pthread_mutex_unlock (&id_lock);
+  return id;
+}
+
+
+
+/* Read up to SIZE bytes from CONN into BUFFER.  Returns the number
+   of bytes read, 0 on EOF or -1 on error.  */
+static ssize_t
+conn_read (conn_t conn, void *buffer, size_t size)
+{
+  ssize_t n;
+
+  if (conn->tls)
+    {
+      do
+        n = gnutls_record_recv (conn->tls, buffer, size);
+      while (n == GNUTLS_E_INTERRUPTED || n == GNUTLS_E_AGAIN);
+      if (n == GNUTLS_E_PREMATURE_TERMINATION)
+        n = 0;
+      else if (n < 0)
+        {
+          if (opt.verbose)
+            log_info ("TLS read error: %s\n", gnutls_strerror (n));
+          n = -1;
+        }
+    }
+  else
+    {
+      do
+        n = read (conn->fd, buffer, size);
+      while (n == -1 && errno == EINTR);
+    }
+  return n;
+}
+
+
+/* Write LENGTH bytes of DATA to CONN.  Returns 0 on success.  */
+static int
+conn_write (conn_t conn, const void *data, size_t length)
+{
+  const char *p = data;
+  ssize_t n;
+
+  while (length)
+    {
+      if (conn->tls)
+        {
+          do
+            n = gnutls_record_send (conn->tls, p, length);
+          while (n == GNUTLS_E_INTERRUPTED || n == GNUTLS_E_AGAIN);
+          if (n < 0)
+            return -1;
+        }
+      else
+        {
+          do
+            n = write (conn->fd, p, length);
+          while (n == -1 && errno == EINTR);
+          if (n == -1)
+            return -1;
+        }
+      p += n;
+      length -= n;
+    }
+  return 0;
+}
+
+
+/* Read a request from CONN into REQ.  Returns 0 on success.  */
+static int
+read_request (conn_t conn, request_t req)
+{
+  char *buffer;
+  size_t len = 0;
+  char *hdrend = NULL;
+  char *line, *next, *p;
+  size_t contentlen = 0;
+  ssize_t n;
+
+  buffer = xmalloc (MAX_HEADER + MAX_BODY + 1);
+  while (!hdrend)
+    {
+      if (len >= MAX_HEADER)
+        goto failure;
+      n = conn_read (conn, buffer + len, MAX_HEADER - len);
+      if (n <= 0)
+        goto failure;
+      len += n;
+      buffer[len] = 0;
+      hdrend = strstr (buffer, "\r\n\r\n");
+    }
+  *hdrend = 0;
+
+  /* Parse the request line.  */
+  line = buffer;
+  next = strstr (line, "\r\n");
+  if (next)
+    *next = 0;
+  p = strchr (line, ' ');
+  if (!p)
+    goto failure;
+  *p++ = 0;
+  req->method = xstrdup (line);
+  line = p;
+  p = strchr (line, ' ');
+  if (p)
+    *p = 0;
+  req->path = xstrdup (line);
+
+  /* Parse the headers we are interested in.  */
+  for (line = next? next + 2 : NULL; line && *line; line = next)
+    {
+      next = strstr (line, "\r\n");
+      if (next)
+        {
+          *next = 0;
+          next += 2;
+        }
+      if (!memicmp (line, "Content-Length:", 15))
+        contentlen = strtoul (line + 15, NULL, 10);
+      else if (!memicmp (line, "Host:", 5))
+        req->host = xstrdup (trim_spaces (line + 5));
+    }
+  if (contentlen > MAX_BODY)
+    goto failure;
+
+  /* Move the already read part of the body to the start of the
+     buffer and read the rest.  */
+  hdrend += 4;
+  len -= hdrend - buffer;
+  memmove (buffer, hdrend, len);
+  while (len < contentlen)
+    {
+      n = conn_read (conn, buffer + len, contentlen - len);
+      if (n <= 0)
+        goto failure;
+      len += n;
+    }
+  buffer[contentlen] = 0;
+  req->body = buffer;
+  req->bodylen = contentlen;
+  return 0;
+
+ failure:
+  xfree (buffer);
+  return -1;
+}
+
+
+static void
+release_request (request_t req)
+{
+  xfree (req->method);
+  xfree (req->path);
+  xfree (req->host);
+  xfree (req->body);
+}
+
+
+/* Send a response with STATUS and the JSON or text object BODY.  */
+static int
+write_response (conn_t conn, unsigned int status, const char *body)
+{
+  char *response;
+  const char *text;
+  int rc;
+
+  switch (status)
+    {
+    case 200: text = "OK"; break;
+    case 201: text = "Created"; break;
+    case 204: text = "No Content"; break;
+    case 404: text = "Not Found"; break;
+    case 500: text = "Internal Server Error"; break;
+    default:  text = "Unknown"; break;
+    }
+
+  /* Send everything with one write to avoid a Nagle delay.  */
+  response = es_bsprintf ("HTTP/1.1 %u %s\r\n"
+                          "Content-Type: %s\r\n"
+                          "Content-Length: %zu\r\n"
+                          "Connection: close\r\n"
+                          "\r\n"
+                          "%s",
+                          status, text,
+                          (body && *body == '{')? "application/json"
+                          /**/                  : "text/plain",
+                          body? strlen (body) : 0,
+                          body? body : "");
+  if (!response)
+    return -1;
+  rc = conn_write (conn, response, strlen (response));
+  es_free (response);
+  return rc;
+}
+
+
+/* Return the value of the JSON string member NAME in JSON.  This is
+   not a JSON parser; it is good enough for the requests sent by
+   payprocd.  The caller must release the result.  */
+static char *
+get_json_string (const char *json, const char *name)
+{
+  char *pattern;
+  const char *s, *e;
+  char *result;
+
+  pattern = strconcat ("\"", name, "\"", NULL);
+  s = pattern? strstr (json, pattern) : NULL;
+  if (s)
+    {
+      s += strlen (pattern);
+      while (*s == ' ' || *s == ':')
+        s++;
+    }
+  xfree (pattern);
+  if (!s || *s != '\"')
+    return NULL;
+  s++;
+  e = strchr (s, '\"');
+  if (!e)
+    return NULL;
+  result = xmalloc (e - s + 1);
+  memcpy (result, s, e - s);
+  result[e - s] = 0;
+  return result;
+}
+
+
+
+/* Create the response to a Stripe request for METHOD.  */
+static char *
+stripe_response (request_t req, const char *method, unsigned int *r_status)
+{
+  keyvalue_t form = NULL;
+  char *body = NULL;
+  unsigned long id = next_id ();
+
+  if (!strcmp (req->method, "POST"))
+    parse_www_form_urlencoded (&form, req->body);
+
+  *r_status = 200;
+  if (!strcmp (method, "tokens"))
+    body = es_bsprintf ("{\"id\":\"tok_fake%lu\",\"livemode\":false,"
+                        "\"card\":{\"last4\":\"4242\"}}", id);
+  else if (!strcmp (method, "charges"))
+    body = es_bsprintf ("{\"id\":\"ch_fake%lu\","
+                        "\"balance_transaction\":\"txn_fake%lu\","
+                        "\"livemode\":false,"
+                        "\"currency\":\"%s\",\"amount\":%d,"
+                        "\"card\":{\"last4\":\"4242\"}}",
+                        id, id,
+                        keyvalue_get_string (form, "currency"),
+                        keyvalue_get_int (form, "amount"));
+  else if (!strncmp (method, "plans/", 6))
+    {
+      *r_status = 404;
+      body = es_bsprintf ("{\"error\":{\"type\":\"invalid_request_error\","
+                          "\"message\":\"No such plan: %s\"}}", method + 6);
+    }
+  else if (!strcmp (method, "plans"))
+    body = es_bsprintf ("{\"id\":\"%s\",\"livemode\":false}",
+                        *keyvalue_get_string (form, "id")
+                        ? keyvalue_get_string (form, "id") : "plan_fake");
+  else if (!strcmp (method, "customers"))
+    body = es_bsprintf ("{\"id\":\"cus_fake%lu\",\"livemode\":false}", id);
+  else if (!strncmp (method, "customers/", 10)
+           && !strcmp (req->method, "DELETE"))
+    body = es_bsprintf ("{\"id\":\"%s\",\"deleted\":true}", method + 10);
+  else if (!strcmp (method, "subscriptions"))
+    body = es_bsprintf ("{\"id\":\"sub_fake%lu\",\"livemode\":false}", id);
+  else
+    {
+      *r_status = 404;
+      body = es_bsprintf ("{\"error\":{\"type\":\"invalid_request_error\","
+                          "\"message\":\"Unrecognized request URL\"}}");
+    }
+
+  keyvalue_release (form);
+  return body;
+}
+
+
+/* Create the response to a PayPal request for METHOD.  */
+static char *
+paypal_response (request_t req, const char *method, unsigned int *r_status)
+{
+  char *body = NULL;
+  unsigned long id = next_id ();
+  const char *host = req->host? req->host : "127.0.0.1";
+  const char *scheme = tls_cred? "https" : "http";
+
+  *r_status = 200;
+  if (!strcmp (method, "oauth2/token"))
+    body = es_bsprintf ("{\"token_type\":\"Bearer\",\"expires_in\":32400,"
+                        "\"access_token\":\"A21fake%lu\"}", id);
+  else if (!strncmp (method, "payments/billing-plans", 22)
+           && !strcmp (req->method, "GET"))
+    *r_status = 204;  /* No plans.  */
+  else if (!strcmp (method, "payments/billing-plans"))
+    {
+      *r_status = 201;
+      body = es_bsprintf ("{\"id\":\"P-FAKE%lu\",\"state\":\"CREATED\"}", id);
+    }
+  else if (!strncmp (method, "payments/billing-plans/", 23))
+    body = es_bsprintf ("{}");
+  else if (!strcmp (method, "payments/payment")
+           || !strcmp (method, "payments/billing-agreements"))
+    {
+      char *return_url = get_json_string (req->body, "return_url");
+
+      /* The approval URL redirects to the return URL given by the
+       * caller so that a test client can take the aliasid from it.  */
+      *r_status = 201;
+      body = es_bsprintf ("{\"id\":\"PAY-FAKE%lu\",\"state\":\"created\","
+                          "\"links\":["
+                          "{\"rel\":\"approval_url\","
+                          "\"href\":\"%s%ctoken=EC-FAKE%lu"
+                          "&PayerID=FAKEPAYER\","
+                          "\"method\":\"REDIRECT\"},"
+                          "{\"rel\":\"execute\","
+                          "\"href\":\"%s://%s/paypal/v1/%s"
+                          "/PAY-FAKE%lu/execute\","
+                          "\"method\":\"POST\"}]}",
+                          id,
+                          return_url? return_url : "https://example.org/",
+                          (return_url && strchr (return_url, '?'))? '&':'?',
+                          id, scheme, host, method, id);
+      xfree (return_url);
+    }
+  else if (strlen (method) > 8 && !strcmp (method + strlen (method) - 8,
+                                           "/execute"))
+    body = es_bsprintf ("{\"id\":\"I-FAKE%lu\",\"state\":\"approved\","
+                        "\"payer\":{\"payer_info\":{"
+                        "\"email\":\"buyer@example.org\","
+                        "\"payer_id\":\"FAKEPAYER\"}},"
+                        "\"transactions\":[{\"related_resources\":["
+                        "{\"sale\":{\"id\":\"SALE-FAKE%lu\"}}]}]}",
+                        id, id);
+  else
+    {
+      *r_status = 404;
+      body = es_bsprintf ("{\"name\":\"INVALID_RESOURCE_ID\","
+                          "\"message\":\"Requested resource ID was "
+                          "not found.\"}");
+    }
+
+  return body;
+}
+
+
+/* Handle one request on CONN.  */
+static void
+handle_request (conn_t conn)
+{
+  struct request_s req;
+  char *body = NULL;
+  unsigned int status;
+  unsigned int delay;
+
+  memset (&req, 0, sizeof req);
+  if (read_request (conn, &req))
+    goto leave;
+
+  if (opt.verbose)
+    log_info ("%s %s\n", req.method, req.path);
+
+  delay = opt.delay;
+  if (opt.jitter)
+    delay += rand_r (&conn->seed) % (opt.jitter + 1);
+  if (delay)
+    {
+      struct timespec ts;
+
+      ts.tv_sec = delay / 1000;
+      ts.tv_nsec = (delay % 1000) * 1000000;
+      nanosleep (&ts, NULL);
+    }
+
+  if (opt.drop_rate && rand_r (&conn->seed) % 100 < opt.drop_rate)
+    goto leave;  /* Just close the connection.  */
+
+  if (opt.error_rate && rand_r (&conn->seed) % 100 < opt.error_rate)
+    {
+      status = 500;
+      body = es_bsprintf ("{\"error\":{\"type\":\"api_error\","
+                          "\"message\":\"injected failure\"}}");
+    }
+  else if (!strncmp (req.path, "/stripe/v1/", 11))
+    body = stripe_response (&req, req.path + 11, &status);
+  else if (!strcmp (req.path, "/paypal/cgi-bin/webscr"))
+    {
+      status = 200;
+      body = es_bsprintf ("VERIFIED");
+    }
+  else if (!strncmp (req.path, "/paypal/v1/", 11))
+    body = paypal_response (&req, req.path + 11, &status);
+  else
+    {
+      status = 404;
+      body = es_bsprintf ("not found");
+    }
+
+  write_response (conn, status, body);
+
+ leave:
+  es_free (body);
+  release_request (&req);
+}
+
+
+/* The thread serving one connection.  */
+static void *
+connection_thread (void *arg)
+{
+  conn_t conn = arg;
+  int rc;
+
+  if (tls_cred)
+    {
+      rc = gnutls_init (&conn->tls, GNUTLS_SERVER);
+      if (!rc)
+        rc = gnutls_set_default_priority (conn->tls);
+      if (!rc)
+        rc = gnutls_credentials_set (conn->tls, GNUTLS_CRD_CERTIFICATE,
+                                     tls_cred);
+      if (!rc)
+        rc = gnutls_session_ticket_enable_server (conn->tls, &ticket_key);
+      if (rc)
+        {
+          log_error ("error setting up TLS: %s\n", gnutls_strerror (rc));
+          goto leave;
+        }
+      gnutls_transport_set_int (conn->tls, conn->fd);
+      do
+        rc = gnutls_handshake (conn->tls);
+      while (rc < 0 && !gnutls_error_is_fatal (rc));
+      if (rc < 0)
+        {
+          if (opt.verbose)
+            log_info ("TLS handshake failed: %s\n", gnutls_strerror (rc));
+          goto leave;
+        }
+    }
+
+  handle_request (conn);
+
+  if (conn->tls)
+    gnutls_bye (conn->tls, GNUTLS_SHUT_WR);
+
+ leave:
+  if (conn->tls)
+    gnutls_deinit (conn->tls);
+  close (conn->fd);
+  xfree (conn);
+  return NULL;
+}
+
+
+int
+main (int argc, char **argv)
+{
+  ARGPARSE_ARGS pargs;
+  struct sockaddr_in addr;
+  int listenfd;
+  int one = 1;
+  int rc;
+
+  /* Set program name etc.  */
+  set_strusage (my_strusage);
+  log_set_prefix ("fake-psp", JNLIB_LOG_WITH_PREFIX);
+
+  /* Make sure that our subsystems are ready.  */
+  gpgrt_init ();
+
+  opt.port = 8443;
+
+  /* Parse the command line. */
+  pargs.argc  = &argc;
+  pargs.argv  = &argv;
+  pargs.flags = ARGPARSE_FLAG_KEEP;
+  while (arg_parse (&pargs, opts))
+    {
+      switch (pargs.r_opt)
+        {
+        case oVerbose: opt.verbose++; break;
+        case oPort: opt.port = pargs.r.ret_int; break;
+        case oCert: opt.certfile = pargs.r.ret_str; break;
+        case oKey: opt.keyfile = pargs.r.ret_str; break;
+        case oDelay: opt.delay = pargs.r.ret_int; break;
+        case oJitter: opt.jitter = pargs.r.ret_int; break;
+        case oErrorRate: opt.error_rate = pargs.r.ret_int; break;
+        case oDropRate: opt.drop_rate = pargs.r.ret_int; break;
+
+        default: pargs.err = ARGPARSE_PRINT_ERROR; break;
+	}
+    }
+  if (log_get_errorcount (0))
+    exit (2);
+  if (argc)
+    usage (1);
+  if (!opt.certfile != !opt.keyfile)
+    log_fatal ("options --cert and --key must be used together\n");
+
+  signal (SIGPIPE, SIG_IGN);
+
+  if (opt.certfile)
+    {
+      rc = gnutls_global_init ();
+      if (rc)
+        log_fatal ("gnutls_global_init failed: %s\n", gnutls_strerror (rc));
+      rc = gnutls_certificate_allocate_credentials (&tls_cred);
+      if (!rc)
+        rc = gnutls_certificate_set_x509_key_file (tls_cred,
+                                                   opt.certfile, opt.keyfile,
+                                                   GNUTLS_X509_FMT_PEM);
+      if (rc < 0)
+        log_fatal ("error loading '%s': %s\n",
+                   opt.certfile, gnutls_strerror (rc));
+      rc = gnutls_session_ticket_key_generate (&ticket_key);
+      if (rc)
+        log_fatal ("error creating the ticket key: %s\n",
+                   gnutls_strerror (rc));
+    }
+
+  listenfd = socket (AF_INET, SOCK_STREAM, 0);
+  if (listenfd == -1)
+    log_fatal ("socket() failed: %s\n", strerror (errno));
+  setsockopt (listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (opt.port);
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (bind (listenfd, (struct sockaddr *)&addr, sizeof addr))
+    log_fatal ("error binding port %d: %s\n", opt.port, strerror (errno));
+  if (listen (listenfd, 128))
+    log_fatal ("listen() failed: %s\n", strerror (errno));
+
+  log_info ("listening on %s://127.0.0.1:%d\n",
+            tls_cred? "https":"http", opt.port);
+
+  for (;;)
+    {
+      pthread_attr_t tattr;
+      pthread_t thread;
+      conn_t conn;
+      int fd;
+
+      fd = accept (listenfd, NULL, NULL);
+      if (fd == -1)
+        {
+          if (errno != EINTR)
+            log_error ("accept() failed: %s\n", strerror (errno));
+          continue;
+        }
+
+      /* Like real servers we do not want to delay the TLS records.  */
+      setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+      conn = xcalloc (1, sizeof *conn);
+      conn->fd = fd;
+      conn->seed = (unsigned int)time (NULL) ^ (fd << 16) ^ next_id ();
+
+      pthread_attr_init (&tattr);
+      pthread_attr_setdetachstate (&tattr, PTHREAD_CREATE_DETACHED);
+      rc = pthread_create (&thread, &tattr, connection_thread, conn);
+      pthread_attr_destroy (&tattr);
+      if (rc)
+        {
+          log_error ("error spawning connection thread: %s\n", strerror (rc));
+          close (fd);
+          xfree (conn);
+        }
+    }
+
+  /*NOTREACHED*/
+  return 0;
+}
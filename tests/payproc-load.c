@@ -0,0 +1,552 @@
+/* payproc-load.c - Load generator for payprocd
+ * Copyright (C) 2017 g10 Code GmbH
+ *
+ * This file is part of Payproc.
+ *
+ * Payproc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Payproc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This tool drives a payprocd over its socket with a fixed number of
+ * concurrent clients and reports the throughput and the latency
+ * percentiles for each command.  It is meant to be used with a
+ * payprocd running in test mode against fake-psp so that performance
+ * work can be measured without the real payment services.  Example:
+ *
+ *   payproc-load --concurrency 16 --requests 2000 \
+ *                --mix ping,chargecard,ppcheckout,ppipnhd
+ *
+ * Each element of the mix is a workload; "chargecard" runs CARDTOKEN
+ * and CHARGECARD, "ppcheckout" runs PPCHECKOUT prepare and execute.
+ * Workloads are run in round-robin order by each client.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "logging.h"
+#include "argparse.h"
+#include "client.h"
+
+
+/* Constants to identify the options. */
+enum opt_values
+  {
+    aNull = 0,
+    oVerbose	= 'v',
+    oConcurrency = 'c',
+    oRequests   = 'n',
+
+    oSocket     = 500,
+    oDuration,
+    oMix,
+    oNoPool,
+
+    oLast
+  };
+
+
+/* The list of commands and options. */
+static ARGPARSE_OPTS opts[] = {
+  ARGPARSE_group (301, "@Options:\n "),
+
+  ARGPARSE_s_n (oVerbose, "verbose", "verbose diagnostics"),
+  ARGPARSE_s_s (oSocket,  "socket",  "|NAME|connect to socket NAME"),
+  ARGPARSE_s_i (oConcurrency, "concurrency",
+                "|N|run N clients in parallel (default 8)"),
+  ARGPARSE_s_i (oRequests, "requests",
+                "|N|run N workloads in total (default 1000)"),
+  ARGPARSE_s_i (oDuration, "duration",
+                "|N|run for N seconds instead of a fixed count"),
+  ARGPARSE_s_s (oMix,     "mix",     "|LIST|comma separated workloads"),
+  ARGPARSE_s_n (oNoPool,  "no-pool",
+                "use a new connection and the text protocol for each "
+                "request"),
+
+  ARGPARSE_end ()
+};
+
+
+static struct
+{
+  int verbose;
+  const char *socketname;
+  int concurrency;
+  int requests;
+  int duration;
+  int nopool;
+} opt;
+
+
+/* The commands we keep statistics for.  */
+enum
+  {
+    CMD_PING = 0,
+    CMD_GETINFO,
+    CMD_CARDTOKEN,
+    CMD_CHARGECARD,
+    CMD_PPCHECKOUT_PREPARE,
+    CMD_PPCHECKOUT_EXECUTE,
+    CMD_PPIPNHD,
+    N_COMMANDS
+  };
+
+static const char *command_names[N_COMMANDS] =
+  {
+    "PING",
+    "GETINFO",
+    "CARDTOKEN",
+    "CHARGECARD",
+    "PPCHECKOUT prepare",
+    "PPCHECKOUT execute",
+    "PPIPNHD"
+  };
+
+/* The workloads.  */
+enum
+  {
+    WL_PING = 0,
+    WL_GETINFO,
+    WL_CHARGECARD,
+    WL_PPCHECKOUT,
+    WL_PPIPNHD,
+    N_WORKLOADS
+  };
+
+static const char *workload_names[N_WORKLOADS] =
+  {
+    "ping",
+    "getinfo",
+    "chargecard",
+    "ppcheckout",
+    "ppipnhd"
+  };
+
+/* The configured mix of workloads.  */
+static int mix[32];
+static int nmix;
+
+/* The statistics for one command.  Each client keeps its own set and
+ * they are merged at the end.  */
+struct cmdstat_s
+{
+  unsigned int *latencies;  /* Latencies in microseconds.  */
+  size_t count;
+  size_t size;
+  unsigned long errors;
+};
+
+/* Object describing a client.  */
+struct client_s
+{
+  pthread_t thread;
+  int idx;
+  struct cmdstat_s stats[N_COMMANDS];
+};
+
+/* The connection pool.  */
+static client_pool_t pool;
+
+/* The number of workloads started so far and the time at which to
+   stop.  */
+static int workloads_started;
+static time_t stop_time;
+static pthread_mutex_t counter_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+static const char *
+my_strusage( int level )
+{
+  const char *p;
+
+  switch (level)
+    {
+    case 11: p = "payproc-load"; break;
+    case 13: p = PACKAGE_VERSION; break;
+    case 19: p = "Please report bugs to bugs@g10code.com.\n"; break;
+    case 1:
+    case 40:
+      p = ("Usage: payproc-load [options] (-h for help)");
+      break;
+    case 41:
+      p = ("Syntax: payproc-load [options]\n"
+           "Run a load test against payprocd\n");
+      break;
+    default: p = NULL; break;
+    }
+  return p;
+}
+
+
+/* Parse the comma separated list of workloads in STRING.  */
+static void
+parse_mix (const char *string)
+{
+  char **tokens;
+  int i, wl;
+
+  tokens = strtokenize (string, ",");
+  if (!tokens)
+    log_fatal ("strtokenize failed: %s\n", strerror (errno));
+  nmix = 0;
+  for (i=0; tokens[i]; i++)
+    {
+      if (!*tokens[i])
+        continue;
+      for (wl=0; wl < N_WORKLOADS; wl++)
+        if (!strcmp (tokens[i], workload_names[wl]))
+          break;
+      if (wl == N_WORKLOADS)
+        log_fatal ("unknown workload '%s'\n", tokens[i]);
+      if (nmix >= (int)DIM (mix))
+        log_fatal ("too many workloads\n");
+      mix[nmix++] = wl;
+    }
+  xfree (tokens);
+}
+
+
+/* Return the current time in microseconds.  */
+static unsigned long long
+now_usec (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* Return true if another workload shall be run.  */
+static int
+next_workload (void)
+{
+  int more;
+
+  pthread_mutex_lock (&counter_lock);
+  if (opt.duration)
+    more = time (NULL) < stop_time;
+  else
+    more = workloads_started < opt.requests;
+  if (more)
+    workloads_started++;
+  pthread_mutex_unlock (&counter_lock);
+  return more;
+}
+
+
+/* Run COMMAND with INDATA and record the result as command CMD of
+   CLIENT.  */
+static gpg_error_t
+run_command (struct client_s *client, int cmd, const char *command,
+             keyvalue_t indata, keyvalue_t *outdata)
+{
+  struct cmdstat_s *st = &client->stats[cmd];
+  unsigned long long start;
+  unsigned int elapsed;
+  gpg_error_t err;
+
+  start = now_usec ();
+  if (opt.nopool)
+    err = client_request (opt.socketname, 0, command, indata, outdata);
+  else
+    err = client_pool_request (pool, command, indata, outdata);
+  elapsed = now_usec () - start;
+
+  if (st->count == st->size)
+    {
+      st->size = st->size? 2 * st->size : 1024;
+      st->latencies = xrealloc (st->latencies,
+                                st->size * sizeof *st->latencies);
+    }
+  st->latencies[st->count++] = elapsed;
+
+  if (err)
+    {
+      st->errors++;
+      if (opt.verbose)
+        log_error ("%s failed: %s (%s)\n", command, gpg_strerror (err),
+                   keyvalue_get_string (*outdata, "_errdesc"));
+    }
+  return err;
+}
+
+
+/* Run the workload WL for CLIENT.  SEQ is a unique sequence
+   number.  */
+static void
+run_workload (struct client_s *client, int wl, unsigned long seq)
+{
+  keyvalue_t indata = NULL;
+  keyvalue_t outdata = NULL;
+  const char *s;
+  gpg_error_t err;
+
+  switch (wl)
+    {
+    case WL_PING:
+      run_command (client, CMD_PING, "PING", NULL, &outdata);
+      break;
+
+    case WL_GETINFO:
+      run_command (client, CMD_GETINFO, "GETINFO version", NULL, &outdata);
+      break;
+
+    case WL_CHARGECARD:
+      err = keyvalue_put (&indata, "Number", "4242424242424242");
+      if (!err)
+        err = keyvalue_put (&indata, "Exp-Year", "2030");
+      if (!err)
+        err = keyvalue_put (&indata, "Exp-Month", "12");
+      if (!err)
+        err = keyvalue_put (&indata, "Cvc", "123");
+      if (err)
+        log_fatal ("error building request: %s\n", gpg_strerror (err));
+      if (run_command (client, CMD_CARDTOKEN, "CARDTOKEN", indata, &outdata))
+        break;
+      keyvalue_release (indata); indata = NULL;
+
+      err = keyvalue_put (&indata, "Card-Token",
+                          keyvalue_get_string (outdata, "Token"));
+      if (!err)
+        err = keyvalue_put (&indata, "Currency", "EUR");
+      if (!err)
+        err = keyvalue_putf (&indata, "Amount", "%lu.%02lu",
+                             1 + seq % 100, seq % 100);
+      if (err)
+        log_fatal ("error building request: %s\n", gpg_strerror (err));
+      keyvalue_release (outdata); outdata = NULL;
+      run_command (client, CMD_CHARGECARD, "CHARGECARD", indata, &outdata);
+      break;
+
+    case WL_PPCHECKOUT:
+      err = keyvalue_put (&indata, "Currency", "EUR");
+      if (!err)
+        err = keyvalue_put (&indata, "Amount", "10");
+      if (!err)
+        err = keyvalue_put (&indata, "Return-Url",
+                            "https://payproc.example.org/return");
+      if (!err)
+        err = keyvalue_put (&indata, "Cancel-Url",
+                            "https://payproc.example.org/cancel");
+      if (err)
+        log_fatal ("error building request: %s\n", gpg_strerror (err));
+      if (run_command (client, CMD_PPCHECKOUT_PREPARE, "PPCHECKOUT prepare",
+                       indata, &outdata))
+        break;
+      keyvalue_release (indata); indata = NULL;
+
+      /* fake-psp redirects to our return URL with the aliasid.  */
+      s = strstr (keyvalue_get_string (outdata, "Redirect-Url"), "aliasid=");
+      if (!s)
+        {
+          client->stats[CMD_PPCHECKOUT_EXECUTE].errors++;
+          if (opt.verbose)
+            log_error ("PPCHECKOUT prepare: no aliasid in Redirect-Url\n");
+          break;
+        }
+      s += 8;
+      err = keyvalue_putf (&indata, "Alias-Id", "%.*s",
+                           (int)strcspn (s, "&"), s);
+      if (!err)
+        err = keyvalue_put (&indata, "Paypal-Payer", "FAKEPAYER");
+      if (err)
+        log_fatal ("error building request: %s\n", gpg_strerror (err));
+      keyvalue_release (outdata); outdata = NULL;
+      run_command (client, CMD_PPCHECKOUT_EXECUTE, "PPCHECKOUT execute",
+                   indata, &outdata);
+      break;
+
+    case WL_PPIPNHD:
+      err = keyvalue_putf (&indata, "Request",
+                           "receiver_email=paypal-test%%40g10code.com"
+                           "&test_ipn=1&payment_status=Completed"
+                           "&txn_id=LOAD%d-%lu&ipn_track_id=load%d%lu",
+                           client->idx, seq, client->idx, seq);
+      if (err)
+        log_fatal ("error building request: %s\n", gpg_strerror (err));
+      run_command (client, CMD_PPIPNHD, "PPIPNHD", indata, &outdata);
+      break;
+    }
+
+  keyvalue_release (indata);
+  keyvalue_release (outdata);
+}
+
+
+/* The thread running one client.  */
+static void *
+client_thread (void *arg)
+{
+  struct client_s *client = arg;
+  unsigned long seq = 0;
+  int i = client->idx;
+
+  while (next_workload ())
+    {
+      run_workload (client, mix[i % nmix], seq++);
+      i++;
+    }
+  return NULL;
+}
+
+
+static int
+compare_uint (const void *a, const void *b)
+{
+  unsigned int x = *(const unsigned int *)a;
+  unsigned int y = *(const unsigned int *)b;
+
+  return x < y? -1 : x > y;
+}
+
+
+/* Merge the statistics of the NCLIENTS CLIENTS and print them.
+   ELAPSED is the duration of the test in microseconds.  */
+static void
+print_report (struct client_s *clients, int nclients,
+              unsigned long long elapsed)
+{
+  struct cmdstat_s all;
+  int cmd, i;
+
+  printf ("%-20s %8s %7s %9s %9s %9s %9s %9s\n",
+          "command", "count", "errors", "req/s",
+          "p50[ms]", "p99[ms]", "p999[ms]", "max[ms]");
+  for (cmd=0; cmd < N_COMMANDS; cmd++)
+    {
+      memset (&all, 0, sizeof all);
+      for (i=0; i < nclients; i++)
+        all.size += clients[i].stats[cmd].count;
+      if (!all.size)
+        continue;
+      all.latencies = xmalloc (all.size * sizeof *all.latencies);
+      for (i=0; i < nclients; i++)
+        {
+          memcpy (all.latencies + all.count, clients[i].stats[cmd].latencies,
+                  clients[i].stats[cmd].count * sizeof *all.latencies);
+          all.count += clients[i].stats[cmd].count;
+          all.errors += clients[i].stats[cmd].errors;
+        }
+      qsort (all.latencies, all.count, sizeof *all.latencies, compare_uint);
+
+      printf ("%-20s %8zu %7lu %9.1f %9.3f %9.3f %9.3f %9.3f\n",
+              command_names[cmd], all.count, all.errors,
+              all.count * 1e6 / elapsed,
+              all.latencies[(all.count - 1) * 500 / 1000] / 1000.0,
+              all.latencies[(all.count - 1) * 990 / 1000] / 1000.0,
+              all.latencies[(all.count - 1) * 999 / 1000] / 1000.0,
+              all.latencies[all.count - 1] / 1000.0);
+      xfree (all.latencies);
+    }
+}
+
+
+int
+main (int argc, char **argv)
+{
+  ARGPARSE_ARGS pargs;
+  struct client_s *clients;
+  unsigned long long start, elapsed;
+  gpg_error_t err;
+  int i, rc;
+
+  /* Set program name etc.  */
+  set_strusage (my_strusage);
+  log_set_prefix ("payproc-load", JNLIB_LOG_WITH_PREFIX);
+
+  /* Make sure that our subsystems are ready.  */
+  gpgrt_init ();
+
+  opt.socketname = PAYPROCD_TEST_SOCKET_NAME;
+  opt.concurrency = 8;
+  opt.requests = 1000;
+  mix[nmix++] = WL_PING;
+
+  /* Parse the command line. */
+  pargs.argc  = &argc;
+  pargs.argv  = &argv;
+  pargs.flags = ARGPARSE_FLAG_KEEP;
+  while (arg_parse (&pargs, opts))
+    {
+      switch (pargs.r_opt)
+        {
+        case oVerbose: opt.verbose++; break;
+        case oSocket: opt.socketname = pargs.r.ret_str; break;
+        case oConcurrency: opt.concurrency = pargs.r.ret_int; break;
+        case oRequests: opt.requests = pargs.r.ret_int; break;
+        case oDuration: opt.duration = pargs.r.ret_int; break;
+        case oMix: parse_mix (pargs.r.ret_str); break;
+        case oNoPool: opt.nopool = 1; break;
+
+        default: pargs.err = ARGPARSE_PRINT_ERROR; break;
+	}
+    }
+  if (log_get_errorcount (0))
+    exit (2);
+  if (argc)
+    usage (1);
+  if (opt.concurrency < 1 || opt.concurrency > 1024)
+    log_fatal ("invalid value for --concurrency\n");
+  if (!nmix)
+    log_fatal ("no workloads given\n");
+
+  if (!opt.nopool)
+    {
+      err = client_pool_new (&pool, opt.socketname, opt.concurrency);
+      if (err)
+        log_fatal ("error creating connection pool: %s\n",
+                   gpg_strerror (err));
+    }
+
+  clients = xcalloc (opt.concurrency, sizeof *clients);
+  start = now_usec ();
+  if (opt.duration)
+    stop_time = time (NULL) + opt.duration;
+  for (i=0; i < opt.concurrency; i++)
+    {
+      clients[i].idx = i;
+      rc = pthread_create (&clients[i].thread, NULL, client_thread,
+                           clients + i);
+      if (rc)
+        log_fatal ("error spawning client thread: %s\n", strerror (rc));
+    }
+  for (i=0; i < opt.concurrency; i++)
+    pthread_join (clients[i].thread, NULL);
+  elapsed = now_usec () - start;
+  if (!elapsed)
+    elapsed = 1;
+
+  printf ("%d clients, %d workloads in %.3f s\n",
+          opt.concurrency, workloads_started, elapsed / 1e6);
+  print_report (clients, opt.concurrency, elapsed);
+
+  for (i=0; i < opt.concurrency; i++)
+    {
+      int cmd;
+
+      for (cmd=0; cmd < N_COMMANDS; cmd++)
+        xfree (clients[i].stats[cmd].latencies);
+    }
+  xfree (clients);
+  client_pool_release (pool);
+  return 0;
+}